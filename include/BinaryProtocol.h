@@ -0,0 +1,167 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+#include <cstring>
+
+namespace douban {
+namespace mc {
+namespace binary {
+
+/**
+ * The binary protocol of memcached: every request and response starts with
+ * a 24 bytes header, followed by extras, key and value, as many bytes of
+ * each as the header says. Numbers are big endian.
+ *
+ * A server takes the protocol of the first byte of a connection for all of
+ * it, so a connection is either text or binary throughout.
+ **/
+
+enum {
+  MAGIC_REQUEST = 0x80,
+  MAGIC_RESPONSE = 0x81,
+};
+
+// the "Q" ones are quiet: answered on failure only, and GETQ on hits only
+enum {
+  OP_GET = 0x00,
+  OP_SET = 0x01,
+  OP_ADD = 0x02,
+  OP_REPLACE = 0x03,
+  OP_DELETE = 0x04,
+  OP_INCREMENT = 0x05,
+  OP_DECREMENT = 0x06,
+  OP_QUIT = 0x07,
+  OP_FLUSH = 0x08,
+  OP_GETQ = 0x09,
+  OP_NOOP = 0x0a,
+  OP_VERSION = 0x0b,
+  OP_GETK = 0x0c,
+  OP_GETKQ = 0x0d,
+  OP_APPEND = 0x0e,
+  OP_PREPEND = 0x0f,
+  OP_STAT = 0x10,
+  OP_SETQ = 0x11,
+  OP_ADDQ = 0x12,
+  OP_REPLACEQ = 0x13,
+  OP_DELETEQ = 0x14,
+  OP_INCREMENTQ = 0x15,
+  OP_DECREMENTQ = 0x16,
+  OP_QUITQ = 0x17,
+  OP_FLUSHQ = 0x18,
+  OP_APPENDQ = 0x19,
+  OP_PREPENDQ = 0x1a,
+  OP_TOUCH = 0x1c,
+};
+
+enum {
+  STATUS_OK = 0x00,
+  STATUS_KEY_NOT_FOUND = 0x01,
+  STATUS_KEY_EXISTS = 0x02,
+  STATUS_VALUE_TOO_LARGE = 0x03,
+  STATUS_INVALID_ARGUMENTS = 0x04,
+  STATUS_ITEM_NOT_STORED = 0x05,
+  STATUS_NON_NUMERIC = 0x06,
+  STATUS_UNKNOWN_COMMAND = 0x81,
+  STATUS_OUT_OF_MEMORY = 0x82,
+};
+
+
+// All fields are at their natural alignment, packed only so that a header
+// can be read in place wherever it starts in a DataBlock.
+typedef struct __attribute__((packed)) {
+  uint8_t magic;
+  uint8_t opcode;
+  uint16_t keyLen;
+  uint8_t extrasLen;
+  uint8_t dataType;
+  uint16_t status; // vbucket id of requests
+  uint32_t bodyLen; // extras, key and value
+  uint32_t opaque; // echoed back, the index of the request key
+  uint64_t cas;
+} header_t;
+
+static_assert(sizeof(header_t) == 24, "the binary header is 24 bytes");
+
+// The opaque of noreply requests. Their failures are still answered, and
+// are passed over by whichever batch they arrive in front of.
+static const uint32_t kNoreplyOpaque = 0xffffffff;
+
+// extras of requests: flags and exptime of storage, delta, initial value and
+// exptime of incr/decr
+static const size_t kMaxRequestExtras = 20;
+
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+inline uint16_t swap16(uint16_t v) { return v; }
+inline uint32_t swap32(uint32_t v) { return v; }
+inline uint64_t swap64(uint64_t v) { return v; }
+#else
+inline uint16_t swap16(uint16_t v) { return __builtin_bswap16(v); }
+inline uint32_t swap32(uint32_t v) { return __builtin_bswap32(v); }
+inline uint64_t swap64(uint64_t v) { return __builtin_bswap64(v); }
+#endif
+
+
+// numbers of extras and values, at any alignment
+inline void put32(char* p, uint32_t v) {
+  v = swap32(v);
+  memcpy(p, &v, sizeof v);
+}
+
+inline void put64(char* p, uint64_t v) {
+  v = swap64(v);
+  memcpy(p, &v, sizeof v);
+}
+
+inline uint32_t get32(const char* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof v);
+  return swap32(v);
+}
+
+inline uint64_t get64(const char* p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof v);
+  return swap64(v);
+}
+
+
+// a header as received, to host order
+inline void decodeHeader(const header_t* in, header_t& out) {
+  out.magic = in->magic;
+  out.opcode = in->opcode;
+  out.keyLen = swap16(in->keyLen);
+  out.extrasLen = in->extrasLen;
+  out.dataType = in->dataType;
+  out.status = swap16(in->status);
+  out.bodyLen = swap32(in->bodyLen);
+  out.opaque = swap32(in->opaque);
+  out.cas = swap64(in->cas);
+}
+
+
+// The header of a request followed by its extras, written to buf. Returns
+// the bytes written, the key and value are to be sent after them.
+inline size_t encodeRequest(char* buf, uint8_t opcode, size_t keyLen, const char* extras,
+                            uint8_t extrasLen, size_t valueLen, uint32_t opaque,
+                            uint64_t cas = 0) {
+  header_t* h = reinterpret_cast<header_t*>(buf);
+  h->magic = MAGIC_REQUEST;
+  h->opcode = opcode;
+  h->keyLen = swap16(static_cast<uint16_t>(keyLen));
+  h->extrasLen = extrasLen;
+  h->dataType = 0;
+  h->status = 0;
+  h->bodyLen = swap32(static_cast<uint32_t>(extrasLen + keyLen + valueLen));
+  h->opaque = swap32(opaque);
+  h->cas = swap64(cas);
+  if (extrasLen > 0) {
+    memcpy(buf + sizeof(header_t), extras, extrasLen);
+  }
+  return sizeof(header_t) + extrasLen;
+}
+
+} // namespace binary
+} // namespace mc
+} // namespace douban
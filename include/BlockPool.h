@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include "Export.h"
+
+namespace douban {
+namespace mc {
+namespace io {
+
+/**
+ * Size-class allocator for DataBlock storage.
+ *
+ * Requests are rounded up to a power of two between
+ * MC_BLOCK_POOL_MIN_CLASS and MC_BLOCK_POOL_MAX_CLASS. Freed blocks go to
+ * a cache of the freeing thread, up to MC_BLOCK_POOL_THREAD_BYTES, so
+ * that the next block of the same class on that thread skips malloc.
+ * Larger requests are not cached.
+ *
+ * For bulk transfers, reserveMapped() sets aside one pre-faulted mapping,
+ * backed by huge pages where the system allows it. From then on, blocks of
+ * the cached classes are carved from it first, and go back to per-class
+ * free lists shared by all threads, so the pages stay mapped from one
+ * batch to the next. Blocks fall back to the heap when it is exhausted.
+ **/
+class BlockPool {
+ public:
+  // cache line aligned, NULL on failure
+  static char* allocate(size_t len);
+  // len must be the one given to allocate()
+  static void deallocate(char* ptr, size_t len);
+  static void getStats(block_pool_stats_t* stats);
+  // Maps bytes, rounded up to MC_HUGE_PAGE_SIZE, for the rest of the
+  // process. Tries MAP_HUGETLB, then transparent huge pages. Returns 0 or
+  // -errno, -EEXIST if called before.
+  static int reserveMapped(size_t bytes);
+};
+
+} // namespace io
+} // namespace mc
+} // namespace douban
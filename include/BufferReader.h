@@ -1,14 +1,16 @@
 #pragma once
 
 #include <stdint.h>
+#include <sys/uio.h>
 #include <cassert>
 #include <cstring>
-#include <list>
+#include <deque>
 #include <vector>
 
 #include "Export.h"
 #include "Common.h"
 #include "DataBlock.h"
+#include "RequestArena.h"
 
 #ifdef MC_USE_SMALL_VECTOR
 #include "llvm/SmallVector.h"
@@ -18,27 +20,28 @@ namespace douban {
 namespace mc {
 namespace io {
 
-typedef std::list<DataBlock> DataBlockList;
-typedef DataBlockList::iterator DataBlockListIterator;
+// deque::push_back never moves the elements, so a DataBlock* taken by a
+// slice stays valid while the ring grows.
+typedef std::deque<DataBlock> DataBlockRing;
 
 
 struct DataCursor_s {
-  DataBlockListIterator iterator;
+  size_t index;  // into the ring
   size_t offset;
 
   bool operator==(const DataCursor_s& other) const {
-    return (this->iterator == other.iterator && this->offset == other.offset);
+    return (this->index == other.index && this->offset == other.offset);
   }
 
   bool operator!=(const DataCursor_s& other) const {
-    return (this->iterator != other.iterator || this->offset != other.offset);
+    return (this->index != other.index || this->offset != other.offset);
   }
 };
 typedef struct DataCursor_s DataCursor;
 
 
 typedef struct {
-  DataBlockListIterator iterator;
+  DataBlock* block;
   size_t offset;
   size_t size;
 } DataBlockSlice;
@@ -49,9 +52,40 @@ typedef llvm::SmallVector<DataBlockSlice, 1> TokenData;
 typedef std::vector<DataBlockSlice> TokenData;
 #endif
 
+
+/**
+ * The slices of a token kept by a result. A single slice is stored inline;
+ * when there are more, they all go to a RequestArena, so that the slices
+ * are always contiguous.
+ **/
+class TokenSlices {
+ public:
+  typedef const DataBlockSlice* const_iterator;
+
+  TokenSlices();
+  // takes over the slices of td, which is cleared
+  void assign(TokenData& td, RequestArena& arena);
+  void clear();
+  size_t size() const;
+  bool empty() const;
+  const_iterator begin() const;
+  const_iterator end() const;
+
+ protected:
+  DataBlockSlice* m_spilled;
+  DataBlockSlice m_inline;
+  uint32_t m_size;
+};
+
+
 void freeTokenData(TokenData& td);
+void freeTokenData(TokenSlices& ts);
 char* parseTokenData(TokenData& td, size_t reserved);
+// same, but a copy is allocated from arena instead of new[]
+char* parseTokenData(const TokenSlices& ts, size_t reserved, RequestArena& arena);
 void copyTokenData(const TokenData& src, TokenData& dst);
+// dst takes over the slices and their references, src is cleared
+void moveTokenData(TokenSlices& src, TokenSlices& dst);
 
 
 class BufferReader {
@@ -61,49 +95,88 @@ class BufferReader {
   void reset();
 
   size_t prepareWriteBlock(size_t len);
+  // Scatter version of prepareWriteBlock: fills up to iovcnt regions
+  // totaling len bytes, from the write block on into new blocks behind it.
+  size_t prepareWriteBlocks(size_t len, struct iovec* iov, size_t& iovcnt);
 
   char* getWritePtr();
   void commitWrite(size_t len);
+  void commitWriteBlocks(size_t len);
   void write(char* ptr, size_t len, bool copying = true);
 
   size_t capacity();
+  size_t retainedCapacity();
+  // gives all blocks back, a no-op unless reset()
+  void shrink();
+  // Once everything is read, the trailing blocks no token refers to any
+  // more are emptied and written again, so that a value streamed through
+  // them needs no more blocks than one recv.
+  void recycle();
   size_t size();
   size_t readLeft();
   size_t nDataBlock();
   size_t nBytesRef();
 
   const char peek(err_code_t& err, size_t offset) const;
+  // The unread bytes of the read block, to be parsed in place. NULL if
+  // the read cursor is at the end of its block.
+  const char* contiguous(size_t& len) const;
+  // Same, up to the first value, which is left unread. NULL if value is not
+  // in the read block; how far it was looked for is kept, like readUntil.
+  const char* contiguousUntil(char value, size_t& len);
 
   size_t readUntil(err_code_t& err, char value, TokenData& tokenData);
+  // stops at whichever of value and other comes first
+  size_t readUntil(err_code_t& err, char value, char other, TokenData& tokenData);
   size_t skipUntil(err_code_t& err, char value);
   void readUnsigned(err_code_t& err, uint64_t& value);
   void readBytes(err_code_t& err, size_t len, TokenData& tokenData);
+  // reads what has arrived, up to maxLen, and returns its length
+  size_t readAvailable(size_t maxLen, TokenData& tokenData);
   void expectBytes(err_code_t& err, const char* str, size_t str_size);
   void skipBytes(err_code_t& err, size_t str_size);
   void setNextPreferedDataBlockSize(size_t n);
   size_t getNextPreferedDataBlockSize();
+  size_t recvSize();
 
  protected:
   const char charAtCursor(DataCursor& cur) const;
-
-  DataBlockList m_dataBlockList;
+  bool scanUntil(char value, char other, DataCursor& endCur);
+  const char* scanContiguousUntil(char value, size_t& len);
+  void forgetScan();
+  void learnRecvSize(size_t nBytes);
+  DataBlock& pushBlock(size_t len);
+
+  // Blocks [0, m_nBlocks) hold the data of the current batch, the rest
+  // are empty and reused in order by the next ones. reset() rewinds the
+  // ring instead of freeing it.
+  DataBlockRing m_blocks;
+  size_t m_nBlocks;
   size_t m_capacity;
   size_t m_size;
   size_t m_readLeft;
   DataCursor m_blockReadCursor;
-  DataBlockListIterator m_blockWriteIterator;
+  size_t m_blockWriteIndex;  // == m_nBlocks if a block is to be pushed
   size_t m_nextPreferedDataBlockSize;
+
+  // Neither m_scanValue nor m_scanOther is in [m_scanFrom, m_scanTo), as
+  // found by the last scan from the read cursor m_scanFrom. A line that
+  // arrives in many recvs is scanned once, not from its start on each.
+  DataCursor m_scanFrom;
+  DataCursor m_scanTo;
+  char m_scanValue;
+  char m_scanOther;
+
+  // EWMA of the bytes received between two reset(), i.e. per batch of
+  // requests, and the recv size derived from it.
+  size_t m_bytesPerBatch;
+  size_t m_recvSize;
 };
 
 
 inline const char BufferReader::charAtCursor(DataCursor& cur) const {
   // NOTE: make sure cur is valid
-  /**
-   * DataBlock& db = *cur.iterator;
-   * char* chrPtr = db[cur.offset];
-   * return *chrPtr;
-   **/
-  return *((*cur.iterator)[cur.offset]);
+  return *(m_blocks[cur.index][cur.offset]);
 }
 
 
@@ -111,6 +184,61 @@ inline size_t BufferReader::readLeft() {
   return m_readLeft;
 }
 
+inline const char* BufferReader::contiguous(size_t& len) const {
+  len = 0;
+  if (m_readLeft == 0 || m_blockReadCursor.index >= m_nBlocks) {
+    return NULL;
+  }
+  const DataBlock& block = m_blocks[m_blockReadCursor.index];
+  len = block.size() - m_blockReadCursor.offset;
+  return len > 0 ? block[m_blockReadCursor.offset] : NULL;
+}
+
+
+// Mostly the line is all in the read block, and is found there without
+// keeping where the scan got to.
+inline const char* BufferReader::contiguousUntil(char value, size_t& len) {
+  if (m_scanFrom != m_blockReadCursor) {
+    const char* begin = contiguous(len);
+    const char* p = begin != NULL ? static_cast<const char*>(memchr(begin, value, len)) : NULL;
+    if (p != NULL) {
+      len = p - begin;
+      return begin;
+    }
+  }
+  return scanContiguousUntil(value, len);
+}
+
+
+inline size_t BufferReader::recvSize() {
+  return MAX(m_recvSize, DataBlock::minCapacity());
+}
+
+
+inline TokenSlices::TokenSlices() : m_spilled(NULL), m_size(0) {
+}
+
+inline void TokenSlices::clear() {
+  m_spilled = NULL;
+  m_size = 0;
+}
+
+inline size_t TokenSlices::size() const {
+  return m_size;
+}
+
+inline bool TokenSlices::empty() const {
+  return m_size == 0;
+}
+
+inline TokenSlices::const_iterator TokenSlices::begin() const {
+  return m_size > 1 ? m_spilled : &m_inline;
+}
+
+inline TokenSlices::const_iterator TokenSlices::end() const {
+  return begin() + m_size;
+}
+
 } // namespace io
 } // namespace mc
 } // namespace douban
@@ -23,24 +23,54 @@ class BufferWriter {
   void reserve(size_t n);
   void takeBuffer(const char* const buf, size_t buf_len);
   void takeNumber(int64_t val);
+  // Unlike take*, copy* copy into a scratch arena. Consecutive copies
+  // share one iovec, so a whole command header costs a single iovec.
+  void copyBuffer(const char* const buf, size_t buf_len);
+  void copyNumber(int64_t val);
   const struct iovec* const getReadPtr(size_t &n);
   void commitRead(size_t nSent);
-  void rewind();
+  // sends again from iovec `from` on, those before it having been sent
+  void rewind(size_t from = 0);
+  // drops what is not sent yet
+  void discard();
+  // Ends a segment, the requests of an asynchronous batch: the next data
+  // doesn't share an iovec with it. Returns the iovec index it ends at.
+  size_t endSegment();
   size_t msgIovlen();
+  // iovecs sent in full
+  size_t iovecsSent() const;
   const bool isRead();
+  // memory kept between requests, shrink() gives it back if reset()
+  size_t retainedBytes() const;
+  void shrink();
 
  protected:
+  char* arenaAlloc(size_t len);
+  void takeArena(char* ptr, size_t len);
+
   std::vector<struct iovec> m_iovec;
   std::vector<struct iovec> m_originalIovec;
-  std::vector<char*>  m_unsignedStringList;
+  std::vector<char*> m_largeCopies; // copies too large for the arena
+
+  // fixed-size chunks, reused from the first one after reset()
+  std::vector<char*> m_arenaChunks;
+  size_t m_arenaChunk; // the chunk being filled
+  size_t m_arenaOffset; // used bytes of it
 
   // the index of iovec vector we'll read next
   size_t m_readIdx;
 
+  // iovecs of the segments ended so far
+  size_t m_segmentEnd;
+
   // the number of iovec left to read
   size_t m_msgIovlen;
 };
 
+inline size_t BufferWriter::iovecsSent() const {
+  return m_readIdx;
+}
+
 inline const bool BufferWriter::isRead() {
   return m_readIdx != 0;
 }
@@ -13,6 +13,9 @@ class Client : public ConnectionPool {
  public:
   Client();
   ~Client();
+  // With CFG_ZEROCOPY_THRESHOLD, values are sent straight from the caller's
+  // buffers. Those must stay unmodified until the command returns, or until
+  // complete() for *Async commands; the kernel is done with them by then.
   void config(config_options_t opt, int val);
   // retrieval commands
   void destroyRetrievalResult();
@@ -24,6 +27,36 @@ DECL_RETRIEVAL_CMD(get)
 DECL_RETRIEVAL_CMD(gets)
 #undef DECL_RETRIEVAL_CMD
 
+  // Like get/gets, but results[i] is that of keys[i], NULL for a miss or
+  // an invalid key. There are nKeys of them, nResults of which are hits.
+#define DECL_INDEXED_RETRIEVAL_CMD(M) \
+  err_code_t M##Indexed(const char* const* keys, const size_t* keyLens, size_t nKeys, \
+                        retrieval_result_t*** results, size_t* nResults);
+DECL_INDEXED_RETRIEVAL_CMD(get)
+DECL_INDEXED_RETRIEVAL_CMD(gets)
+#undef DECL_INDEXED_RETRIEVAL_CMD
+
+  // Like get/gets, but values are not joined into one buffer. Fragments
+  // point into the receive buffers until destroyRetrievalResult().
+#define DECL_FRAGMENTED_RETRIEVAL_CMD(M) \
+  err_code_t M##Fragmented(const char* const* keys, const size_t* keyLens, size_t nKeys, \
+                           fragmented_retrieval_result_t*** results, size_t* nResults);
+DECL_FRAGMENTED_RETRIEVAL_CMD(get)
+DECL_FRAGMENTED_RETRIEVAL_CMD(gets)
+#undef DECL_FRAGMENTED_RETRIEVAL_CMD
+
+  // Streams values to cb, piece by piece as they are received, instead of
+  // returning results. The receive buffers are written over right after
+  // each call, so memory does not grow with the value size. Misses get no
+  // call. A piece at offset 0 (re)starts a value: a connection retried
+  // after an error sends its values again.
+#define DECL_STREAM_RETRIEVAL_CMD(M) \
+  err_code_t M##Stream(const char* const* keys, const size_t* keyLens, size_t nKeys, \
+                       retrieval_chunk_cb_t cb, void* ctx);
+DECL_STREAM_RETRIEVAL_CMD(get)
+DECL_STREAM_RETRIEVAL_CMD(gets)
+#undef DECL_STREAM_RETRIEVAL_CMD
+
   // storage commands
   void destroyMessageResult();
 #define DECL_STORAGE_CMD(M) \
@@ -50,6 +83,9 @@ DECL_RETRIEVAL_CMD(gets)
   err_code_t version(broadcast_result_t** results, size_t* nHosts);
   err_code_t quit();
   err_code_t stats(broadcast_result_t** results, size_t* nHosts);
+  // The stat_field_t counters of each server, in the order of stats(), and
+  // over all of them. Results are valid until the next call.
+  err_code_t statsTyped(server_stats_t** results, size_t* nHosts, cluster_stats_t* cluster);
   err_code_t flushAll(broadcast_result_t** results, size_t* nHosts);
 
   // touch
@@ -66,6 +102,57 @@ DECL_RETRIEVAL_CMD(gets)
            const bool noreply,
            unsigned_result_t** result, size_t* nResults);
 
+  // asynchronous commands
+  // Each *Async call queues one more batch behind the ones in flight, starts
+  // sending it and returns its ticket. Keys and values must stay valid until
+  // the ticket completes. complete() returns the tickets done since its last
+  // call, whose results can be fetched then. destroyTickets() frees those,
+  // and must be called before any synchronous command, once none is in
+  // flight.
+#define DECL_RETRIEVAL_ASYNC_CMD(M) \
+  err_code_t M##Async(const char* const* keys, const size_t* keyLens, size_t nKeys, \
+                      ticket_t* ticket);
+DECL_RETRIEVAL_ASYNC_CMD(get)
+DECL_RETRIEVAL_ASYNC_CMD(gets)
+#undef DECL_RETRIEVAL_ASYNC_CMD
+
+#define DECL_STORAGE_ASYNC_CMD(M) \
+  err_code_t M##Async(const char* const* keys, const size_t* keyLens, \
+           const flags_t* flags, const exptime_t exptime, \
+           const cas_unique_t* cas_uniques, const bool noreply, \
+           const char* const* vals, const size_t* valLens, \
+           size_t nItems, ticket_t* ticket)
+
+  DECL_STORAGE_ASYNC_CMD(set);
+  DECL_STORAGE_ASYNC_CMD(add);
+  DECL_STORAGE_ASYNC_CMD(replace);
+  DECL_STORAGE_ASYNC_CMD(append);
+  DECL_STORAGE_ASYNC_CMD(prepend);
+  DECL_STORAGE_ASYNC_CMD(cas);
+#undef DECL_STORAGE_ASYNC_CMD
+  err_code_t deleteAsync(const char* const* keys, const size_t* keyLens,
+                         const bool noreply, size_t nItems, ticket_t* ticket);
+  err_code_t touchAsync(const char* const* keys, const size_t* keyLens,
+                        const exptime_t exptime, const bool noreply, size_t nItems,
+                        ticket_t* ticket);
+
+  // Waits up to timeout ms for a ticket to complete, -1 for no limit, 0 not
+  // at all. The tickets returned are valid until destroyTickets(), and the
+  // error is the first met since the last call.
+  err_code_t complete(int timeout, ticket_t** tickets, size_t* nTickets);
+  // results are valid until the next call or destroyTickets()
+  err_code_t ticketRetrievalResult(ticket_t ticket, retrieval_result_t*** results,
+                                   size_t* nResults);
+  err_code_t ticketMessageResult(ticket_t ticket, message_result_t*** results,
+                                 size_t* nResults);
+  void destroyTickets();
+
+  // memory kept for the next requests, see memory_stats_t
+  void getMemoryStats(memory_stats_t* stats);
+  // Gives back what is over the CFG_MAX_RETAINED_* limits. Results must be
+  // destroyed first. Called by ClientPool on release.
+  void trimRetained();
+
   inline void toggleFlushAllFeature(bool enabled) {
     m_flushAllEnabled = enabled;
   }
@@ -76,13 +163,28 @@ DECL_RETRIEVAL_CMD(gets)
   void collectMessageResult(message_result_t*** results, size_t* nResults);
   void collectBroadcastResult(broadcast_result_t** results, size_t* nHosts, bool isFlushAll=false);
   void collectUnsignedResult(unsigned_result_t** results, size_t* nResults);
+  void beginSubmit();
+  err_code_t endSubmit(ticket_t* ticket);
+  bool hasTicket(ticket_t ticket);
+  inline bool hasTickets() {
+    return !m_tickets.empty() || !m_doneTickets.empty();
+  }
 
   std::vector<retrieval_result_t*> m_outRetrievalResultPtrs;
+  std::vector<fragmented_retrieval_result_t*> m_outFragmentedResultPtrs;
   std::vector<message_result_t*> m_outMessageResultPtrs;
   std::vector<broadcast_result_t> m_outBroadcastResultPtrs;
   std::vector<unsigned_result_t*> m_outUnsignedResultPtrs;
+  std::vector<server_stats_t> m_outServerStats;
 
   bool m_flushAllEnabled;
+  size_t m_maxRetainedBufferBytes; // 0 for no limit
+  size_t m_maxRetainedResultBytes;
+
+  std::vector<ticket_t> m_tickets; // in flight, in submit order
+  std::vector<ticket_t> m_doneTickets; // returned by complete(), not destroyed
+  ticket_t m_lastTicket;
+  err_code_t m_ticketError; // for the next complete()
 };
 
 } // namespace mc
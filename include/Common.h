@@ -26,6 +26,10 @@
 #endif
 
 
+// sendmsg calls in a row on one wakeup, while the socket takes it all
+#define MC_SEND_MAX_ROUNDS 16
+
+
 #ifdef NI_MAXHOST
 #define MC_NI_MAXHOST NI_MAXHOST
 #else
@@ -44,8 +48,29 @@
 #define MC_MSG_MORE 0
 #endif
 
+#ifdef __linux__
+#define MC_USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#ifdef MSG_ZEROCOPY
+#define MC_USE_ZEROCOPY
+#endif
+#endif
+
 
 #define MIN_DATABLOCK_CAPACITY 8192
+#define MC_CACHE_LINE_SIZE 64
+// DataBlock storage classes: 8 KB (1 << 13) up to 1 MB (1 << 20)
+#define MC_BLOCK_POOL_MIN_CLASS 13
+#define MC_BLOCK_POOL_MAX_CLASS 20
+#define MC_BLOCK_POOL_THREAD_BYTES (8 << 20)
+// mapped block storage is reserved in multiples of this, see BlockPool.h
+#define MC_HUGE_PAGE_SIZE (2 << 20)
+// request arena: chunk size, and how much of it is kept across requests
+#define MC_REQUEST_ARENA_CHUNK_SIZE (64 << 10)
+#define MC_REQUEST_ARENA_RETAIN_BYTES (1 << 20)
+// recv size learned per connection is at most this many min capacities
+#define MAX_RECV_CAPACITY_SCALE 64
 #define MIN(A, B) (((A) > (B)) ? (B) : (A))
 #define MAX(A, B) (((A) < (B)) ? (B) : (A))
 #define CSTR(STR) (const_cast<char*>(STR))
@@ -174,6 +199,12 @@ typedef enum {
   // [0-9] // INCR/DECR
   FSM_INCR_DECR_START, // got [0-9]
   FSM_INCR_DECR_REMAINING, // not got "\r\n"
+
+  // <code> [<datalen>] <flags>*\r\n of meta commands, "VA" then <data block>
+  FSM_META_LINE, // got a code like "VA", "HD", "NF" or "MN"
+
+  // <24 bytes header><extras><key><value> of the binary protocol
+  FSM_BINARY_BODY, // got the header
 } parser_state_t;
 
 #define IS_END_STATE(st) ((st) == FSM_END or (st) == FSM_ERROR)
@@ -220,6 +251,7 @@ typedef enum {
   DELETE_OP,
 
   STATS_OP,
+  TYPED_STATS_OP, // stats, the counters parsed to server_stats_t
   FLUSHALL_OP,
   VERSION_OP,
   QUIT_OP,
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <netdb.h>
+#include <sys/socket.h>
 #include <stdint.h>
 #include <ctime>
 
@@ -38,15 +39,48 @@ class Connection {
     void takeBuffer(const char* const buf, size_t buf_len);
     void addRequestKey(const char* const key, const size_t len);
     size_t requestKeyCount();
-    void setParserMode(ParserMode md);
+    void setParserMode(ParserMode md, message_result_type quietResult = MSG_LIBMC_INVALID);
+    void setTypedStats();
+    size_t pushBatch(ticket_t ticket);
+    bool hasBatch();
+    // batches not sent or not answered yet
+    bool batchesPending();
+    size_t batchesDone();
+    bool batchDone(ticket_t ticket);
+    // The batches not done are sent again, on a new connection. False if
+    // some of their responses came in already, and can't be taken back.
+    bool rewindBatches();
+    // the batches not done end with what they got
+    void dropBatches();
+    const bool sendPending();
+    void batchRetrievalRange(ticket_t ticket, size_t& begin, size_t& end);
+    void batchMessageRange(ticket_t ticket, size_t& begin, size_t& end);
     void takeNumber(int64_t val);
+    void copyBuffer(const char* const buf, size_t buf_len);
+    void copyNumber(int64_t val);
     ssize_t send();
     ssize_t recv(bool peek = false);
+    // split send()/recv() for callers doing the I/O themselves (io_uring):
+    // the returned msghdr/buffer stay valid until the matching commit call.
+    const struct msghdr* prepareSend(int& flags);
+    ssize_t commitSend(size_t nSent);
+    void sendAgain();
+    const send_stats_t& sendStats();
+    char* prepareRecv(size_t& len);
+    void commitRecv(size_t len);
     void process(err_code_t& err);
     types::RetrievalResultList* getRetrievalResults();
     types::MessageResultList* getMessageResults();
     types::LineResultList* getLineResults();
     types::UnsignedResultList* getUnsignedResults();
+    const server_stats_t& getServerStats();
+    void setRequestArena(RequestArena* arena);
+    void setChunkCallback(retrieval_chunk_cb_t cb, void* ctx);
+    size_t resultBytes() const;
+    size_t bufferBytes() const;
+    // the parts of reset() that keep memory for the next request
+    void shrinkResults();
+    void shrinkBuffers();
 
     std::vector<struct iovec>* getRequestKeys();
 
@@ -57,12 +91,20 @@ class Connection {
     const int getRetryTimeout();
     void setConnectTimeout(int timeout);
     void setMaxRetries(int max_retries);
+    void setZerocopyThreshold(size_t threshold);
+    bool zerocopyPending();
+    bool reapZerocopy();
 
     size_t m_counter;
+    // where each request key is in the keys of an indexed retrieval
+    std::vector<uint32_t> m_keyPositions;
+    short m_pollEvents; // POLLOUT/POLLIN the event loop still waits for
+    bool m_pollRegistered; // the socket is in the epoll set of the pool
 
  protected:
     int connectPoll(int fd, const sockaddr* ai_ptr, const socklen_t ai_addrlen);
     int unixSocketConnect();
+    void enableZerocopy();
 
     char m_name[MC_NI_MAXHOST + 1 + MC_NI_MAXSERV];
     char m_host[MC_NI_MAXHOST];
@@ -74,6 +116,9 @@ class Connection {
     bool m_unixSocket;
     time_t m_deadUntil;
     io::BufferWriter* m_buffer_writer; // for send
+    struct msghdr m_sendMsg;
+    size_t m_sendMsgBytes;
+    send_stats_t m_sendStats;
     io::BufferReader* m_buffer_reader; // for recv
     PacketParser m_parser;
 
@@ -83,6 +128,15 @@ class Connection {
     int m_maxRetries; // max reconnect tries during one command
     int m_retires;
 
+    // MSG_ZEROCOPY for sends with an iovec of at least m_zerocopyThreshold
+    // bytes. The kernel holds on to those pages until it reports the send
+    // done on the socket error queue.
+    size_t m_zerocopyThreshold;
+    bool m_zerocopy; // SO_ZEROCOPY is set on the socket
+    bool m_sendZerocopy; // the send prepared is flagged MSG_ZEROCOPY
+    uint32_t m_zerocopySent;
+    uint32_t m_zerocopyDone;
+
  private:
     Connection(const Connection& conn);
 };
@@ -112,10 +166,26 @@ inline const bool Connection::isSent() {
   return m_buffer_writer->isRead();
 }
 
+inline const bool Connection::sendPending() {
+  return m_buffer_writer->msgIovlen() > 0;
+}
+
 inline const int Connection::getRetryTimeout() {
   return m_retryTimeout;
 }
 
+inline void Connection::sendAgain() {
+  ++m_sendStats.eagain_sends;
+}
+
+inline const send_stats_t& Connection::sendStats() {
+  return m_sendStats;
+}
+
+inline bool Connection::zerocopyPending() {
+  return m_zerocopyDone != m_zerocopySent;
+}
+
 
 } // namespace mc
 } // namespace douban
@@ -3,6 +3,8 @@
 #include <vector>
 #include "Common.h"
 #include "Connection.h"
+#include "IoUring.h"
+#include "RequestArena.h"
 #include "hashkit/ketama.h"
 
 namespace douban {
@@ -21,8 +23,10 @@ class ConnectionPool {
   const char* getRealtimeServerAddressByKey(const char* key, const size_t keyLen);
   void enableConsistentFailover();
   void disableConsistentFailover();
+  // With indexed, where each request key is in keys is kept, for the
+  // collectRetrievalResult taking nKeys
   void dispatchRetrieval(op_code_t op, const char* const* keys, const size_t* keyLens,
-                    size_t nKeys);
+                    size_t nKeys, bool indexed = false);
   void dispatchStorage(op_code_t op,
                         const char* const* keys, const size_t* keyLens,
                         const flags_t* flags, const exptime_t exptime,
@@ -35,24 +39,127 @@ class ConnectionPool {
                      const exptime_t exptime, const bool noreply, size_t nItems);
   void dispatchIncrDecr(op_code_t op, const char* key, const size_t keyLen,
                         const uint64_t delta, const bool noreply);
-  void broadcastCommand(const char * const cmd, const size_t cmdLen, const bool noreply=false);
+  // VERSION_OP, STATS_OP, TYPED_STATS_OP, FLUSHALL_OP or QUIT_OP
+  void broadcastCommand(op_code_t op, const bool noreply=false);
 
   err_code_t waitPoll();
 
   void collectRetrievalResult(std::vector<retrieval_result_t*>& results);
+  void collectRetrievalResult(std::vector<fragmented_retrieval_result_t*>& results);
+  // results[i] is that of keys[i] of an indexed dispatch, NULL if it missed
+  void collectRetrievalResult(size_t nKeys, std::vector<retrieval_result_t*>& results);
   void collectMessageResult(std::vector<message_result_t*>& results);
   void collectBroadcastResult(std::vector<broadcast_result_t>& results, bool isFlushAll=false);
   void collectUnsignedResult(std::vector<unsigned_result_t*>& results);
+  // those of TYPED_STATS_OP, one per connection, and over all of them
+  void collectServerStats(std::vector<server_stats_t>& results, cluster_stats_t* cluster);
+
+  // Asynchronous batches: the dispatch* calls between beginBatch() and
+  // endBatch() are queued behind the batches in flight. pollBatches() sends
+  // and receives for them, and activateBatches() lists the connections with
+  // one for reset().
+  void beginBatch();
+  void endBatch(ticket_t ticket);
+  void activateBatches();
+  // Waits up to timeout ms, -1 for no limit, for a batch to be done on a
+  // connection, 0 only takes what the sockets have ready.
+  err_code_t pollBatches(int timeout);
+  // on every connection it was queued on
+  bool batchDone(ticket_t ticket);
+  void collectRetrievalResult(ticket_t ticket, std::vector<retrieval_result_t*>& results);
+  void collectMessageResult(ticket_t ticket, std::vector<message_result_t*>& results);
   void reset();
   void setPollTimeout(int timeout);
   void setConnectTimeout(int timeout);
   void setRetryTimeout(int timeout);
   void setMaxRetries(int max_retries);
+  void setUseIoUring(bool enabled);
+  void setUseMetaProtocol(bool enabled);
+  void setUseBinaryProtocol(bool enabled);
+  void setZerocopyThreshold(size_t threshold);
+  void getSendStats(send_stats_t* stats);
+  void getMemoryStats(memory_stats_t* stats);
+  void setChunkCallback(retrieval_chunk_cb_t cb, void* ctx);
+  // give back what reset() keeps, connections still in use are skipped
+  void shrinkResults();
+  void shrinkBuffers();
 
  protected:
+  err_code_t waitResponses();
   void markDeadAll(pollfd_t* pollfds, const char* reason);
   void markDeadConn(Connection* conn, const char* reason, pollfd_t* fd_ptr);
   void rewindConn(Connection* conn, pollfd_t* fd_ptr);
+  void serveBatches(Connection* conn, short revents, err_code_t& ret_code);
+  void failBatches(Connection* conn, const char* reason, err_code_t code, bool retry,
+                   err_code_t& ret_code);
+
+#ifdef MC_USE_EPOLL
+  // sockets stay in m_epollFd across calls, edge-triggered, and only
+  // the connections reported by epoll_wait are serviced.
+  bool initEpoll();
+  err_code_t waitEpoll();
+  bool epollRegister(Connection* conn);
+  Connection* epollEventConn(const struct epoll_event& ev);
+  void epollServe(Connection* conn, uint32_t events, err_code_t& ret_code);
+  bool epollSend(Connection* conn, err_code_t& ret_code);
+  bool epollRecv(Connection* conn, err_code_t& ret_code);
+  void markDeadPending(const char* reason);
+  void markDeadConn(Connection* conn, const char* reason);
+  bool rewindConn(Connection* conn);
+
+  int m_epollFd;
+  pid_t m_epollPid; // that made m_epollFd
+  std::vector<struct epoll_event> m_epollEvents;
+#endif
+
+#ifdef MC_USE_ZEROCOPY
+  // The kernel may still read the caller's values after a MSG_ZEROCOPY
+  // send returned, even after the reply came in. Wait for it to let go of
+  // them before returning to the caller.
+  void waitZerocopy();
+#endif
+
+#ifdef MC_USE_IO_URING
+  // sendmsg/recv of all active connections are batched into one
+  // io_uring_enter per wakeup. At most one op of each kind is in flight
+  // per connection, so the BufferWriter iovecs and the BufferReader
+  // block handed to the kernel stay untouched until their cqe is reaped.
+  enum {
+    URING_OP_SEND = 0,
+    URING_OP_RECV,
+    URING_OP_PEEK,
+    URING_OP_CANCEL,
+  };
+  enum UringRetry {
+    URING_NO_RETRY = 0,
+    URING_RETRY, // counts against max_retries, like a send/recv error
+    URING_RETRY_IDLE, // closed by the server while idle, like the poll peek
+  };
+  struct UringState {
+    uint8_t inflight; // bit (1 << URING_OP_*) per sqe not completed yet
+    const char* deadReason; // failed, finalized once inflight drains
+    err_code_t deadCode;
+    UringRetry retry;
+    char peekByte;
+  };
+
+  bool initUring();
+  err_code_t waitUring();
+  struct io_uring_sqe* uringSqe();
+  bool uringQueue(Connection* conn, int op, bool link = false);
+  void uringStart(Connection* conn, bool peek, err_code_t& ret_code);
+  void uringComplete(uint64_t userData, int res, err_code_t& ret_code);
+  void uringFail(Connection* conn, const char* reason, err_code_t code, UringRetry retry,
+                 err_code_t& ret_code);
+  void uringFinalize(Connection* conn, err_code_t& ret_code);
+  void uringCancel(Connection* conn);
+  void uringAbort();
+
+  io::IoUring m_uring;
+  bool m_useUring;
+  std::vector<UringState> m_uringStates;
+  uint32_t m_uringInflight;
+#endif
 
   uint32_t m_nActiveConn; // wait for poll
   uint32_t m_nInvalidKey;
@@ -61,6 +168,17 @@ class ConnectionPool {
   Connection *m_conns;
   size_t m_nConns;
   int m_pollTimeout;
+  // Requests are sent as meta commands, quiet and ended by "mn", so that
+  // only hits of get and touch, and failures of the rest are answered.
+  // Requests the server is quiet about are taken as answered the other way.
+  bool m_useMeta;
+  // The binary protocol for every command, see BinaryProtocol.h. Requests
+  // are quiet where they can be and ended by a NOOP, and are matched by
+  // their opaque like meta commands. Noreply ones are not waited for.
+  bool m_useBinary;
+  // when the batches in flight on each connection last moved, in ms
+  std::vector<uint64_t> m_batchProgress;
+  RequestArena m_requestArena; // released by reset()
 };
 
 } // namespace mc
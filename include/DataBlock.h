@@ -17,6 +17,7 @@ class DataBlock {
   static size_t minCapacity();
 
   void init(size_t len);
+  void destroy();
   void reset();
   inline char* operator[](size_t offset) {
     assert(offset < m_size);
@@ -35,7 +36,7 @@ class DataBlock {
 
   void acquire(size_t len);
   void release(size_t len);
-  size_t size();
+  size_t size() const;
   size_t capacity();
   bool reusable();
   size_t nBytesRef();
@@ -43,6 +44,8 @@ class DataBlock {
   char* getWritePtr();
   size_t getWriteLeft();
   size_t find(char c, size_t since = 0);
+  // whichever of c1 and c2 comes first
+  size_t find(char c1, char c2, size_t since);
   size_t findNotNumeric(size_t since = 0);
 
  protected:
@@ -64,7 +67,7 @@ inline void DataBlock::release(size_t len) {
 }
 
 
-inline size_t DataBlock::size() {
+inline size_t DataBlock::size() const {
   return m_size;
 }
 
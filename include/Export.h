@@ -16,6 +16,18 @@ typedef enum {
   CFG_HASH_FUNCTION,
   CFG_MAX_RETRIES,
   CFG_SET_FAILOVER,
+  CFG_USE_IO_URING,
+  CFG_ZEROCOPY_THRESHOLD, // bytes, 0 to disable
+  // bytes a Client keeps between requests, trimmed on release to the
+  // ClientPool, 0 for no limit
+  CFG_MAX_RETAINED_BUFFER_BYTES, // read and write buffers
+  CFG_MAX_RETAINED_RESULT_BYTES, // result lists and request arena
+  // 1 to send the meta commands (mg/ms/md/ma) of memcached 1.6 instead of
+  // the classic ones, noreply commands stay classic
+  CFG_USE_META_PROTOCOL,
+  // 1 to speak the binary protocol on every command, quiet gets and sets
+  // ended by a NOOP; it takes precedence over CFG_USE_META_PROTOCOL
+  CFG_USE_BINARY_PROTOCOL,
 
   // type separator to track number of Client config options to save
   CLIENT_CONFIG_OPTION_COUNT,
@@ -58,6 +70,7 @@ typedef struct {
 typedef int64_t exptime_t;
 typedef uint32_t flags_t;
 typedef uint64_t cas_unique_t;
+typedef uint32_t ticket_t;
 
 
 typedef struct {
@@ -70,6 +83,40 @@ typedef struct {
 } retrieval_result_t;
 
 
+typedef struct {
+  char* ptr;
+  size_t len;
+} data_fragment_t;
+
+
+// a piece of a value streamed by get/getsStream(), valid during the call
+typedef struct {
+  char* key; // 8B
+  const char* data; // 8B
+  cas_unique_t cas_unique; // 8B
+  uint32_t bytes; // 4B, of the whole value
+  uint32_t offset; // 4B, of data in the value
+  uint32_t len; // 4B
+  flags_t flags;  // 4B
+  uint8_t key_len; // 1B
+} retrieval_chunk_t;
+
+typedef void (*retrieval_chunk_cb_t)(void* ctx, const retrieval_chunk_t* chunk);
+
+
+// a retrieval result whose value is not joined, fragments point into the
+// receive buffers and add up to bytes
+typedef struct {
+  char* key; // 8B
+  data_fragment_t* fragments; // 8B
+  cas_unique_t cas_unique; // 8B
+  uint32_t bytes; // 4B
+  uint32_t n_fragments; // 4B
+  flags_t flags;  // 4B
+  uint8_t key_len; // 1B
+} fragmented_retrieval_result_t;
+
+
 enum message_result_type {
   MSG_LIBMC_INVALID = -1,
   MSG_EXISTS = 0,
@@ -107,3 +154,92 @@ typedef struct {
   size_t len;
   enum message_result_type msg_type;  // for flush_all command
 } broadcast_result_t;
+
+
+// The counters of "stats" that statsTyped() parses to numbers, in the
+// order servers send them. stat_field_name() has their names.
+typedef enum {
+  STAT_PID = 0,
+  STAT_UPTIME,
+  STAT_TIME,
+  STAT_MAX_CONNECTIONS,
+  STAT_CURR_CONNECTIONS,
+  STAT_TOTAL_CONNECTIONS,
+  STAT_REJECTED_CONNECTIONS,
+  STAT_CMD_GET,
+  STAT_CMD_SET,
+  STAT_CMD_FLUSH,
+  STAT_CMD_TOUCH,
+  STAT_GET_HITS,
+  STAT_GET_MISSES,
+  STAT_GET_EXPIRED,
+  STAT_DELETE_MISSES,
+  STAT_DELETE_HITS,
+  STAT_INCR_MISSES,
+  STAT_INCR_HITS,
+  STAT_DECR_MISSES,
+  STAT_DECR_HITS,
+  STAT_CAS_MISSES,
+  STAT_CAS_HITS,
+  STAT_CAS_BADVAL,
+  STAT_TOUCH_HITS,
+  STAT_TOUCH_MISSES,
+  STAT_BYTES_READ,
+  STAT_BYTES_WRITTEN,
+  STAT_LIMIT_MAXBYTES,
+  STAT_THREADS,
+  STAT_BYTES,
+  STAT_CURR_ITEMS,
+  STAT_TOTAL_ITEMS,
+  STAT_EXPIRED_UNFETCHED,
+  STAT_EVICTED_UNFETCHED,
+  STAT_EVICTIONS,
+  STAT_RECLAIMED,
+
+  STAT_FIELD_COUNT
+} stat_field_t;
+
+
+// the counters of one server
+typedef struct {
+  char* host;
+  uint64_t values[STAT_FIELD_COUNT];
+  uint64_t present;  // bit 1 << field is set if the server sent it
+} server_stats_t;
+
+
+// over the servers that sent each counter
+typedef struct {
+  uint64_t sum[STAT_FIELD_COUNT];
+  uint64_t min[STAT_FIELD_COUNT];
+  uint64_t max[STAT_FIELD_COUNT];
+  uint32_t n_present[STAT_FIELD_COUNT];  // servers that sent it
+  uint32_t n_servers;  // servers that answered
+} cluster_stats_t;
+
+
+// cumulative over all connections of a client
+typedef struct {
+  uint64_t sendmsg_calls;  // successful sendmsg calls
+  uint64_t partial_sends;  // calls the socket buffer took only part of
+  uint64_t eagain_sends;  // calls failed with EAGAIN
+} send_stats_t;
+
+
+// memory held by a client between requests
+typedef struct {
+  size_t result_bytes;  // result and request key lists
+  size_t arena_bytes;  // request arena chunks
+  size_t buffer_bytes;  // read blocks and write iovecs of all connections
+} memory_stats_t;
+
+
+// process wide, see BlockPool.h
+typedef struct {
+  uint64_t allocs;  // DataBlock storage requests
+  uint64_t hits;  // served from a thread cache
+  uint64_t retained_bytes;  // held by thread caches
+  uint64_t mapped_bytes;  // reserved by block_pool_reserve_mapped()
+  uint64_t mapped_used_bytes;  // of those, backing blocks now
+  uint64_t mapped_huge;  // 1 if the reservation got MAP_HUGETLB pages
+} block_pool_stats_t;
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+// waiting with a timeout needs IORING_ENTER_EXT_ARG (linux 5.11)
+#ifdef IORING_FEAT_EXT_ARG
+#define MC_USE_IO_URING
+#endif
+#endif
+#endif
+
+#ifdef MC_USE_IO_URING
+
+namespace douban {
+namespace mc {
+namespace io {
+
+/**
+ * A minimal io_uring wrapper on raw syscalls, so that no liburing
+ * is needed at build time or runtime.
+ **/
+class IoUring {
+ public:
+  IoUring();
+  ~IoUring();
+  // returns 0 on success or -errno, e.g. -ENOSYS/-EPERM when io_uring
+  // is not available on this kernel or forbidden by seccomp.
+  int init(unsigned entries);
+  void destroy();
+  bool ready();
+  unsigned capacity();
+
+  // returns NULL if the submission queue is full, call submit() first
+  struct io_uring_sqe* getSqe();
+  // submit queued sqes and wait for at least waitNr cqes,
+  // returns the number of sqes submitted or -errno (-ETIME on timeout)
+  int submitAndWait(unsigned waitNr, int timeoutMs = -1);
+  int submit();
+
+  struct io_uring_cqe* peekCqe();
+  void cqeSeen();
+
+ protected:
+  int m_ringFd;
+  unsigned m_entries;
+
+  void* m_ringPtr;
+  size_t m_ringSize;
+  struct io_uring_sqe* m_sqes;
+  size_t m_sqesSize;
+
+  unsigned* m_sqHead;
+  unsigned* m_sqTail;
+  unsigned* m_sqMask;
+  unsigned* m_sqArray;
+  unsigned* m_cqHead;
+  unsigned* m_cqTail;
+  unsigned* m_cqMask;
+  struct io_uring_cqe* m_cqes;
+
+  unsigned m_sqeTail;  // local tail, published on submit
+  unsigned m_sqeSubmitted;
+
+ private:
+  IoUring(const IoUring&);
+};
+
+
+inline bool IoUring::ready() {
+  return m_ringFd != -1;
+}
+
+inline unsigned IoUring::capacity() {
+  return m_entries;
+}
+
+} // namespace io
+} // namespace mc
+} // namespace douban
+
+#endif // MC_USE_IO_URING
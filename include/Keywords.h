@@ -29,12 +29,47 @@ static const char kDECR_[] = "decr ";
 
 static const char k_NOREPLY[] = " noreply";
 
+// meta commands, each tagged with the index of its request key as opaque
+static const char kMG_[] = "mg ";
+static const char kMS_[] = "ms ";
+static const char kMD_[] = "md ";
+static const char kMA_[] = "ma ";
+static const char kMN_CRLF[] = "mn\r\n";
+static const char k_META_GET[] = " v f O";
+static const char k_META_GETS[] = " v f c O";
+static const char k_META_FLAGS[] = " F";
+static const char k_META_EXPTIME[] = " T";
+static const char k_META_CAS[] = " C";
+static const char k_META_ADD[] = " ME";
+static const char k_META_REPLACE[] = " MR";
+static const char k_META_APPEND[] = " MA";
+static const char k_META_PREPEND[] = " MP";
+static const char k_META_OPAQUE[] = " O";
+static const char k_META_QUIET_CRLF[] = " q\r\n";
+static const char k_META_INCR[] = " v D";
+static const char k_META_DECR[] = " v MD D";
+
 static const char kVERSION[] = "version";
 static const char kSTATS[] = "stats";
 static const char kFLUSHALL[] = "flush_all";
 
 static const char kQUIT[] = "quit";
 
+// names of the stat_field_t counters
+static const char* const kSTAT_FIELDS[] = {
+  "pid", "uptime", "time", "max_connections", "curr_connections",
+  "total_connections", "rejected_connections", "cmd_get", "cmd_set", "cmd_flush",
+  "cmd_touch", "get_hits", "get_misses", "get_expired", "delete_misses",
+  "delete_hits", "incr_misses", "incr_hits", "decr_misses", "decr_hits",
+  "cas_misses", "cas_hits", "cas_badval", "touch_hits", "touch_misses",
+  "bytes_read", "bytes_written", "limit_maxbytes", "threads", "bytes",
+  "curr_items", "total_items", "expired_unfetched", "evicted_unfetched", "evictions",
+  "reclaimed",
+};
+static_assert(sizeof(kSTAT_FIELDS) / sizeof(kSTAT_FIELDS[0]) == STAT_FIELD_COUNT,
+              "a name for each stat_field_t");
+static_assert(STAT_FIELD_COUNT <= 64, "server_stats_t.present has a bit for each");
+
 
 // error messages for human
 static const char kSEND_ERROR[] = "send_error";
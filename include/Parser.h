@@ -4,6 +4,7 @@
 #include <queue>
 
 #include "Common.h"
+#include "BinaryProtocol.h"
 #include "BufferReader.h"
 #include "Result.h"
 
@@ -14,21 +15,64 @@ namespace mc {
 typedef enum {
   MODE_UNDEFINED,
   MODE_END_STATE,
-  MODE_COUNTING
+  MODE_COUNTING,
+  MODE_BINARY // binary responses, up to that of a NOOP or a broadcast
 } ParserMode;
 
 
+// A batch of requests submitted asynchronously. Responses of the batches
+// queued on a connection come back in order, each parsed in its own mode.
+typedef struct {
+  ticket_t ticket;
+  ParserMode mode;
+  message_result_type quietResult;
+  size_t requestKeyEnd; // m_requestKeys of this batch end here
+  size_t iovecEnd; // and its requests at this iovec of the writer
+  size_t retrievalEnd; // set once the batch is parsed
+  size_t messageEnd;
+} pending_batch_t;
+
+
 class PacketParser {
  public:
   PacketParser();
   explicit PacketParser(io::BufferReader* reader);
   ~PacketParser();
   void setBufferReader(io::BufferReader* reader);
-  void setMode(ParserMode md);
+  // where results spill their slices, see io::TokenSlices
+  void setRequestArena(RequestArena* arena);
+  // stream values to cb instead of keeping them as results, NULL to stop
+  void setChunkCallback(retrieval_chunk_cb_t cb, void* ctx);
+  // capacity of the result and request key lists
+  size_t resultBytes() const;
+  // gives the capacity back, a no-op unless reset()
+  void shrink();
+  // Meta commands are quiet and ended by "mn". quietResult is the result
+  // of each request key the server says nothing about before "MN", none
+  // if MSG_LIBMC_INVALID.
+  void setMode(ParserMode md, message_result_type quietResult = MSG_LIBMC_INVALID);
+  // STAT lines of the stat_field_t counters are parsed into getServerStats()
+  // instead of line results, the others are passed over. Until reset().
+  void setTypedStats();
   void addRequestKey(const char* const key, const size_t len);
   std::vector<struct iovec>* getRequestKeys();
   struct iovec* currentRequestKey();
   size_t requestKeyCount();
+  size_t pushBatch(ticket_t ticket, size_t iovecEnd = 0);
+  bool hasBatch();
+  // batches not answered yet
+  bool batchesPending();
+  // Batches both sent and answered, iovecsSent being how much of the
+  // writer is sent. A batch of noreply requests is answered at once.
+  size_t batchesDone(size_t iovecsSent);
+  bool batchDone(ticket_t ticket, size_t iovecsSent);
+  // The iovec to send the batches not done from again, false if some of
+  // their responses were parsed already.
+  bool rewindBatches(size_t iovecsSent, size_t& iovecBegin);
+  // the batches not answered end with what they got
+  void dropBatches();
+  void batchRetrievalRange(ticket_t ticket, size_t& begin, size_t& end);
+  void batchMessageRange(ticket_t ticket, size_t& begin, size_t& end);
   void process_packets(err_code_t &err);
   void reset();
   void rewind();
@@ -37,20 +81,45 @@ class PacketParser {
   types::MessageResultList* getMessageResults();
   types::LineResultList* getLineResults();
   types::UnsignedResultList* getUnsignedResults();
+  const server_stats_t& getServerStats();
 
  protected:
   int start_state(err_code_t& err);
   bool canEndParse();
+  size_t batchKeyEnd();
+  bool nextBatch();
+  const pending_batch_t* findBatch(ticket_t ticket, size_t& idx);
   void processMessageResult(message_result_type tp);
   void processLineResult(err_code_t& err);
+  void streamValue(err_code_t& err);
+  bool parseValueLine();
+  const struct iovec* matchRequestKey(const char* key, size_t len);
+  bool isMetaValueLine();
+  void processMetaLine(err_code_t& err);
+  void processQuietResults(size_t end);
+  void copyBytes(char* out, size_t n);
+  void processBinaryHeader(err_code_t& err);
+  void processBinaryBody(err_code_t& err);
+  void processBinaryLine(size_t keyLen, size_t valueLen);
+  void processTypedStat(err_code_t& err);
+  void processBinaryStat(size_t keyLen, size_t valueLen);
+  void parseStatLine(const char* line, size_t n);
 
 
   std::vector<struct iovec> m_requestKeys;
   io::BufferReader* m_buffer_reader;
+  RequestArena* m_requestArena;
+  retrieval_chunk_cb_t m_chunkCallback;
+  void* m_chunkCtx;
   parser_state_t m_state;
   ParserMode m_mode;
+  message_result_type m_quietResult;
   size_t m_expectedResultCount;
   size_t m_requestKeyIdx;
+  std::vector<pending_batch_t> m_batches;
+  size_t m_batchIdx; // the batch being parsed
+  bool m_typedStats;
+  server_stats_t m_serverStats; // host is left to the connection
 
   types::RetrievalResultList m_retrievalResults;
   types::MessageResultList m_messageResults;
@@ -59,12 +128,36 @@ class PacketParser {
 
   // mt means Member-Tmp-variable
   types::RetrievalResult* mt_kvPtr;
+  io::TokenData mt_token; // read, then handed to a result
+  char* mt_streamKey; // copy of the key of the value being streamed
+  binary::header_t mt_binHeader; // in host order
 };
 
 
 inline bool PacketParser::canEndParse() {
-  assert(m_mode == MODE_END_STATE || m_mode == MODE_COUNTING);
-  return m_mode == MODE_END_STATE ? IS_END_STATE(m_state) : m_requestKeyIdx == m_requestKeys.size();
+  assert(m_mode == MODE_END_STATE || m_mode == MODE_COUNTING || m_mode == MODE_BINARY);
+  if (m_mode == MODE_COUNTING) {
+    return m_requestKeyIdx == batchKeyEnd();
+  }
+  return IS_END_STATE(m_state);
+}
+
+
+// the request keys of the batch being parsed end here
+inline size_t PacketParser::batchKeyEnd() {
+  if (m_batchIdx < m_batches.size()) {
+    return m_batches[m_batchIdx].requestKeyEnd;
+  }
+  return m_requestKeys.size();
+}
+
+
+inline bool PacketParser::hasBatch() {
+  return !m_batches.empty();
+}
+
+inline bool PacketParser::batchesPending() {
+  return m_batchIdx < m_batches.size();
 }
 
 } // namespace mc
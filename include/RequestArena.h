@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace douban {
+namespace mc {
+
+/**
+ * Bump allocator for the buffers materialized while results are collected,
+ * e.g. a key or value that spans more than one DataBlock.
+ *
+ * Nothing is freed one by one: reset() drops everything at once, when the
+ * results of the request are destroyed. Chunks of
+ * MC_REQUEST_ARENA_CHUNK_SIZE are kept for the next request up to
+ * MC_REQUEST_ARENA_RETAIN_BYTES; larger allocations get a chunk of their
+ * own, which is released by reset().
+ **/
+class RequestArena {
+ public:
+  RequestArena();
+  ~RequestArena();
+  // 8 bytes aligned, never NULL
+  char* allocate(size_t len);
+  void reset();
+  // frees the chunks reset() keeps, a no-op unless reset()
+  void shrink();
+  // bytes handed out since the last reset()
+  size_t allocatedBytes() const;
+  // bytes held by chunks, in use or not
+  size_t retainedBytes() const;
+
+ protected:
+  std::vector<char*> m_chunks;
+  size_t m_chunkIdx; // the chunk being filled
+  size_t m_chunkOffset; // used bytes of it
+  std::vector<char*> m_largeChunks;
+  size_t m_largeBytes;
+  size_t m_allocatedBytes;
+
+ private:
+  RequestArena(const RequestArena&);
+  RequestArena& operator=(const RequestArena&);
+};
+
+
+inline size_t RequestArena::allocatedBytes() const {
+  return m_allocatedBytes;
+}
+
+} // namespace mc
+} // namespace douban
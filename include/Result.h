@@ -3,9 +3,6 @@
 #include <vector>
 #include "Export.h"
 #include "BufferReader.h"
-#ifdef MC_USE_SMALL_VECTOR
-#include "llvm/SmallVector.h"
-#endif
 
 namespace douban {
 namespace mc {
@@ -15,19 +12,27 @@ namespace types {
 class RetrievalResult {
  public:
   RetrievalResult();
-  RetrievalResult(const RetrievalResult& other);
+  // move only, so that growing a result list never touches DataBlock
+  // references
+  RetrievalResult(RetrievalResult&& other) noexcept;
   ~RetrievalResult();
 
-  douban::mc::io::TokenData key; // 24B
-  douban::mc::io::TokenData data_block; // 24B
+  douban::mc::io::TokenSlices key; // 40B
+  // the key of the request instead, if the response has none (meta)
+  char* requestKey; // 8B
+  douban::mc::io::TokenSlices data_block; // 40B
   cas_unique_t cas_unique; // 8B
   uint32_t bytesRemain; // 4B. bytes remain to read, complete data if this is 0
   uint32_t bytes; // 4B
   flags_t flags; // 4B
   uint8_t key_len; // 1B
-  retrieval_result_t* inner();
+  // allocated from arena, key and value split over DataBlocks are joined
+  // into it too
+  retrieval_result_t* inner(RequestArena& arena);
+  // the value is left in the DataBlocks, only a split key is joined
+  fragmented_retrieval_result_t* fragmented(RequestArena& arena);
  protected:
-  retrieval_result_t m_inner;
+  retrieval_result_t* m_inner; // 8B
 };
 
 
@@ -37,21 +42,20 @@ void delete_broadcast_result(broadcast_result_t* ptr);
 class LineResult {
  public:
   LineResult();
-  LineResult(const LineResult& other);
+  LineResult(LineResult&& other) noexcept;
   ~LineResult();
-  douban::mc::io::TokenData line;
+  douban::mc::io::TokenSlices line;
   size_t line_len;
-  char* inner(size_t& n);
+  char* inner(size_t& n, RequestArena& arena);
+  // a line joined in the arena already, of n bytes with the '\r'
+  void assign(char* joined, size_t n);
  protected:
   char* m_inner;
 };
 
 
-#ifdef MC_USE_SMALL_VECTOR
-typedef llvm::SmallVector<types::RetrievalResult, 100> RetrievalResultList;
-#else
+// no inline storage, a Client has one list per server and most stay empty
 typedef std::vector<types::RetrievalResult> RetrievalResultList;
-#endif
 typedef std::vector<message_result_t> MessageResultList;
 typedef std::vector<types::LineResult> LineResultList;
 typedef std::vector<unsigned_result_t> UnsignedResultList;
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__) && defined(__GNUC__)
+#define MC_USE_SSE2_SCAN
+#include <emmintrin.h>
+#endif
+
+namespace douban {
+namespace mc {
+namespace io {
+
+/**
+ * Delimiter scans over [begin, end), each returning end if nothing is
+ * found, and the parsing of the numbers they delimit.
+ *
+ * On x86 the first 16 bytes are compared inline with SSE2, as protocol
+ * tokens are mostly shorter than that. Longer spans go on out of line,
+ * 32 bytes at a time with AVX2 when the CPU has it. Elsewhere, and for
+ * spans shorter than a vector, they are plain loops.
+ **/
+
+// the rest of a span past its first 16 bytes, which are already scanned
+const char* findEitherSlow(const char* begin, const char* end, char c1, char c2);
+const char* findNotDigitSlow(const char* begin, const char* end);
+
+
+// libc memchr is already vectorized, and picks its own instruction set
+inline const char* findChar(const char* begin, const char* end, char c) {
+  const void* p = memchr(begin, c, end - begin);
+  return p != NULL ? static_cast<const char*>(p) : end;
+}
+
+
+// whichever of c1 and c2 comes first
+inline const char* findEither(const char* begin, const char* end, char c1, char c2) {
+#ifdef MC_USE_SSE2_SCAN
+  if (end - begin >= 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+    unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(
+      _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(c1)), _mm_cmpeq_epi8(v, _mm_set1_epi8(c2)))));
+    if (mask != 0) {
+      return begin + __builtin_ctz(mask);
+    }
+    return findEitherSlow(begin + 16, end, c1, c2);
+  }
+#endif
+  const char* p = begin;
+  while (p != end && *p != c1 && *p != c2) {
+    ++p;
+  }
+  return p;
+}
+
+
+inline const char* findNotDigit(const char* begin, const char* end) {
+#ifdef MC_USE_SSE2_SCAN
+  if (end - begin >= 16) {
+    // a digit d - '0' is at most 9, comparing unsigned
+    __m128i d = _mm_sub_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(begin)),
+                             _mm_set1_epi8('0'));
+    unsigned mask = ~static_cast<unsigned>(_mm_movemask_epi8(
+      _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d))) & 0xFFFF;
+    if (mask != 0) {
+      return begin + __builtin_ctz(mask);
+    }
+    return findNotDigitSlow(begin + 16, end);
+  }
+#endif
+  const char* p = begin;
+  while (p != end && static_cast<unsigned char>(*p - '0') <= 9) {
+    ++p;
+  }
+  return p;
+}
+
+
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define MC_USE_SWAR_DIGITS
+// the value of 8 digits, combined in pairs, then fours, then all of them
+inline uint64_t parseEightDigits(const char* p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  v -= 0x3030303030303030ULL;
+  v = v * 10 + (v >> 8);
+  v = ((v & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32)) +
+       ((v >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32))) >> 32;
+  return v;
+}
+#endif
+
+
+// Appends the digits in [begin, end) to value, 8 at a time where it can.
+// Returns false if value overflows 64 bits.
+inline bool parseDigits(const char* begin, const char* end, uint64_t& value) {
+  const char* p = begin;
+  if (value == 0 && end - begin <= 19) {
+    // too short to overflow, as all counts from flags to cas mostly are
+#ifdef MC_USE_SWAR_DIGITS
+    for (; end - p >= 8; p += 8) {
+      value = value * 100000000ULL + parseEightDigits(p);
+    }
+#endif
+    for (; p != end; ++p) {
+      value = value * 10 + static_cast<uint64_t>(*p - '0');
+    }
+    return true;
+  }
+  bool overflow = false;
+  for (; p != end; ++p) {
+    overflow |= __builtin_mul_overflow(value, 10ULL, &value);
+    overflow |= __builtin_add_overflow(value, static_cast<uint64_t>(*p - '0'), &value);
+  }
+  return !overflow;
+}
+
+} // namespace io
+} // namespace mc
+} // namespace douban
@@ -21,6 +21,7 @@ inline int int64ToCharArray(int64_t n, char s[]) {
 // Memcached Injections @ blackhat2014 [pdf](http://t.cn/RP0J10Z)
 bool isValidKey(const char* key, const size_t keylen);
 void fprintBuffer(std::FILE* file, const char *data_buffer_, const unsigned int length);
+uint64_t monotonicMs();
 
 } // namespace utility
 } // namespace mc
@@ -29,6 +29,32 @@ extern "C" {
   DECL_RETRIEVAL_CMD(gets);
 #undef DECL_RETRIEVAL_CMD
 
+  // results[i] is that of keys[i], NULL for a miss
+#define DECL_INDEXED_RETRIEVAL_CMD(M) \
+  err_code_t client_##M##_indexed(void* client, const char* const* keys, \
+                 const size_t* key_lens, size_t nKeys, \
+                 retrieval_result_t*** results, size_t* n_results)
+  DECL_INDEXED_RETRIEVAL_CMD(get);
+  DECL_INDEXED_RETRIEVAL_CMD(gets);
+#undef DECL_INDEXED_RETRIEVAL_CMD
+
+#define DECL_FRAGMENTED_RETRIEVAL_CMD(M) \
+  err_code_t client_##M##_fragmented(void* client, const char* const* keys, \
+                 const size_t* key_lens, size_t nKeys, \
+                 fragmented_retrieval_result_t*** results, size_t* n_results)
+  DECL_FRAGMENTED_RETRIEVAL_CMD(get);
+  DECL_FRAGMENTED_RETRIEVAL_CMD(gets);
+#undef DECL_FRAGMENTED_RETRIEVAL_CMD
+
+#define DECL_STREAM_RETRIEVAL_CMD(M) \
+  err_code_t client_##M##_stream(void* client, const char* const* keys, \
+                 const size_t* key_lens, size_t nKeys, \
+                 retrieval_chunk_cb_t cb, void* ctx)
+  DECL_STREAM_RETRIEVAL_CMD(get);
+  DECL_STREAM_RETRIEVAL_CMD(gets);
+#undef DECL_STREAM_RETRIEVAL_CMD
+
+  // for both plain and fragmented retrieval results
   void client_destroy_retrieval_result(void* client);
 
 #define DECL_STORAGE_CMD(M) \
@@ -62,8 +88,55 @@ extern "C" {
                   unsigned_result_t** results, size_t* n_results);
   void client_destroy_unsigned_result(void* client);
 
+  // asynchronous commands, see Client::complete()
+#define DECL_RETRIEVAL_ASYNC_CMD(M) \
+  err_code_t client_##M##_async(void* client, const char* const* keys, \
+                 const size_t* key_lens, size_t nKeys, ticket_t* ticket)
+  DECL_RETRIEVAL_ASYNC_CMD(get);
+  DECL_RETRIEVAL_ASYNC_CMD(gets);
+#undef DECL_RETRIEVAL_ASYNC_CMD
+
+#define DECL_STORAGE_ASYNC_CMD(M) \
+  err_code_t client_##M##_async(void* client, const char* const* keys, \
+               const size_t* key_lens, const flags_t* flags, const exptime_t exptime, \
+               const cas_unique_t* cas_uniques, const bool noreply, \
+               const char* const* vals, const size_t* val_lens, \
+               size_t nItems, ticket_t* ticket)
+  DECL_STORAGE_ASYNC_CMD(set);
+  DECL_STORAGE_ASYNC_CMD(add);
+  DECL_STORAGE_ASYNC_CMD(replace);
+  DECL_STORAGE_ASYNC_CMD(append);
+  DECL_STORAGE_ASYNC_CMD(prepend);
+  DECL_STORAGE_ASYNC_CMD(cas);
+#undef DECL_STORAGE_ASYNC_CMD
+
+  err_code_t client_delete_async(void* client, const char* const* keys,
+                    const size_t* key_lens, const bool noreply, size_t n_items,
+                    ticket_t* ticket);
+  err_code_t client_touch_async(void* client, const char* const* keys,
+                   const size_t* key_lens, const exptime_t exptime, const bool noreply,
+                   size_t n_items, ticket_t* ticket);
+  err_code_t client_complete(void* client, int timeout, ticket_t** tickets,
+                             size_t* n_tickets);
+  err_code_t client_ticket_retrieval_result(void* client, ticket_t ticket,
+                                            retrieval_result_t*** results,
+                                            size_t* n_results);
+  err_code_t client_ticket_message_result(void* client, ticket_t ticket,
+                                          message_result_t*** results, size_t* n_results);
+  void client_destroy_tickets(void* client);
+
   err_code_t client_stats(void* client, broadcast_result_t** results, size_t* n_servers);
+  // results are valid until the next call, there is nothing to destroy
+  err_code_t client_stats_typed(void* client, server_stats_t** results, size_t* n_servers,
+                                cluster_stats_t* cluster);
+  const char* stat_field_name(stat_field_t field);
   void client_toggle_flush_all_feature(void* client, bool enabled);
+  void client_get_send_stats(void* client, send_stats_t* stats);
+  void client_get_memory_stats(void* client, memory_stats_t* stats);
+  void client_trim_retained(void* client);
+  void get_block_pool_stats(block_pool_stats_t* stats);
+  // see BlockPool::reserveMapped, returns 0 or -errno
+  int block_pool_reserve_mapped(size_t bytes);
   err_code_t client_flush_all(void* client, broadcast_result_t** results, size_t* n_servers);
   err_code_t client_quit(void* client);
 
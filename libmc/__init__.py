@@ -11,6 +11,12 @@ from ._client import (
     MC_CONNECT_TIMEOUT,
     MC_RETRY_TIMEOUT,
     MC_SET_FAILOVER,
+    MC_USE_IO_URING,
+    MC_ZEROCOPY_THRESHOLD,
+    MC_MAX_RETAINED_BUFFER_BYTES,
+    MC_MAX_RETAINED_RESULT_BYTES,
+    MC_USE_META_PROTOCOL,
+    MC_USE_BINARY_PROTOCOL,
     MC_INITIAL_CLIENTS,
     MC_MAX_CLIENTS,
     MC_MAX_GROWTH,
@@ -30,6 +36,7 @@ from ._client import (
     MC_RETURN_INVALID_KEY_ERR,
     MC_RETURN_INCOMPLETE_BUFFER_ERR,
     MC_RETURN_OK,
+    STAT_FIELD_NAMES,
     __file__ as _libmc_so_file
 )
 
@@ -77,8 +84,11 @@ __all__ = [
     'ClientUnsafe', 'ClientPool', 'ThreadedClient',
 
     'MC_DEFAULT_EXPTIME', 'MC_POLL_TIMEOUT', 'MC_CONNECT_TIMEOUT',
-    'MC_RETRY_TIMEOUT', 'MC_SET_FAILOVER', 'MC_INITIAL_CLIENTS',
-    'MC_MAX_CLIENTS', 'MC_MAX_GROWTH',
+    'MC_RETRY_TIMEOUT', 'MC_SET_FAILOVER', 'MC_USE_IO_URING',
+    'MC_ZEROCOPY_THRESHOLD', 'MC_MAX_RETAINED_BUFFER_BYTES',
+    'MC_MAX_RETAINED_RESULT_BYTES', 'MC_USE_META_PROTOCOL',
+    'MC_USE_BINARY_PROTOCOL',
+    'MC_INITIAL_CLIENTS', 'MC_MAX_CLIENTS', 'MC_MAX_GROWTH',
 
     'MC_HASH_MD5', 'MC_HASH_FNV1_32', 'MC_HASH_FNV1A_32', 'MC_HASH_CRC_32',
 
@@ -86,5 +96,5 @@ __all__ = [
     'MC_RETURN_POLL_TIMEOUT_ERR', 'MC_RETURN_POLL_ERR',
     'MC_RETURN_MC_SERVER_ERR', 'MC_RETURN_PROGRAMMING_ERR',
     'MC_RETURN_INVALID_KEY_ERR', 'MC_RETURN_INCOMPLETE_BUFFER_ERR',
-    'MC_RETURN_OK', 'DYNAMIC_LIBRARIES'
+    'MC_RETURN_OK', 'STAT_FIELD_NAMES', 'DYNAMIC_LIBRARIES'
 ]
@@ -42,6 +42,7 @@ cdef extern from "Common.h" namespace "douban::mc":
         TOUCH_OP
         DELETE_OP
         STATS_OP
+        TYPED_STATS_OP
         FLUSHALL_OP
         VERSION_OP
         QUIT_OP
@@ -57,6 +58,12 @@ cdef extern from "Export.h":
         CFG_HASH_FUNCTION
         CFG_MAX_RETRIES
         CFG_SET_FAILOVER
+        CFG_USE_IO_URING
+        CFG_ZEROCOPY_THRESHOLD
+        CFG_MAX_RETAINED_BUFFER_BYTES
+        CFG_MAX_RETAINED_RESULT_BYTES
+        CFG_USE_META_PROTOCOL
+        CFG_USE_BINARY_PROTOCOL
 
         CFG_INITIAL_CLIENTS
         CFG_MAX_CLIENTS
@@ -124,6 +131,35 @@ cdef extern from "Export.h":
         size_t len
         message_result_type msg_type;
 
+    ctypedef struct send_stats_t:
+        uint64_t sendmsg_calls
+        uint64_t partial_sends
+        uint64_t eagain_sends
+
+    ctypedef struct memory_stats_t:
+        size_t result_bytes
+        size_t arena_bytes
+        size_t buffer_bytes
+
+    ctypedef int stat_field_t
+    enum: STAT_FIELD_COUNT
+
+    ctypedef struct server_stats_t:
+        char* host
+        uint64_t values[STAT_FIELD_COUNT]
+        uint64_t present
+
+    ctypedef struct cluster_stats_t:
+        uint64_t sum[STAT_FIELD_COUNT]
+        uint64_t min[STAT_FIELD_COUNT]
+        uint64_t max[STAT_FIELD_COUNT]
+        uint32_t n_present[STAT_FIELD_COUNT]
+        uint32_t n_servers
+
+
+cdef extern from "c_client.h":
+    const char* stat_field_name(stat_field_t field) nogil
+
 
 cdef extern from "Client.h" namespace "douban::mc":
     cdef cppclass Client:
@@ -204,8 +240,12 @@ cdef extern from "Client.h" namespace "douban::mc":
         err_code_t version(broadcast_result_t** results, size_t* nHosts) nogil
         err_code_t quit() nogil
         err_code_t stats(broadcast_result_t** results, size_t* nHosts) nogil
+        err_code_t statsTyped(server_stats_t** results, size_t* nHosts,
+                              cluster_stats_t* cluster) nogil
         err_code_t flushAll(broadcast_result_t** results, size_t* nHosts) nogil
         void toggleFlushAllFeature(bool_t enabled)
+        void getSendStats(send_stats_t* stats) nogil
+        void getMemoryStats(memory_stats_t* stats) nogil
         void destroyBroadcastResult() nogil
 
         err_code_t incr(
@@ -264,6 +304,12 @@ MC_CONNECT_TIMEOUT = PyInt_FromLong(CFG_CONNECT_TIMEOUT)
 MC_RETRY_TIMEOUT = PyInt_FromLong(CFG_RETRY_TIMEOUT)
 MC_MAX_RETRIES = PyInt_FromLong(CFG_MAX_RETRIES)
 MC_SET_FAILOVER = PyInt_FromLong(CFG_SET_FAILOVER)
+MC_USE_IO_URING = PyInt_FromLong(CFG_USE_IO_URING)
+MC_ZEROCOPY_THRESHOLD = PyInt_FromLong(CFG_ZEROCOPY_THRESHOLD)
+MC_MAX_RETAINED_BUFFER_BYTES = PyInt_FromLong(CFG_MAX_RETAINED_BUFFER_BYTES)
+MC_MAX_RETAINED_RESULT_BYTES = PyInt_FromLong(CFG_MAX_RETAINED_RESULT_BYTES)
+MC_USE_META_PROTOCOL = PyInt_FromLong(CFG_USE_META_PROTOCOL)
+MC_USE_BINARY_PROTOCOL = PyInt_FromLong(CFG_USE_BINARY_PROTOCOL)
 MC_INITIAL_CLIENTS = PyInt_FromLong(CFG_INITIAL_CLIENTS)
 MC_MAX_CLIENTS = PyInt_FromLong(CFG_MAX_CLIENTS)
 MC_MAX_GROWTH = PyInt_FromLong(CFG_MAX_GROWTH)
@@ -286,6 +332,11 @@ MC_RETURN_INVALID_KEY_ERR = PyInt_FromLong(RET_INVALID_KEY_ERR)
 MC_RETURN_INCOMPLETE_BUFFER_ERR = PyInt_FromLong(RET_INCOMPLETE_BUFFER_ERR)
 MC_RETURN_OK = PyInt_FromLong(RET_OK)
 
+# the counters of stats_typed(), in the order of stat_field_t
+STAT_FIELD_NAMES = tuple([
+    stat_field_name(<stat_field_t>f) for f in range(STAT_FIELD_COUNT)
+])
+
 
 
 cdef bytes _encode_value(object val, int comp_threshold, flags_t *flags):
@@ -980,6 +1031,26 @@ cdef class PyClientShell(PyClientSettings):
     def toggle_flush_all_feature(self, enabled):
         self._imp.toggleFlushAllFeature(enabled)
 
+    def get_send_stats(self):
+        cdef send_stats_t stats
+        with nogil:
+            self._imp.getSendStats(&stats)
+        return {
+            'sendmsg_calls': stats.sendmsg_calls,
+            'partial_sends': stats.partial_sends,
+            'eagain_sends': stats.eagain_sends,
+        }
+
+    def get_memory_stats(self):
+        cdef memory_stats_t stats
+        with nogil:
+            self._imp.getMemoryStats(&stats)
+        return {
+            'result_bytes': stats.result_bytes,
+            'arena_bytes': stats.arena_bytes,
+            'buffer_bytes': stats.buffer_bytes,
+        }
+
     def flush_all(self):
         self._record_thread_ident()
         cdef broadcast_result_t* rst = NULL
@@ -1038,6 +1109,38 @@ cdef class PyClientShell(PyClientSettings):
             self._imp.destroyBroadcastResult()
         return rv
 
+    def stats_typed(self):
+        """The counters of STAT_FIELD_NAMES, as parsed by the client: those
+        of each server that answered, and their sum, min and max over the
+        servers that sent them."""
+        self._record_thread_ident()
+        cdef server_stats_t* rst = NULL
+        cdef server_stats_t* r = NULL
+        cdef cluster_stats_t cluster
+        cdef size_t n = 0
+        with nogil:
+            self.last_error = self._imp.statsTyped(&rst, &n, &cluster)
+
+        servers = {}
+        for i in range(n):
+            r = &rst[i]
+            if r.present == 0:
+                continue
+            counters = {}
+            for f, name in enumerate(STAT_FIELD_NAMES):
+                if r.present & (1 << f):
+                    counters[name] = r.values[f]
+            servers[r.host] = counters
+        rv = {'servers': servers, 'n_servers': cluster.n_servers,
+              'sum': {}, 'min': {}, 'max': {}}
+        for f, name in enumerate(STAT_FIELD_NAMES):
+            if cluster.n_present[f] == 0:
+                continue
+            rv['sum'][name] = cluster.sum[f]
+            rv['min'][name] = cluster.min[f]
+            rv['max'][name] = cluster.max[f]
+        return rv
+
     def _incr_decr_raw(self, op_code_t op, bytes key, uint64_t delta):
 
         cdef char* c_key = NULL
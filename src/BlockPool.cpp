@@ -0,0 +1,284 @@
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+#include <atomic>
+#include <cstdlib>
+#include <mutex>
+#include <vector>
+
+#include "BlockPool.h"
+#include "Common.h"
+
+namespace douban {
+namespace mc {
+namespace io {
+
+static const size_t kNumClasses = MC_BLOCK_POOL_MAX_CLASS - MC_BLOCK_POOL_MIN_CLASS + 1;
+
+// relaxed, they are only read for reporting
+static std::atomic<uint64_t> s_allocs(0);
+static std::atomic<uint64_t> s_hits(0);
+static std::atomic<uint64_t> s_retainedBytes(0);
+
+
+// returns kNumClasses if len is too large to be cached
+static size_t sizeClass(size_t len) {
+  size_t cls = 0;
+  size_t size = static_cast<size_t>(1) << MC_BLOCK_POOL_MIN_CLASS;
+  while (size < len && cls < kNumClasses) {
+    size <<= 1;
+    ++cls;
+  }
+  return cls;
+}
+
+
+static size_t classSize(size_t cls) {
+  return static_cast<size_t>(1) << (MC_BLOCK_POOL_MIN_CLASS + cls);
+}
+
+
+static char* alignedAlloc(size_t len) {
+  void* ptr = NULL;
+  if (posix_memalign(&ptr, MC_CACHE_LINE_SIZE, len) != 0) {
+    return NULL;
+  }
+  return static_cast<char*>(ptr);
+}
+
+
+// The mapping of reserveMapped(). It is never unmapped, and the object
+// itself is never deleted, so that blocks can still be given back from
+// static destructors.
+class MappedRegion {
+ public:
+  MappedRegion(char* base, size_t len, bool huge)
+    : m_base(base), m_end(base + len), m_top(base), m_usedBytes(0), m_huge(huge) {}
+
+  bool contains(const char* ptr) const {
+    return m_base <= ptr && ptr < m_end;
+  }
+
+  // blocks of a class are carved at multiples of 8 KB, as all classes
+  // are, so they stay cache line aligned
+  char* pop(size_t cls) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    char* ptr = NULL;
+    if (!m_free[cls].empty()) {
+      ptr = m_free[cls].back();
+      m_free[cls].pop_back();
+    } else if (static_cast<size_t>(m_end - m_top) >= classSize(cls)) {
+      ptr = m_top;
+      m_top += classSize(cls);
+    } else {
+      return NULL;
+    }
+    m_usedBytes += classSize(cls);
+    return ptr;
+  }
+
+  void push(size_t cls, char* ptr) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_free[cls].push_back(ptr);
+    m_usedBytes -= classSize(cls);
+  }
+
+  void getStats(block_pool_stats_t* stats) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    stats->mapped_bytes = m_end - m_base;
+    stats->mapped_used_bytes = m_usedBytes;
+    stats->mapped_huge = m_huge ? 1 : 0;
+  }
+
+ protected:
+  std::mutex m_mutex;
+  char* const m_base;
+  char* const m_end;
+  char* m_top;
+  std::vector<char*> m_free[kNumClasses];
+  size_t m_usedBytes;
+  bool m_huge;
+};
+
+
+static std::atomic<MappedRegion*> s_mapped(NULL);
+
+
+// len is a multiple of MC_HUGE_PAGE_SIZE, NULL with errno set on failure
+static char* mapRegion(size_t len, bool& huge) {
+  void* ptr = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  // only succeeds if enough huge pages are reserved, see vm.nr_hugepages
+  ptr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+  if (ptr != MAP_FAILED) {
+    huge = true;
+    return static_cast<char*>(ptr);
+  }
+#endif
+  huge = false;
+  // map one huge page more, so that the region can start on a boundary
+  size_t mapLen = len + MC_HUGE_PAGE_SIZE;
+  ptr = mmap(NULL, mapLen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED) {
+    return NULL;
+  }
+  char* raw = static_cast<char*>(ptr);
+  uintptr_t mask = MC_HUGE_PAGE_SIZE - 1;
+  char* base = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(raw) + mask) & ~mask);
+  if (base > raw) {
+    munmap(raw, base - raw);
+  }
+  if (raw + mapLen > base + len) {
+    munmap(base + len, raw + mapLen - (base + len));
+  }
+#ifdef MADV_HUGEPAGE
+  // only a hint, transparent huge pages may be disabled
+  madvise(base, len, MADV_HUGEPAGE);
+#endif
+  // fault the pages in now rather than on the first recv into them
+  size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  for (size_t offset = 0; offset < len; offset += pageSize) {
+    base[offset] = 0;
+  }
+  return base;
+}
+
+
+// plain data, so it is still readable after the cache is destroyed
+static thread_local bool t_cacheDestroyed = false;
+
+
+class ThreadBlockCache {
+ public:
+  ThreadBlockCache() : m_bytes(0) {}
+
+  ~ThreadBlockCache() {
+    for (size_t cls = 0; cls < kNumClasses; ++cls) {
+      for (size_t i = 0; i < m_free[cls].size(); ++i) {
+        free(m_free[cls][i]);
+      }
+    }
+    s_retainedBytes.fetch_sub(m_bytes, std::memory_order_relaxed);
+    t_cacheDestroyed = true;
+  }
+
+  char* pop(size_t cls) {
+    if (m_free[cls].empty()) {
+      return NULL;
+    }
+    char* ptr = m_free[cls].back();
+    m_free[cls].pop_back();
+    m_bytes -= classSize(cls);
+    s_retainedBytes.fetch_sub(classSize(cls), std::memory_order_relaxed);
+    return ptr;
+  }
+
+  bool push(size_t cls, char* ptr) {
+    if (m_bytes + classSize(cls) > MC_BLOCK_POOL_THREAD_BYTES) {
+      return false;
+    }
+    m_free[cls].push_back(ptr);
+    m_bytes += classSize(cls);
+    s_retainedBytes.fetch_add(classSize(cls), std::memory_order_relaxed);
+    return true;
+  }
+
+ protected:
+  std::vector<char*> m_free[kNumClasses];
+  size_t m_bytes;
+};
+
+
+// NULL once the thread is exiting, e.g. for blocks freed by other
+// thread_local or static destructors
+static ThreadBlockCache* threadCache() {
+  if (t_cacheDestroyed) {
+    return NULL;
+  }
+  static thread_local ThreadBlockCache cache;
+  return &cache;
+}
+
+
+char* BlockPool::allocate(size_t len) {
+  s_allocs.fetch_add(1, std::memory_order_relaxed);
+  size_t cls = sizeClass(len);
+  if (cls == kNumClasses) {
+    return alignedAlloc(len);
+  }
+  MappedRegion* region = s_mapped.load(std::memory_order_acquire);
+  if (region != NULL) {
+    char* ptr = region->pop(cls);
+    if (ptr != NULL) {
+      return ptr;
+    }
+  }
+  ThreadBlockCache* cache = threadCache();
+  if (cache != NULL) {
+    char* ptr = cache->pop(cls);
+    if (ptr != NULL) {
+      s_hits.fetch_add(1, std::memory_order_relaxed);
+      return ptr;
+    }
+  }
+  return alignedAlloc(classSize(cls));
+}
+
+
+void BlockPool::deallocate(char* ptr, size_t len) {
+  if (ptr == NULL) {
+    return;
+  }
+  size_t cls = sizeClass(len);
+  if (cls < kNumClasses) {
+    // thread caches only hold heap blocks
+    MappedRegion* region = s_mapped.load(std::memory_order_acquire);
+    if (region != NULL && region->contains(ptr)) {
+      region->push(cls, ptr);
+      return;
+    }
+    ThreadBlockCache* cache = threadCache();
+    if (cache != NULL && cache->push(cls, ptr)) {
+      return;
+    }
+  }
+  free(ptr);
+}
+
+
+void BlockPool::getStats(block_pool_stats_t* stats) {
+  stats->allocs = s_allocs.load(std::memory_order_relaxed);
+  stats->hits = s_hits.load(std::memory_order_relaxed);
+  stats->retained_bytes = s_retainedBytes.load(std::memory_order_relaxed);
+  MappedRegion* region = s_mapped.load(std::memory_order_acquire);
+  if (region != NULL) {
+    region->getStats(stats);
+  } else {
+    stats->mapped_bytes = stats->mapped_used_bytes = stats->mapped_huge = 0;
+  }
+}
+
+
+int BlockPool::reserveMapped(size_t bytes) {
+  static std::mutex mutex;
+  std::lock_guard<std::mutex> lock(mutex);
+  if (s_mapped.load(std::memory_order_acquire) != NULL) {
+    return -EEXIST;
+  }
+  size_t len = (bytes + MC_HUGE_PAGE_SIZE - 1) / MC_HUGE_PAGE_SIZE * MC_HUGE_PAGE_SIZE;
+  if (len == 0) {
+    return -EINVAL;
+  }
+  bool huge = false;
+  char* base = mapRegion(len, huge);
+  if (base == NULL) {
+    return -errno;
+  }
+  s_mapped.store(new MappedRegion(base, len, huge), std::memory_order_release);
+  return 0;
+}
+
+} // namespace io
+} // namespace mc
+} // namespace douban
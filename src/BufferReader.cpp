@@ -6,28 +6,32 @@
 #include "Export.h"
 #include "BufferReader.h"
 #include "Utility.h"
+#include "Scan.h"
 
 namespace douban {
 namespace mc {
 namespace io {
 
 BufferReader::BufferReader()
-  :m_capacity(0), m_size(0), m_readLeft(0), m_nextPreferedDataBlockSize(0) {
-    m_blockWriteIterator = m_dataBlockList.end();
-    m_blockReadCursor.iterator = m_dataBlockList.end();
+  :m_nBlocks(0), m_capacity(0), m_size(0), m_readLeft(0), m_blockWriteIndex(0),
+   m_nextPreferedDataBlockSize(0), m_scanValue('\0'), m_scanOther('\0'),
+   m_bytesPerBatch(0), m_recvSize(0) {
+    m_blockReadCursor.index = 0;
     m_blockReadCursor.offset = 0;
+    forgetScan();
 }
 
 
 BufferReader::~BufferReader() {
-  for (DataBlockListIterator it = m_dataBlockList.begin();
-       it != m_dataBlockList.end(); ++it) {
-    if (!it->reusable()) {
+  for (size_t i = 0; i < m_nBlocks; ++i) {
+    DataBlock& db = m_blocks[i];
+    if (!db.reusable()) {
       log_warn("delete a DataBlock(%p) in use. nBytes: %lu.\n---\n%s\n---\n",
-               &*it, it->nBytesRef(), (*it)[0]);
+               &db, db.nBytesRef(), db[0]);
     }
   }
-  m_dataBlockList.clear();
+  m_blocks.clear();
+  m_nBlocks = 0;
   m_capacity = 0;
   m_size = 0;
   m_readLeft = 0;
@@ -35,12 +39,13 @@ BufferReader::~BufferReader() {
 
 
 void BufferReader::reset() {
+  if (m_size > 0) {
+    learnRecvSize(m_size);
+  }
 
   // assume all datablocks are reusable(ref == 0)
-  int i = 0;
-  for (DataBlockListIterator it = m_dataBlockList.begin();
-       it != m_dataBlockList.end(); ++it, ++i) {
-    DataBlock* dbPtr = &*it;
+  for (size_t i = 0; i < m_nBlocks; ++i) {
+    DataBlock* dbPtr = &m_blocks[i];
     if (!dbPtr->reusable()) {
       log_warn("A DataBlock(%p) in use is backspace-ed. "
                "This should ONLY be happened on error. "
@@ -51,50 +56,107 @@ void BufferReader::reset() {
 #endif
     }
     dbPtr->reset();
-    if (i > 0) {
-      m_capacity -= dbPtr->capacity();
+  }
+
+  // Keep about two recv sizes of blocks for the next batches. A block
+  // sized for one large value is given back, its slot is kept.
+  size_t budget = 2 * recvSize();
+  size_t retained = 0;
+  for (size_t i = 0; i < m_blocks.size(); ++i) {
+    DataBlock& db = m_blocks[i];
+    if (db.capacity() > budget - std::min(retained, budget)) {
+      db.destroy();
     }
+    retained += db.capacity();
   }
-  if (i > 1) {
-    m_dataBlockList.resize(1);
+  while (!m_blocks.empty() && m_blocks.back().capacity() == 0) {
+    m_blocks.pop_back();
   }
 
+  // the first block stays in use, as an empty write block
+  m_nBlocks = (!m_blocks.empty() && m_blocks.front().capacity() > 0) ? 1 : 0;
+  m_capacity = m_nBlocks > 0 ? m_blocks.front().capacity() : 0;
   m_size = 0;
   m_readLeft = 0;
-  m_blockWriteIterator = m_dataBlockList.begin();
-  m_blockReadCursor.iterator = m_dataBlockList.begin();
+  m_blockWriteIndex = 0;
+  m_blockReadCursor.index = 0;
   m_blockReadCursor.offset = 0;
+  forgetScan();
 }
 
 
-size_t BufferReader::prepareWriteBlock(size_t len) {
+void BufferReader::shrink() {
+  if (m_size > 0) {
+    return;
+  }
+  for (size_t i = 0; i < m_blocks.size(); ++i) {
+    m_blocks[i].destroy();
+  }
+  DataBlockRing().swap(m_blocks);
+  m_nBlocks = 0;
+  m_capacity = 0;
+  m_blockWriteIndex = 0;
+  forgetScan();
+}
 
-  if (m_blockWriteIterator != m_dataBlockList.end() &&
-      m_blockWriteIterator->getWriteLeft() == 0) {
-    ++m_blockWriteIterator;
+
+void BufferReader::recycle() {
+  if (m_readLeft > 0) {
+    return;
+  }
+  size_t first = m_nBlocks;
+  while (first > 0 && m_blocks[first - 1].nBytesRef() == 0) {
+    --first;
+  }
+  if (first == m_nBlocks) {
+    return;
   }
+  for (size_t i = first; i < m_nBlocks; ++i) {
+    m_size -= m_blocks[i].size();
+    m_blocks[i].reset();
+  }
+  // the blocks stay in use, empty behind the write block
+  m_blockWriteIndex = first;
+  m_blockReadCursor.index = first;
+  m_blockReadCursor.offset = 0;
+  forgetScan();
+}
 
-  assert(m_blockWriteIterator == m_dataBlockList.end() ||
-         m_blockWriteIterator->getWriteLeft() > 0);
 
-  DataBlock *dbPtr = NULL;
+DataBlock& BufferReader::pushBlock(size_t len) {
+  if (m_nBlocks == m_blocks.size()) {
+    m_blocks.push_back(DataBlock());
+  }
+  DataBlock& db = m_blocks[m_nBlocks++];
+  if (db.capacity() < len) {
+    // a slot given back by reset(), or too small for this one
+    db.destroy();
+    db.init(len);
+  }
+  m_capacity += db.capacity();
+  return db;
+}
 
-  if (m_blockWriteIterator == m_dataBlockList.end()) {
-    // create new block
-    size_t preferedSize = std::max(len, DataBlock::minCapacity());
-    m_dataBlockList.push_back(DataBlock());
-    dbPtr = &m_dataBlockList.back();
-    dbPtr->init(preferedSize);
-    m_capacity += dbPtr->capacity();
 
-    m_blockWriteIterator = --m_dataBlockList.end();
+size_t BufferReader::prepareWriteBlock(size_t len) {
+
+  if (m_blockWriteIndex < m_nBlocks &&
+      m_blocks[m_blockWriteIndex].getWriteLeft() == 0) {
+    ++m_blockWriteIndex;
+  }
+
+  DataBlock *dbPtr = NULL;
+
+  if (m_blockWriteIndex == m_nBlocks) {
+    dbPtr = &pushBlock(std::max(len, DataBlock::minCapacity()));
   } else {
-    dbPtr = &*m_blockWriteIterator;
+    dbPtr = &m_blocks[m_blockWriteIndex];
   }
+  assert(dbPtr->getWriteLeft() > 0);
 
   // init read cursor
   if (m_readLeft == 0) {
-    m_blockReadCursor.iterator = m_blockWriteIterator;
+    m_blockReadCursor.index = m_blockWriteIndex;
     m_blockReadCursor.offset = dbPtr->size();
   }
 
@@ -102,25 +164,68 @@ size_t BufferReader::prepareWriteBlock(size_t len) {
 }
 
 
+size_t BufferReader::prepareWriteBlocks(size_t len, struct iovec* iov, size_t& iovcnt) {
+  assert(iovcnt > 0);
+  if (m_size == 0 && m_nBlocks == 1 && m_blocks.front().capacity() < len) {
+    // the block kept by reset() follows the learned recv size
+    m_blocks.front().destroy();
+    m_blocks.front().init(len);
+    m_capacity = len;
+  }
+  size_t total = prepareWriteBlock(len);
+  iov[0].iov_base = getWritePtr();
+  iov[0].iov_len = total;
+
+  size_t n = 1;
+  size_t index = m_blockWriteIndex;
+  while (total < len && n < iovcnt) {
+    // blocks behind the write block are empty, left by an earlier call
+    DataBlock* dbPtr = NULL;
+    if (++index == m_nBlocks) {
+      dbPtr = &pushBlock(std::max(len - total, DataBlock::minCapacity()));
+    } else {
+      dbPtr = &m_blocks[index];
+    }
+    size_t blockLen = std::min(len - total, dbPtr->getWriteLeft());
+    iov[n].iov_base = dbPtr->getWritePtr();
+    iov[n].iov_len = blockLen;
+    total += blockLen;
+    ++n;
+  }
+  iovcnt = n;
+  return total;
+}
+
+
 char* BufferReader::getWritePtr() {
-  if (m_blockWriteIterator != m_dataBlockList.end()) {
-    return m_blockWriteIterator->getWritePtr();
+  if (m_blockWriteIndex < m_nBlocks) {
+    return m_blocks[m_blockWriteIndex].getWritePtr();
   }
   return NULL;
 }
 
 
 void BufferReader::commitWrite(size_t len) {
-  assert(m_blockWriteIterator->size() + len <= m_blockWriteIterator->capacity());
-  m_blockWriteIterator->occupy(len);
-  if (m_blockWriteIterator->size() + len == m_blockWriteIterator->capacity()) {
-    ++m_blockWriteIterator;
+  DataBlock& db = m_blocks[m_blockWriteIndex];
+  assert(db.size() + len <= db.capacity());
+  db.occupy(len);
+  if (db.getWriteLeft() == 0) {
+    ++m_blockWriteIndex;
   }
   m_size += len;
   m_readLeft += len;
 }
 
 
+void BufferReader::commitWriteBlocks(size_t len) {
+  while (len > 0) {
+    size_t blockLen = std::min(len, m_blocks[m_blockWriteIndex].getWriteLeft());
+    commitWrite(blockLen);
+    len -= blockLen;
+  }
+}
+
+
 void BufferReader::write(char* ptr, size_t len, bool copying) {
   // TODO copying = false, and take over ptr
   size_t n_copied = 0;
@@ -139,19 +244,27 @@ size_t BufferReader::capacity() {
   return m_capacity;
 }
 
+
+size_t BufferReader::retainedCapacity() {
+  size_t t = 0;
+  for (DataBlockRing::iterator it = m_blocks.begin(); it != m_blocks.end(); ++it) {
+    t += it->capacity();
+  }
+  return t;
+}
+
 size_t BufferReader::size() {
   return m_size;
 }
 
 size_t BufferReader::nDataBlock() {
-  return m_dataBlockList.size();
+  return m_nBlocks;
 }
 
 size_t BufferReader::nBytesRef() {
   size_t t = 0;
-  for (DataBlockListIterator it = m_dataBlockList.begin();
-      it != m_dataBlockList.end(); ++it) {
-    t += it->nBytesRef();
+  for (size_t i = 0; i < m_nBlocks; ++i) {
+    t += m_blocks[i].nBytesRef();
   }
   return t;
 }
@@ -166,13 +279,13 @@ const char BufferReader::peek(err_code_t& err, size_t offset) const {
   DataCursor cur = m_blockReadCursor;
 
   while (offset > 0) {
-    if (offset < cur.iterator->size() - cur.offset) {
+    if (offset < m_blocks[cur.index].size() - cur.offset) {
       cur.offset += offset;
       offset = 0;
     } else {
-      if (cur.iterator != m_blockWriteIterator) {
-        offset -= (cur.iterator->size() - cur.offset);
-        ++cur.iterator;
+      if (cur.index != m_blockWriteIndex) {
+        offset -= (m_blocks[cur.index].size() - cur.offset);
+        ++cur.index;
         cur.offset = 0;
       } else {
         err = RET_INCOMPLETE_BUFFER_ERR;
@@ -185,40 +298,87 @@ const char BufferReader::peek(err_code_t& err, size_t offset) const {
 }
 
 
-size_t BufferReader::readUntil(err_code_t& err, char value, TokenData& tokenData) {
-  assert(tokenData.empty());
-  err = RET_OK;
-  DataCursor endCur = m_blockReadCursor;
-  DataBlock * dbPtr = NULL;
-  size_t nSize = 0;
-  while (endCur.iterator != m_dataBlockList.end()) {
-    dbPtr = &*endCur.iterator;
-    size_t pos = dbPtr->find(value, endCur.offset);
-    if (pos != dbPtr->size()) {
+// The blocks are only ever written at their end, so no one of the scans
+// below needs to go over what it saw last time again.
+void BufferReader::forgetScan() {
+  m_scanFrom.index = SIZE_MAX;
+  m_scanFrom.offset = 0;
+  m_scanTo = m_scanFrom;
+}
+
+
+// Finds the first value or other from the read cursor on, from where the
+// last scan for them stopped. False if it has not arrived yet.
+bool BufferReader::scanUntil(char value, char other, DataCursor& endCur) {
+  endCur = m_blockReadCursor;
+  if (m_scanFrom == m_blockReadCursor && m_scanValue == value && m_scanOther == other) {
+    endCur = m_scanTo;
+  }
+  m_scanFrom = m_blockReadCursor;
+  m_scanValue = value;
+  m_scanOther = other;
+  while (endCur.index < m_nBlocks) {
+    DataBlock& db = m_blocks[endCur.index];
+    size_t pos = value == other ? db.find(value, endCur.offset) :
+      db.find(value, other, endCur.offset);
+    if (pos != db.size()) {
       endCur.offset = pos;
-      break;
+      m_scanTo = endCur;
+      return true;
     }
-    ++endCur.iterator;
+    ++endCur.index;
     endCur.offset = 0;
   }
 
-  if (endCur.iterator == m_dataBlockList.end()) {
+  // the next recv is written from the write block on
+  m_scanTo.index = m_blockWriteIndex;
+  m_scanTo.offset = 0;
+  if (m_blockWriteIndex < m_nBlocks) {
+    m_scanTo.offset = m_blocks[m_blockWriteIndex].size();
+  }
+  return false;
+}
+
+
+const char* BufferReader::scanContiguousUntil(char value, size_t& len) {
+  len = 0;
+  DataCursor endCur;
+  if (!scanUntil(value, value, endCur) || endCur.index != m_blockReadCursor.index) {
+    return NULL;
+  }
+  len = endCur.offset - m_blockReadCursor.offset;
+  return m_blocks[m_blockReadCursor.index][m_blockReadCursor.offset];
+}
+
+
+size_t BufferReader::readUntil(err_code_t& err, char value, TokenData& tokenData) {
+  return readUntil(err, value, value, tokenData);
+}
+
+
+size_t BufferReader::readUntil(err_code_t& err, char value, char other, TokenData& tokenData) {
+  assert(tokenData.empty());
+  err = RET_OK;
+  DataCursor endCur;
+  DataBlock * dbPtr = NULL;
+  size_t nSize = 0;
+  if (!scanUntil(value, other, endCur)) {
     err = RET_INCOMPLETE_BUFFER_ERR;
     return 0;
   }
 
   while (m_blockReadCursor != endCur) {
-    dbPtr = &*m_blockReadCursor.iterator;
+    dbPtr = &m_blocks[m_blockReadCursor.index];
 
     DataBlockSlice dbs;
-    dbs.iterator = m_blockReadCursor.iterator;
+    dbs.block = &m_blocks[m_blockReadCursor.index];
     dbs.offset =  m_blockReadCursor.offset;
-    if (m_blockReadCursor.iterator == endCur.iterator) {
+    if (m_blockReadCursor.index == endCur.index) {
       dbs.size = endCur.offset - m_blockReadCursor.offset;
       m_blockReadCursor.offset = endCur.offset;
     } else {
       dbs.size = dbPtr->size() - m_blockReadCursor.offset;
-      ++m_blockReadCursor.iterator;
+      ++m_blockReadCursor.index;
       m_blockReadCursor.offset = 0;
     }
 
@@ -234,34 +394,23 @@ size_t BufferReader::readUntil(err_code_t& err, char value, TokenData& tokenData
 
 size_t BufferReader::skipUntil(err_code_t& err, char value) {
   err = RET_OK;
-  DataCursor endCur = m_blockReadCursor;
+  DataCursor endCur;
   DataBlock * dbPtr = NULL;
   size_t nSize = 0;
-  while (endCur.iterator != m_dataBlockList.end()) {
-    dbPtr = &*endCur.iterator;
-    size_t pos = dbPtr->find(value, endCur.offset);
-    if (pos != dbPtr->size()) {
-      endCur.offset = pos;
-      break;
-    }
-    ++endCur.iterator;
-    endCur.offset = 0;
-  }
-
-  if (endCur.iterator == m_dataBlockList.end()) {
+  if (!scanUntil(value, value, endCur)) {
     err = RET_INCOMPLETE_BUFFER_ERR;
     return 0;
   }
 
   while (m_blockReadCursor != endCur) {
-    dbPtr = &*m_blockReadCursor.iterator;
+    dbPtr = &m_blocks[m_blockReadCursor.index];
     size_t len = 0;
-    if (m_blockReadCursor.iterator == endCur.iterator) {
+    if (m_blockReadCursor.index == endCur.index) {
       len = endCur.offset - m_blockReadCursor.offset;
       m_blockReadCursor.offset = endCur.offset;
     } else {
       len = dbPtr->size() - m_blockReadCursor.offset;
-      ++m_blockReadCursor.iterator;
+      ++m_blockReadCursor.index;
       m_blockReadCursor.offset = 0;
     }
 
@@ -283,16 +432,31 @@ void BufferReader::readUnsigned(err_code_t& err, uint64_t& value) {
     return;
   }
 
+  // mostly the number and what ends it are in the read block
+  size_t len = 0;
+  const char* begin = contiguous(len);
+  const char* digitsEnd = begin != NULL ? findNotDigit(begin, begin + len) : NULL;
+  if (digitsEnd != NULL && digitsEnd != begin + len) {
+    len = digitsEnd - begin;
+    if (len == 0 || !parseDigits(begin, digitsEnd, value)) {
+      err = RET_PROGRAMMING_ERR;
+    }
+    m_blocks[m_blockReadCursor.index].release(len);
+    m_blockReadCursor.offset += len;
+    m_readLeft -= len;
+    return;
+  }
+
   DataCursor endCur = m_blockReadCursor;
   DataBlock* dbPtr = NULL;
-  while (endCur.iterator != m_dataBlockList.end()) {
-    dbPtr = &*endCur.iterator;
+  while (endCur.index < m_nBlocks) {
+    dbPtr = &m_blocks[endCur.index];
     size_t pos = dbPtr->findNotNumeric(endCur.offset);
     if (pos != dbPtr->size()) {
       endCur.offset = pos;
       break;
     }
-    ++endCur.iterator;
+    ++endCur.index;
     endCur.offset = 0;
   }
 
@@ -301,32 +465,34 @@ void BufferReader::readUnsigned(err_code_t& err, uint64_t& value) {
     return;
   }
 
-  if (endCur.iterator == m_dataBlockList.end()) {
+  if (endCur.index >= m_nBlocks) {
     err = RET_INCOMPLETE_BUFFER_ERR;
     return;
   }
 
+  bool overflow = false;
   while (m_blockReadCursor != endCur) {
-    dbPtr = &*m_blockReadCursor.iterator;
+    dbPtr = &m_blocks[m_blockReadCursor.index];
     size_t offset = m_blockReadCursor.offset;
 
-    size_t len = 0, j = 0;
-
-    if (m_blockReadCursor.iterator == endCur.iterator) {
+    if (m_blockReadCursor.index == endCur.index) {
       len = endCur.offset - m_blockReadCursor.offset;
       m_blockReadCursor.offset = endCur.offset;
     } else {
       len = dbPtr->size() - m_blockReadCursor.offset;
-      ++m_blockReadCursor.iterator;
+      ++m_blockReadCursor.index;
       m_blockReadCursor.offset = 0;
     }
-    for (j = 0; j < len; j++) {
-      value = value * 10ULL + (*((*dbPtr)[offset + j]) - '0');
-    }
+    const char* digits = dbPtr->at(offset);
+    overflow |= !parseDigits(digits, digits + len, value);
 
     m_readLeft -= len;
     dbPtr->release(len);
   }
+  if (overflow) {
+    // not a number the protocol can send
+    err = RET_PROGRAMMING_ERR;
+  }
 }
 
 
@@ -344,10 +510,10 @@ void BufferReader::readBytes(err_code_t& err, size_t len, TokenData& tokenData)
 
   while (len > 0) {
     DataBlockSlice dbs;
-    dbs.iterator = m_blockReadCursor.iterator;
+    dbs.block = &m_blocks[m_blockReadCursor.index];
     dbs.offset = m_blockReadCursor.offset;
 
-    size_t maxToRead = m_blockReadCursor.iterator->size() - m_blockReadCursor.offset;
+    size_t maxToRead = m_blocks[m_blockReadCursor.index].size() - m_blockReadCursor.offset;
 
     if (len < maxToRead) {
       dbs.size = len;
@@ -356,7 +522,7 @@ void BufferReader::readBytes(err_code_t& err, size_t len, TokenData& tokenData)
     } else {
       dbs.size = maxToRead;
       len -= maxToRead;
-      ++m_blockReadCursor.iterator;
+      ++m_blockReadCursor.index;
       m_blockReadCursor.offset = 0;
     }
     tokenData.push_back(dbs);
@@ -364,6 +530,17 @@ void BufferReader::readBytes(err_code_t& err, size_t len, TokenData& tokenData)
 }
 
 
+size_t BufferReader::readAvailable(size_t maxLen, TokenData& tokenData) {
+  size_t len = std::min(maxLen, m_readLeft);
+  if (len > 0) {
+    err_code_t err;
+    readBytes(err, len, tokenData);
+    assert(err == RET_OK);
+  }
+  return len;
+}
+
+
 void BufferReader::expectBytes(err_code_t& err, const char* str, size_t len) {
   assert(len > 0);
   err = RET_OK;
@@ -376,7 +553,7 @@ void BufferReader::expectBytes(err_code_t& err, const char* str, size_t len) {
 
   DataBlock* dbPtr = NULL;
   while (len > 0) {
-    dbPtr = &*(m_blockReadCursor.iterator);
+    dbPtr = &m_blocks[m_blockReadCursor.index];
     size_t maxToRead = dbPtr->size() - m_blockReadCursor.offset;
 
     if (len < maxToRead) {
@@ -396,7 +573,7 @@ void BufferReader::expectBytes(err_code_t& err, const char* str, size_t len) {
       pos += maxToRead;
       dbPtr->release(maxToRead);
       len -= maxToRead;
-      ++m_blockReadCursor.iterator;
+      ++m_blockReadCursor.index;
       m_blockReadCursor.offset = 0;
     }
   }
@@ -413,7 +590,7 @@ void BufferReader::skipBytes(err_code_t& err, size_t len) {
   m_readLeft -= len;
   DataBlock* dbPtr = NULL;
   while (len > 0) {
-    dbPtr = &*m_blockReadCursor.iterator;
+    dbPtr = &m_blocks[m_blockReadCursor.index];
     size_t maxToRead = dbPtr->size() - m_blockReadCursor.offset;
 
     if (len < maxToRead) {
@@ -423,7 +600,7 @@ void BufferReader::skipBytes(err_code_t& err, size_t len) {
     } else {
       dbPtr->release(maxToRead);
       len -= maxToRead;
-      ++m_blockReadCursor.iterator;
+      ++m_blockReadCursor.index;
       m_blockReadCursor.offset = 0;
     }
   }
@@ -431,44 +608,81 @@ void BufferReader::skipBytes(err_code_t& err, size_t len) {
 
 
 size_t BufferReader::getNextPreferedDataBlockSize() {
-  size_t tmp = m_nextPreferedDataBlockSize == 0 ?
-      DataBlock::minCapacity() :
-      m_nextPreferedDataBlockSize;
-  m_nextPreferedDataBlockSize = DataBlock::minCapacity();
+  // a value body should fit in one block, but never recv less than usual
+  size_t tmp = std::max(m_nextPreferedDataBlockSize, recvSize());
+  m_nextPreferedDataBlockSize = 0;
   return tmp;
 }
 
 
+void BufferReader::learnRecvSize(size_t nBytes) {
+  // weight 1/8 for the latest batch, like TCP's srtt
+  if (m_bytesPerBatch == 0) {
+    m_bytesPerBatch = nBytes;
+  } else {
+    m_bytesPerBatch = m_bytesPerBatch - m_bytesPerBatch / 8 + nBytes / 8;
+  }
+
+  // round up to a power of two so that the kept block isn't
+  // reallocated for every small change
+  size_t minCapacity = DataBlock::minCapacity();
+  size_t maxCapacity = minCapacity * MAX_RECV_CAPACITY_SCALE;
+  size_t size = minCapacity;
+  while (size < m_bytesPerBatch && size < maxCapacity) {
+    size <<= 1;
+  }
+  m_recvSize = MIN(size, maxCapacity);
+}
+
+
 void BufferReader::setNextPreferedDataBlockSize(size_t n) {
   m_nextPreferedDataBlockSize = n;
 }
 
-void freeTokenData(TokenData& td) {
-  for (TokenData::const_iterator it = td.begin(); it != td.end(); ++it) {
-    it->iterator->release(it->size);
-  }
+void TokenSlices::assign(TokenData& td, RequestArena& arena) {
+  m_size = static_cast<uint32_t>(td.size());
+  m_spilled = NULL;
+  if (m_size == 1) {
+    m_inline = td.front();
+  } else if (m_size > 1) {
+    m_spilled = reinterpret_cast<DataBlockSlice*>(
+      arena.allocate(m_size * sizeof(DataBlockSlice)));
+    std::copy(td.begin(), td.end(), m_spilled);
+  }
+  td.clear();
 }
 
-char* parseTokenData(TokenData& td, size_t reserved) {
-  if (reserved == 0) {
-    return NULL;
-  }
-  if (td.size() == 1) {
-    TokenData::const_iterator it = td.begin();
-    assert(it->size == reserved);
-    return it->iterator->at(it->offset);
+
+template <typename T>
+static void releaseSlices(const T& slices) {
+  for (typename T::const_iterator it = slices.begin(); it != slices.end(); ++it) {
+    it->block->release(it->size);
   }
+}
+
+
+void freeTokenData(TokenData& td) {
+  releaseSlices(td);
+}
+
+
+void freeTokenData(TokenSlices& ts) {
+  releaseSlices(ts);
+  ts.clear();
+}
+
 
-  char* ptr = new char[reserved];
+template <typename T>
+static char* joinTokenData(const T& td, size_t reserved, char* ptr) {
   size_t pos = 0;
-  for (TokenData::const_iterator it = td.begin(); it != td.end(); ++it) {
+  for (typename T::const_iterator it = td.begin(); it != td.end(); ++it) {
     if (pos + it->size > reserved) {
       log_err("programmer error: overflow in parseTokenData(%p), reserved: %zu",
               &td, reserved);
       return NULL;
     }
 
-    memcpy(ptr + pos, it->iterator->at(it->offset), it->size);
+    memcpy(ptr + pos, it->block->at(it->offset), it->size);
     pos += (it->size);
   }
   assert(reserved == pos);
@@ -476,6 +690,32 @@ char* parseTokenData(TokenData& td, size_t reserved) {
 }
 
 
+char* parseTokenData(TokenData& td, size_t reserved) {
+  if (reserved == 0) {
+    return NULL;
+  }
+  if (td.size() == 1) {
+    TokenData::const_iterator it = td.begin();
+    assert(it->size == reserved);
+    return it->block->at(it->offset);
+  }
+  return joinTokenData(td, reserved, new char[reserved]);
+}
+
+
+char* parseTokenData(const TokenSlices& ts, size_t reserved, RequestArena& arena) {
+  if (reserved == 0) {
+    return NULL;
+  }
+  if (ts.size() == 1) {
+    TokenSlices::const_iterator it = ts.begin();
+    assert(it->size == reserved);
+    return it->block->at(it->offset);
+  }
+  return joinTokenData(ts, reserved, arena.allocate(reserved));
+}
+
+
 void copyTokenData(const TokenData& src, TokenData& dst) {
   if (src.empty()) {
     return;
@@ -484,11 +724,18 @@ void copyTokenData(const TokenData& src, TokenData& dst) {
   dst = src;
   assert(dst.size() == src.size());
   for (TokenData::const_iterator it = dst.begin(); it != dst.end(); ++it) {
-    it->iterator->acquire(it->size);
+    it->block->acquire(it->size);
   }
 }
 
 
+void moveTokenData(TokenSlices& src, TokenSlices& dst) {
+  assert(dst.empty());
+  dst = src;
+  src.clear();
+}
+
+
 
 } // namespace io
 } // namespace mc
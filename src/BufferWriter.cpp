@@ -1,5 +1,6 @@
 #include <inttypes.h>
 #include <cstdio>
+#include <algorithm>
 #include <vector>
 
 #include "BufferWriter.h"
@@ -9,28 +10,67 @@ namespace douban{
 namespace mc {
 namespace io {
 
-BufferWriter::BufferWriter() :m_readIdx(0), m_msgIovlen(0) {
+static const size_t kArenaChunkSize = 4096;
+// chunks kept by reset(), enough for the headers of a ~1000 item set_multi
+static const size_t kArenaKeepChunks = 16;
+static const size_t kNumberMaxLen = 32;
+static const char kZero[] = "0";
+
+
+BufferWriter::BufferWriter()
+  :m_arenaChunk(0), m_arenaOffset(0), m_readIdx(0), m_segmentEnd(0), m_msgIovlen(0) {
 }
 
 
 BufferWriter::~BufferWriter() {
   reset();
+  for (size_t i = 0; i < m_arenaChunks.size(); ++i) {
+    delete[] m_arenaChunks[i];
+  }
 }
 
 
 void BufferWriter::reset() {
   m_iovec.clear();
   m_originalIovec.clear();
-  for (std::vector<char*>::const_iterator it = m_unsignedStringList.begin();
-       it != m_unsignedStringList.end(); ++it) {
+  for (std::vector<char*>::const_iterator it = m_largeCopies.begin();
+       it != m_largeCopies.end(); ++it) {
     delete[] *it;
   }
-  m_unsignedStringList.clear();
+  m_largeCopies.clear();
+  for (size_t i = kArenaKeepChunks; i < m_arenaChunks.size(); ++i) {
+    delete[] m_arenaChunks[i];
+  }
+  if (m_arenaChunks.size() > kArenaKeepChunks) {
+    m_arenaChunks.resize(kArenaKeepChunks);
+  }
+  m_arenaChunk = 0;
+  m_arenaOffset = 0;
   m_readIdx = 0;
+  m_segmentEnd = 0;
   m_msgIovlen = 0;
 }
 
 
+size_t BufferWriter::retainedBytes() const {
+  return (m_iovec.capacity() + m_originalIovec.capacity()) * sizeof(struct iovec) +
+    m_arenaChunks.size() * kArenaChunkSize;
+}
+
+
+void BufferWriter::shrink() {
+  if (!m_iovec.empty()) {
+    return;
+  }
+  std::vector<struct iovec>().swap(m_iovec);
+  std::vector<struct iovec>().swap(m_originalIovec);
+  for (size_t i = 0; i < m_arenaChunks.size(); ++i) {
+    delete[] m_arenaChunks[i];
+  }
+  std::vector<char*>().swap(m_arenaChunks);
+}
+
+
 void BufferWriter::reserve(size_t n) {
   m_iovec.reserve(n);
 }
@@ -41,19 +81,74 @@ void BufferWriter::takeBuffer(const char* const buf, size_t buf_len) {
   iov.iov_base = const_cast<char*>(buf);
   iov.iov_len = buf_len;
   m_iovec.push_back(iov);
+  if (!m_originalIovec.empty()) {
+    // queued behind a partial send
+    m_originalIovec.push_back(iov);
+  }
   ++m_msgIovlen;
 }
 
 
 void BufferWriter::takeNumber(int64_t val) {
-  m_unsignedStringList.push_back(new char[32]);
-  char* buf = m_unsignedStringList.back();
-  struct iovec iov;
+  if (val == 0) {
+    // flags and exptime mostly
+    takeBuffer(kZero, 1);
+    return;
+  }
+  copyNumber(val);
+}
 
-  iov.iov_base = buf;
-  iov.iov_len = douban::mc::utility::int64ToCharArray(val, buf);
-  m_iovec.push_back(iov);
-  ++m_msgIovlen;
+
+void BufferWriter::copyBuffer(const char* const buf, size_t buf_len) {
+  if (buf_len > kArenaChunkSize) {
+    // never the case for a header, own a copy anyway
+    m_largeCopies.push_back(new char[buf_len]);
+    std::memcpy(m_largeCopies.back(), buf, buf_len);
+    takeBuffer(m_largeCopies.back(), buf_len);
+    return;
+  }
+  char* ptr = arenaAlloc(buf_len);
+  std::memcpy(ptr, buf, buf_len);
+  takeArena(ptr, buf_len);
+}
+
+
+void BufferWriter::copyNumber(int64_t val) {
+  char* ptr = arenaAlloc(kNumberMaxLen);
+  size_t len = douban::mc::utility::int64ToCharArray(val, ptr);
+  // give back what the number didn't use
+  m_arenaOffset -= kNumberMaxLen - len;
+  takeArena(ptr, len);
+}
+
+
+char* BufferWriter::arenaAlloc(size_t len) {
+  if (m_arenaChunks.empty()) {
+    m_arenaChunks.push_back(new char[kArenaChunkSize]);
+  } else if (m_arenaOffset + len > kArenaChunkSize) {
+    if (++m_arenaChunk == m_arenaChunks.size()) {
+      m_arenaChunks.push_back(new char[kArenaChunkSize]);
+    }
+    m_arenaOffset = 0;
+  }
+  char* ptr = m_arenaChunks[m_arenaChunk] + m_arenaOffset;
+  m_arenaOffset += len;
+  return ptr;
+}
+
+
+void BufferWriter::takeArena(char* ptr, size_t len) {
+  if (m_msgIovlen > 0 && m_iovec.size() > m_segmentEnd) {
+    struct iovec& last = m_iovec.back();
+    if (static_cast<char*>(last.iov_base) + last.iov_len == ptr) {
+      last.iov_len += len;
+      if (!m_originalIovec.empty()) {
+        m_originalIovec.back().iov_len += len;
+      }
+      return;
+    }
+  }
+  takeBuffer(ptr, len);
 }
 
 
@@ -84,15 +179,27 @@ void BufferWriter::commitRead(size_t nSent) {
 }
 
 
-void BufferWriter::rewind() {
-  m_readIdx = 0;
-  m_msgIovlen = m_iovec.size();
+void BufferWriter::rewind(size_t from) {
+  m_readIdx = from;
+  m_msgIovlen = m_iovec.size() - from;
   if (!m_originalIovec.empty()) {
-    m_iovec = m_originalIovec;
+    std::copy(m_originalIovec.begin() + from, m_originalIovec.end(), m_iovec.begin() + from);
   }
 }
 
 
+void BufferWriter::discard() {
+  m_readIdx = m_iovec.size();
+  m_msgIovlen = 0;
+}
+
+
+size_t BufferWriter::endSegment() {
+  m_segmentEnd = m_iovec.size();
+  return m_segmentEnd;
+}
+
+
 size_t BufferWriter::msgIovlen() {
   return m_msgIovlen;
 }
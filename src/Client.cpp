@@ -1,17 +1,34 @@
 #include <unistd.h>
 #include <vector>
+#include <algorithm>
 
 #include "Common.h"
 #include "Client.h"
 #include "Keywords.h"
+#include "Utility.h"
 
 namespace douban {
 namespace mc {
 
-Client::Client(): m_flushAllEnabled(false) {
+Client::Client()
+  : m_flushAllEnabled(false), m_maxRetainedBufferBytes(0), m_maxRetainedResultBytes(0),
+    m_lastTicket(0), m_ticketError(RET_OK) {
 }
 
 
+// synchronous commands would dispatch into the batches in flight, and
+// reset the results of the tickets completed
+#define RETURN_IF_TICKETS(RESULTS, N) \
+  do { \
+    if (hasTickets()) { \
+      log_err("destroyTickets() first"); \
+      *(RESULTS) = NULL; \
+      *(N) = 0; \
+      return RET_PROGRAMMING_ERR; \
+    } \
+  } while (0)
+
+
 Client::~Client() {
 }
 
@@ -40,6 +57,25 @@ void Client::config(config_options_t opt, int val) {
       } else {
         enableConsistentFailover();
       }
+      break;
+    case CFG_USE_IO_URING:
+      setUseIoUring(val != 0);
+      break;
+    case CFG_ZEROCOPY_THRESHOLD:
+      setZerocopyThreshold(val > 0 ? static_cast<size_t>(val) : 0);
+      break;
+    case CFG_MAX_RETAINED_BUFFER_BYTES:
+      m_maxRetainedBufferBytes = val > 0 ? static_cast<size_t>(val) : 0;
+      break;
+    case CFG_MAX_RETAINED_RESULT_BYTES:
+      m_maxRetainedResultBytes = val > 0 ? static_cast<size_t>(val) : 0;
+      break;
+    case CFG_USE_META_PROTOCOL:
+      setUseMetaProtocol(val != 0);
+      break;
+    case CFG_USE_BINARY_PROTOCOL:
+      setUseBinaryProtocol(val != 0);
+      break;
     default:
       break;
   }
@@ -48,6 +84,7 @@ void Client::config(config_options_t opt, int val) {
 
 err_code_t Client::get(const char* const* keys, const size_t* keyLens, size_t nKeys,
                  retrieval_result_t*** results, size_t* nResults) {
+  RETURN_IF_TICKETS(results, nResults);
   dispatchRetrieval(GET_OP, keys, keyLens, nKeys);
   err_code_t rv = waitPoll();
   collectRetrievalResult(results, nResults);
@@ -57,6 +94,7 @@ err_code_t Client::get(const char* const* keys, const size_t* keyLens, size_t nK
 
 err_code_t Client::gets(const char* const* keys, const size_t* keyLens, size_t nKeys,
                  retrieval_result_t*** results, size_t* nResults) {
+  RETURN_IF_TICKETS(results, nResults);
   dispatchRetrieval(GETS_OP, keys, keyLens, nKeys);
   err_code_t rv = waitPoll();
   collectRetrievalResult(results, nResults);
@@ -76,9 +114,68 @@ void Client::collectRetrievalResult(retrieval_result_t*** results, size_t* nResu
 }
 
 
+#define IMPL_INDEXED_RETRIEVAL_CMD(M, O) \
+err_code_t Client::M##Indexed(const char* const* keys, const size_t* keyLens, size_t nKeys, \
+                              retrieval_result_t*** results, size_t* nResults) { \
+  RETURN_IF_TICKETS(results, nResults); \
+  dispatchRetrieval((O), keys, keyLens, nKeys, true); \
+  err_code_t rv = waitPoll(); \
+  assert(m_outRetrievalResultPtrs.empty()); \
+  ConnectionPool::collectRetrievalResult(nKeys, m_outRetrievalResultPtrs); \
+  *nResults = nKeys - std::count(m_outRetrievalResultPtrs.begin(), \
+                                 m_outRetrievalResultPtrs.end(), \
+                                 static_cast<retrieval_result_t*>(NULL)); \
+  *results = nKeys == 0 ? NULL : &m_outRetrievalResultPtrs.front(); \
+  return rv; \
+}
+
+IMPL_INDEXED_RETRIEVAL_CMD(get, GET_OP)
+IMPL_INDEXED_RETRIEVAL_CMD(gets, GETS_OP)
+#undef IMPL_INDEXED_RETRIEVAL_CMD
+
+
+#define IMPL_FRAGMENTED_RETRIEVAL_CMD(M, O) \
+err_code_t Client::M##Fragmented(const char* const* keys, const size_t* keyLens, size_t nKeys, \
+                                 fragmented_retrieval_result_t*** results, size_t* nResults) { \
+  RETURN_IF_TICKETS(results, nResults); \
+  dispatchRetrieval((O), keys, keyLens, nKeys); \
+  err_code_t rv = waitPoll(); \
+  assert(m_outFragmentedResultPtrs.empty()); \
+  ConnectionPool::collectRetrievalResult(m_outFragmentedResultPtrs); \
+  *nResults = m_outFragmentedResultPtrs.size(); \
+  *results = *nResults == 0 ? NULL : &m_outFragmentedResultPtrs.front(); \
+  return rv; \
+}
+
+IMPL_FRAGMENTED_RETRIEVAL_CMD(get, GET_OP)
+IMPL_FRAGMENTED_RETRIEVAL_CMD(gets, GETS_OP)
+#undef IMPL_FRAGMENTED_RETRIEVAL_CMD
+
+
+#define IMPL_STREAM_RETRIEVAL_CMD(M, O) \
+err_code_t Client::M##Stream(const char* const* keys, const size_t* keyLens, size_t nKeys, \
+                             retrieval_chunk_cb_t cb, void* ctx) { \
+  if (hasTickets()) { \
+    log_err("destroyTickets() first"); \
+    return RET_PROGRAMMING_ERR; \
+  } \
+  setChunkCallback(cb, ctx); \
+  dispatchRetrieval((O), keys, keyLens, nKeys); \
+  err_code_t rv = waitPoll(); \
+  setChunkCallback(NULL, NULL); \
+  ConnectionPool::reset(); \
+  return rv; \
+}
+
+IMPL_STREAM_RETRIEVAL_CMD(get, GET_OP)
+IMPL_STREAM_RETRIEVAL_CMD(gets, GETS_OP)
+#undef IMPL_STREAM_RETRIEVAL_CMD
+
+
 void Client::destroyRetrievalResult() {
   ConnectionPool::reset();
   m_outRetrievalResultPtrs.clear();
+  m_outFragmentedResultPtrs.clear();
 }
 
 
@@ -107,6 +204,7 @@ err_code_t Client::M(const char* const* keys, const size_t* keyLens, \
                  const cas_unique_t* cas_uniques, const bool noreply, \
                  const char* const* vals, const size_t* valLens, \
                  size_t nItems, message_result_t*** results, size_t* nResults) { \
+  RETURN_IF_TICKETS(results, nResults); \
   dispatchStorage((O), keys, keyLens, flags, exptime, cas_uniques, noreply, vals, \
                   valLens, nItems); \
   err_code_t rv = waitPoll(); \
@@ -125,6 +223,7 @@ IMPL_STORAGE_CMD(cas, CAS_OP)
 err_code_t Client::_delete(const char* const* keys, const size_t* keyLens,
                      const bool noreply, size_t nItems,
                      message_result_t*** results, size_t* nResults) {
+  RETURN_IF_TICKETS(results, nResults);
   dispatchDeletion(keys, keyLens, noreply, nItems);
   err_code_t rv = waitPoll();
   collectMessageResult(results, nResults);
@@ -151,7 +250,8 @@ void Client::destroyBroadcastResult() {
 
 
 err_code_t Client::version(broadcast_result_t** results, size_t* nHosts) {
-  broadcastCommand(keywords::kVERSION, 7);
+  RETURN_IF_TICKETS(results, nHosts);
+  broadcastCommand(VERSION_OP);
   err_code_t rv = waitPoll();
   collectBroadcastResult(results, nHosts);
   return rv;
@@ -159,7 +259,11 @@ err_code_t Client::version(broadcast_result_t** results, size_t* nHosts) {
 
 
 err_code_t Client::quit() {
-  broadcastCommand(keywords::kQUIT, 4, true);
+  if (hasTickets()) {
+    log_err("destroyTickets() first");
+    return RET_PROGRAMMING_ERR;
+  }
+  broadcastCommand(QUIT_OP, true);
   err_code_t rv = waitPoll();
   markDeadAll(NULL, keywords::kCONN_QUIT);
   return rv;
@@ -167,20 +271,36 @@ err_code_t Client::quit() {
 
 
 err_code_t Client::stats(broadcast_result_t** results, size_t* nHosts) {
-  broadcastCommand(keywords::kSTATS, 5);
+  RETURN_IF_TICKETS(results, nHosts);
+  broadcastCommand(STATS_OP);
   err_code_t rv = waitPoll();
   collectBroadcastResult(results, nHosts);
   return rv;
 }
 
+err_code_t Client::statsTyped(server_stats_t** results, size_t* nHosts,
+                              cluster_stats_t* cluster) {
+  memset(cluster, 0, sizeof *cluster);
+  RETURN_IF_TICKETS(results, nHosts);
+  broadcastCommand(TYPED_STATS_OP);
+  err_code_t rv = waitPoll();
+  // copied out, nothing is left to destroy
+  ConnectionPool::collectServerStats(m_outServerStats, cluster);
+  ConnectionPool::reset();
+  *results = m_outServerStats.data();
+  *nHosts = m_nConns;
+  return rv;
+}
+
 err_code_t Client::flushAll(broadcast_result_t** results, size_t* nHosts) {
+  RETURN_IF_TICKETS(results, nHosts);
   if (!m_flushAllEnabled) {
     *results = NULL;
     *nHosts = 0;
     return RET_PROGRAMMING_ERR;
   }
 
-  broadcastCommand(keywords::kFLUSHALL, 9);
+  broadcastCommand(FLUSHALL_OP);
   err_code_t rv = waitPoll();
   collectBroadcastResult(results, nHosts, true);
   return rv;
@@ -190,6 +310,7 @@ err_code_t Client::flushAll(broadcast_result_t** results, size_t* nHosts) {
 err_code_t Client::touch(const char* const* keys, const size_t* keyLens,
                    const exptime_t exptime, const bool noreply, size_t nItems,
                    message_result_t*** results, size_t* nResults) {
+  RETURN_IF_TICKETS(results, nResults);
   dispatchTouch(keys, keyLens, exptime, noreply, nItems);
   err_code_t rv = waitPoll();
   collectMessageResult(results, nResults);
@@ -213,6 +334,7 @@ void Client::collectUnsignedResult(unsigned_result_t** results, size_t* nResults
 err_code_t Client::incr(const char* key, const size_t keyLen, const uint64_t delta,
                  const bool noreply,
                  unsigned_result_t** results, size_t* nResults) {
+  RETURN_IF_TICKETS(results, nResults);
   dispatchIncrDecr(INCR_OP, key, keyLen, delta, noreply);
   err_code_t rv = waitPoll();
   collectUnsignedResult(results, nResults);
@@ -223,6 +345,7 @@ err_code_t Client::incr(const char* key, const size_t keyLen, const uint64_t del
 err_code_t Client::decr(const char* key, const size_t keyLen, const uint64_t delta,
                  const bool noreply,
                  unsigned_result_t** results, size_t* nResults) {
+  RETURN_IF_TICKETS(results, nResults);
   dispatchIncrDecr(DECR_OP, key, keyLen, delta, noreply);
   err_code_t rv = waitPoll();
   collectUnsignedResult(results, nResults);
@@ -236,6 +359,197 @@ void Client::destroyUnsignedResult() {
 }
 
 
+void Client::beginSubmit() {
+  beginBatch();
+}
+
+
+// The batch starts out right away, as far as the sockets take it without
+// blocking. Errors wait for complete().
+err_code_t Client::endSubmit(ticket_t* ticket) {
+  *ticket = ++m_lastTicket;
+  endBatch(*ticket);
+  m_tickets.push_back(*ticket);
+  err_code_t rv = pollBatches(0);
+  if (rv != RET_OK) {
+    m_ticketError = rv;
+  }
+  return RET_OK;
+}
+
+
+bool Client::hasTicket(ticket_t ticket) {
+  return std::find(m_doneTickets.begin(), m_doneTickets.end(), ticket) != m_doneTickets.end();
+}
+
+
+#define IMPL_RETRIEVAL_ASYNC_CMD(M, O) \
+err_code_t Client::M##Async(const char* const* keys, const size_t* keyLens, size_t nKeys, \
+                            ticket_t* ticket) { \
+  beginSubmit(); \
+  dispatchRetrieval((O), keys, keyLens, nKeys); \
+  return endSubmit(ticket); \
+}
+
+IMPL_RETRIEVAL_ASYNC_CMD(get, GET_OP)
+IMPL_RETRIEVAL_ASYNC_CMD(gets, GETS_OP)
+#undef IMPL_RETRIEVAL_ASYNC_CMD
+
+
+#define IMPL_STORAGE_ASYNC_CMD(M, O) \
+err_code_t Client::M##Async(const char* const* keys, const size_t* keyLens, \
+                            const flags_t* flags, const exptime_t exptime, \
+                            const cas_unique_t* cas_uniques, const bool noreply, \
+                            const char* const* vals, const size_t* valLens, \
+                            size_t nItems, ticket_t* ticket) { \
+  beginSubmit(); \
+  dispatchStorage((O), keys, keyLens, flags, exptime, cas_uniques, noreply, vals, \
+                  valLens, nItems); \
+  return endSubmit(ticket); \
+}
+
+IMPL_STORAGE_ASYNC_CMD(set, SET_OP)
+IMPL_STORAGE_ASYNC_CMD(add, ADD_OP)
+IMPL_STORAGE_ASYNC_CMD(replace, REPLACE_OP)
+IMPL_STORAGE_ASYNC_CMD(append, APPEND_OP)
+IMPL_STORAGE_ASYNC_CMD(prepend, PREPEND_OP)
+IMPL_STORAGE_ASYNC_CMD(cas, CAS_OP)
+#undef IMPL_STORAGE_ASYNC_CMD
+
+
+err_code_t Client::deleteAsync(const char* const* keys, const size_t* keyLens,
+                               const bool noreply, size_t nItems, ticket_t* ticket) {
+  beginSubmit();
+  dispatchDeletion(keys, keyLens, noreply, nItems);
+  return endSubmit(ticket);
+}
+
+
+err_code_t Client::touchAsync(const char* const* keys, const size_t* keyLens,
+                              const exptime_t exptime, const bool noreply, size_t nItems,
+                              ticket_t* ticket) {
+  beginSubmit();
+  dispatchTouch(keys, keyLens, exptime, noreply, nItems);
+  return endSubmit(ticket);
+}
+
+
+err_code_t Client::complete(int timeout, ticket_t** tickets, size_t* nTickets) {
+  size_t nBefore = m_doneTickets.size();
+  uint64_t start = utility::monotonicMs();
+  for (;;) {
+    int wait = timeout;
+    if (timeout > 0) {
+      uint64_t elapsed = utility::monotonicMs() - start;
+      wait = elapsed < static_cast<uint64_t>(timeout) ? timeout - static_cast<int>(elapsed) : 0;
+    }
+    err_code_t rv = pollBatches(wait);
+    if (rv != RET_OK) {
+      m_ticketError = rv;
+    }
+    // tickets complete in any order, a batch only waits for its connections
+    std::vector<ticket_t>::iterator it = m_tickets.begin();
+    while (it != m_tickets.end()) {
+      if (batchDone(*it)) {
+        m_doneTickets.push_back(*it);
+        it = m_tickets.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    if (m_doneTickets.size() > nBefore || m_tickets.empty() || wait == 0) {
+      break;
+    }
+  }
+  *nTickets = m_doneTickets.size() - nBefore;
+  *tickets = *nTickets == 0 ? NULL : &m_doneTickets[nBefore];
+  err_code_t rv = m_ticketError;
+  m_ticketError = RET_OK;
+  return rv;
+}
+
+
+err_code_t Client::ticketRetrievalResult(ticket_t ticket, retrieval_result_t*** results,
+                                         size_t* nResults) {
+  m_outRetrievalResultPtrs.clear();
+  *results = NULL;
+  *nResults = 0;
+  if (!hasTicket(ticket)) {
+    return RET_PROGRAMMING_ERR;
+  }
+  ConnectionPool::collectRetrievalResult(ticket, m_outRetrievalResultPtrs);
+  *nResults = m_outRetrievalResultPtrs.size();
+  if (*nResults > 0) {
+    *results = &m_outRetrievalResultPtrs.front();
+  }
+  return RET_OK;
+}
+
+
+err_code_t Client::ticketMessageResult(ticket_t ticket, message_result_t*** results,
+                                       size_t* nResults) {
+  m_outMessageResultPtrs.clear();
+  *results = NULL;
+  *nResults = 0;
+  if (!hasTicket(ticket)) {
+    return RET_PROGRAMMING_ERR;
+  }
+  ConnectionPool::collectMessageResult(ticket, m_outMessageResultPtrs);
+  *nResults = m_outMessageResultPtrs.size();
+  if (*nResults > 0) {
+    *results = &m_outMessageResultPtrs.front();
+  }
+  return RET_OK;
+}
+
+
+void Client::destroyTickets() {
+  m_outRetrievalResultPtrs.clear();
+  m_outMessageResultPtrs.clear();
+  m_doneTickets.clear();
+  if (m_tickets.empty()) {
+    // nothing in flight, the memory of every batch is given back
+    activateBatches();
+    ConnectionPool::reset();
+  }
+}
+
+
+void Client::getMemoryStats(memory_stats_t* stats) {
+  ConnectionPool::getMemoryStats(stats);
+  stats->result_bytes += m_outRetrievalResultPtrs.capacity() * sizeof(retrieval_result_t*) +
+    m_outFragmentedResultPtrs.capacity() * sizeof(fragmented_retrieval_result_t*) +
+    m_outMessageResultPtrs.capacity() * sizeof(message_result_t*) +
+    m_outBroadcastResultPtrs.capacity() * sizeof(broadcast_result_t) +
+    m_outUnsignedResultPtrs.capacity() * sizeof(unsigned_result_t*);
+}
+
+
+void Client::trimRetained() {
+  if (m_maxRetainedBufferBytes == 0 && m_maxRetainedResultBytes == 0) {
+    return;
+  }
+  if (hasTickets() || !m_activeConns.empty()) {
+    // results not destroyed yet
+    return;
+  }
+  memory_stats_t stats;
+  getMemoryStats(&stats);
+  if (m_maxRetainedBufferBytes > 0 && stats.buffer_bytes > m_maxRetainedBufferBytes) {
+    shrinkBuffers();
+  }
+  if (m_maxRetainedResultBytes > 0 &&
+      stats.result_bytes + stats.arena_bytes > m_maxRetainedResultBytes) {
+    shrinkResults();
+    std::vector<retrieval_result_t*>().swap(m_outRetrievalResultPtrs);
+    std::vector<fragmented_retrieval_result_t*>().swap(m_outFragmentedResultPtrs);
+    std::vector<message_result_t*>().swap(m_outMessageResultPtrs);
+    std::vector<broadcast_result_t>().swap(m_outBroadcastResultPtrs);
+    std::vector<unsigned_result_t*>().swap(m_outUnsignedResultPtrs);
+  }
+}
+
+
 void Client::_sleep(uint32_t seconds) {
   usleep(seconds * 1000000);
 }
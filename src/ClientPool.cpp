@@ -137,6 +137,8 @@ IndexedClient* ClientPool::_acquire() {
 }
 
 void ClientPool::_release(const IndexedClient* idx) {
+  // still held by the releasing thread
+  m_clients[idx->index].c.trimRetained();
   std::mutex* const * mux = &m_thread_workers[idx->index];
   (**mux).unlock();
   releaseWorker(idx->index);
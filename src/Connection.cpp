@@ -11,6 +11,10 @@
 #include <fcntl.h>
 #include <queue>
 
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
+
 #include "Common.h"
 #include "Connection.h"
 #include "Keywords.h"
@@ -22,13 +26,18 @@ namespace douban {
 namespace mc {
 
 Connection::Connection()
-    : m_counter(0), m_port(0), m_socketFd(-1),
+    : m_counter(0), m_pollEvents(0), m_pollRegistered(false),
+      m_port(0), m_socketFd(-1),
       m_alive(false), m_hasAlias(false), m_unixSocket(false),
       m_deadUntil(0), m_connectTimeout(MC_DEFAULT_CONNECT_TIMEOUT),
       m_retryTimeout(MC_DEFAULT_RETRY_TIMEOUT),
-      m_maxRetries(MC_DEFAULT_MAX_RETRIES), m_retires(0) {
+      m_maxRetries(MC_DEFAULT_MAX_RETRIES), m_retires(0),
+      m_zerocopyThreshold(0), m_zerocopy(false), m_sendZerocopy(false),
+      m_zerocopySent(0), m_zerocopyDone(0) {
   m_name[0] = '\0';
   m_host[0] = '\0';
+  m_sendMsgBytes = 0;
+  memset(&m_sendStats, 0, sizeof m_sendStats);
   m_buffer_writer = new BufferWriter();
   m_buffer_reader = new BufferReader();
   m_parser.setBufferReader(m_buffer_reader);
@@ -118,6 +127,7 @@ int Connection::connect() {
     if (connectPoll(fd, ai_ptr->ai_addr, ai_ptr->ai_addrlen) == 0) {
       m_socketFd = fd;
       m_alive = true;
+      enableZerocopy();
       break;
     }
 
@@ -198,11 +208,38 @@ int Connection::connectPoll(int fd, const sockaddr* ai_addr, const socklen_t ai_
   }
 }
 
+void Connection::enableZerocopy() {
+#ifdef MC_USE_ZEROCOPY
+  if (m_zerocopyThreshold == 0 || m_zerocopy || m_unixSocket || m_socketFd == -1) {
+    return;
+  }
+  int opt_zerocopy = 1;
+  if (setsockopt(m_socketFd, SOL_SOCKET, SO_ZEROCOPY, &opt_zerocopy, sizeof opt_zerocopy) != 0) {
+    // kernel before 4.14, fall back to copying sends
+    log_warn("%s: SO_ZEROCOPY", m_name);
+    return;
+  }
+  m_zerocopy = true;
+#endif
+}
+
 void Connection::close() {
   if (m_socketFd > 0) {
     m_alive = false;
+#ifdef MC_USE_ZEROCOPY
+    if (zerocopyPending()) {
+      // Abort instead of a graceful close, so the kernel drops the unsent
+      // data still referencing caller buffers right away.
+      struct linger opt_linger = {1, 0};
+      setsockopt(m_socketFd, SOL_SOCKET, SO_LINGER, &opt_linger, sizeof opt_linger);
+    }
+    m_zerocopy = false;
+    m_zerocopySent = m_zerocopyDone = 0;
+#endif
     ::close(m_socketFd);
     m_socketFd = -1;
+    // closing the socket removes it from any epoll set
+    m_pollRegistered = false;
   }
 }
 
@@ -266,56 +303,224 @@ size_t Connection::requestKeyCount() {
   return m_parser.requestKeyCount();
 }
 
-void Connection::setParserMode(ParserMode md) {
-  m_parser.setMode(md);
+void Connection::setParserMode(ParserMode md, message_result_type quietResult) {
+  m_parser.setMode(md, quietResult);
+}
+
+void Connection::setTypedStats() {
+  m_parser.setTypedStats();
+}
+
+size_t Connection::pushBatch(ticket_t ticket) {
+  // reconnects are counted per batch, like per synchronous command
+  m_retires = 0;
+  return m_parser.pushBatch(ticket, m_buffer_writer->endSegment());
+}
+
+bool Connection::hasBatch() {
+  return m_parser.hasBatch();
+}
+
+bool Connection::batchesPending() {
+  return m_parser.batchesPending() || sendPending() || zerocopyPending();
+}
+
+// Sends the kernel may still read from hold back every batch here
+size_t Connection::batchesDone() {
+  return m_parser.batchesDone(zerocopyPending() ? 0 : m_buffer_writer->iovecsSent());
+}
+
+bool Connection::batchDone(ticket_t ticket) {
+  return m_parser.batchDone(ticket, zerocopyPending() ? 0 : m_buffer_writer->iovecsSent());
+}
+
+bool Connection::rewindBatches() {
+  size_t iovecBegin = 0;
+  // what is received is kept for the batches answered before
+  if (m_buffer_reader->readLeft() > 0 ||
+      !m_parser.rewindBatches(m_buffer_writer->iovecsSent(), iovecBegin)) {
+    return false;
+  }
+  m_buffer_writer->rewind(iovecBegin);
+  return true;
+}
+
+void Connection::dropBatches() {
+  err_code_t err;
+  m_parser.dropBatches();
+  if (m_buffer_reader->readLeft() > 0) {
+    m_buffer_reader->skipBytes(err, m_buffer_reader->readLeft());
+  }
+  m_buffer_writer->discard();
+}
+
+void Connection::batchRetrievalRange(ticket_t ticket, size_t& begin, size_t& end) {
+  m_parser.batchRetrievalRange(ticket, begin, end);
+}
+
+void Connection::batchMessageRange(ticket_t ticket, size_t& begin, size_t& end) {
+  m_parser.batchMessageRange(ticket, begin, end);
 }
 
 void Connection::takeNumber(int64_t val) {
   m_buffer_writer->takeNumber(val);
 }
 
-ssize_t Connection::send() {
-  struct msghdr msg = {};
+void Connection::copyBuffer(const char* const buf, size_t buf_len) {
+  m_buffer_writer->copyBuffer(buf, buf_len);
+}
+
+void Connection::copyNumber(int64_t val) {
+  m_buffer_writer->copyNumber(val);
+}
 
+const struct msghdr* Connection::prepareSend(int& flags) {
   size_t n = 0;
-  msg.msg_iov = const_cast<struct iovec *>(m_buffer_writer->getReadPtr(n));
-  msg.msg_iovlen = n;
+  memset(&m_sendMsg, 0, sizeof m_sendMsg);
+  m_sendMsg.msg_iov = const_cast<struct iovec *>(m_buffer_writer->getReadPtr(n));
+  m_sendMsg.msg_iovlen = n;
 
   // otherwise may lead to EMSGSIZE, SEE issue#3 on code
-  int flags = 0;
-  if (msg.msg_iovlen > MC_UIO_MAXIOV) {
-    msg.msg_iovlen = MC_UIO_MAXIOV;
+  flags = 0;
+  if (m_sendMsg.msg_iovlen > MC_UIO_MAXIOV) {
+    m_sendMsg.msg_iovlen = MC_UIO_MAXIOV;
     flags = MC_MSG_MORE;
   }
 
-  ssize_t nSent = ::sendmsg(m_socketFd, &msg, flags);
+  m_sendZerocopy = false;
+  m_sendMsgBytes = 0;
+  for (size_t i = 0; i < m_sendMsg.msg_iovlen; i++) {
+    m_sendMsgBytes += m_sendMsg.msg_iov[i].iov_len;
+#ifdef MC_USE_ZEROCOPY
+    if (m_zerocopy && m_sendMsg.msg_iov[i].iov_len >= m_zerocopyThreshold) {
+      m_sendZerocopy = true;
+    }
+#endif
+  }
+#ifdef MC_USE_ZEROCOPY
+  if (m_sendZerocopy) {
+    flags |= MSG_ZEROCOPY;
+  }
+#endif
+  return &m_sendMsg;
+}
 
-  if (nSent == -1) {
-    return -1;
-  } else {
-    m_buffer_writer->commitRead(nSent);
+ssize_t Connection::commitSend(size_t nSent) {
+  if (m_sendZerocopy) {
+    // every successful MSG_ZEROCOPY call gets a sequence number,
+    // even if the kernel copied the data eventually
+    ++m_zerocopySent;
+  }
+  ++m_sendStats.sendmsg_calls;
+  if (nSent < m_sendMsgBytes) {
+    ++m_sendStats.partial_sends;
   }
+  m_buffer_writer->commitRead(nSent);
+  return m_buffer_writer->msgIovlen();
+}
 
-  size_t msgLeft = m_buffer_writer->msgIovlen();
-  if (msgLeft == 0) {
-    return 0;
-  } else {
-    return msgLeft;
+// Keeps calling sendmsg while the socket takes whole MC_UIO_MAXIOV windows,
+// instead of waiting for another POLLOUT for each of them. Returns the
+// number of iovecs left, or -1 on error if nothing was sent at all.
+ssize_t Connection::send() {
+  ssize_t nToSend = -1;
+  for (int round = 0; round < MC_SEND_MAX_ROUNDS; round++) {
+    int flags = 0;
+    const struct msghdr* msg = prepareSend(flags);
+    ssize_t nSent = ::sendmsg(m_socketFd, msg, flags);
+#ifdef MC_USE_ZEROCOPY
+    if (nSent == -1 && errno == ENOBUFS && m_sendZerocopy) {
+      // out of optmem for pinning pages, copy this one
+      m_sendZerocopy = false;
+      nSent = ::sendmsg(m_socketFd, msg, flags & ~MSG_ZEROCOPY);
+    }
+#endif
+    if (nSent == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        sendAgain();
+      }
+      return round == 0 ? -1 : nToSend;
+    }
+    bool partial = static_cast<size_t>(nSent) < m_sendMsgBytes;
+    nToSend = commitSend(nSent);
+    if (nToSend == 0 || partial) {
+      // a partial send means the socket buffer is full
+      break;
+    }
   }
+  return nToSend;
 }
 
-ssize_t Connection::recv(bool peek) {
-  int flags = 0;
+// Drain the zerocopy notifications from the socket error queue. Returns
+// false if the socket has an error of its own, with errno set.
+bool Connection::reapZerocopy() {
+#ifdef MC_USE_ZEROCOPY
+  char control[CMSG_SPACE(sizeof(struct sock_extended_err)) * 2];
+  while (zerocopyPending()) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+    if (::recvmsg(m_socketFd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        return false;
+      }
+      break;
+    }
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+            (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))) {
+        continue;
+      }
+      struct sock_extended_err serr;
+      memcpy(&serr, CMSG_DATA(cmsg), sizeof serr);
+      if (serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+        errno = serr.ee_errno;
+        return false;
+      }
+      // sends [ee_info, ee_data] are done, ranges may come out of order
+      m_zerocopyDone += serr.ee_data - serr.ee_info + 1;
+    }
+  }
+
+  int err = 0;
+  socklen_t errLen = sizeof err;
+  if (getsockopt(m_socketFd, SOL_SOCKET, SO_ERROR, &err, &errLen) == 0 && err != 0) {
+    errno = err;
+    return false;
+  }
+#endif
+  return true;
+}
+
+char* Connection::prepareRecv(size_t& len) {
   size_t bufferSize = m_buffer_reader->getNextPreferedDataBlockSize();
-  size_t bufferSizeAvailable = m_buffer_reader->prepareWriteBlock(bufferSize);
-  char* writePtr = m_buffer_reader->getWritePtr();
+  len = m_buffer_reader->prepareWriteBlock(bufferSize);
+  return m_buffer_reader->getWritePtr();
+}
+
+void Connection::commitRecv(size_t len) {
+  m_buffer_reader->commitWrite(len);
+}
+
+ssize_t Connection::recv(bool peek) {
   if (peek) {
-    flags |= MSG_PEEK;
+    size_t bufferSizeAvailable = 0;
+    char* writePtr = prepareRecv(bufferSizeAvailable);
+    return ::recv(m_socketFd, writePtr, bufferSizeAvailable, MSG_PEEK);
   }
-  ssize_t bufferSizeActual = ::recv(m_socketFd, writePtr, bufferSizeAvailable, flags);
-  // log_info("%p recv(%lu) %.*s", this, bufferSizeActual, (int)bufferSizeActual, writePtr);
-  if (!peek && bufferSizeActual > 0) {
-    m_buffer_reader->commitWrite(bufferSizeActual);
+
+  // the rest of the write block plus a fresh one, so that a full recv
+  // size is read in one syscall even if the write block is almost full
+  struct iovec iov[2];
+  size_t iovcnt = 2;
+  size_t bufferSize = m_buffer_reader->getNextPreferedDataBlockSize();
+  m_buffer_reader->prepareWriteBlocks(bufferSize, iov, iovcnt);
+  ssize_t bufferSizeActual = ::readv(m_socketFd, iov, static_cast<int>(iovcnt));
+  // log_info("%p recv(%lu)", this, bufferSizeActual);
+  if (bufferSizeActual > 0) {
+    m_buffer_reader->commitWriteBlocks(bufferSizeActual);
   }
   return bufferSizeActual;
 }
@@ -324,6 +529,31 @@ void Connection::process(err_code_t& err) {
   return m_parser.process_packets(err);
 }
 
+void Connection::setRequestArena(RequestArena* arena) {
+  m_parser.setRequestArena(arena);
+}
+
+void Connection::setChunkCallback(retrieval_chunk_cb_t cb, void* ctx) {
+  m_parser.setChunkCallback(cb, ctx);
+}
+
+size_t Connection::resultBytes() const {
+  return m_parser.resultBytes();
+}
+
+size_t Connection::bufferBytes() const {
+  return m_buffer_reader->retainedCapacity() + m_buffer_writer->retainedBytes();
+}
+
+void Connection::shrinkResults() {
+  m_parser.shrink();
+}
+
+void Connection::shrinkBuffers() {
+  m_buffer_reader->shrink();
+  m_buffer_writer->shrink();
+}
+
 types::RetrievalResultList* Connection::getRetrievalResults() {
   return m_parser.getRetrievalResults();
 }
@@ -340,12 +570,18 @@ types::UnsignedResultList* Connection::getUnsignedResults() {
   return m_parser.getUnsignedResults();
 }
 
+const server_stats_t& Connection::getServerStats() {
+  return m_parser.getServerStats();
+}
+
 std::vector<struct iovec>* Connection::getRequestKeys() {
   return m_parser.getRequestKeys();
 }
 
 void Connection::reset() {
   m_counter = 0;
+  m_keyPositions.clear();
+  m_pollEvents = 0;
   m_retires = 0;
   m_parser.reset();
   m_buffer_reader->reset();
@@ -370,5 +606,15 @@ void Connection::setMaxRetries(int max_retries) {
   m_maxRetries = max_retries;
 }
 
+void Connection::setZerocopyThreshold(size_t threshold) {
+  m_zerocopyThreshold = threshold;
+  if (threshold == 0) {
+    // notifications of sends already made are still reaped
+    m_zerocopy = false;
+    return;
+  }
+  enableZerocopy();
+}
+
 } // namespace mc
 } // namespace douban
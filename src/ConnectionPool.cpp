@@ -1,11 +1,13 @@
 #include <sys/socket.h>
 #include <poll.h>
 #include <errno.h>
+#include <unistd.h>
 #include <stdlib.h>
 #include <list>
 #include <vector>
 #include <algorithm>
 
+#include "BinaryProtocol.h"
 #include "ConnectionPool.h"
 #include "Utility.h"
 #include "Keywords.h"
@@ -26,12 +28,25 @@ namespace mc {
 
 ConnectionPool::ConnectionPool()
   : m_nActiveConn(0), m_nInvalidKey(0), m_conns(NULL), m_nConns(0),
-    m_pollTimeout(MC_DEFAULT_POLL_TIMEOUT) {
+    m_pollTimeout(MC_DEFAULT_POLL_TIMEOUT), m_useMeta(false), m_useBinary(false) {
+#ifdef MC_USE_EPOLL
+  m_epollFd = -1;
+  m_epollPid = 0;
+#endif
+#ifdef MC_USE_IO_URING
+  m_useUring = false;
+  m_uringInflight = 0;
+#endif
 }
 
 
 ConnectionPool::~ConnectionPool() {
   delete[] m_conns;
+#ifdef MC_USE_EPOLL
+  if (m_epollFd != -1) {
+    ::close(m_epollFd);
+  }
+#endif
 }
 
 
@@ -65,8 +80,16 @@ int ConnectionPool::init(const char* const * hosts, const uint32_t* ports, const
   m_conns = new Connection[m_nConns];
   for (size_t i = 0; i < m_nConns; i++) {
     rv += m_conns[i].init(hosts[i], ports[i], aliases == NULL ? NULL : aliases[i]);
+    m_conns[i].setRequestArena(&m_requestArena);
   }
   m_connSelector.addServers(m_conns, m_nConns);
+  m_batchProgress.resize(m_nConns);
+#ifdef MC_USE_EPOLL
+  m_epollEvents.resize(m_nConns);
+#endif
+#ifdef MC_USE_IO_URING
+  m_uringStates.resize(m_nConns);
+#endif
   return rv;
 }
 
@@ -127,6 +150,23 @@ void ConnectionPool::disableConsistentFailover() {
 }
 
 
+// Header, extras and key of a binary request, copied into the iovec the
+// previous request ends in. The opaque is the index of its request key.
+static void copyBinaryRequest(Connection* conn, uint8_t opcode, const char* key, size_t keyLen,
+                              bool noreply, const char* extras = NULL, uint8_t extrasLen = 0,
+                              size_t valueLen = 0, uint64_t cas = 0) {
+  char header[sizeof(binary::header_t) + binary::kMaxRequestExtras];
+  uint32_t opaque = noreply ? binary::kNoreplyOpaque :
+    static_cast<uint32_t>(conn->requestKeyCount());
+  size_t n = binary::encodeRequest(header, opcode, keyLen, extras, extrasLen, valueLen,
+                                   opaque, cas);
+  conn->copyBuffer(header, n);
+  if (keyLen > 0) {
+    conn->copyBuffer(key, keyLen);
+  }
+}
+
+
 void ConnectionPool::dispatchStorage(op_code_t op,
                                       const char* const* keys, const size_t* keyLens,
                                       const flags_t* flags, const exptime_t exptime,
@@ -145,56 +185,150 @@ void ConnectionPool::dispatchStorage(op_code_t op,
     if (conn == NULL) {
       continue;
     }
+    // the header goes to the writer's arena, into one iovec with the
+    // CRLF ending the previous item; only the value is referenced
+    if (m_useBinary) {
+      // SETQ and the like, answered on failure only. A cas is a SETQ with
+      // the cas in its header.
+      char extras[8];
+      uint8_t extrasLen = 8;
+      uint8_t opcode = binary::OP_SETQ;
+      uint64_t cas = 0;
+      switch (op) {
+        case SET_OP:
+          break;
+        case ADD_OP:
+          opcode = binary::OP_ADDQ;
+          break;
+        case REPLACE_OP:
+          opcode = binary::OP_REPLACEQ;
+          break;
+        case APPEND_OP:
+          opcode = binary::OP_APPENDQ;
+          extrasLen = 0;
+          break;
+        case PREPEND_OP:
+          opcode = binary::OP_PREPENDQ;
+          extrasLen = 0;
+          break;
+        case CAS_OP:
+          cas = cas_uniques[i];
+          break;
+        default:
+          NOT_REACHED();
+          break;
+      }
+      binary::put32(extras, flags[i]);
+      binary::put32(extras + 4, static_cast<uint32_t>(exptime));
+      copyBinaryRequest(conn, opcode, keys[i], keyLens[i], noreply, extras, extrasLen,
+                        valLens[i], cas);
+      if (!noreply) {
+        conn->addRequestKey(keys[i], keyLens[i]);
+      }
+      ++conn->m_counter;
+      conn->takeBuffer(vals[i], valLens[i]);
+      continue;
+    }
+    if (m_useMeta && !noreply) {
+      // ms <key> <bytes> F<flags> T<exptime> [C<cas>] [M<mode>] O<opaque> q
+      conn->copyBuffer(keywords::kMS_, 3);
+      conn->copyBuffer(keys[i], keyLens[i]);
+      conn->copyBuffer(kSPACE, 1);
+      conn->copyNumber(valLens[i]);
+      conn->copyBuffer(keywords::k_META_FLAGS, 2);
+      conn->copyNumber(flags[i]);
+      conn->copyBuffer(keywords::k_META_EXPTIME, 2);
+      conn->copyNumber(exptime);
+      switch (op) {
+        case SET_OP:
+          break;
+        case ADD_OP:
+          conn->copyBuffer(keywords::k_META_ADD, 3);
+          break;
+        case REPLACE_OP:
+          conn->copyBuffer(keywords::k_META_REPLACE, 3);
+          break;
+        case APPEND_OP:
+          conn->copyBuffer(keywords::k_META_APPEND, 3);
+          break;
+        case PREPEND_OP:
+          conn->copyBuffer(keywords::k_META_PREPEND, 3);
+          break;
+        case CAS_OP:
+          conn->copyBuffer(keywords::k_META_CAS, 2);
+          conn->copyNumber(cas_uniques[i]);
+          break;
+        default:
+          NOT_REACHED();
+          break;
+      }
+      conn->copyBuffer(keywords::k_META_OPAQUE, 2);
+      conn->copyNumber(conn->requestKeyCount());
+      conn->copyBuffer(keywords::k_META_QUIET_CRLF, 4);
+      conn->addRequestKey(keys[i], keyLens[i]);
+      ++conn->m_counter;
+      conn->takeBuffer(vals[i], valLens[i]);
+      conn->copyBuffer(kCRLF, 2);
+      continue;
+    }
     switch (op) {
       case SET_OP:
-        conn->takeBuffer(keywords::kSET_, 4);
+        conn->copyBuffer(keywords::kSET_, 4);
         break;
       case ADD_OP:
-        conn->takeBuffer(keywords::kADD_, 4);
+        conn->copyBuffer(keywords::kADD_, 4);
         break;
       case REPLACE_OP:
-        conn->takeBuffer(keywords::kREPLACE_, 8);
+        conn->copyBuffer(keywords::kREPLACE_, 8);
         break;
       case APPEND_OP:
-        conn->takeBuffer(keywords::kAPPEND_, 7);
+        conn->copyBuffer(keywords::kAPPEND_, 7);
         break;
       case PREPEND_OP:
-        conn->takeBuffer(keywords::kPREPEND_, 8);
+        conn->copyBuffer(keywords::kPREPEND_, 8);
         break;
       case CAS_OP:
-        conn->takeBuffer(keywords::kCAS_, 4);
+        conn->copyBuffer(keywords::kCAS_, 4);
         break;
       default:
         NOT_REACHED();
         break;
     }
 
-    conn->takeBuffer(keys[i], keyLens[i]);
-    conn->takeBuffer(kSPACE, 1);
-    conn->takeNumber(flags[i]);
-    conn->takeBuffer(kSPACE, 1);
-    conn->takeNumber(exptime);
-    conn->takeBuffer(kSPACE, 1);
-    conn->takeNumber(valLens[i]);
+    conn->copyBuffer(keys[i], keyLens[i]);
+    conn->copyBuffer(kSPACE, 1);
+    conn->copyNumber(flags[i]);
+    conn->copyBuffer(kSPACE, 1);
+    conn->copyNumber(exptime);
+    conn->copyBuffer(kSPACE, 1);
+    conn->copyNumber(valLens[i]);
     if (op == CAS_OP) {
-      conn->takeBuffer(kSPACE, 1);
-      conn->takeNumber(cas_uniques[i]);
+      conn->copyBuffer(kSPACE, 1);
+      conn->copyNumber(cas_uniques[i]);
     }
     if (noreply) {
-      conn->takeBuffer(k_NOREPLY, 8);
+      conn->copyBuffer(k_NOREPLY, 8);
     } else {
       conn->addRequestKey(keys[i], keyLens[i]);
     }
     ++conn->m_counter;
-    conn->takeBuffer(kCRLF, 2);
+    conn->copyBuffer(kCRLF, 2);
     conn->takeBuffer(vals[i], valLens[i]);
-    conn->takeBuffer(kCRLF, 2);
+    conn->copyBuffer(kCRLF, 2);
   }
 
   for (idx = 0; idx < m_nConns; idx++) {
     Connection* conn = m_conns + idx;
     if (conn->m_counter > 0) {
-      conn->setParserMode(MODE_COUNTING);
+      if (m_useBinary && !noreply) {
+        copyBinaryRequest(conn, binary::OP_NOOP, NULL, 0, false);
+        conn->setParserMode(MODE_BINARY, MSG_STORED);
+      } else if (m_useMeta && !noreply) {
+        conn->copyBuffer(keywords::kMN_CRLF, 4);
+        conn->setParserMode(MODE_END_STATE, MSG_STORED);
+      } else {
+        conn->setParserMode(MODE_COUNTING);
+      }
       ++m_nActiveConn;
       m_activeConns.push_back(conn);
     }
@@ -208,7 +342,7 @@ void ConnectionPool::dispatchStorage(op_code_t op,
 
 
 void ConnectionPool::dispatchRetrieval(op_code_t op, const char* const* keys,
-                                  const size_t* keyLens, size_t nKeys) {
+                                  const size_t* keyLens, size_t nKeys, bool indexed) {
   size_t i = 0, idx = 0;
   for (; i < nKeys; ++i) {
     const char* key = keys[i];
@@ -221,7 +355,33 @@ void ConnectionPool::dispatchRetrieval(op_code_t op, const char* const* keys,
     if (conn == NULL) {
       continue;
     }
+    if (indexed) {
+      conn->m_keyPositions.push_back(static_cast<uint32_t>(i));
+    }
 
+    if (m_useBinary) {
+      // GETQ, misses are not answered. Hits are told by their opaque, so
+      // the key GETKQ would echo is not needed, and the cas comes anyway.
+      copyBinaryRequest(conn, binary::OP_GETQ, key, len, false);
+      conn->addRequestKey(key, len);
+      ++conn->m_counter;
+      continue;
+    }
+    if (m_useMeta) {
+      // mg <key> v f [c] O<opaque> q, misses are not answered
+      conn->takeBuffer(keywords::kMG_, 3);
+      conn->takeBuffer(key, len);
+      if (op == GETS_OP) {
+        conn->takeBuffer(keywords::k_META_GETS, 8);
+      } else {
+        conn->takeBuffer(keywords::k_META_GET, 6);
+      }
+      conn->takeNumber(conn->requestKeyCount());
+      conn->takeBuffer(keywords::k_META_QUIET_CRLF, 4);
+      conn->addRequestKey(key, len);
+      ++conn->m_counter;
+      continue;
+    }
     if (++conn->m_counter == 1) {
       switch (op) {
         case GET_OP:
@@ -237,12 +397,22 @@ void ConnectionPool::dispatchRetrieval(op_code_t op, const char* const* keys,
     }
     conn->takeBuffer(kSPACE, 1);
     conn->takeBuffer(key, len);
+    // for the VALUE lines to point at, see PacketParser::matchRequestKey
+    conn->addRequestKey(key, len);
   }
   for (idx = 0; idx < m_nConns; idx++) {
     Connection* conn = m_conns + idx;
     if (conn->m_counter > 0) {
-      conn->takeBuffer(kCRLF, 2);
-      conn->setParserMode(MODE_END_STATE);
+      if (m_useBinary) {
+        copyBinaryRequest(conn, binary::OP_NOOP, NULL, 0, false);
+        conn->setParserMode(MODE_BINARY);
+      } else if (m_useMeta) {
+        conn->takeBuffer(keywords::kMN_CRLF, 4);
+        conn->setParserMode(MODE_END_STATE);
+      } else {
+        conn->takeBuffer(kCRLF, 2);
+        conn->setParserMode(MODE_END_STATE);
+      }
       ++m_nActiveConn;
       m_activeConns.push_back(conn);
       conn->getRetrievalResults()->reserve(conn->m_counter);
@@ -266,6 +436,25 @@ void ConnectionPool::dispatchDeletion(const char* const* keys, const size_t* key
       continue;
     }
 
+    if (m_useBinary) {
+      copyBinaryRequest(conn, binary::OP_DELETEQ, keys[i], keyLens[i], noreply);
+      if (!noreply) {
+        conn->addRequestKey(keys[i], keyLens[i]);
+      }
+      ++conn->m_counter;
+      continue;
+    }
+    if (m_useMeta && !noreply) {
+      // md <key> O<opaque> q
+      conn->takeBuffer(keywords::kMD_, 3);
+      conn->takeBuffer(keys[i], keyLens[i]);
+      conn->takeBuffer(keywords::k_META_OPAQUE, 2);
+      conn->takeNumber(conn->requestKeyCount());
+      conn->takeBuffer(keywords::k_META_QUIET_CRLF, 4);
+      conn->addRequestKey(keys[i], keyLens[i]);
+      ++conn->m_counter;
+      continue;
+    }
     conn->takeBuffer(keywords::kDELETE_, 7);
     conn->takeBuffer(keys[i], keyLens[i]);
     if (noreply) {
@@ -280,7 +469,15 @@ void ConnectionPool::dispatchDeletion(const char* const* keys, const size_t* key
   for (idx = 0; idx < m_nConns; idx++) {
     Connection* conn = m_conns + idx;
     if (conn->m_counter > 0) {
-      conn->setParserMode(MODE_COUNTING);
+      if (m_useBinary && !noreply) {
+        copyBinaryRequest(conn, binary::OP_NOOP, NULL, 0, false);
+        conn->setParserMode(MODE_BINARY, MSG_DELETED);
+      } else if (m_useMeta && !noreply) {
+        conn->takeBuffer(keywords::kMN_CRLF, 4);
+        conn->setParserMode(MODE_END_STATE, MSG_DELETED);
+      } else {
+        conn->setParserMode(MODE_COUNTING);
+      }
       ++m_nActiveConn;
       m_activeConns.push_back(conn);
     }
@@ -308,6 +505,30 @@ void ConnectionPool::dispatchTouch(
       continue;
     }
 
+    if (m_useBinary) {
+      // TOUCH has no quiet version, every key is answered
+      char extras[4];
+      binary::put32(extras, static_cast<uint32_t>(exptime));
+      copyBinaryRequest(conn, binary::OP_TOUCH, keys[i], keyLens[i], noreply, extras, 4);
+      if (!noreply) {
+        conn->addRequestKey(keys[i], keyLens[i]);
+      }
+      ++conn->m_counter;
+      continue;
+    }
+    if (m_useMeta && !noreply) {
+      // mg <key> T<exptime> O<opaque> q, misses are not answered
+      conn->takeBuffer(keywords::kMG_, 3);
+      conn->takeBuffer(keys[i], keyLens[i]);
+      conn->takeBuffer(keywords::k_META_EXPTIME, 2);
+      conn->takeNumber(exptime);
+      conn->takeBuffer(keywords::k_META_OPAQUE, 2);
+      conn->takeNumber(conn->requestKeyCount());
+      conn->takeBuffer(keywords::k_META_QUIET_CRLF, 4);
+      conn->addRequestKey(keys[i], keyLens[i]);
+      ++conn->m_counter;
+      continue;
+    }
     conn->takeBuffer(keywords::kTOUCH_, 6);
     conn->takeBuffer(keys[i], keyLens[i]);
     conn->takeBuffer(kSPACE, 1);
@@ -324,7 +545,15 @@ void ConnectionPool::dispatchTouch(
   for (idx = 0; idx < m_nConns; idx++) {
     Connection* conn = m_conns + idx;
     if (conn->m_counter > 0) {
-      conn->setParserMode(MODE_COUNTING);
+      if (m_useBinary && !noreply) {
+        copyBinaryRequest(conn, binary::OP_NOOP, NULL, 0, false);
+        conn->setParserMode(MODE_BINARY);
+      } else if (m_useMeta && !noreply) {
+        conn->takeBuffer(keywords::kMN_CRLF, 4);
+        conn->setParserMode(MODE_END_STATE, MSG_NOT_FOUND);
+      } else {
+        conn->setParserMode(MODE_COUNTING);
+      }
       ++m_nActiveConn;
       m_activeConns.push_back(conn);
     }
@@ -347,19 +576,54 @@ void ConnectionPool::dispatchIncrDecr(op_code_t op, const char* key, const size_
   if (conn == NULL) {
     return;
   }
-  switch (op) {
-    case INCR_OP:
-      conn->takeBuffer(keywords::kINCR_, 5);
-      break;
-    case DECR_OP:
-      conn->takeBuffer(keywords::kDECR_, 5);
-      break;
-    default:
-      NOT_REACHED();
-      break;
+  if (m_useBinary) {
+    // fails on a miss, with an exptime of all ones
+    char extras[20];
+    binary::put64(extras, delta);
+    binary::put64(extras + 8, 0);
+    binary::put32(extras + 16, 0xffffffff);
+    uint8_t opcode = op == DECR_OP ? binary::OP_DECREMENT : binary::OP_INCREMENT;
+    if (noreply) {
+      opcode = op == DECR_OP ? binary::OP_DECREMENTQ : binary::OP_INCREMENTQ;
+    }
+    copyBinaryRequest(conn, opcode, key, keyLen, noreply, extras, 20);
+    ++conn->m_counter;
+    if (noreply) {
+      conn->setParserMode(MODE_COUNTING);
+    } else {
+      conn->addRequestKey(key, keyLen);
+      copyBinaryRequest(conn, binary::OP_NOOP, NULL, 0, false);
+      conn->setParserMode(MODE_BINARY);
+    }
+    ++m_nActiveConn;
+    m_activeConns.push_back(conn);
+    conn->m_counter = conn->requestKeyCount();
+    return;
+  }
+  if (m_useMeta && !noreply) {
+    // ma <key> v [MD] D<delta>, answered with "VA" and the value, or "NF"
+    conn->takeBuffer(keywords::kMA_, 3);
+    conn->takeBuffer(key, keyLen);
+    if (op == DECR_OP) {
+      conn->takeBuffer(keywords::k_META_DECR, 7);
+    } else {
+      conn->takeBuffer(keywords::k_META_INCR, 4);
+    }
+  } else {
+    switch (op) {
+      case INCR_OP:
+        conn->takeBuffer(keywords::kINCR_, 5);
+        break;
+      case DECR_OP:
+        conn->takeBuffer(keywords::kDECR_, 5);
+        break;
+      default:
+        NOT_REACHED();
+        break;
+    }
+    conn->takeBuffer(key, keyLen);
+    conn->takeBuffer(kSPACE, 1);
   }
-  conn->takeBuffer(key, keyLen);
-  conn->takeBuffer(kSPACE, 1);
   conn->takeNumber(delta);
   if (noreply) {
     conn->takeBuffer(k_NOREPLY, 8);
@@ -380,7 +644,36 @@ void ConnectionPool::dispatchIncrDecr(op_code_t op, const char* key, const size_
 }
 
 
-void ConnectionPool::broadcastCommand(const char * const cmd, const size_t cmdLen, const bool noreply) {
+void ConnectionPool::broadcastCommand(op_code_t op, const bool noreply) {
+  const char* cmd = NULL;
+  size_t cmdLen = 0;
+  uint8_t opcode = binary::OP_NOOP;
+  switch (op) {
+    case VERSION_OP:
+      cmd = keywords::kVERSION;
+      cmdLen = 7;
+      opcode = binary::OP_VERSION;
+      break;
+    case STATS_OP:
+    case TYPED_STATS_OP:
+      cmd = keywords::kSTATS;
+      cmdLen = 5;
+      opcode = binary::OP_STAT;
+      break;
+    case FLUSHALL_OP:
+      cmd = keywords::kFLUSHALL;
+      cmdLen = 9;
+      opcode = binary::OP_FLUSH;
+      break;
+    case QUIT_OP:
+      cmd = keywords::kQUIT;
+      cmdLen = 4;
+      opcode = binary::OP_QUITQ;
+      break;
+    default:
+      NOT_REACHED();
+      break;
+  }
   for (size_t idx = 0; idx < m_nConns; ++idx) {
     Connection* conn = m_conns + idx;
     if (!conn->alive()) {
@@ -388,18 +681,35 @@ void ConnectionPool::broadcastCommand(const char * const cmd, const size_t cmdLe
         continue;
       }
     }
-    conn->takeBuffer(cmd, cmdLen);
     if (!noreply) {
       ++conn->m_counter;
     }
-    conn->takeBuffer(kCRLF, 2);
-    conn->setParserMode(MODE_END_STATE);
+    if (m_useBinary) {
+      copyBinaryRequest(conn, opcode, NULL, 0, false);
+      conn->setParserMode(MODE_BINARY);
+    } else {
+      conn->takeBuffer(cmd, cmdLen);
+      conn->takeBuffer(kCRLF, 2);
+      conn->setParserMode(MODE_END_STATE);
+    }
+    if (op == TYPED_STATS_OP) {
+      conn->setTypedStats();
+    }
     ++m_nActiveConn;
     m_activeConns.push_back(conn);
   }
 }
 
 err_code_t ConnectionPool::waitPoll() {
+  err_code_t ret_code = waitResponses();
+#ifdef MC_USE_ZEROCOPY
+  waitZerocopy();
+#endif
+  return ret_code;
+}
+
+
+err_code_t ConnectionPool::waitResponses() {
   if (m_nActiveConn == 0) {
     if (m_nInvalidKey > 0) {
       return RET_INVALID_KEY_ERR;
@@ -408,6 +718,16 @@ err_code_t ConnectionPool::waitPoll() {
       return RET_MC_SERVER_ERR;
     }
   }
+#ifdef MC_USE_IO_URING
+  if (m_useUring && (m_uring.ready() || initUring())) {
+    return waitUring();
+  }
+#endif
+#ifdef MC_USE_EPOLL
+  if (initEpoll()) {
+    return waitEpoll();
+  }
+#endif
   nfds_t n_fds = m_nActiveConn;
   pollfd_t pollfds[n_fds];
 
@@ -444,6 +764,13 @@ err_code_t ConnectionPool::waitPoll() {
         pollfd_ptr = &pollfds[fd_idx];
         Connection* conn = fd2conn[fd_idx];
 
+#ifdef MC_USE_ZEROCOPY
+        if ((pollfd_ptr->revents & (POLLERR | POLLHUP | POLLNVAL)) == POLLERR &&
+            conn->zerocopyPending() && conn->reapZerocopy()) {
+          // only zerocopy notifications in the error queue
+          pollfd_ptr->revents &= ~POLLERR;
+        }
+#endif
         if (pollfd_ptr->revents & (POLLERR | POLLHUP | POLLNVAL)) {
           markDeadConn(conn, keywords::kCONN_POLL_ERROR, pollfd_ptr);
           if (conn->tryReconnect()) {
@@ -564,7 +891,59 @@ void ConnectionPool::collectRetrievalResult(std::vector<retrieval_result_t*>& re
         // of one retrieval result is not complete yet.
         continue;
       }
-      results.push_back(r1.inner());
+      results.push_back(r1.inner(m_requestArena));
+    }
+  }
+}
+
+
+void ConnectionPool::collectRetrievalResult(
+    std::vector<fragmented_retrieval_result_t*>& results) {
+  for (std::vector<Connection*>::iterator it = m_activeConns.begin();
+       it != m_activeConns.end(); ++it) {
+    types::RetrievalResultList* rst = (*it)->getRetrievalResults();
+
+    for (types::RetrievalResultList::iterator it2 = rst->begin(); it2 != rst->end(); ++it2) {
+      RetrievalResult& r1 = *it2;
+      if (r1.bytesRemain > 0) {
+        continue;
+      }
+      results.push_back(r1.fragmented(m_requestArena));
+    }
+  }
+}
+
+
+// The results of a connection are in the order of its request keys, so
+// the key of each is looked for from where the last one was. A key that
+// was answered out of order is looked for from the first.
+void ConnectionPool::collectRetrievalResult(size_t nKeys,
+                                            std::vector<retrieval_result_t*>& results) {
+  results.assign(nKeys, NULL);
+  for (std::vector<Connection*>::iterator it = m_activeConns.begin();
+       it != m_activeConns.end(); ++it) {
+    types::RetrievalResultList* rst = (*it)->getRetrievalResults();
+    std::vector<struct iovec>* requestKeys = (*it)->getRequestKeys();
+    const std::vector<uint32_t>& positions = (*it)->m_keyPositions;
+    assert(positions.size() == requestKeys->size());
+    size_t nRequestKeys = requestKeys->size(), next = 0;
+
+    for (types::RetrievalResultList::iterator it2 = rst->begin(); it2 != rst->end(); ++it2) {
+      RetrievalResult& r1 = *it2;
+      if (r1.bytesRemain > 0) {
+        continue;
+      }
+      retrieval_result_t* r = r1.inner(m_requestArena);
+      for (size_t n = 0; n < nRequestKeys; ++n) {
+        size_t j = (next + n) % nRequestKeys;
+        const struct iovec& iov = (*requestKeys)[j];
+        if (iov.iov_base == r->key ||
+            (iov.iov_len == r->key_len && memcmp(iov.iov_base, r->key, r->key_len) == 0)) {
+          results[positions[j]] = r;
+          next = j + 1;
+          break;
+        }
+      }
     }
   }
 }
@@ -613,8 +992,45 @@ void ConnectionPool::collectBroadcastResult(std::vector<broadcast_result_t>& res
       int j = 0;
       for (types::LineResultList::iterator it2 = rst->begin(); it2 != rst->end(); ++it2, ++j) {
         types::LineResult* r1 = &(*it2);
-        conn_result->lines[j] = r1->inner(conn_result->line_lens[j]);
+        conn_result->lines[j] = r1->inner(conn_result->line_lens[j], m_requestArena);
+      }
+    }
+  }
+}
+
+
+// A counter no server sent is 0 in all of cluster. A connection that died,
+// before or during the response, sent nothing.
+void ConnectionPool::collectServerStats(std::vector<server_stats_t>& results,
+                                        cluster_stats_t* cluster) {
+  memset(cluster, 0, sizeof *cluster);
+  results.resize(m_nConns);
+  for (size_t i = 0; i < m_nConns; ++i) {
+    Connection* conn = m_conns + i;
+    server_stats_t* s = &results[i];
+    if (conn->alive()) {
+      *s = conn->getServerStats();
+    } else {
+      memset(s, 0, sizeof *s);
+    }
+    s->host = const_cast<char*>(conn->name());
+    if (s->present == 0) {
+      continue;
+    }
+    ++cluster->n_servers;
+    for (size_t f = 0; f < STAT_FIELD_COUNT; ++f) {
+      if ((s->present & (1ULL << f)) == 0) {
+        continue;
+      }
+      uint64_t v = s->values[f];
+      if (cluster->n_present[f] == 0 || v < cluster->min[f]) {
+        cluster->min[f] = v;
       }
+      if (v > cluster->max[f]) {
+        cluster->max[f] = v;
+      }
+      cluster->sum[f] += v;
+      ++cluster->n_present[f];
     }
   }
 }
@@ -635,47 +1051,398 @@ void ConnectionPool::collectUnsignedResult(std::vector<unsigned_result_t*>& resu
 }
 
 
-void ConnectionPool::reset() {
+void ConnectionPool::beginBatch() {
+  uint64_t now = utility::monotonicMs();
+  for (size_t idx = 0; idx < m_nConns; idx++) {
+    Connection* conn = m_conns + idx;
+    // dispatch* counts from 0 the requests of the batch on each connection
+    conn->m_counter = 0;
+    if (!conn->batchesPending()) {
+      // the poll timeout runs from now on for an idle connection
+      m_batchProgress[idx] = now;
+    }
+  }
+}
+
+
+void ConnectionPool::endBatch(ticket_t ticket) {
   for (std::vector<Connection*>::iterator it = m_activeConns.begin();
        it != m_activeConns.end(); ++it) {
-    (*it)->reset();
+    (*it)->pushBatch(ticket);
+  }
+  for (size_t idx = 0; idx < m_nConns; idx++) {
+    m_conns[idx].m_counter = 0;
   }
+  // pollBatches() finds them by their batches
   m_nActiveConn = 0;
-  m_nInvalidKey = 0;
   m_activeConns.clear();
 }
 
 
-void ConnectionPool::setPollTimeout(int timeout) {
-  m_pollTimeout = timeout;
+void ConnectionPool::activateBatches() {
+  m_nActiveConn = 0;
+  m_activeConns.clear();
+  for (size_t idx = 0; idx < m_nConns; idx++) {
+    Connection* conn = m_conns + idx;
+    if (conn->hasBatch()) {
+      ++m_nActiveConn;
+      m_activeConns.push_back(conn);
+    }
+  }
 }
 
 
-void ConnectionPool::setConnectTimeout(int timeout) {
-  for (size_t idx = 0; idx < m_nConns; ++idx) {
-    Connection* conn = m_conns + idx;
-    conn->setConnectTimeout(timeout);
+// Batches are driven with poll(2), whatever the transport of synchronous
+// commands: the sockets are left alone between two calls, which neither a
+// ring with ops in flight nor an edge-triggered epoll set would allow. A
+// connection times out once its batches haven't moved for m_pollTimeout.
+err_code_t ConnectionPool::pollBatches(int timeout) {
+  err_code_t ret_code = RET_OK;
+  pollfd_t pollfds[m_nConns];
+  Connection* fd2conn[m_nConns];
+  uint64_t start = utility::monotonicMs();
+  bool done = false;
+  bool ready = true;
+
+  while (!done) {
+    uint64_t now = utility::monotonicMs();
+    int wait = timeout;
+    if (timeout >= 0) {
+      if (now - start >= static_cast<uint64_t>(timeout)) {
+        // past the timeout, only while the sockets have more ready
+        if (!ready) {
+          break;
+        }
+        wait = 0;
+      } else {
+        wait = timeout - static_cast<int>(now - start);
+      }
+    }
+    nfds_t n_fds = 0;
+    for (size_t idx = 0; idx < m_nConns; idx++) {
+      Connection* conn = m_conns + idx;
+      if (!conn->batchesPending()) {
+        continue;
+      }
+      uint64_t idle = now - m_batchProgress[idx];
+      if (idle >= static_cast<uint64_t>(m_pollTimeout)) {
+        log_warn("poll timeout on %s", conn->name());
+        // NOTE: MUST reset the TCP connection after timeout.
+        failBatches(conn, keywords::kPOLL_TIMEOUT_ERROR, RET_POLL_TIMEOUT_ERR, false, ret_code);
+        done = true;
+        continue;
+      }
+      if (wait < 0 || m_pollTimeout - static_cast<int>(idle) < wait) {
+        wait = m_pollTimeout - static_cast<int>(idle);
+      }
+      // POLLERR brings zerocopy notifications, and needs no events
+      pollfds[n_fds].fd = conn->socketFd();
+      pollfds[n_fds].events = POLLIN;
+      if (conn->sendPending()) {
+        pollfds[n_fds].events |= POLLOUT;
+      }
+      pollfds[n_fds].revents = 0;
+      fd2conn[n_fds++] = conn;
+    }
+    if (n_fds == 0 || done) {
+      break;
+    }
+
+    int rv = poll(pollfds, n_fds, wait);
+    ready = rv > 0;
+    if (rv == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      for (nfds_t i = 0; i < n_fds; i++) {
+        failBatches(fd2conn[i], keywords::kPOLL_ERROR, RET_POLL_ERR, false, ret_code);
+      }
+      break;
+    }
+    for (nfds_t i = 0; i < n_fds && rv > 0; i++) {
+      if (pollfds[i].revents == 0) {
+        continue;
+      }
+      Connection* conn = fd2conn[i];
+      size_t nDone = conn->batchesDone();
+      serveBatches(conn, pollfds[i].revents, ret_code);
+      if (conn->batchesDone() != nDone || !conn->batchesPending()) {
+        done = true;
+      }
+    }
   }
+  return ret_code;
 }
 
 
-void ConnectionPool::setRetryTimeout(int timeout) {
-  for (size_t idx = 0; idx < m_nConns; ++idx) {
-    Connection* conn = m_conns + idx;
-    conn->setRetryTimeout(timeout);
+// Like a round of waitResponses() for one connection, the responses come
+// in while more is sent.
+void ConnectionPool::serveBatches(Connection* conn, short revents, err_code_t& ret_code) {
+  size_t idx = conn - m_conns;
+  err_code_t err;
+
+#ifdef MC_USE_ZEROCOPY
+  if ((revents & (POLLERR | POLLHUP | POLLNVAL)) == POLLERR &&
+      conn->zerocopyPending() && conn->reapZerocopy()) {
+    // only zerocopy notifications in the error queue
+    revents &= ~POLLERR;
+  }
+#endif
+  // a hang up with responses left to read ends on recv() == 0
+  if (revents & (POLLERR | POLLNVAL) || (revents & (POLLHUP | POLLIN)) == POLLHUP) {
+    failBatches(conn, keywords::kCONN_POLL_ERROR, RET_CONN_POLL_ERR, true, ret_code);
+    return;
+  }
+
+  if (revents & POLLIN) {
+    ssize_t nRecv = conn->recv();
+    if (nRecv == 0 || (nRecv == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+      failBatches(conn, keywords::kRECV_ERROR, RET_RECV_ERR, true, ret_code);
+      return;
+    }
+    if (nRecv > 0) {
+      m_batchProgress[idx] = utility::monotonicMs();
+      conn->process(err);
+      switch (err) {
+        case RET_OK:
+        case RET_INCOMPLETE_BUFFER_ERR:
+          break;
+        case RET_PROGRAMMING_ERR:
+          failBatches(conn, keywords::kPROGRAMMING_ERROR, RET_PROGRAMMING_ERR, false, ret_code);
+          return;
+        case RET_MC_SERVER_ERR:
+          // soft server error
+          failBatches(conn, keywords::kSERVER_ERROR, RET_MC_SERVER_ERR, false, ret_code);
+          return;
+        default:
+          NOT_REACHED();
+          break;
+      }
+    }
+  }
+
+  if (revents & POLLOUT && conn->sendPending()) {
+    ssize_t nToSend = conn->send();
+    if (nToSend == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      failBatches(conn, keywords::kSEND_ERROR, RET_SEND_ERR, true, ret_code);
+      return;
+    }
+    if (nToSend != -1) {
+      m_batchProgress[idx] = utility::monotonicMs();
+    }
   }
 }
 
 
-void ConnectionPool::setMaxRetries(int max_retries) {
-  for (size_t idx = 0; idx < m_nConns; ++idx) {
-    Connection* conn = m_conns + idx;
-    conn->setMaxRetries(max_retries);
+// The batches of a failed connection are sent again on a new one, unless
+// some of their responses came in already. Then they end with those.
+void ConnectionPool::failBatches(Connection* conn, const char* reason, err_code_t code,
+                                 bool retry, err_code_t& ret_code) {
+  conn->markDead(reason);
+  if (retry && conn->rewindBatches() && conn->tryReconnect()) {
+    m_batchProgress[conn - m_conns] = utility::monotonicMs();
+    return;
   }
+  conn->dropBatches();
+  ret_code = code;
 }
 
 
-void ConnectionPool::markDeadAll(pollfd_t* pollfds, const char* reason) {
+bool ConnectionPool::batchDone(ticket_t ticket) {
+  for (size_t idx = 0; idx < m_nConns; idx++) {
+    if (!m_conns[idx].batchDone(ticket)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+void ConnectionPool::collectRetrievalResult(ticket_t ticket,
+                                            std::vector<retrieval_result_t*>& results) {
+  size_t begin = 0, end = 0;
+  for (size_t idx = 0; idx < m_nConns; idx++) {
+    Connection* conn = m_conns + idx;
+    types::RetrievalResultList* rst = conn->getRetrievalResults();
+    conn->batchRetrievalRange(ticket, begin, end);
+    for (size_t i = begin; i < end; i++) {
+      RetrievalResult& r1 = (*rst)[i];
+      if (r1.bytesRemain > 0) {
+        continue;
+      }
+      results.push_back(r1.inner(m_requestArena));
+    }
+  }
+}
+
+
+void ConnectionPool::collectMessageResult(ticket_t ticket,
+                                          std::vector<message_result_t*>& results) {
+  size_t begin = 0, end = 0;
+  for (size_t idx = 0; idx < m_nConns; idx++) {
+    Connection* conn = m_conns + idx;
+    types::MessageResultList* rst = conn->getMessageResults();
+    conn->batchMessageRange(ticket, begin, end);
+    for (size_t i = begin; i < end; i++) {
+      results.push_back(&(*rst)[i]);
+    }
+  }
+}
+
+
+void ConnectionPool::reset() {
+  for (std::vector<Connection*>::iterator it = m_activeConns.begin();
+       it != m_activeConns.end(); ++it) {
+    (*it)->reset();
+  }
+  m_nActiveConn = 0;
+  m_nInvalidKey = 0;
+  m_activeConns.clear();
+  m_requestArena.reset();
+}
+
+
+void ConnectionPool::setPollTimeout(int timeout) {
+  m_pollTimeout = timeout;
+}
+
+
+void ConnectionPool::setConnectTimeout(int timeout) {
+  for (size_t idx = 0; idx < m_nConns; ++idx) {
+    Connection* conn = m_conns + idx;
+    conn->setConnectTimeout(timeout);
+  }
+}
+
+
+void ConnectionPool::setRetryTimeout(int timeout) {
+  for (size_t idx = 0; idx < m_nConns; ++idx) {
+    Connection* conn = m_conns + idx;
+    conn->setRetryTimeout(timeout);
+  }
+}
+
+
+void ConnectionPool::setMaxRetries(int max_retries) {
+  for (size_t idx = 0; idx < m_nConns; ++idx) {
+    Connection* conn = m_conns + idx;
+    conn->setMaxRetries(max_retries);
+  }
+}
+
+
+void ConnectionPool::getSendStats(send_stats_t* stats) {
+  memset(stats, 0, sizeof *stats);
+  for (size_t idx = 0; idx < m_nConns; ++idx) {
+    const send_stats_t& connStats = m_conns[idx].sendStats();
+    stats->sendmsg_calls += connStats.sendmsg_calls;
+    stats->partial_sends += connStats.partial_sends;
+    stats->eagain_sends += connStats.eagain_sends;
+  }
+}
+
+
+void ConnectionPool::getMemoryStats(memory_stats_t* stats) {
+  memset(stats, 0, sizeof *stats);
+  for (size_t idx = 0; idx < m_nConns; ++idx) {
+    stats->result_bytes += m_conns[idx].resultBytes();
+    stats->buffer_bytes += m_conns[idx].bufferBytes();
+  }
+  stats->arena_bytes = m_requestArena.retainedBytes();
+}
+
+
+void ConnectionPool::setChunkCallback(retrieval_chunk_cb_t cb, void* ctx) {
+  for (size_t idx = 0; idx < m_nConns; ++idx) {
+    m_conns[idx].setChunkCallback(cb, ctx);
+  }
+}
+
+
+void ConnectionPool::shrinkResults() {
+  for (size_t idx = 0; idx < m_nConns; ++idx) {
+    m_conns[idx].shrinkResults();
+  }
+  m_requestArena.shrink();
+}
+
+
+void ConnectionPool::shrinkBuffers() {
+  for (size_t idx = 0; idx < m_nConns; ++idx) {
+    m_conns[idx].shrinkBuffers();
+  }
+}
+
+
+void ConnectionPool::setZerocopyThreshold(size_t threshold) {
+#ifdef MC_USE_ZEROCOPY
+  for (size_t idx = 0; idx < m_nConns; ++idx) {
+    Connection* conn = m_conns + idx;
+    conn->setZerocopyThreshold(threshold);
+  }
+#else
+  log_warn_if(threshold > 0, "MSG_ZEROCOPY is not supported in this build, fall back to copying");
+#endif
+}
+
+
+void ConnectionPool::setUseIoUring(bool enabled) {
+#ifdef MC_USE_IO_URING
+  m_useUring = enabled;
+  if (!enabled) {
+    m_uring.destroy();
+  }
+#else
+  log_warn_if(enabled, "io_uring is not supported in this build, fall back to poll");
+#endif
+}
+
+
+void ConnectionPool::setUseMetaProtocol(bool enabled) {
+  m_useMeta = enabled;
+}
+
+
+void ConnectionPool::setUseBinaryProtocol(bool enabled) {
+  if (m_useBinary == enabled) {
+    return;
+  }
+  m_useBinary = enabled;
+  // the server took the protocol of the first request for the connection
+  for (size_t idx = 0; idx < m_nConns; ++idx) {
+    m_conns[idx].close();
+  }
+}
+
+
+#ifdef MC_USE_ZEROCOPY
+void ConnectionPool::waitZerocopy() {
+  for (std::vector<Connection*>::iterator it = m_activeConns.begin();
+       it != m_activeConns.end(); ++it) {
+    Connection* conn = *it;
+    while (conn->zerocopyPending()) {
+      if (!conn->reapZerocopy()) {
+        conn->markDead(keywords::kSEND_ERROR);
+        break;
+      }
+      if (!conn->zerocopyPending()) {
+        break;
+      }
+      // notifications are signaled as POLLERR, which needs no events
+      pollfd_t pollfd = {conn->socketFd(), 0, 0};
+      if (poll(&pollfd, 1, m_pollTimeout) <= 0) {
+        log_warn("%s: zerocopy completion timeout", conn->name());
+        // the abortive close discards what the kernel still holds
+        conn->markDead(keywords::kPOLL_TIMEOUT_ERROR);
+        break;
+      }
+    }
+  }
+}
+#endif
+
+
+void ConnectionPool::markDeadAll(pollfd_t* pollfds, const char* reason) {
   nfds_t fd_idx = 0;
   for (std::vector<Connection*>::iterator it = m_activeConns.begin();
       it != m_activeConns.end();
@@ -707,5 +1474,591 @@ void ConnectionPool::rewindConn(Connection* conn, pollfd_t* fd_ptr) {
 }
 
 
+#ifdef MC_USE_EPOLL
+// The epoll instance is made by the process that waits on it. A client
+// made before a fork would otherwise share its interest list with all the
+// children, and one of them could take the events of another, whose fds
+// have the same numbers.
+bool ConnectionPool::initEpoll() {
+  pid_t pid = getpid();
+  if (m_epollPid == pid) {
+    return m_epollFd != -1;
+  }
+  if (m_epollFd != -1) {
+    ::close(m_epollFd);
+    for (size_t i = 0; i < m_nConns; i++) {
+      m_conns[i].m_pollRegistered = false;
+    }
+  }
+  m_epollPid = pid;
+  m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+  log_warn_if(m_epollFd == -1, "epoll_create1 failed, fall back to poll");
+  return m_epollFd != -1;
+}
+
+
+err_code_t ConnectionPool::waitEpoll() {
+  err_code_t ret_code = RET_OK;
+  struct epoll_event* events = &m_epollEvents.front();
+  int maxEvents = static_cast<int>(m_epollEvents.size());
+  int rv = 0;
+
+  for (std::vector<Connection*>::iterator it = m_activeConns.begin();
+       it != m_activeConns.end(); ++it) {
+    Connection* conn = *it;
+    conn->m_pollEvents = POLLOUT;
+    if (!conn->m_pollRegistered && !epollRegister(conn)) {
+      markDeadConn(conn, keywords::kCONN_POLL_ERROR);
+      ret_code = RET_CONN_POLL_ERR;
+      --m_nActiveConn;
+    }
+  }
+
+  // Events left behind since the last call, e.g. a server closing an idle
+  // connection, must be handled before anything is sent on that connection.
+  rv = epoll_wait(m_epollFd, events, maxEvents, 0);
+  for (int i = 0; i < rv; i++) {
+    Connection* conn = epollEventConn(events[i]);
+    if (conn != NULL) {
+      epollServe(conn, events[i].events, ret_code);
+    }
+  }
+
+  // An edge-triggered socket that is already writable won't report
+  // EPOLLOUT again, so start sending right away.
+  for (std::vector<Connection*>::iterator it = m_activeConns.begin();
+       it != m_activeConns.end(); ++it) {
+    epollSend(*it, ret_code);
+  }
+
+  while (m_nActiveConn) {
+    rv = epoll_wait(m_epollFd, events, maxEvents, m_pollTimeout);
+    if (rv == -1) {
+      markDeadPending(keywords::kPOLL_ERROR);
+      ret_code = RET_POLL_ERR;
+      break;
+    } else if (rv == 0) {
+      log_warn("poll timeout. (m_nActiveConn: %d)", m_nActiveConn);
+      // NOTE: MUST reset all active TCP connections after timeout.
+      markDeadPending(keywords::kPOLL_TIMEOUT_ERROR);
+      ret_code = RET_POLL_TIMEOUT_ERR;
+      break;
+    }
+    for (int i = 0; i < rv; i++) {
+      Connection* conn = epollEventConn(events[i]);
+      if (conn != NULL) {
+        epollServe(conn, events[i].events, ret_code);
+      }
+    }
+  }
+  return ret_code;
+}
+
+
+bool ConnectionPool::epollRegister(Connection* conn) {
+  struct epoll_event ev;
+  int fd = conn->socketFd();
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+  // the fd is kept to drop events of a socket closed since it was added
+  ev.data.u64 = (static_cast<uint64_t>(conn - m_conns) << 32) | static_cast<uint32_t>(fd);
+  if (epoll_ctl(m_epollFd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+    log_warn("epoll_ctl failed on %s", conn->name());
+    return false;
+  }
+  conn->m_pollRegistered = true;
+  return true;
+}
+
+
+Connection* ConnectionPool::epollEventConn(const struct epoll_event& ev) {
+  size_t idx = static_cast<size_t>(ev.data.u64 >> 32);
+  int fd = static_cast<int>(ev.data.u64 & 0xFFFFFFFFULL);
+  if (idx >= m_nConns || m_conns[idx].socketFd() != fd) {
+    return NULL;
+  }
+  return m_conns + idx;
+}
+
+
+void ConnectionPool::epollServe(Connection* conn, uint32_t events, err_code_t& ret_code) {
+  if (conn->m_pollEvents == 0) {
+    // not part of this round (or done already), but the server may have
+    // closed it. We won't get another edge for that, so check it now.
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+      ssize_t nRecv = conn->recv(true);
+      if (nRecv == 0 || (nRecv == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        conn->markDead(keywords::kRECV_ERROR);
+      }
+    }
+    return;
+  }
+
+#ifdef MC_USE_ZEROCOPY
+  if ((events & (EPOLLERR | EPOLLHUP)) == EPOLLERR &&
+      conn->zerocopyPending() && conn->reapZerocopy()) {
+    // only zerocopy notifications in the error queue
+    events &= ~EPOLLERR;
+  }
+#endif
+  if (events & (EPOLLERR | EPOLLHUP)) {
+    markDeadConn(conn, keywords::kCONN_POLL_ERROR);
+    if (!conn->tryReconnect() || !rewindConn(conn)) {
+      ret_code = RET_CONN_POLL_ERR;
+      --m_nActiveConn;
+    }
+    return;
+  }
+
+  // first recv before send
+  if (events & EPOLLIN && !conn->isSent()) {
+    ssize_t nRecv = conn->recv(true);
+    if (nRecv == 0 || (nRecv == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+      markDeadConn(conn, keywords::kRECV_ERROR);
+      if (!conn->tryReconnect(false) || !epollRegister(conn)) {
+        ret_code = RET_RECV_ERR;
+        --m_nActiveConn;
+      } else {
+        conn->m_pollEvents = POLLOUT;
+      }
+      return;
+    }
+  }
+
+  if (events & EPOLLOUT && !epollSend(conn, ret_code)) {
+    return;
+  }
+
+  if (events & EPOLLIN) {
+    epollRecv(conn, ret_code);
+  }
+}
+
+
+// Edge-triggered: keep sending until done or EAGAIN.
+// Returns false if conn is marked dead.
+bool ConnectionPool::epollSend(Connection* conn, err_code_t& ret_code) {
+  while (conn->m_pollEvents & POLLOUT) {
+    ssize_t nToSend = conn->send();
+    if (nToSend == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      markDeadConn(conn, keywords::kSEND_ERROR);
+      if (!conn->tryReconnect() || !rewindConn(conn)) {
+        ret_code = RET_SEND_ERR;
+        --m_nActiveConn;
+      }
+      return false;
+    }
+    // start to recv if any data is sent
+    conn->m_pollEvents |= POLLIN;
+
+    if (nToSend == 0) {
+      conn->m_pollEvents &= ~POLLOUT;
+      if (conn->m_counter == 0) {
+        // just send, no recv for noreply
+        conn->m_pollEvents = 0;
+        --m_nActiveConn;
+      }
+    }
+  }
+  return true;
+}
+
+
+// Edge-triggered: keep receiving until the response is complete or EAGAIN.
+// Returns false if conn is marked dead.
+bool ConnectionPool::epollRecv(Connection* conn, err_code_t& ret_code) {
+  err_code_t err;
+  while (conn->m_pollEvents & POLLIN) {
+    ssize_t nRecv = conn->recv();
+    if (nRecv == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (nRecv == -1 || nRecv == 0) {
+      markDeadConn(conn, keywords::kRECV_ERROR);
+      if (!conn->tryReconnect() || !rewindConn(conn)) {
+        ret_code = RET_RECV_ERR;
+        --m_nActiveConn;
+      }
+      return false;
+    }
+
+    conn->process(err);
+    switch (err) {
+      case RET_OK:
+        conn->m_pollEvents &= ~POLLIN;
+        --m_nActiveConn;
+        break;
+      case RET_INCOMPLETE_BUFFER_ERR:
+        break;
+      case RET_PROGRAMMING_ERR:
+        markDeadConn(conn, keywords::kPROGRAMMING_ERROR);
+        ret_code = RET_PROGRAMMING_ERR;
+        --m_nActiveConn;
+        return false;
+      case RET_MC_SERVER_ERR:
+        // soft server error
+        markDeadConn(conn, keywords::kSERVER_ERROR);
+        ret_code = RET_MC_SERVER_ERR;
+        --m_nActiveConn;
+        return false;
+      default:
+        NOT_REACHED();
+        break;
+    }
+  }
+  return true;
+}
+
+
+void ConnectionPool::markDeadPending(const char* reason) {
+  for (std::vector<Connection*>::iterator it = m_activeConns.begin();
+       it != m_activeConns.end(); ++it) {
+    Connection* conn = *it;
+    if (conn->m_pollEvents != 0) {
+      markDeadConn(conn, reason);
+    }
+  }
+}
+
+
+void ConnectionPool::markDeadConn(Connection* conn, const char* reason) {
+  conn->markDead(reason);
+  conn->m_pollEvents = 0;
+}
+
+
+bool ConnectionPool::rewindConn(Connection* conn) {
+  conn->rewind();
+  if (!epollRegister(conn)) {
+    return false;
+  }
+  // a new registration reports EPOLLOUT once the socket is writable
+  conn->m_pollEvents = POLLOUT;
+  return true;
+}
+#endif
+
+
+#ifdef MC_USE_IO_URING
+bool ConnectionPool::initUring() {
+  // room for a peek, a send and a recv per connection, plus cancels
+  unsigned entries = 8;
+  while (entries < 4 * m_nConns && entries < 4096) {
+    entries <<= 1;
+  }
+  int rv = m_uring.init(entries);
+  if (rv != 0) {
+    errno = -rv;
+    log_warn("io_uring_setup failed, fall back to poll");
+    m_useUring = false;
+    return false;
+  }
+  return true;
+}
+
+
+err_code_t ConnectionPool::waitUring() {
+  err_code_t ret_code = RET_OK;
+  struct io_uring_cqe* cqe = NULL;
+
+  for (std::vector<Connection*>::iterator it = m_activeConns.begin();
+       it != m_activeConns.end(); ++it) {
+    uringStart(*it, true, ret_code);
+  }
+
+  while (m_nActiveConn || m_uringInflight) {
+    int rv = m_uring.submitAndWait(1, m_pollTimeout);
+    if (rv == -ETIME) {
+      log_warn("poll timeout. (m_nActiveConn: %d)", m_nActiveConn);
+      // NOTE: MUST reset all active TCP connections after timeout.
+      uringAbort();
+      markDeadPending(keywords::kPOLL_TIMEOUT_ERROR);
+      return RET_POLL_TIMEOUT_ERR;
+    } else if (rv < 0 && rv != -EINTR && rv != -EBUSY) {
+      errno = -rv;
+      log_warn("io_uring_enter failed. (m_nActiveConn: %d)", m_nActiveConn);
+      uringAbort();
+      markDeadPending(keywords::kPOLL_ERROR);
+      return RET_POLL_ERR;
+    }
+    while ((cqe = m_uring.peekCqe()) != NULL) {
+      uint64_t userData = cqe->user_data;
+      int res = cqe->res;
+      m_uring.cqeSeen();
+      uringComplete(userData, res, ret_code);
+    }
+  }
+  return ret_code;
+}
+
+
+struct io_uring_sqe* ConnectionPool::uringSqe() {
+  struct io_uring_sqe* sqe = m_uring.getSqe();
+  if (sqe == NULL && m_uring.submit() >= 0) {
+    sqe = m_uring.getSqe();
+  }
+  return sqe;
+}
+
+
+bool ConnectionPool::uringQueue(Connection* conn, int op, bool link) {
+  size_t idx = conn - m_conns;
+  UringState& st = m_uringStates[idx];
+  struct io_uring_sqe* sqe = uringSqe();
+  if (sqe == NULL) {
+    log_warn("io_uring submission queue is full on %s", conn->name());
+    return false;
+  }
+
+  switch (op) {
+    case URING_OP_SEND:
+      {
+        int flags = 0;
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->addr = reinterpret_cast<uint64_t>(conn->prepareSend(flags));
+        sqe->len = 1;
+        sqe->msg_flags = flags;
+      }
+      break;
+    case URING_OP_RECV:
+      {
+        size_t len = 0;
+        sqe->opcode = IORING_OP_RECV;
+        sqe->addr = reinterpret_cast<uint64_t>(conn->prepareRecv(len));
+        sqe->len = static_cast<uint32_t>(len);
+      }
+      break;
+    case URING_OP_PEEK:
+      // MSG_DONTWAIT: complete at once instead of waiting for data
+      sqe->opcode = IORING_OP_RECV;
+      sqe->addr = reinterpret_cast<uint64_t>(&st.peekByte);
+      sqe->len = 1;
+      sqe->msg_flags = MSG_PEEK | MSG_DONTWAIT;
+      break;
+    default:
+      NOT_REACHED();
+      break;
+  }
+  sqe->fd = conn->socketFd();
+  if (link) {
+    // a hard link runs the next sqe however this one ends
+    sqe->flags |= IOSQE_IO_HARDLINK;
+  }
+  sqe->user_data = (static_cast<uint64_t>(idx) << 2) | op;
+  st.inflight |= 1 << op;
+  ++m_uringInflight;
+  return true;
+}
+
+
+void ConnectionPool::uringStart(Connection* conn, bool peek, err_code_t& ret_code) {
+  UringState& st = m_uringStates[conn - m_conns];
+  st.deadReason = NULL;
+  st.retry = URING_NO_RETRY;
+  conn->m_pollEvents = POLLOUT;
+
+  // The server may have closed the connection while it was idle.
+  // Peek first, like the first recv before send of poll.
+  if ((peek && !uringQueue(conn, URING_OP_PEEK, true)) || !uringQueue(conn, URING_OP_SEND)) {
+    uringFail(conn, keywords::kCONN_POLL_ERROR, RET_CONN_POLL_ERR, URING_NO_RETRY, ret_code);
+  }
+}
+
+
+void ConnectionPool::uringComplete(uint64_t userData, int res, err_code_t& ret_code) {
+  size_t idx = static_cast<size_t>(userData >> 2);
+  int op = static_cast<int>(userData & 3);
+  if (op == URING_OP_CANCEL || idx >= m_nConns) {
+    return;
+  }
+  Connection* conn = m_conns + idx;
+  UringState& st = m_uringStates[idx];
+  err_code_t err;
+
+  st.inflight &= ~(1 << op);
+  --m_uringInflight;
+  if (st.deadReason != NULL) {
+    if (st.inflight == 0) {
+      uringFinalize(conn, ret_code);
+    }
+    return;
+  }
+
+  switch (op) {
+    case URING_OP_PEEK:
+      // -EAGAIN: nothing to read, which is expected before the request is sent
+      if (res == 0 || (res < 0 && res != -EAGAIN)) {
+        uringFail(conn, keywords::kRECV_ERROR, RET_RECV_ERR, URING_RETRY_IDLE, ret_code);
+      }
+      break;
+    case URING_OP_SEND:
+      if (conn->m_pollEvents == 0) {
+        // all responses are received before this cqe is reaped
+        break;
+      }
+      if (res < 0 && res != -EAGAIN) {
+        uringFail(conn, keywords::kSEND_ERROR, RET_SEND_ERR, URING_RETRY, ret_code);
+        break;
+      }
+      if (res == -EAGAIN) {
+        conn->sendAgain();
+      }
+      if (res == -EAGAIN || conn->commitSend(res) > 0) {
+        if (!uringQueue(conn, URING_OP_SEND)) {
+          uringFail(conn, keywords::kCONN_POLL_ERROR, RET_CONN_POLL_ERR, URING_NO_RETRY,
+                    ret_code);
+          break;
+        }
+      } else {
+        conn->m_pollEvents &= ~POLLOUT;
+        if (conn->m_counter == 0) {
+          // just send, no recv for noreply
+          conn->m_pollEvents = 0;
+          --m_nActiveConn;
+          break;
+        }
+      }
+      // start to recv if any data is sent
+      if (!(st.inflight & (1 << URING_OP_RECV))) {
+        conn->m_pollEvents |= POLLIN;
+        if (!uringQueue(conn, URING_OP_RECV)) {
+          uringFail(conn, keywords::kCONN_POLL_ERROR, RET_CONN_POLL_ERR, URING_NO_RETRY,
+                    ret_code);
+        }
+      }
+      break;
+    case URING_OP_RECV:
+      if (res == 0 || (res < 0 && res != -EAGAIN)) {
+        uringFail(conn, keywords::kRECV_ERROR, RET_RECV_ERR, URING_RETRY, ret_code);
+        break;
+      }
+      if (res > 0) {
+        conn->commitRecv(res);
+        conn->process(err);
+      } else {
+        err = RET_INCOMPLETE_BUFFER_ERR;
+      }
+      switch (err) {
+        case RET_OK:
+          // the server answered everything, so it got everything sent
+          conn->m_pollEvents = 0;
+          --m_nActiveConn;
+          break;
+        case RET_INCOMPLETE_BUFFER_ERR:
+          if (!uringQueue(conn, URING_OP_RECV)) {
+            uringFail(conn, keywords::kCONN_POLL_ERROR, RET_CONN_POLL_ERR, URING_NO_RETRY,
+                      ret_code);
+          }
+          break;
+        case RET_PROGRAMMING_ERR:
+          uringFail(conn, keywords::kPROGRAMMING_ERROR, RET_PROGRAMMING_ERR, URING_NO_RETRY,
+                    ret_code);
+          break;
+        case RET_MC_SERVER_ERR:
+          // soft server error
+          uringFail(conn, keywords::kSERVER_ERROR, RET_MC_SERVER_ERR, URING_NO_RETRY, ret_code);
+          break;
+        default:
+          NOT_REACHED();
+          break;
+      }
+      break;
+    default:
+      NOT_REACHED();
+      break;
+  }
+}
+
+
+// The buffers of the sqes still in flight belong to the kernel, so the
+// connection is only marked dead (and maybe rewound) once they complete.
+void ConnectionPool::uringFail(Connection* conn, const char* reason, err_code_t code,
+                               UringRetry retry, err_code_t& ret_code) {
+  UringState& st = m_uringStates[conn - m_conns];
+  st.deadReason = reason;
+  st.deadCode = code;
+  st.retry = retry;
+  if (st.inflight == 0) {
+    uringFinalize(conn, ret_code);
+  } else {
+    uringCancel(conn);
+  }
+}
+
+
+void ConnectionPool::uringFinalize(Connection* conn, err_code_t& ret_code) {
+  UringState& st = m_uringStates[conn - m_conns];
+  const char* reason = st.deadReason;
+  st.deadReason = NULL;
+  markDeadConn(conn, reason);
+  if (st.retry != URING_NO_RETRY && conn->tryReconnect(st.retry == URING_RETRY)) {
+    conn->rewind();
+    uringStart(conn, false, ret_code);
+  } else {
+    ret_code = st.deadCode;
+    --m_nActiveConn;
+  }
+}
+
+
+void ConnectionPool::uringCancel(Connection* conn) {
+  size_t idx = conn - m_conns;
+  UringState& st = m_uringStates[idx];
+  for (int op = URING_OP_SEND; op < URING_OP_CANCEL; op++) {
+    if (!(st.inflight & (1 << op))) {
+      continue;
+    }
+    struct io_uring_sqe* sqe = uringSqe();
+    if (sqe == NULL) {
+      log_warn("io_uring submission queue is full on %s", conn->name());
+      return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (static_cast<uint64_t>(idx) << 2) | op;
+    sqe->user_data = (static_cast<uint64_t>(idx) << 2) | URING_OP_CANCEL;
+  }
+}
+
+
+// Cancel everything in flight and wait for it, nothing more is queued.
+void ConnectionPool::uringAbort() {
+  struct io_uring_cqe* cqe = NULL;
+  for (size_t idx = 0; idx < m_nConns; idx++) {
+    m_uringStates[idx].deadReason = NULL;
+    if (m_uringStates[idx].inflight) {
+      uringCancel(m_conns + idx);
+    }
+  }
+  while (m_uringInflight) {
+    int rv = m_uring.submitAndWait(1);
+    if (rv < 0 && rv != -EINTR && rv != -EBUSY && rv != -ETIME) {
+      // tearing down the ring is the only way left to get the buffers back
+      log_err("io_uring_enter failed while canceling, disable io_uring");
+      m_uring.destroy();
+      m_useUring = false;
+      break;
+    }
+    while ((cqe = m_uring.peekCqe()) != NULL) {
+      uint64_t userData = cqe->user_data;
+      m_uring.cqeSeen();
+      size_t idx = static_cast<size_t>(userData >> 2);
+      int op = static_cast<int>(userData & 3);
+      if (op != URING_OP_CANCEL && idx < m_nConns) {
+        m_uringStates[idx].inflight &= ~(1 << op);
+        --m_uringInflight;
+      }
+    }
+  }
+  for (size_t idx = 0; idx < m_nConns; idx++) {
+    m_uringStates[idx].inflight = 0;
+  }
+  m_uringInflight = 0;
+}
+#endif
+
+
 } // namespace mc
 } // namespace douban
@@ -1,7 +1,7 @@
-#include <algorithm>
-
 #include "DataBlock.h"
+#include "BlockPool.h"
 #include "Common.h"
+#include "Scan.h"
 
 namespace douban {
 namespace mc {
@@ -32,7 +32,7 @@ size_t DataBlock::s_minCapacity(MIN_DATABLOCK_CAPACITY);
 
 
 DataBlock::~DataBlock() {
-  delete[] m_data;
+  destroy();
 }
 
 
@@ -41,13 +41,27 @@ void DataBlock::init(size_t len) {
     log_err("DataBlock(%p)::init should only be called once", this);
     return;
   }
-  this->m_data = new char[len];
+  this->m_data = BlockPool::allocate(len);
+  if (m_data == NULL) {
+    log_err("DataBlock(%p)::init failed to allocate %zu bytes", this, len);
+    return;
+  }
   this->m_capacity = len;
   this->m_nBytesRef = 0;
   this->m_size = 0;
 }
 
 
+// give the storage back, so that init() can be called again
+void DataBlock::destroy() {
+  BlockPool::deallocate(m_data, m_capacity);
+  this->m_data = NULL;
+  this->m_capacity = 0;
+  this->m_nBytesRef = 0;
+  this->m_size = 0;
+}
+
+
 void DataBlock::setMinCapacity(size_t len) {
   log_warn("make sure this line is never called in production");
   s_minCapacity = len;
@@ -91,19 +105,17 @@ size_t DataBlock::getWriteLeft() {
 
 
 size_t DataBlock::find(char c, size_t since) {
-  char *p = std::find(m_data + since, m_data + m_size, c);
-  return p - m_data;
+  return findChar(m_data + since, m_data + m_size, c) - m_data;
 }
 
 
-bool is_not_digit(int c) {
-  return  !('0' <= c && c <= '9');
+size_t DataBlock::find(char c1, char c2, size_t since) {
+  return findEither(m_data + since, m_data + m_size, c1, c2) - m_data;
 }
 
 
 size_t DataBlock::findNotNumeric(size_t since) {
-  char *p = std::find_if(m_data + since, m_data + m_size, is_not_digit);
-  return p - m_data;
+  return findNotDigit(m_data + since, m_data + m_size) - m_data;
 }
 
 
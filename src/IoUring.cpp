@@ -0,0 +1,178 @@
+#include "IoUring.h"
+
+#ifdef MC_USE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <cstring>
+
+#include "Common.h"
+
+namespace douban {
+namespace mc {
+namespace io {
+
+#define smp_load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+
+IoUring::IoUring()
+  : m_ringFd(-1), m_entries(0), m_ringPtr(MAP_FAILED), m_ringSize(0),
+    m_sqes(static_cast<struct io_uring_sqe*>(MAP_FAILED)), m_sqesSize(0),
+    m_sqHead(NULL), m_sqTail(NULL), m_sqMask(NULL), m_sqArray(NULL),
+    m_cqHead(NULL), m_cqTail(NULL), m_cqMask(NULL), m_cqes(NULL),
+    m_sqeTail(0), m_sqeSubmitted(0) {
+}
+
+
+IoUring::~IoUring() {
+  destroy();
+}
+
+
+int IoUring::init(unsigned entries) {
+  destroy();
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof params);
+  int fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+  if (fd < 0) {
+    return -errno;
+  }
+
+  const unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+  if ((params.features & required) != required) {
+    ::close(fd);
+    return -EOPNOTSUPP;
+  }
+
+  size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  m_ringSize = MAX(sqSize, cqSize);
+  m_ringPtr = mmap(NULL, m_ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   fd, IORING_OFF_SQ_RING);
+  if (m_ringPtr == MAP_FAILED) {
+    int err = errno;
+    ::close(fd);
+    return -err;
+  }
+
+  m_sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  void* sqes = mmap(NULL, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    int err = errno;
+    munmap(m_ringPtr, m_ringSize);
+    m_ringPtr = MAP_FAILED;
+    ::close(fd);
+    return -err;
+  }
+  m_sqes = static_cast<struct io_uring_sqe*>(sqes);
+
+  char* ring = static_cast<char*>(m_ringPtr);
+  m_sqHead = reinterpret_cast<unsigned*>(ring + params.sq_off.head);
+  m_sqTail = reinterpret_cast<unsigned*>(ring + params.sq_off.tail);
+  m_sqMask = reinterpret_cast<unsigned*>(ring + params.sq_off.ring_mask);
+  m_sqArray = reinterpret_cast<unsigned*>(ring + params.sq_off.array);
+  m_cqHead = reinterpret_cast<unsigned*>(ring + params.cq_off.head);
+  m_cqTail = reinterpret_cast<unsigned*>(ring + params.cq_off.tail);
+  m_cqMask = reinterpret_cast<unsigned*>(ring + params.cq_off.ring_mask);
+  m_cqes = reinterpret_cast<struct io_uring_cqe*>(ring + params.cq_off.cqes);
+
+  // sqe slot i is always submitted through sq array entry i
+  for (unsigned i = 0; i < params.sq_entries; i++) {
+    m_sqArray[i] = i;
+  }
+  m_sqeTail = m_sqeSubmitted = *m_sqTail;
+  m_entries = params.sq_entries;
+  m_ringFd = fd;
+  return 0;
+}
+
+
+void IoUring::destroy() {
+  if (m_ringFd == -1) {
+    return;
+  }
+  munmap(m_sqes, m_sqesSize);
+  munmap(m_ringPtr, m_ringSize);
+  ::close(m_ringFd);
+  m_sqes = static_cast<struct io_uring_sqe*>(MAP_FAILED);
+  m_ringPtr = MAP_FAILED;
+  m_ringFd = -1;
+  m_entries = 0;
+}
+
+
+struct io_uring_sqe* IoUring::getSqe() {
+  unsigned head = smp_load_acquire(m_sqHead);
+  if (m_sqeTail - head >= m_entries) {
+    return NULL;
+  }
+  struct io_uring_sqe* sqe = &m_sqes[m_sqeTail & *m_sqMask];
+  ++m_sqeTail;
+  memset(sqe, 0, sizeof *sqe);
+  return sqe;
+}
+
+
+int IoUring::submitAndWait(unsigned waitNr, int timeoutMs) {
+  unsigned toSubmit = m_sqeTail - m_sqeSubmitted;
+  smp_store_release(m_sqTail, m_sqeTail);
+
+  unsigned flags = 0;
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof arg);
+  if (waitNr > 0) {
+    flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    if (timeoutMs >= 0) {
+      ts.tv_sec = timeoutMs / 1000;
+      ts.tv_nsec = (timeoutMs % 1000) * 1000000LL;
+      arg.ts = reinterpret_cast<uint64_t>(&ts);
+    }
+  }
+
+  int rv = static_cast<int>(syscall(__NR_io_uring_enter, m_ringFd, toSubmit, waitNr, flags,
+                                    waitNr > 0 ? &arg : NULL, waitNr > 0 ? sizeof arg : 0));
+  if (rv < 0) {
+    return -errno;
+  }
+  m_sqeSubmitted += rv;
+  // the kernel reports the sqes it took even if the wait timed out after
+  if (waitNr > 0 && peekCqe() == NULL) {
+    return -ETIME;
+  }
+  return rv;
+}
+
+
+int IoUring::submit() {
+  return submitAndWait(0);
+}
+
+
+struct io_uring_cqe* IoUring::peekCqe() {
+  unsigned head = *m_cqHead;
+  if (head == smp_load_acquire(m_cqTail)) {
+    return NULL;
+  }
+  return &m_cqes[head & *m_cqMask];
+}
+
+
+void IoUring::cqeSeen() {
+  smp_store_release(m_cqHead, *m_cqHead + 1);
+}
+
+#undef smp_load_acquire
+#undef smp_store_release
+
+} // namespace io
+} // namespace mc
+} // namespace douban
+
+#endif // MC_USE_IO_URING
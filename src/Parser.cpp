@@ -1,5 +1,7 @@
+#include <ctype.h>
 #include "Parser.h"
 #include "Keywords.h"
+#include "Scan.h"
 
 
 using douban::mc::io::BufferReader;
@@ -13,14 +15,20 @@ namespace douban {
 namespace mc {
 
 PacketParser::PacketParser(BufferReader* reader)
-  : m_buffer_reader(NULL), m_state(FSM_START), m_mode(MODE_UNDEFINED),
-    m_expectedResultCount(0), m_requestKeyIdx(0), mt_kvPtr(NULL) {
+  : m_buffer_reader(NULL), m_requestArena(NULL), m_chunkCallback(NULL), m_chunkCtx(NULL),
+    m_state(FSM_START), m_mode(MODE_UNDEFINED), m_quietResult(MSG_LIBMC_INVALID),
+    m_expectedResultCount(0), m_requestKeyIdx(0),
+    m_batchIdx(0), m_typedStats(false), m_serverStats(),
+    mt_kvPtr(NULL), mt_streamKey(NULL) {
   m_buffer_reader = reader;
 }
 
 PacketParser::PacketParser()
-  : m_buffer_reader(NULL), m_state(FSM_START), m_mode(MODE_UNDEFINED),
-    m_expectedResultCount(0), m_requestKeyIdx(0), mt_kvPtr(NULL) {
+  : m_buffer_reader(NULL), m_requestArena(NULL), m_chunkCallback(NULL), m_chunkCtx(NULL),
+    m_state(FSM_START), m_mode(MODE_UNDEFINED), m_quietResult(MSG_LIBMC_INVALID),
+    m_expectedResultCount(0), m_requestKeyIdx(0),
+    m_batchIdx(0), m_typedStats(false), m_serverStats(),
+    mt_kvPtr(NULL), mt_streamKey(NULL) {
 }
 
 
@@ -28,8 +36,15 @@ PacketParser::~PacketParser() {
 }
 
 
-void PacketParser::setMode(ParserMode md) {
+void PacketParser::setMode(ParserMode md, message_result_type quietResult) {
   m_mode = md;
+  m_quietResult = quietResult;
+}
+
+
+void PacketParser::setTypedStats() {
+  m_typedStats = true;
+  memset(&m_serverStats, 0, sizeof m_serverStats);
 }
 
 
@@ -55,20 +70,703 @@ void PacketParser::processMessageResult(enum message_result_type tp) {
 void PacketParser::processLineResult(err_code_t& err) {
   err = RET_OK;
   LineResult* inner = &(m_lineResults.back());
-  inner->line.clear();
-  inner->line_len = m_buffer_reader->readUntil(err, '\n', inner->line);
+  inner->line_len = m_buffer_reader->readUntil(err, '\n', mt_token);
   if (err != RET_OK) {
     return;
   }
+  inner->line.assign(mt_token, *m_requestArena);
   m_buffer_reader->skipBytes(err, 1);
 }
 
 
+// Hands the value of mt_kvPtr to the chunk callback as it arrives, and
+// lets the reader write the next recv over what was handed.
+void PacketParser::streamValue(err_code_t& err) {
+  err = RET_OK;
+  RetrievalResult* kv = mt_kvPtr;
+  retrieval_chunk_t chunk;
+  bool starting = mt_streamKey == NULL;
+  if (starting && kv->requestKey != NULL) {
+    mt_streamKey = kv->requestKey;
+  } else if (starting) {
+    // a copy, the blocks of the key are reused too
+    mt_streamKey = m_requestArena->allocate(kv->key_len);
+    size_t pos = 0;
+    for (io::TokenSlices::const_iterator it = kv->key.begin(); it != kv->key.end(); ++it) {
+      memcpy(mt_streamKey + pos, it->block->at(it->offset), it->size);
+      pos += it->size;
+    }
+    freeTokenData(kv->key);
+  }
+  chunk.key = mt_streamKey;
+  chunk.key_len = kv->key_len;
+  chunk.flags = kv->flags;
+  chunk.cas_unique = kv->cas_unique;
+  chunk.bytes = kv->bytes;
+
+  if (starting && kv->bytes == 0) {
+    // an empty value still gets its call
+    chunk.data = NULL;
+    chunk.offset = chunk.len = 0;
+    m_chunkCallback(m_chunkCtx, &chunk);
+  }
+  while (kv->bytesRemain > 0) {
+    size_t n = m_buffer_reader->readAvailable(kv->bytesRemain, mt_token);
+    if (n == 0) {
+      err = RET_INCOMPLETE_BUFFER_ERR;
+      return;
+    }
+    chunk.offset = kv->bytes - kv->bytesRemain;
+    for (TokenData::const_iterator it = mt_token.begin(); it != mt_token.end(); ++it) {
+      chunk.data = it->block->at(it->offset);
+      chunk.len = static_cast<uint32_t>(it->size);
+      m_chunkCallback(m_chunkCtx, &chunk);
+      chunk.offset += chunk.len;
+    }
+    freeTokenData(mt_token);
+    mt_token.clear();
+    kv->bytesRemain -= static_cast<uint32_t>(n);
+    m_buffer_reader->recycle();
+  }
+}
+
+
+// a STAT line of a counter is much shorter: a name and up to 20 digits
+static const size_t kMaxStatLine = 128;
+
+
+// stat_field_t by name, hashed to a table of many more slots than names.
+// Most names of a "stats" response are of no counter, and are told apart
+// in a probe or two.
+class StatFieldTable {
+ public:
+  // of the first and last 8 bytes and the length, which tell the names
+  // apart well enough
+  static size_t hash(const char* name, size_t len) {
+    uint64_t head = 0, tail = 0;
+    size_t n = MIN(len, 8);
+    memcpy(&head, name, n);
+    memcpy(&tail, name + len - n, n);
+    return static_cast<size_t>(((head ^ (tail * 31) ^ len) * 0x9E3779B97F4A7C15ULL) >> 56);
+  }
+
+  StatFieldTable() {
+    memset(m_slots, 0, sizeof m_slots);
+    for (uint8_t f = 0; f < STAT_FIELD_COUNT; f++) {
+      const char* name = keywords::kSTAT_FIELDS[f];
+      size_t i = hash(name, strlen(name));
+      while (m_slots[i] != 0) {
+        i = (i + 1) & kMask;
+      }
+      m_slots[i] = f + 1;
+    }
+  }
+
+  // -1 if name is of no counter
+  int find(const char* name, size_t len) const {
+    size_t i = hash(name, len);
+    for (; m_slots[i] != 0; i = (i + 1) & kMask) {
+      const char* s = keywords::kSTAT_FIELDS[m_slots[i] - 1];
+      if (strncmp(s, name, len) == 0 && s[len] == '\0') {
+        return m_slots[i] - 1;
+      }
+    }
+    return -1;
+  }
+
+ protected:
+  static const size_t kMask = 255; // hash() is 8 bits
+  uint8_t m_slots[kMask + 1]; // field + 1, 0 if empty
+};
+
+static const StatFieldTable kStatFieldTable;
+
+
+// NULL if no number starts at p, or if it does not fit in 64 bits
+static inline const char* parseUnsigned(const char* p, const char* end, uint64_t& value) {
+  const char* q = io::findNotDigit(p, end);
+  value = 0;
+  if (q == p || q == end || !io::parseDigits(p, q, value)) {
+    return NULL;
+  }
+  return q;
+}
+
+
+// The request key a VALUE line echoes. Hits come in request order and
+// misses are left out, so it is the first equal one from m_requestKeyIdx
+// on, those passed over were misses. NULL if there is none, as with a
+// server answering out of order, and the keys of the rest of the batch are
+// taken as echoed then.
+const struct iovec* PacketParser::matchRequestKey(const char* key, size_t len) {
+  size_t end = batchKeyEnd();
+  for (size_t i = m_requestKeyIdx; i < end; ++i) {
+    const struct iovec& iov = m_requestKeys[i];
+    if (iov.iov_len == len && memcmp(iov.iov_base, key, len) == 0) {
+      m_requestKeyIdx = i + 1;
+      return &iov;
+    }
+  }
+  m_requestKeyIdx = end;
+  return NULL;
+}
+
+
+// Takes "VALUE <key> <flags> <bytes> [<cas>]\r\n" in one pass if the whole
+// line is in the read block, as it mostly is. Returns false having read
+// nothing otherwise, for the state machine to take it step by step, and
+// to fail on it if it is broken. The key is that of the request if it
+// matches, and is not read then.
+bool PacketParser::parseValueLine() {
+  size_t len;
+  const char* begin = m_buffer_reader->contiguous(len);
+  if (begin == NULL || len < 6 || memcmp(begin, "VALUE ", 6) != 0) {
+    return false;
+  }
+  const char* end = begin + len;
+  const char* key = begin + 6;
+  const char* p = io::findEither(key, end, ' ', '\r');
+  if (p == key || p == end || *p != ' ') {
+    return false;
+  }
+  size_t keyLen = p - key;
+  uint64_t flags, bytes, casUnique = 0;
+  p = parseUnsigned(p + 1, end, flags);
+  if (p == NULL || *p != ' ') {
+    return false;
+  }
+  p = parseUnsigned(p + 1, end, bytes);
+  if (p != NULL && *p == ' ') {
+    p = parseUnsigned(p + 1, end, casUnique);
+  }
+  if (p == NULL || end - p < 2 || p[0] != '\r' || p[1] != '\n') {
+    return false;
+  }
+
+  // the line is all there, so none of these can fail
+  err_code_t err;
+  m_retrievalResults.emplace_back();
+  mt_kvPtr = &m_retrievalResults.back();
+  const struct iovec* requestKey = matchRequestKey(key, keyLen);
+  if (requestKey != NULL) {
+    mt_kvPtr->requestKey = static_cast<char*>(requestKey->iov_base);
+    m_buffer_reader->skipBytes(err, p + 2 - begin);
+  } else {
+    m_buffer_reader->skipBytes(err, 6);  // "VALUE "
+    m_buffer_reader->readBytes(err, keyLen, mt_token);
+    mt_kvPtr->key.assign(mt_token, *m_requestArena);
+    m_buffer_reader->skipBytes(err, p + 2 - (key + keyLen));
+  }
+  mt_kvPtr->key_len = static_cast<uint8_t>(keyLen);
+  mt_kvPtr->flags = static_cast<flags_t>(flags);
+  mt_kvPtr->bytes = mt_kvPtr->bytesRemain = static_cast<uint32_t>(bytes);
+  mt_kvPtr->cas_unique = casUnique;
+  m_state = FSM_GET_VALUE_REMAINING;
+  return true;
+}
+
+
+// "VA " in the read block, what most meta responses start with
+bool PacketParser::isMetaValueLine() {
+  size_t len;
+  const char* begin = m_buffer_reader->contiguous(len);
+  return len >= 3 && begin[0] == 'V' && begin[1] == 'A' && begin[2] == ' ';
+}
+
+
+// The requests before the one at end that the server was quiet about
+void PacketParser::processQuietResults(size_t end) {
+  if (m_quietResult == MSG_LIBMC_INVALID) {
+    m_requestKeyIdx = end;
+    return;
+  }
+  while (m_requestKeyIdx < end) {
+    processMessageResult(m_quietResult);
+  }
+}
+
+
+typedef struct {
+  uint64_t bytes;
+  uint64_t flags;
+  uint64_t casUnique;
+  uint64_t opaque;
+} meta_line_t;
+
+
+// Parses "<code> [<datalen>] <flags>*\r", a meta response line of n bytes
+// before its '\n'. Flags are a letter each, then a token. Those not asked
+// for, like the win and stale flags (W, X and Z), are passed over.
+static bool parseMetaLine(const char* line, size_t n, meta_line_t& ml) {
+  if (n < 3 || line[n - 1] != '\r') {
+    return false;
+  }
+  const char* end = line + n;  // the '\r' before end stops the last token
+  const char* p = line + 2;
+  if (line[0] == 'V' && line[1] == 'A') {
+    p = *p == ' ' ? parseUnsigned(p + 1, end, ml.bytes) : NULL;
+  }
+  while (p != NULL && *p == ' ') {
+    uint64_t* value = NULL;
+    switch (p[1]) {
+      case 'f':
+        value = &ml.flags;
+        break;
+      case 'c':
+        value = &ml.casUnique;
+        break;
+      case 'O':
+        value = &ml.opaque;
+        break;
+      default:
+        if (!isalpha(p[1])) {
+          return false;
+        }
+        break;
+    }
+    if (value != NULL) {
+      p = parseUnsigned(p + 2, end, *value);
+    } else {
+      p = io::findEither(p + 2, end, ' ', '\r');
+    }
+  }
+  return p != NULL && *p == '\r';
+}
+
+
+// Takes the response line of a meta command, whose opaque ("O") is the
+// index of its request key. Mostly the line is in the read block, and is
+// parsed in place.
+void PacketParser::processMetaLine(err_code_t& err) {
+  meta_line_t ml = {0, 0, 0, m_requestKeyIdx};
+  size_t n = 0;
+  const char* begin = m_buffer_reader->contiguousUntil('\n', n);
+  char* line = NULL;
+  if (begin != NULL) {
+    line = const_cast<char*>(begin);
+  } else {
+    n = m_buffer_reader->readUntil(err, '\n', mt_token);
+    if (err != RET_OK) {
+      return;
+    }
+    // joined, it is short
+    line = parseTokenData(mt_token, n);
+  }
+  // the code is taken before a joined line is freed, and only from a line
+  // parseMetaLine() found long enough to have one
+  bool valid = parseMetaLine(line, n, ml);
+  char c1 = '\0', c2 = '\0';
+  if (valid) {
+    c1 = line[0];
+    c2 = line[1];
+  } else {
+    log_err("meta response error: [%.*s]", static_cast<int>(n), line);
+  }
+  if (mt_token.empty()) {
+    m_buffer_reader->skipBytes(err, n + 1);
+  } else {
+    freeTokenData(mt_token);
+    if (mt_token.size() > 1) {
+      delete[] line;
+    }
+    mt_token.clear();
+    m_buffer_reader->skipBytes(err, 1);  // '\n'
+  }
+  assert(err == RET_OK);
+  if (!valid) {
+    err = RET_PROGRAMMING_ERR;
+    m_state = FSM_ERROR;
+    return;
+  }
+
+  if (c1 == 'M' && c2 == 'N') {
+    processQuietResults(batchKeyEnd());
+    m_state = FSM_END;
+    return;
+  }
+  if (ml.opaque < m_requestKeyIdx || ml.opaque >= batchKeyEnd()) {
+    log_err("meta response to no request: opaque %lu", static_cast<unsigned long>(ml.opaque));
+    err = RET_PROGRAMMING_ERR;
+    m_state = FSM_ERROR;
+    return;
+  }
+  processQuietResults(ml.opaque);
+  m_state = FSM_START;
+  if (c1 == 'V') {
+    if (m_mode == MODE_COUNTING) {
+      // the value of ma, on a line of its own
+      m_unsignedResults.push_back(unsigned_result_t());
+      m_state = FSM_INCR_DECR_START;
+      return;
+    }
+    const struct iovec& iov = m_requestKeys[m_requestKeyIdx++];
+    m_retrievalResults.emplace_back();
+    mt_kvPtr = &m_retrievalResults.back();
+    mt_kvPtr->requestKey = static_cast<char*>(iov.iov_base);
+    mt_kvPtr->key_len = static_cast<uint8_t>(iov.iov_len);
+    mt_kvPtr->flags = static_cast<flags_t>(ml.flags);
+    mt_kvPtr->bytes = mt_kvPtr->bytesRemain = static_cast<uint32_t>(ml.bytes);
+    mt_kvPtr->cas_unique = ml.casUnique;
+    m_state = FSM_GET_VALUE_REMAINING;
+  } else if (c1 == 'H') {
+    // "HD" is quiet, but for the hits of touch
+    processMessageResult(m_quietResult == MSG_NOT_FOUND ? MSG_TOUCHED : m_quietResult);
+  } else if (c2 == 'S') {
+    processMessageResult(MSG_NOT_STORED);
+  } else if (c2 == 'X') {
+    processMessageResult(MSG_EXISTS);
+  } else {
+    // "NF" and "EN"
+    processMessageResult(MSG_NOT_FOUND);
+  }
+}
+
+
+// Copies the next n bytes, which have all arrived, to out
+void PacketParser::copyBytes(char* out, size_t n) {
+  assert(m_buffer_reader->readLeft() >= n);
+  if (n == 0) {
+    return;
+  }
+  err_code_t err;
+  size_t len;
+  const char* begin = m_buffer_reader->contiguous(len);
+  if (begin != NULL && len >= n) {
+    memcpy(out, begin, n);
+    m_buffer_reader->skipBytes(err, n);
+    return;
+  }
+  m_buffer_reader->readBytes(err, n, mt_token);
+  for (TokenData::const_iterator it = mt_token.begin(); it != mt_token.end(); ++it) {
+    memcpy(out, it->block->at(it->offset), it->size);
+    out += it->size;
+  }
+  freeTokenData(mt_token);
+  mt_token.clear();
+}
+
+
+// Takes the 24 bytes header of a binary response. It is read in place, as
+// a struct, if it is in the read block, and copied out of the blocks if it
+// is split over two.
+void PacketParser::processBinaryHeader(err_code_t& err) {
+  err = RET_OK;
+  size_t len;
+  const char* begin = m_buffer_reader->contiguous(len);
+  if (begin != NULL && len >= sizeof(binary::header_t)) {
+    binary::decodeHeader(reinterpret_cast<const binary::header_t*>(begin), mt_binHeader);
+    m_buffer_reader->skipBytes(err, sizeof(binary::header_t));
+  } else if (m_buffer_reader->readLeft() >= sizeof(binary::header_t)) {
+    binary::header_t header;
+    copyBytes(reinterpret_cast<char*>(&header), sizeof header);
+    binary::decodeHeader(&header, mt_binHeader);
+  } else {
+    err = RET_INCOMPLETE_BUFFER_ERR;
+    return;
+  }
+  if (mt_binHeader.magic != binary::MAGIC_RESPONSE ||
+      mt_binHeader.bodyLen < mt_binHeader.extrasLen + mt_binHeader.keyLen) {
+    log_err("binary response error: magic 0x%02x, opcode 0x%02x", mt_binHeader.magic,
+            mt_binHeader.opcode);
+    err = RET_PROGRAMMING_ERR;
+    m_state = FSM_ERROR;
+    return;
+  }
+  m_state = FSM_BINARY_BODY;
+}
+
+
+// "<key> <value>\r" of STAT, or "<value>\r" of VERSION, as the text
+// protocol has them
+void PacketParser::processBinaryLine(size_t keyLen, size_t valueLen) {
+  size_t n = keyLen + (keyLen > 0 ? 1 : 0) + valueLen + 1;
+  char* line = m_requestArena->allocate(n);
+  copyBytes(line, keyLen);
+  if (keyLen > 0) {
+    line[keyLen] = ' ';
+    ++keyLen;
+  }
+  copyBytes(line + keyLen, valueLen);
+  line[n - 1] = '\r';
+  m_lineResults.emplace_back();
+  m_lineResults.back().assign(line, n);
+}
+
+
+// "<name> <value>\r" of a STAT line. Values of the stat_field_t counters
+// are kept, anything else is passed over.
+void PacketParser::parseStatLine(const char* line, size_t n) {
+  const char* end = line + n;
+  const char* sp = static_cast<const char*>(memchr(line, ' ', n));
+  if (sp == NULL) {
+    return;
+  }
+  int field = kStatFieldTable.find(line, sp - line);
+  uint64_t value;
+  if (field >= 0 && parseUnsigned(sp + 1, end, value) != NULL) {
+    m_serverStats.values[field] = value;
+    m_serverStats.present |= 1ULL << field;
+  }
+}
+
+
+// The line of FSM_STAT_START, parsed in place if it is all in the read
+// block. Else it is copied out, unless it is too long to be of a counter.
+void PacketParser::processTypedStat(err_code_t& err) {
+  err = RET_OK;
+  size_t n = 0;
+  const char* begin = m_buffer_reader->contiguousUntil('\n', n);
+  if (begin != NULL) {
+    parseStatLine(begin, n);
+    m_buffer_reader->skipBytes(err, n + 1);
+    return;
+  }
+  n = m_buffer_reader->readUntil(err, '\n', mt_token);
+  if (err != RET_OK) {
+    return;
+  }
+  char line[kMaxStatLine];
+  if (n <= sizeof line) {
+    char* out = line;
+    for (TokenData::const_iterator it = mt_token.begin(); it != mt_token.end(); ++it) {
+      memcpy(out, it->block->at(it->offset), it->size);
+      out += it->size;
+    }
+    parseStatLine(line, n);
+  }
+  freeTokenData(mt_token);
+  mt_token.clear();
+  m_buffer_reader->skipBytes(err, 1);  // '\n'
+}
+
+
+// a binary STAT response as the text line of processTypedStat()
+void PacketParser::processBinaryStat(size_t keyLen, size_t valueLen) {
+  char line[kMaxStatLine];
+  size_t n = keyLen + 1 + valueLen + 1;
+  if (n > sizeof line) {
+    err_code_t err;
+    m_buffer_reader->skipBytes(err, keyLen + valueLen);
+    return;
+  }
+  copyBytes(line, keyLen);
+  line[keyLen] = ' ';
+  copyBytes(line + keyLen + 1, valueLen);
+  line[n - 1] = '\r';
+  parseStatLine(line, n);
+}
+
+
+// Takes the body of the binary response of mt_binHeader. The opaque of a
+// response to a key is the index of that key, as for meta commands. A
+// value is left to FSM_GET_VALUE_REMAINING, anything else is short and is
+// taken once it has all arrived.
+void PacketParser::processBinaryBody(err_code_t& err) {
+  err = RET_OK;
+  const binary::header_t& h = mt_binHeader;
+  size_t valueLen = h.bodyLen - h.extrasLen - h.keyLen;
+  bool getHit = h.status == binary::STATUS_OK &&
+    (h.opcode == binary::OP_GETQ || h.opcode == binary::OP_GET ||
+     h.opcode == binary::OP_GETKQ || h.opcode == binary::OP_GETK);
+  if (m_buffer_reader->readLeft() < (getHit ? h.bodyLen - valueLen : h.bodyLen)) {
+    err = RET_INCOMPLETE_BUFFER_ERR;
+    return;
+  }
+  char extras[UINT8_MAX];
+  copyBytes(extras, h.extrasLen);
+
+  // NOOP, VERSION, STAT and FLUSH are not of a key
+  m_state = FSM_START;
+  switch (h.opcode) {
+    case binary::OP_NOOP:
+      processQuietResults(batchKeyEnd());
+      m_state = FSM_END;
+      return;
+    case binary::OP_VERSION:
+      processBinaryLine(h.keyLen, valueLen);
+      m_state = FSM_END;
+      return;
+    case binary::OP_STAT:
+      // the last one has no key
+      if (h.keyLen == 0) {
+        m_state = FSM_END;
+      } else if (m_typedStats) {
+        processBinaryStat(h.keyLen, valueLen);
+      } else {
+        processBinaryLine(h.keyLen, valueLen);
+      }
+      return;
+    case binary::OP_FLUSH:
+      if (h.status == binary::STATUS_OK) {
+        processMessageResult(MSG_OK);
+        m_state = FSM_END;
+        return;
+      }
+      log_err("binary response error: opcode 0x%02x, status 0x%02x", h.opcode, h.status);
+      err = RET_MC_SERVER_ERR;
+      m_state = FSM_ERROR;
+      return;
+    default:
+      break;
+  }
+
+  // a key echoed by GETK and GETKQ is that of the opaque
+  if (h.keyLen > 0) {
+    m_buffer_reader->skipBytes(err, h.keyLen);
+  }
+  if (h.opaque == binary::kNoreplyOpaque && !getHit) {
+    // of a noreply request sent before the ones parsed now
+    if (valueLen > 0) {
+      m_buffer_reader->skipBytes(err, valueLen);
+    }
+    return;
+  }
+  if (h.opaque < m_requestKeyIdx || h.opaque >= batchKeyEnd()) {
+    log_err("binary response to no request: opcode 0x%02x, opaque %u", h.opcode, h.opaque);
+    err = RET_PROGRAMMING_ERR;
+    m_state = FSM_ERROR;
+    return;
+  }
+  processQuietResults(h.opaque);
+  if (getHit) {
+    const struct iovec& iov = m_requestKeys[m_requestKeyIdx++];
+    m_retrievalResults.emplace_back();
+    mt_kvPtr = &m_retrievalResults.back();
+    mt_kvPtr->requestKey = static_cast<char*>(iov.iov_base);
+    mt_kvPtr->key_len = static_cast<uint8_t>(iov.iov_len);
+    mt_kvPtr->flags = h.extrasLen >= 4 ? binary::get32(extras) : 0;
+    mt_kvPtr->bytes = mt_kvPtr->bytesRemain = static_cast<uint32_t>(valueLen);
+    mt_kvPtr->cas_unique = h.cas;
+    m_state = FSM_GET_VALUE_REMAINING;
+    return;
+  }
+  if ((h.opcode == binary::OP_INCREMENT || h.opcode == binary::OP_DECREMENT) &&
+      h.status == binary::STATUS_OK && valueLen == 8) {
+    char value[8];
+    copyBytes(value, 8);
+    const struct iovec& iov = m_requestKeys[m_requestKeyIdx++];
+    m_unsignedResults.push_back(unsigned_result_t());
+    unsigned_result_t* inner_rst = &m_unsignedResults.back();
+    inner_rst->key = static_cast<char*>(iov.iov_base);
+    inner_rst->key_len = iov.iov_len;
+    inner_rst->value = binary::get64(value);
+    return;
+  }
+  // anything else has no value but the message of a failure
+  if (valueLen > 0) {
+    m_buffer_reader->skipBytes(err, valueLen);
+  }
+
+  message_result_type tp = MSG_LIBMC_INVALID;
+  switch (h.status) {
+    case binary::STATUS_OK:
+      switch (h.opcode) {
+        case binary::OP_DELETE:
+        case binary::OP_DELETEQ:
+          tp = MSG_DELETED;
+          break;
+        case binary::OP_TOUCH:
+          tp = MSG_TOUCHED;
+          break;
+        case binary::OP_GET:
+        case binary::OP_GETQ:
+        case binary::OP_GETK:
+        case binary::OP_GETKQ:
+        case binary::OP_INCREMENT:
+        case binary::OP_DECREMENT:
+          break;
+        default:
+          tp = MSG_STORED;
+          break;
+      }
+      break;
+    case binary::STATUS_KEY_NOT_FOUND:
+    case binary::STATUS_KEY_EXISTS:
+    case binary::STATUS_ITEM_NOT_STORED:
+      switch (h.opcode) {
+        case binary::OP_GET:
+        case binary::OP_GETQ:
+        case binary::OP_GETK:
+        case binary::OP_GETKQ:
+          // a miss, answered only if not quiet
+          ++m_requestKeyIdx;
+          return;
+        case binary::OP_SET:
+        case binary::OP_SETQ:
+          // a SET with a cas tells what "cas" would
+          tp = h.status == binary::STATUS_KEY_NOT_FOUND ? MSG_NOT_FOUND :
+            h.status == binary::STATUS_KEY_EXISTS ? MSG_EXISTS : MSG_NOT_STORED;
+          break;
+        case binary::OP_ADD:
+        case binary::OP_ADDQ:
+        case binary::OP_REPLACE:
+        case binary::OP_REPLACEQ:
+        case binary::OP_APPEND:
+        case binary::OP_APPENDQ:
+        case binary::OP_PREPEND:
+        case binary::OP_PREPENDQ:
+          tp = MSG_NOT_STORED;
+          break;
+        default:
+          if (h.status == binary::STATUS_KEY_NOT_FOUND) {
+            tp = MSG_NOT_FOUND;
+          }
+          break;
+      }
+      break;
+    default:
+      break;
+  }
+  if (tp == MSG_LIBMC_INVALID) {
+    // as "CLIENT_ERROR" or "SERVER_ERROR" would be
+    log_err("binary response error: opcode 0x%02x, status 0x%02x", h.opcode, h.status);
+    err = h.status == binary::STATUS_VALUE_TOO_LARGE ||
+      h.status == binary::STATUS_OUT_OF_MEMORY ? RET_MC_SERVER_ERR : RET_PROGRAMMING_ERR;
+    m_state = FSM_ERROR;
+    return;
+  }
+  processMessageResult(tp);
+}
+
+
 void PacketParser::setBufferReader(BufferReader* reader) {
   m_buffer_reader = reader;
 }
 
 
+void PacketParser::setRequestArena(RequestArena* arena) {
+  m_requestArena = arena;
+}
+
+
+void PacketParser::setChunkCallback(retrieval_chunk_cb_t cb, void* ctx) {
+  m_chunkCallback = cb;
+  m_chunkCtx = ctx;
+}
+
+
+size_t PacketParser::resultBytes() const {
+  return m_retrievalResults.capacity() * sizeof(types::RetrievalResult) +
+    m_messageResults.capacity() * sizeof(message_result_t) +
+    m_lineResults.capacity() * sizeof(types::LineResult) +
+    m_unsignedResults.capacity() * sizeof(unsigned_result_t) +
+    m_requestKeys.capacity() * sizeof(struct iovec);
+}
+
+
+void PacketParser::shrink() {
+  if (!m_requestKeys.empty() || !m_retrievalResults.empty() || !m_messageResults.empty() ||
+      !m_lineResults.empty() || !m_unsignedResults.empty()) {
+    return;
+  }
+  types::RetrievalResultList().swap(m_retrievalResults);
+  types::MessageResultList().swap(m_messageResults);
+  types::LineResultList().swap(m_lineResults);
+  types::UnsignedResultList().swap(m_unsignedResults);
+  std::vector<struct iovec>().swap(m_requestKeys);
+}
+
+
 void PacketParser::addRequestKey(const char* const key, const size_t len) {
   // log_info("add request key: %.*s", static_cast<int>(len), key);
   struct iovec iov = {const_cast<char*>(key), len};
@@ -88,6 +786,138 @@ struct iovec* PacketParser::currentRequestKey() {
   return m_requestKeyIdx == m_requestKeys.size() ? NULL : &m_requestKeys[m_requestKeyIdx];
 }
 
+// Queue the requests added since the last batch as the batch of `ticket`,
+// in the mode just set, behind those still parsed. Returns how many
+// responses it waits for.
+size_t PacketParser::pushBatch(ticket_t ticket, size_t iovecEnd) {
+  size_t keyBegin = m_batches.empty() ? 0 : m_batches.back().requestKeyEnd;
+  pending_batch_t batch;
+  batch.ticket = ticket;
+  batch.mode = m_mode;
+  batch.quietResult = m_quietResult;
+  batch.requestKeyEnd = m_requestKeys.size();
+  batch.iovecEnd = iovecEnd;
+  batch.retrievalEnd = 0;
+  batch.messageEnd = 0;
+  m_batches.push_back(batch);
+  m_mode = m_batches[m_batchIdx].mode;
+  m_quietResult = m_batches[m_batchIdx].quietResult;
+  if (m_batchIdx + 1 == m_batches.size()) {
+    // the batches before are parsed, this one is next
+    m_state = FSM_START;
+    if (canEndParse()) {
+      // it waits for no response
+      nextBatch();
+    }
+  }
+  return batch.mode == MODE_COUNTING ? batch.requestKeyEnd - keyBegin : 1;
+}
+
+
+// The current batch is parsed, move on to the next one still waiting for
+// responses (a batch of noreply requests waits for none).
+bool PacketParser::nextBatch() {
+  while (m_batchIdx < m_batches.size()) {
+    pending_batch_t& batch = m_batches[m_batchIdx];
+    batch.retrievalEnd = m_retrievalResults.size();
+    batch.messageEnd = m_messageResults.size();
+    if (++m_batchIdx == m_batches.size()) {
+      return false;
+    }
+    m_mode = m_batches[m_batchIdx].mode;
+    m_quietResult = m_batches[m_batchIdx].quietResult;
+    m_state = FSM_START;
+    if (!canEndParse()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+size_t PacketParser::batchesDone(size_t iovecsSent) {
+  size_t n = 0;
+  while (n < m_batchIdx && m_batches[n].iovecEnd <= iovecsSent) {
+    ++n;
+  }
+  return n;
+}
+
+
+bool PacketParser::batchDone(ticket_t ticket, size_t iovecsSent) {
+  size_t idx = 0;
+  if (findBatch(ticket, idx) == NULL) {
+    return true;
+  }
+  return idx < m_batchIdx && m_batches[idx].iovecEnd <= iovecsSent;
+}
+
+
+bool PacketParser::rewindBatches(size_t iovecsSent, size_t& iovecBegin) {
+  size_t first = batchesDone(iovecsSent);
+  if (m_batchIdx < m_batches.size()) {
+    size_t keyBegin = m_batchIdx == 0 ? 0 : m_batches[m_batchIdx - 1].requestKeyEnd;
+    size_t retrievalBegin = m_batchIdx == 0 ? 0 : m_batches[m_batchIdx - 1].retrievalEnd;
+    size_t messageBegin = m_batchIdx == 0 ? 0 : m_batches[m_batchIdx - 1].messageEnd;
+    if (m_requestKeyIdx != keyBegin || !mt_token.empty() ||
+        (m_state != FSM_START && !IS_END_STATE(m_state)) ||
+        m_retrievalResults.size() != retrievalBegin || m_messageResults.size() != messageBegin) {
+      return false;
+    }
+  }
+  iovecBegin = first == 0 ? 0 : m_batches[first - 1].iovecEnd;
+  return true;
+}
+
+
+void PacketParser::dropBatches() {
+  while (m_batchIdx < m_batches.size()) {
+    pending_batch_t& batch = m_batches[m_batchIdx++];
+    batch.retrievalEnd = m_retrievalResults.size();
+    batch.messageEnd = m_messageResults.size();
+  }
+  freeTokenData(mt_token);
+  mt_token.clear();
+  mt_kvPtr = NULL;
+  m_requestKeyIdx = m_requestKeys.size();
+  m_state = FSM_START;
+}
+
+
+const pending_batch_t* PacketParser::findBatch(ticket_t ticket, size_t& idx) {
+  for (idx = 0; idx < m_batches.size(); idx++) {
+    if (m_batches[idx].ticket == ticket) {
+      return &m_batches[idx];
+    }
+  }
+  return NULL;
+}
+
+
+// Results of the batch of `ticket` are [begin, end) of the result list,
+// partial if the connection failed while parsing it.
+void PacketParser::batchRetrievalRange(ticket_t ticket, size_t& begin, size_t& end) {
+  size_t idx = 0;
+  begin = end = 0;
+  if (findBatch(ticket, idx) == NULL || idx > m_batchIdx) {
+    return;
+  }
+  begin = idx == 0 ? 0 : m_batches[idx - 1].retrievalEnd;
+  end = idx < m_batchIdx ? m_batches[idx].retrievalEnd : m_retrievalResults.size();
+}
+
+
+void PacketParser::batchMessageRange(ticket_t ticket, size_t& begin, size_t& end) {
+  size_t idx = 0;
+  begin = end = 0;
+  if (findBatch(ticket, idx) == NULL || idx > m_batchIdx) {
+    return;
+  }
+  begin = idx == 0 ? 0 : m_batches[idx - 1].messageEnd;
+  end = idx < m_batchIdx ? m_batches[idx].messageEnd : m_messageResults.size();
+}
+
+
 void PacketParser::process_packets(err_code_t& err) {
   // NOTE: always return with err RET_INCOMPLETE_BUFFER_ERR if not all packets are recved.
   err = RET_OK;
@@ -95,6 +925,11 @@ void PacketParser::process_packets(err_code_t& err) {
   if (IS_END_STATE(m_state)) {
     m_state = FSM_START;
   }
+  if (mt_kvPtr != NULL) {
+    // a value is half received, and a batch submitted since may have
+    // reserved the results elsewhere
+    mt_kvPtr = &m_retrievalResults.back();
+  }
 
 #define SKIP_BYTES(N) \
   do { \
@@ -112,10 +947,27 @@ void PacketParser::process_packets(err_code_t& err) {
     } \
   } while (0)
 
-  while (!canEndParse()) {
+  while (!canEndParse() || nextBatch()) {
     switch (m_state) {
       case FSM_START:
         {
+          if (m_mode == MODE_BINARY) {
+            processBinaryHeader(err);
+            if (err != RET_OK) {
+              return;
+            }
+            break;
+          }
+          if (parseValueLine()) {
+            break;
+          }
+          if (isMetaValueLine()) {
+            processMetaLine(err);
+            if (err != RET_OK) {
+              return;
+            }
+            break;
+          }
           this->start_state(err);
           if (err != RET_OK) {
             return;
@@ -125,11 +977,13 @@ void PacketParser::process_packets(err_code_t& err) {
       case FSM_GET_START: // got "VALUE "
         {
           mt_kvPtr = &m_retrievalResults.back();
-          mt_kvPtr->key.clear();
-          mt_kvPtr->key_len = m_buffer_reader->readUntil(err, ' ', mt_kvPtr->key);
+          // a key never holds '\r', so a broken line ends it rather than
+          // running on into the value
+          mt_kvPtr->key_len = m_buffer_reader->readUntil(err, ' ', '\r', mt_token);
           if (err != RET_OK) {
             return;
           }
+          mt_kvPtr->key.assign(mt_token, *m_requestArena);
           SKIP_BYTES(1);  // ' '
           m_state = FSM_GET_KEY;
         }
@@ -181,28 +1035,38 @@ void PacketParser::process_packets(err_code_t& err) {
         break;
       case FSM_GET_VALUE_REMAINING: // not got <data block> + "\r\n"
         {
+          if (m_chunkCallback != NULL) {
+            streamValue(err);
+            if (err != RET_OK) {
+              return;
+            }
+            if (m_mode != MODE_BINARY) {
+              SKIP_BYTES(2); // "\r\n"
+            }
+            // nothing is kept for a streamed value
+            m_retrievalResults.pop_back();
+            mt_kvPtr = NULL;
+            mt_streamKey = NULL;
+            m_state = FSM_START;
+            break;
+          }
           assert(mt_kvPtr != NULL && (mt_kvPtr->bytesRemain == mt_kvPtr->bytes || mt_kvPtr->bytesRemain == 0));
           if (mt_kvPtr->bytesRemain > 0) {
-            mt_kvPtr->data_block.clear();
             if (m_buffer_reader->readLeft() < mt_kvPtr->bytes + 2) {
               m_buffer_reader->setNextPreferedDataBlockSize(mt_kvPtr->bytes + 2 - m_buffer_reader->readLeft());
             }
-            m_buffer_reader->readBytes(err, mt_kvPtr->bytes, mt_kvPtr->data_block);
+            m_buffer_reader->readBytes(err, mt_kvPtr->bytes, mt_token);
             if (err != RET_OK) {
               return;
             }
+            mt_kvPtr->data_block.assign(mt_token, *m_requestArena);
             mt_kvPtr->bytesRemain = 0;
           }
 
           if (mt_kvPtr->bytesRemain == 0) {
-            SKIP_BYTES(2); // "\r\n"
-#ifndef NDEBUG
-            char* _k = parseTokenData(mt_kvPtr->key, mt_kvPtr->key_len);
-            // log_debug("got %.*s", static_cast<int>(mt_kvPtr->key_len), _k);
-            if (mt_kvPtr->key.size() > 1) {
-              delete[] _k;
+            if (m_mode != MODE_BINARY) {
+              SKIP_BYTES(2); // "\r\n", binary values have none
             }
-#endif
             mt_kvPtr = NULL;
             m_state = FSM_START;
           }
@@ -233,6 +1097,24 @@ void PacketParser::process_packets(err_code_t& err) {
         }
         break;
 
+      case FSM_META_LINE:
+        {
+          processMetaLine(err);
+          if (err != RET_OK) {
+            return;
+          }
+        }
+        break;
+
+      case FSM_BINARY_BODY:
+        {
+          processBinaryBody(err);
+          if (err != RET_OK) {
+            return;
+          }
+        }
+        break;
+
       case FSM_VER_START:
         {
           processLineResult(err);
@@ -244,7 +1126,11 @@ void PacketParser::process_packets(err_code_t& err) {
         break;
       case FSM_STAT_START:
         {
-          processLineResult(err);
+          if (m_typedStats) {
+            processTypedStat(err);
+          } else {
+            processLineResult(err);
+          }
           if (err != RET_OK) {
             return;
           }
@@ -292,15 +1178,22 @@ int PacketParser::start_state(err_code_t& err) {
         if (err != RET_OK) {
           return 0;
         }
-        if (c2 == 'A') {
+        const char c3 = m_buffer_reader->peek(err, 2);
+        if (err != RET_OK) {
+          return 0;
+        }
+        if (c2 == 'A' && c3 != 'L') {
+          // VA, of meta commands
+          m_state = FSM_META_LINE;
+        } else if (c2 == 'A') {
           // VALUE
           EXPECT_BYTES("VALUE ", 6);
-          m_retrievalResults.push_back(types::RetrievalResult());
+          m_retrievalResults.emplace_back();
           m_state = FSM_GET_START;
         } else if (c2 == 'E') {
           // VERSION
           EXPECT_BYTES("VERSION ", 8);
-          m_lineResults.push_back(types::LineResult());
+          m_lineResults.emplace_back();
           m_state = FSM_VER_START;
         }
       }
@@ -329,14 +1222,24 @@ int PacketParser::start_state(err_code_t& err) {
           freeTokenData(err_td);
           err = RET_PROGRAMMING_ERR;
           m_state = FSM_ERROR;
-        } else if (c2 == 'N') {
+          break;
+        }
+        const char c3 = m_buffer_reader->peek(err, 2);
+        if (err != RET_OK) {
+          return 0;
+        }
+        if (c2 == 'N' && c3 == 'D') {
           // END
           EXPECT_BYTES("END\r\n", 5);
+          processQuietResults(batchKeyEnd());  // the misses after the last hit
           m_state = FSM_END;
-        } else if (c2 == 'X') {
+        } else if (c2 == 'X' && c3 == 'I') {
           // EXISTS
           EXPECT_BYTES("EXISTS\r\n", 8);
           processMessageResult(MSG_EXISTS);
+        } else if (c2 == 'N' || c2 == 'X') {
+          // EN and EX, of meta commands
+          m_state = FSM_META_LINE;
         }
       }
       break;
@@ -366,7 +1269,9 @@ int PacketParser::start_state(err_code_t& err) {
           } else {
             // STAT
             EXPECT_BYTES("STAT ", 5);
-            m_lineResults.push_back(types::LineResult());
+            if (!m_typedStats) {
+              m_lineResults.emplace_back();
+            }
             m_state = FSM_STAT_START;
           }
         } else {
@@ -398,6 +1303,15 @@ int PacketParser::start_state(err_code_t& err) {
       break;
     case 'N':
       {
+        const char c2 = m_buffer_reader->peek(err, 1);
+        if (err != RET_OK) {
+          return 0;
+        }
+        if (c2 != 'O') {
+          // NF and NS, of meta commands
+          m_state = FSM_META_LINE;
+          break;
+        }
         const char c5 = m_buffer_reader->peek(err, 4);
         if (err != RET_OK) {
           return 0;
@@ -414,6 +1328,13 @@ int PacketParser::start_state(err_code_t& err) {
         }
       }
       break;
+    case 'H':
+    case 'M':
+      {
+        // HD and MN, of meta commands
+        m_state = FSM_META_LINE;
+      }
+      break;
     case 'T':
       {
         // TOUCHED
@@ -475,11 +1396,18 @@ void PacketParser::reset() {
   m_messageResults.clear();
   m_lineResults.clear();
   m_unsignedResults.clear();
+  m_typedStats = false;
+  memset(&m_serverStats, 0, sizeof m_serverStats);
 
+  mt_kvPtr = NULL;
+  mt_streamKey = NULL;
   m_state = FSM_START;
   m_mode = MODE_UNDEFINED;
+  m_quietResult = MSG_LIBMC_INVALID;
   m_expectedResultCount = 0;
   m_requestKeyIdx = 0;
+  m_batches.clear();
+  m_batchIdx = 0;
 }
 
 
@@ -488,9 +1416,17 @@ void PacketParser::rewind() {
   m_messageResults.clear();
   m_lineResults.clear();
   m_unsignedResults.clear();
+  memset(&m_serverStats, 0, sizeof m_serverStats);
 
+  mt_kvPtr = NULL;
+  mt_streamKey = NULL;
   m_state = FSM_START;
   m_requestKeyIdx = 0;
+  m_batchIdx = 0;
+  if (!m_batches.empty()) {
+    m_mode = m_batches.front().mode;
+    m_quietResult = m_batches.front().quietResult;
+  }
 }
 
 
@@ -504,6 +1440,11 @@ types::MessageResultList* PacketParser::getMessageResults() {
 }
 
 
+const server_stats_t& PacketParser::getServerStats() {
+  return m_serverStats;
+}
+
+
 types::LineResultList* PacketParser::getLineResults() {
   return &m_lineResults;
 }
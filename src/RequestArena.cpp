@@ -0,0 +1,83 @@
+#include "RequestArena.h"
+#include "Common.h"
+
+namespace douban {
+namespace mc {
+
+static const size_t kAlignment = 8;
+
+
+RequestArena::RequestArena()
+  : m_chunkIdx(0), m_chunkOffset(0), m_largeBytes(0), m_allocatedBytes(0) {
+}
+
+
+RequestArena::~RequestArena() {
+  reset();
+  for (size_t i = 0; i < m_chunks.size(); ++i) {
+    delete[] m_chunks[i];
+  }
+}
+
+
+char* RequestArena::allocate(size_t len) {
+  len = (len + kAlignment - 1) & ~(kAlignment - 1);
+  m_allocatedBytes += len;
+  if (len > MC_REQUEST_ARENA_CHUNK_SIZE / 4) {
+    // would waste too much of a chunk
+    m_largeChunks.push_back(new char[len]);
+    m_largeBytes += len;
+    return m_largeChunks.back();
+  }
+
+  if (m_chunks.empty()) {
+    m_chunks.push_back(new char[MC_REQUEST_ARENA_CHUNK_SIZE]);
+  } else if (m_chunkOffset + len > MC_REQUEST_ARENA_CHUNK_SIZE) {
+    if (++m_chunkIdx == m_chunks.size()) {
+      m_chunks.push_back(new char[MC_REQUEST_ARENA_CHUNK_SIZE]);
+    }
+    m_chunkOffset = 0;
+  }
+  char* ptr = m_chunks[m_chunkIdx] + m_chunkOffset;
+  m_chunkOffset += len;
+  return ptr;
+}
+
+
+void RequestArena::reset() {
+  for (size_t i = 0; i < m_largeChunks.size(); ++i) {
+    delete[] m_largeChunks[i];
+  }
+  m_largeChunks.clear();
+  m_largeBytes = 0;
+
+  size_t nKeep = MC_REQUEST_ARENA_RETAIN_BYTES / MC_REQUEST_ARENA_CHUNK_SIZE;
+  for (size_t i = nKeep; i < m_chunks.size(); ++i) {
+    delete[] m_chunks[i];
+  }
+  if (m_chunks.size() > nKeep) {
+    m_chunks.resize(nKeep);
+  }
+  m_chunkIdx = 0;
+  m_chunkOffset = 0;
+  m_allocatedBytes = 0;
+}
+
+
+void RequestArena::shrink() {
+  if (m_allocatedBytes > 0) {
+    return;
+  }
+  for (size_t i = 0; i < m_chunks.size(); ++i) {
+    delete[] m_chunks[i];
+  }
+  std::vector<char*>().swap(m_chunks);
+}
+
+
+size_t RequestArena::retainedBytes() const {
+  return m_chunks.size() * MC_REQUEST_ARENA_CHUNK_SIZE + m_largeBytes;
+}
+
+} // namespace mc
+} // namespace douban
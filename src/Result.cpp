@@ -12,47 +12,71 @@ RetrievalResult::RetrievalResult() {
   this->bytesRemain = this->bytes + 1;
   this->flags = 0;
   this->key_len = 0;
-  m_inner.key = NULL;
-  m_inner.data_block = NULL;
+  this->requestKey = NULL;
+  m_inner = NULL;
 }
 
-RetrievalResult::RetrievalResult(const RetrievalResult& other) {
-  copyTokenData(other.key, this->key);
-  copyTokenData(other.data_block, this->data_block);
+RetrievalResult::RetrievalResult(RetrievalResult&& other) noexcept {
+  moveTokenData(other.key, this->key);
+  moveTokenData(other.data_block, this->data_block);
 
+  this->requestKey = other.requestKey;
   this->cas_unique = other.cas_unique;
   this->bytesRemain = other.bytesRemain;
   this->bytes = other.bytes;
   this->flags = other.flags;
   this->key_len = other.key_len;
-  this->m_inner.key = NULL;
-  this->m_inner.data_block = NULL;
+  this->m_inner = other.m_inner; // in the arena
 }
 
 
 RetrievalResult::~RetrievalResult() {
-  if (key.size() > 1) { // copy happened
-    delete[] m_inner.key;
-  }
-  if (data_block.size() > 1) {
-    delete[] m_inner.data_block;
-  }
   freeTokenData(key);
   freeTokenData(data_block);
 }
 
-retrieval_result_t* RetrievalResult::inner() {
-  if (m_inner.key == NULL) {
-    m_inner.key = parseTokenData(this->key, this->key_len);
+retrieval_result_t* RetrievalResult::inner(RequestArena& arena) {
+  if (m_inner == NULL) {
+    m_inner = reinterpret_cast<retrieval_result_t*>(arena.allocate(sizeof(retrieval_result_t)));
+    m_inner->key = this->requestKey != NULL ? this->requestKey :
+      parseTokenData(this->key, this->key_len, arena);
+    m_inner->data_block = parseTokenData(this->data_block, this->bytes, arena);
+  }
+  m_inner->cas_unique = this->cas_unique; // 8B
+  m_inner->bytes = this->bytes; // 4B
+  m_inner->flags = this->flags;  // 2B
+  m_inner->key_len = this->key_len; // 1B
+  return m_inner;
+}
+
+
+fragmented_retrieval_result_t* RetrievalResult::fragmented(RequestArena& arena) {
+  fragmented_retrieval_result_t* rst = reinterpret_cast<fragmented_retrieval_result_t*>(
+    arena.allocate(sizeof(fragmented_retrieval_result_t)));
+  if (m_inner != NULL) {
+    rst->key = m_inner->key;
+  } else if (this->requestKey != NULL) {
+    rst->key = this->requestKey;
+  } else {
+    rst->key = parseTokenData(this->key, this->key_len, arena);
   }
-  if (m_inner.data_block == NULL) {
-    m_inner.data_block = parseTokenData(this->data_block, this->bytes);
+  rst->n_fragments = static_cast<uint32_t>(this->data_block.size());
+  rst->fragments = NULL;
+  if (rst->n_fragments > 0) {
+    rst->fragments = reinterpret_cast<data_fragment_t*>(
+      arena.allocate(rst->n_fragments * sizeof(data_fragment_t)));
+    size_t i = 0;
+    for (io::TokenSlices::const_iterator it = this->data_block.begin();
+         it != this->data_block.end(); ++it, ++i) {
+      rst->fragments[i].ptr = it->block->at(it->offset);
+      rst->fragments[i].len = it->size;
+    }
   }
-  m_inner.cas_unique = this->cas_unique; // 8B
-  m_inner.bytes = this->bytes; // 4B
-  m_inner.flags = this->flags;  // 2B
-  m_inner.key_len = this->key_len; // 1B
-  return &m_inner;
+  rst->cas_unique = this->cas_unique;
+  rst->bytes = this->bytes;
+  rst->flags = this->flags;
+  rst->key_len = this->key_len;
+  return rst;
 }
 
 
@@ -61,29 +85,32 @@ LineResult::LineResult() {
   this->line_len = 0;
 }
 
-LineResult::LineResult(const LineResult& other) {
+LineResult::LineResult(LineResult&& other) noexcept {
   this->line_len = other.line_len;
-  copyTokenData(other.line, this->line);
-  this->m_inner = NULL;
+  moveTokenData(other.line, this->line);
+  this->m_inner = other.m_inner;
 }
 
 
 LineResult::~LineResult() {
-  if (this->line.size() > 1) {
-    delete[] this->m_inner;
-  }
   freeTokenData(this->line);
 }
 
-char* LineResult::inner(size_t& n) {
+char* LineResult::inner(size_t& n, RequestArena& arena) {
   if (this->m_inner == NULL) {
-    this->m_inner = parseTokenData(this->line, this->line_len);
+    this->m_inner = parseTokenData(this->line, this->line_len, arena);
   }
   n = this->line_len - 1;  // NOTE: LineResult is always ends with '\r', which should be ignored
   return this->m_inner;
 }
 
 
+void LineResult::assign(char* joined, size_t n) {
+  this->m_inner = joined;
+  this->line_len = n;
+}
+
+
 void delete_broadcast_result(broadcast_result_t* ptr) {
   if (ptr->lines) {
     delete[] ptr->lines;
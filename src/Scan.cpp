@@ -0,0 +1,126 @@
+#include "Scan.h"
+
+#ifdef MC_USE_SSE2_SCAN
+#include <immintrin.h>
+#endif
+
+namespace douban {
+namespace mc {
+namespace io {
+
+#ifdef MC_USE_SSE2_SCAN
+
+static bool hasAvx2() {
+  // this may run before the constructor that sets up cpu_supports
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+
+static const bool s_hasAvx2 = hasAvx2();
+
+
+// The masks have a bit set for every byte that matches. Each kernel scans
+// whole vectors from p on, and returns the match, or NULL with p left at
+// the first byte not scanned.
+__attribute__((target("avx2")))
+static const char* findEitherAvx2(const char*& p, const char* end, char c1, char c2) {
+  const __m256i v1 = _mm256_set1_epi8(c1);
+  const __m256i v2 = _mm256_set1_epi8(c2);
+  for (; p + 32 <= end; p += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(
+      _mm256_or_si256(_mm256_cmpeq_epi8(v, v1), _mm256_cmpeq_epi8(v, v2))));
+    if (mask != 0) {
+      return p + __builtin_ctz(mask);
+    }
+  }
+  return NULL;
+}
+
+
+__attribute__((target("avx2")))
+static const char* findNotDigitAvx2(const char*& p, const char* end) {
+  const __m256i zero = _mm256_set1_epi8('0');
+  const __m256i nine = _mm256_set1_epi8(9);
+  for (; p + 32 <= end; p += 32) {
+    __m256i d = _mm256_sub_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)), zero);
+    unsigned mask = ~static_cast<unsigned>(_mm256_movemask_epi8(
+      _mm256_cmpeq_epi8(_mm256_min_epu8(d, nine), d)));
+    if (mask != 0) {
+      return p + __builtin_ctz(mask);
+    }
+  }
+  return NULL;
+}
+
+
+static inline unsigned eitherMask(const char* p, char c1, char c2) {
+  __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+  return static_cast<unsigned>(_mm_movemask_epi8(
+    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(c1)), _mm_cmpeq_epi8(v, _mm_set1_epi8(c2)))));
+}
+
+
+static inline unsigned notDigitMask(const char* p) {
+  __m128i d = _mm_sub_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)),
+                           _mm_set1_epi8('0'));
+  return ~static_cast<unsigned>(_mm_movemask_epi8(
+    _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d))) & 0xFFFF;
+}
+
+
+// Past the whole vectors, the last 16 bytes before end are loaded again,
+// overlapping what was scanned already. They are readable, as the caller
+// scanned 16 bytes before begin.
+#define SCAN_REST(AVX2_KERNEL, MASK) \
+  do { \
+    const char* p = begin; \
+    if (s_hasAvx2) { \
+      const char* found = (AVX2_KERNEL); \
+      if (found != NULL) { \
+        return found; \
+      } \
+    } \
+    for (; p + 16 <= end; p += 16) { \
+      const char* at = p; \
+      unsigned mask = (MASK); \
+      if (mask != 0) { \
+        return p + __builtin_ctz(mask); \
+      } \
+    } \
+    if (p == end) { \
+      return end; \
+    } \
+    const char* at = end - 16; \
+    unsigned mask = (MASK) >> (p - at); \
+    return mask != 0 ? p + __builtin_ctz(mask) : end; \
+  } while (0)
+
+
+const char* findEitherSlow(const char* begin, const char* end, char c1, char c2) {
+  SCAN_REST(findEitherAvx2(p, end, c1, c2), eitherMask(at, c1, c2));
+}
+
+
+const char* findNotDigitSlow(const char* begin, const char* end) {
+  SCAN_REST(findNotDigitAvx2(p, end), notDigitMask(at));
+}
+
+#undef SCAN_REST
+
+#else
+
+const char* findEitherSlow(const char* begin, const char* end, char c1, char c2) {
+  return findEither(begin, end, c1, c2);
+}
+
+
+const char* findNotDigitSlow(const char* begin, const char* end) {
+  return findNotDigit(begin, end);
+}
+
+#endif // MC_USE_SSE2_SCAN
+
+} // namespace io
+} // namespace mc
+} // namespace douban
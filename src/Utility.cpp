@@ -1,3 +1,4 @@
+#include <time.h>
 #include "Utility.h"
 #include "Common.h"
 
@@ -65,6 +66,13 @@ void fprintBuffer(std::FILE* file, const char *data_buffer_, const unsigned int
 }
 
 
+uint64_t monotonicMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+
 } // namespace utility
 } // namespace mc
 } // namespace douban
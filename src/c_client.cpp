@@ -1,5 +1,7 @@
 #include "c_client.h"
 #include "Client.h"
+#include "BlockPool.h"
+#include "Keywords.h"
 
 
 using douban::mc::Client;
@@ -69,6 +71,42 @@ IMPL_RETRIEVAL_CMD(gets)
 #undef IMPL_RETRIEVAL_CMD
 
 
+#define IMPL_INDEXED_RETRIEVAL_CMD(M) \
+err_code_t client_##M##_indexed(void* client, const char* const* keys, \
+               const size_t* key_lens, size_t n_keys, \
+               retrieval_result_t*** results, size_t* n_results) { \
+  douban::mc::Client* c = static_cast<Client*>(client); \
+  return c->M##Indexed(keys, key_lens, n_keys, results, n_results); \
+}
+IMPL_INDEXED_RETRIEVAL_CMD(get)
+IMPL_INDEXED_RETRIEVAL_CMD(gets)
+#undef IMPL_INDEXED_RETRIEVAL_CMD
+
+
+#define IMPL_FRAGMENTED_RETRIEVAL_CMD(M) \
+err_code_t client_##M##_fragmented(void* client, const char* const* keys, \
+               const size_t* key_lens, size_t n_keys, \
+               fragmented_retrieval_result_t*** results, size_t* n_results) { \
+  douban::mc::Client* c = static_cast<Client*>(client); \
+  return c->M##Fragmented(keys, key_lens, n_keys, results, n_results); \
+}
+IMPL_FRAGMENTED_RETRIEVAL_CMD(get)
+IMPL_FRAGMENTED_RETRIEVAL_CMD(gets)
+#undef IMPL_FRAGMENTED_RETRIEVAL_CMD
+
+
+#define IMPL_STREAM_RETRIEVAL_CMD(M) \
+err_code_t client_##M##_stream(void* client, const char* const* keys, \
+               const size_t* key_lens, size_t n_keys, \
+               retrieval_chunk_cb_t cb, void* ctx) { \
+  douban::mc::Client* c = static_cast<Client*>(client); \
+  return c->M##Stream(keys, key_lens, n_keys, cb, ctx); \
+}
+IMPL_STREAM_RETRIEVAL_CMD(get)
+IMPL_STREAM_RETRIEVAL_CMD(gets)
+#undef IMPL_STREAM_RETRIEVAL_CMD
+
+
 void client_destroy_retrieval_result(void* client) {
   douban::mc::Client* c = static_cast<Client*>(client);
   return c->destroyRetrievalResult();
@@ -137,15 +175,121 @@ void client_destroy_unsigned_result(void* client) {
   return c->destroyUnsignedResult();
 }
 
+#define IMPL_RETRIEVAL_ASYNC_CMD(M) \
+err_code_t client_##M##_async(void* client, const char* const* keys, \
+               const size_t* key_lens, size_t nKeys, ticket_t* ticket) { \
+  douban::mc::Client* c = static_cast<Client*>(client); \
+  return c->M##Async(keys, key_lens, nKeys, ticket); \
+}
+
+IMPL_RETRIEVAL_ASYNC_CMD(get)
+IMPL_RETRIEVAL_ASYNC_CMD(gets)
+#undef IMPL_RETRIEVAL_ASYNC_CMD
+
+
+#define IMPL_STORAGE_ASYNC_CMD(M) \
+err_code_t client_##M##_async(void* client, const char* const* keys, \
+               const size_t* key_lens, const flags_t* flags, const exptime_t exptime, \
+               const cas_unique_t* cas_uniques, const bool noreply, \
+               const char* const* vals, const size_t* val_lens, \
+               size_t nItems, ticket_t* ticket) { \
+  douban::mc::Client* c = static_cast<Client*>(client); \
+  return c->M##Async(keys, key_lens, flags, exptime, cas_uniques, \
+                     noreply, vals, val_lens, nItems, ticket); \
+}
+
+IMPL_STORAGE_ASYNC_CMD(set)
+IMPL_STORAGE_ASYNC_CMD(add)
+IMPL_STORAGE_ASYNC_CMD(replace)
+IMPL_STORAGE_ASYNC_CMD(append)
+IMPL_STORAGE_ASYNC_CMD(prepend)
+IMPL_STORAGE_ASYNC_CMD(cas)
+#undef IMPL_STORAGE_ASYNC_CMD
+
+
+err_code_t client_delete_async(void* client, const char* const* keys,
+                  const size_t* key_lens, const bool noreply, size_t n_items,
+                  ticket_t* ticket) {
+  douban::mc::Client* c = static_cast<Client*>(client);
+  return c->deleteAsync(keys, key_lens, noreply, n_items, ticket);
+}
+
+
+err_code_t client_touch_async(void* client, const char* const* keys,
+                 const size_t* key_lens, const exptime_t exptime, const bool noreply,
+                 size_t n_items, ticket_t* ticket) {
+  douban::mc::Client* c = static_cast<Client*>(client);
+  return c->touchAsync(keys, key_lens, exptime, noreply, n_items, ticket);
+}
+
+
+err_code_t client_complete(void* client, int timeout, ticket_t** tickets,
+                           size_t* n_tickets) {
+  douban::mc::Client* c = static_cast<Client*>(client);
+  return c->complete(timeout, tickets, n_tickets);
+}
+
+
+err_code_t client_ticket_retrieval_result(void* client, ticket_t ticket,
+                                          retrieval_result_t*** results,
+                                          size_t* n_results) {
+  douban::mc::Client* c = static_cast<Client*>(client);
+  return c->ticketRetrievalResult(ticket, results, n_results);
+}
+
+
+err_code_t client_ticket_message_result(void* client, ticket_t ticket,
+                                        message_result_t*** results, size_t* n_results) {
+  douban::mc::Client* c = static_cast<Client*>(client);
+  return c->ticketMessageResult(ticket, results, n_results);
+}
+
+
+void client_destroy_tickets(void* client) {
+  douban::mc::Client* c = static_cast<Client*>(client);
+  c->destroyTickets();
+}
+
+
 err_code_t client_stats(void* client, broadcast_result_t** results, size_t* n_servers) {
   douban::mc::Client* c = static_cast<Client*>(client);
   return c->stats(results, n_servers);
 }
 
+err_code_t client_stats_typed(void* client, server_stats_t** results, size_t* n_servers,
+                              cluster_stats_t* cluster) {
+  douban::mc::Client* c = static_cast<Client*>(client);
+  return c->statsTyped(results, n_servers, cluster);
+}
+
+const char* stat_field_name(stat_field_t field) {
+  if (field < 0 || field >= STAT_FIELD_COUNT) {
+    return NULL;
+  }
+  return douban::mc::keywords::kSTAT_FIELDS[field];
+}
+
 void client_toggle_flush_all_feature(void* client, bool enabled) {
   douban::mc::Client* c = static_cast<Client*>(client);
   return c->toggleFlushAllFeature(enabled);
 }
+
+void client_get_send_stats(void* client, send_stats_t* stats) {
+  douban::mc::Client* c = static_cast<Client*>(client);
+  c->getSendStats(stats);
+}
+
+
+void client_get_memory_stats(void* client, memory_stats_t* stats) {
+  douban::mc::Client* c = static_cast<Client*>(client);
+  c->getMemoryStats(stats);
+}
+
+
+void client_trim_retained(void* client) {
+  douban::mc::Client* c = static_cast<Client*>(client);
+  c->trimRetained();
+}
 err_code_t client_flush_all(void* client, broadcast_result_t** results, size_t* n_servers) {
   douban::mc::Client* c = static_cast<Client*>(client);
   return c->flushAll(results, n_servers);
@@ -156,6 +300,14 @@ err_code_t client_quit(void* client) {
   return c->quit();
 }
 
+void get_block_pool_stats(block_pool_stats_t* stats) {
+  douban::mc::io::BlockPool::getStats(stats);
+}
+
+int block_pool_reserve_mapped(size_t bytes) {
+  return douban::mc::io::BlockPool::reserveMapped(bytes);
+}
+
 const char* err_code_to_string(err_code_t err) {
   return douban::mc::errCodeToString(err);
 }
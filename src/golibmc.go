@@ -25,6 +25,19 @@ const (
 	ConnectTimeout = C.CFG_CONNECT_TIMEOUT
 	RetryTimeout   = C.CFG_RETRY_TIMEOUT
 	MaxRetries     = C.CFG_MAX_RETRIES
+	UseIoUring     = C.CFG_USE_IO_URING
+
+	// ZerocopyThreshold sends values of at least this many bytes with
+	// MSG_ZEROCOPY, 0 disables it. Value buffers may be reused once the
+	// command returns.
+	ZerocopyThreshold = C.CFG_ZEROCOPY_THRESHOLD
+
+	// UseMetaProtocol sends the meta commands of memcached 1.6 instead of
+	// the classic ones.
+	UseMetaProtocol = C.CFG_USE_META_PROTOCOL
+
+	// UseBinaryProtocol speaks the binary protocol instead of the text one.
+	UseBinaryProtocol = C.CFG_USE_BINARY_PROTOCOL
 )
 
 // Hash functions
@@ -49,6 +62,15 @@ var hashFunctionMapping = map[int]C.hash_function_options_t{
 	HashCRC32:   C.OPT_HASH_CRC_32,
 }
 
+// the names of the counters of StatsTyped, by stat_field_t
+var statFieldNames = func() []string {
+	names := make([]string, C.STAT_FIELD_COUNT)
+	for f := range names {
+		names[f] = C.GoString(C.stat_field_name(C.stat_field_t(f)))
+	}
+	return names
+}()
+
 // Credits to:
 // https://github.com/bradfitz/gomemcache/blob/master/memcache/memcache.go
 
@@ -117,6 +139,11 @@ type Client struct {
 	pollTimeout    C.int
 	retryTimeout   C.int
 	maxRetries     C.int // maximum amount of retries. maxRetries <= 0 means unlimited. default is -1.
+	// set by Config, -1 leaves the default of the C client
+	useIoUring        C.int
+	zerocopyThreshold C.int
+	useMetaProtocol   C.int
+	useBinaryProtocol C.int
 
 	lk           sync.Mutex // protects following fields
 	freeConns    []*conn
@@ -230,6 +257,10 @@ func New(servers []string, noreply bool, prefix string, hashFunc int, failover b
 	client.retryTimeout = -1
 	// users can set this by client.SetMaxRetries.
 	client.maxRetries = -1
+	client.useIoUring = -1
+	client.zerocopyThreshold = -1
+	client.useMetaProtocol = -1
+	client.useBinaryProtocol = -1
 
 	go client.connectionOpener()
 
@@ -383,6 +414,18 @@ func (client *Client) newConn() (*conn, error) {
 	if client.maxRetries >= 0 {
 		C.client_config(cn._imp, MaxRetries, client.maxRetries)
 	}
+	if client.useIoUring >= 0 {
+		C.client_config(cn._imp, UseIoUring, client.useIoUring)
+	}
+	if client.zerocopyThreshold >= 0 {
+		C.client_config(cn._imp, ZerocopyThreshold, client.zerocopyThreshold)
+	}
+	if client.useMetaProtocol >= 0 {
+		C.client_config(cn._imp, UseMetaProtocol, client.useMetaProtocol)
+	}
+	if client.useBinaryProtocol >= 0 {
+		C.client_config(cn._imp, UseBinaryProtocol, client.useBinaryProtocol)
+	}
 	return &cn, nil
 }
 
@@ -668,6 +711,29 @@ func (client *Client) ConfigTimeout(cCfgKey C.config_options_t, timeout time.Dur
 	}
 }
 
+// Config Keys:
+//
+//	UseIoUring
+//	ZerocopyThreshold
+//	UseMetaProtocol
+//	UseBinaryProtocol
+//
+// applied to the connections opened from now on
+func (client *Client) Config(cCfgKey C.config_options_t, val int) {
+	client.lk.Lock()
+	defer client.lk.Unlock()
+	switch cCfgKey {
+	case UseIoUring:
+		client.useIoUring = C.int(val)
+	case ZerocopyThreshold:
+		client.zerocopyThreshold = C.int(val)
+	case UseMetaProtocol:
+		client.useMetaProtocol = C.int(val)
+	case UseBinaryProtocol:
+		client.useBinaryProtocol = C.int(val)
+	}
+}
+
 // GetServerAddressByKey will return the address of the memcached
 // server where a key is stored (assume all memcached servers are
 // accessiable and wonot establish any connections. )
@@ -1394,6 +1460,73 @@ func (client *Client) Stats(ctx context.Context) (map[string](map[string]string)
 	return rv, nil
 }
 
+// ClusterStats holds the counters StatsTyped parses, by the names of
+// stat_field_t in Export.h: those of each server that answered, and their
+// sum, min and max over the servers that sent them
+type ClusterStats struct {
+	Servers  map[string](map[string]uint64)
+	NServers int
+	Sum      map[string]uint64
+	Min      map[string]uint64
+	Max      map[string]uint64
+}
+
+// StatsTyped is Stats with the numeric counters parsed and aggregated by libmc
+func (client *Client) StatsTyped(ctx context.Context) (*ClusterStats, error) {
+	var rst *C.server_stats_t
+	var n C.size_t
+	var cluster C.cluster_stats_t
+
+	rv := &ClusterStats{
+		Servers: make(map[string](map[string]uint64)),
+		Sum:     make(map[string]uint64),
+		Min:     make(map[string]uint64),
+		Max:     make(map[string]uint64),
+	}
+
+	cn, err := client.conn(ctx)
+	if err != nil {
+		return rv, err
+	}
+	defer func() {
+		client.putConn(cn, err)
+	}()
+
+	errCode := C.client_stats_typed(cn._imp, &rst, &n, &cluster)
+
+	sr := unsafe.Sizeof(*rst)
+
+	for i := 0; i < int(n); i++ {
+		if rst.present != 0 {
+			counters := make(map[string]uint64)
+			for f := 0; f < C.STAT_FIELD_COUNT; f++ {
+				if rst.present&(1<<uint(f)) != 0 {
+					counters[statFieldNames[f]] = uint64(rst.values[f])
+				}
+			}
+			rv.Servers[C.GoString(rst.host)] = counters
+		}
+		rst = (*C.server_stats_t)(unsafe.Pointer(uintptr(unsafe.Pointer(rst)) + sr))
+	}
+
+	rv.NServers = int(cluster.n_servers)
+	for f := 0; f < C.STAT_FIELD_COUNT; f++ {
+		if cluster.n_present[f] == 0 {
+			continue
+		}
+		name := statFieldNames[f]
+		rv.Sum[name] = uint64(cluster.sum[f])
+		rv.Min[name] = uint64(cluster.min[f])
+		rv.Max[name] = uint64(cluster.max[f])
+	}
+
+	if errCode != C.RET_OK {
+		return rv, networkError(errorMessage(errCode))
+	}
+
+	return rv, nil
+}
+
 // Enable/Disable the flush_all feature
 func (client *Client) ToggleFlushAllFeature(enabled bool) {
 	client.flushAllEnabled = enabled
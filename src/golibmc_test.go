@@ -1,8 +1,10 @@
 package golibmc
 
 import (
+	"bytes"
 	"context"
 	"fmt"
+	"net"
 	"strconv"
 	"strings"
 	"sync"
@@ -91,6 +93,22 @@ func testStats(mc *Client, t *testing.T) {
 	}
 }
 
+func TestStatsTyped(t *testing.T) {
+	for _, nServers := range []int{1, 2, 10} {
+		mc := newSimplePrefixClient(nServers, "")
+		st, err := mc.StatsTyped(context.Background())
+		if !(err == nil && st.NServers == len(mc.servers) && len(st.Servers) == len(mc.servers)) {
+			t.Errorf("%v %d %d", err, st.NServers, len(mc.servers))
+		}
+		if pid, ok := st.Servers[LocalMC]["pid"]; !ok || pid == 0 {
+			t.Error(st.Servers[LocalMC])
+		}
+		if st.Min["uptime"] > st.Max["uptime"] || st.Sum["curr_items"] < st.Max["curr_items"] {
+			t.Error(st.Min, st.Max, st.Sum)
+		}
+	}
+}
+
 func TestPrefix(t *testing.T) {
 	c1 := Client{}
 	testPrefix := "prefix"
@@ -1083,3 +1101,68 @@ func TestSlowMemcache(t *testing.T) {
 	}
 	wg.Wait()
 }
+
+// firstRequest returns the first bytes a client sends to a local server,
+// which closes the connection then.
+func firstRequest(t *testing.T, configure func(*Client)) []byte {
+	ln, err := net.Listen("tcp", "127.0.0.1:0")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer ln.Close()
+	got := make(chan []byte, 1)
+	go func() {
+		conn, err := ln.Accept()
+		if err != nil {
+			got <- nil
+			return
+		}
+		defer conn.Close()
+		buf := make([]byte, 64)
+		n, _ := conn.Read(buf)
+		got <- buf[:n]
+	}()
+
+	mc := New([]string{ln.Addr().String()}, false, "", HashCRC32, false, false)
+	configure(mc)
+	mc.Get(context.Background(), "config_key")
+	mc.Quit()
+	return <-got
+}
+
+func TestConfigProtocol(t *testing.T) {
+	request := firstRequest(t, func(mc *Client) {})
+	if !bytes.HasPrefix(request, []byte("get ")) {
+		t.Errorf("text get expected, got %q", request)
+	}
+	request = firstRequest(t, func(mc *Client) { mc.Config(UseMetaProtocol, 1) })
+	if !bytes.HasPrefix(request, []byte("mg ")) {
+		t.Errorf("meta get expected, got %q", request)
+	}
+	request = firstRequest(t, func(mc *Client) { mc.Config(UseBinaryProtocol, 1) })
+	if len(request) == 0 || request[0] != 0x80 {
+		t.Errorf("binary request expected, got %q", request)
+	}
+}
+
+func TestConfigSend(t *testing.T) {
+	configures := []func(*Client){
+		func(mc *Client) { mc.Config(UseIoUring, 1) },
+		func(mc *Client) { mc.Config(ZerocopyThreshold, 4096) },
+	}
+	for _, configure := range configures {
+		mc := newSimpleClient(1)
+		configure(mc)
+		ctx := context.Background()
+		value := []byte(strings.Repeat("v", 100000))
+		item := &Item{Key: "config_send", Value: value}
+		if err := mc.Set(ctx, item); err != nil {
+			t.Fatalf("%s: %v", ErrorSet, err)
+		}
+		got, err := mc.Get(ctx, item.Key)
+		if err != nil || !bytes.Equal(got.Value, value) {
+			t.Errorf("%s: %v", ErrorGetAfterSet, err)
+		}
+		mc.Quit()
+	}
+}
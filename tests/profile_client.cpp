@@ -95,6 +95,7 @@ void profile_set_get_multi_##NITEM##VAL_LEN(Client* client, const char* const *
 DEFINE_PROFILE_SET_GET_MULTI(10, 100, 1000)
 DEFINE_PROFILE_SET_GET_MULTI(10, 1000, 1000)
 DEFINE_PROFILE_SET_GET_MULTI(100, 100, 1000)
+DEFINE_PROFILE_SET_GET_MULTI(1000, 100, 100)
 
 
 static const int N_ITEMS = 1000;
@@ -142,6 +143,7 @@ int main() {
   TIMEIT(profile_set_get_multi_10100(client, keys, key_lens, vals));
   TIMEIT(profile_set_get_multi_101000(client, keys, key_lens, vals));
   TIMEIT(profile_set_get_multi_100100(client, keys, key_lens, vals));
+  TIMEIT(profile_set_get_multi_1000100(client, keys, key_lens, vals));
 
   for (int i = 0; i < N_ITEMS; i++) {
     delete[] keys[i];
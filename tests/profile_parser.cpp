@@ -0,0 +1,438 @@
+// make profile_parser && ./tests/profile_parser
+// Parses canned server responses, no memcached needed.
+#include <time.h>
+#include <cassert>
+#include <cstdio>
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "Common.h"
+#include "BinaryProtocol.h"
+#include "BufferReader.h"
+#include "Keywords.h"
+#include "Parser.h"
+#include "RequestArena.h"
+#include "Scan.h"
+
+using douban::mc::PacketParser;
+using douban::mc::RequestArena;
+using douban::mc::io::BufferReader;
+
+
+static double getCPUTime() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<double>(ts.tv_sec) + 1e-9 * static_cast<double>(ts.tv_nsec);
+}
+
+
+// keys are keyLen bytes long, at least 17
+static std::string profileKey(int i, int keyLen) {
+  char key[300];
+  snprintf(key, sizeof key, "test_profile_key_%0*d", keyLen - 16, i);
+  return key;
+}
+
+
+static std::string getMultiResponse(int nItems, int keyLen, size_t valLen) {
+  std::string response;
+  std::string val(valLen, 'v');
+  char header[300];
+  for (int i = 0; i < nItems; i++) {
+    snprintf(header, sizeof header, "VALUE %s 0 %zu\r\n",
+             profileKey(i, keyLen).c_str(), valLen);
+    response.append(header);
+    response.append(val);
+    response.append("\r\n");
+  }
+  response.append("END\r\n");
+  return response;
+}
+
+
+// the same hits answering "mg <key> v f O<i> q", the keys are not echoed
+static std::string metaGetMultiResponse(int nItems, size_t valLen) {
+  std::string response;
+  std::string val(valLen, 'v');
+  char header[300];
+  for (int i = 0; i < nItems; i++) {
+    snprintf(header, sizeof header, "VA %zu f0 O%d\r\n", valLen, i);
+    response.append(header);
+    response.append(val);
+    response.append("\r\n");
+  }
+  response.append("MN\r\n");
+  return response;
+}
+
+
+// the same hits answering GETQ with opaque i, then a NOOP
+static std::string binaryGetMultiResponse(int nItems, size_t valLen) {
+  namespace binary = douban::mc::binary;
+  std::string response;
+  std::string val(valLen, 'v');
+  for (int i = 0; i < nItems + 1; i++) {
+    bool noop = i == nItems;
+    binary::header_t h;
+    memset(&h, 0, sizeof h);
+    h.magic = binary::MAGIC_RESPONSE;
+    h.opcode = noop ? binary::OP_NOOP : binary::OP_GETQ;
+    h.extrasLen = noop ? 0 : 4;
+    h.bodyLen = binary::swap32(static_cast<uint32_t>(noop ? 0 : 4 + valLen));
+    h.opaque = binary::swap32(static_cast<uint32_t>(i));
+    response.append(reinterpret_cast<const char*>(&h), sizeof h);
+    if (!noop) {
+      response.append(4, '\0');
+      response.append(val);
+    }
+  }
+  return response;
+}
+
+
+// Feeds response in recvSize pieces, as a connection would, then
+// collects the results like Client::get does.
+static void parse(BufferReader& reader, PacketParser& parser, RequestArena& arena,
+                  const std::string& response, size_t recvSize,
+                  const std::vector<std::string>* requestKeys = NULL,
+                  douban::mc::ParserMode mode = douban::mc::MODE_END_STATE) {
+  err_code_t err = RET_OK;
+  for (size_t i = 0; requestKeys != NULL && i < requestKeys->size(); i++) {
+    parser.addRequestKey((*requestKeys)[i].data(), (*requestKeys)[i].size());
+  }
+  parser.setMode(mode);
+  for (size_t pos = 0; pos < response.size(); pos += recvSize) {
+    size_t len = MIN(recvSize, response.size() - pos);
+    reader.write(const_cast<char*>(response.data() + pos), len);
+    parser.process_packets(err);
+    if (err != RET_INCOMPLETE_BUFFER_ERR) {
+      break;
+    }
+  }
+  if (err != RET_OK) {
+    log_err("parse error %d", err);
+  }
+  douban::mc::types::RetrievalResultList* results = parser.getRetrievalResults();
+  assert(results->size() > 0 || parser.getLineResults()->size() > 0);
+  for (size_t i = 0; i < results->size(); i++) {
+    (*results)[i].inner(arena);
+  }
+  parser.reset();
+  reader.reset();
+  arena.reset();
+}
+
+
+#define DEFINE_PROFILE_PARSE_GET_MULTI(NITEM, KEY_LEN, VAL_LEN, N) \
+void profile_parse_get_multi_##NITEM##_##KEY_LEN##_##VAL_LEN() { \
+  std::string response = getMultiResponse((NITEM), (KEY_LEN), (VAL_LEN)); \
+  std::vector<std::string> keys; \
+  for (int i = 0; i < (NITEM); i++) { \
+    keys.push_back(profileKey(i, (KEY_LEN))); \
+  } \
+  BufferReader reader; \
+  RequestArena arena; \
+  PacketParser parser(&reader); \
+  parser.setRequestArena(&arena); \
+  double t0 = getCPUTime(); \
+  for (int i = 0; i < (N); i++) { \
+    parse(reader, parser, arena, response, 16384, &keys); \
+  } \
+  double t1 = getCPUTime(); \
+  printf("get_multi of %d keys of %d bytes, %d bytes values: %.2f us\n", \
+         (NITEM), (KEY_LEN), (VAL_LEN), (t1 - t0) * 1e6 / (N)); \
+}
+
+DEFINE_PROFILE_PARSE_GET_MULTI(1000, 20, 100, 2000)
+DEFINE_PROFILE_PARSE_GET_MULTI(1000, 20, 1000, 1000)
+DEFINE_PROFILE_PARSE_GET_MULTI(100, 20, 100, 20000)
+// mostly headers
+DEFINE_PROFILE_PARSE_GET_MULTI(1000, 20, 10, 2000)
+DEFINE_PROFILE_PARSE_GET_MULTI(1000, 60, 10, 2000)
+DEFINE_PROFILE_PARSE_GET_MULTI(1000, 200, 10, 2000)
+
+
+#define DEFINE_PROFILE_PARSE_META_GET_MULTI(NITEM, KEY_LEN, VAL_LEN, N) \
+void profile_parse_meta_get_multi_##NITEM##_##KEY_LEN##_##VAL_LEN() { \
+  std::string response = metaGetMultiResponse((NITEM), (VAL_LEN)); \
+  std::vector<std::string> keys; \
+  for (int i = 0; i < (NITEM); i++) { \
+    keys.push_back(std::string((KEY_LEN), 'k')); \
+  } \
+  BufferReader reader; \
+  RequestArena arena; \
+  PacketParser parser(&reader); \
+  parser.setRequestArena(&arena); \
+  double t0 = getCPUTime(); \
+  for (int i = 0; i < (N); i++) { \
+    parse(reader, parser, arena, response, 16384, &keys); \
+  } \
+  double t1 = getCPUTime(); \
+  printf("meta get_multi of %d keys of %d bytes, %d bytes values: %.2f us, %zu bytes\n", \
+         (NITEM), (KEY_LEN), (VAL_LEN), (t1 - t0) * 1e6 / (N), response.size()); \
+}
+
+DEFINE_PROFILE_PARSE_META_GET_MULTI(1000, 20, 100, 2000)
+DEFINE_PROFILE_PARSE_META_GET_MULTI(1000, 20, 10, 2000)
+DEFINE_PROFILE_PARSE_META_GET_MULTI(1000, 60, 10, 2000)
+
+
+#define DEFINE_PROFILE_PARSE_BINARY_GET_MULTI(NITEM, KEY_LEN, VAL_LEN, N) \
+void profile_parse_binary_get_multi_##NITEM##_##KEY_LEN##_##VAL_LEN() { \
+  std::string response = binaryGetMultiResponse((NITEM), (VAL_LEN)); \
+  std::vector<std::string> keys; \
+  for (int i = 0; i < (NITEM); i++) { \
+    keys.push_back(std::string((KEY_LEN), 'k')); \
+  } \
+  BufferReader reader; \
+  RequestArena arena; \
+  PacketParser parser(&reader); \
+  parser.setRequestArena(&arena); \
+  double t0 = getCPUTime(); \
+  for (int i = 0; i < (N); i++) { \
+    parse(reader, parser, arena, response, 16384, &keys, douban::mc::MODE_BINARY); \
+  } \
+  double t1 = getCPUTime(); \
+  printf("binary get_multi of %d keys of %d bytes, %d bytes values: %.2f us, %zu bytes\n", \
+         (NITEM), (KEY_LEN), (VAL_LEN), (t1 - t0) * 1e6 / (N), response.size()); \
+}
+
+DEFINE_PROFILE_PARSE_BINARY_GET_MULTI(1000, 20, 100, 2000)
+DEFINE_PROFILE_PARSE_BINARY_GET_MULTI(1000, 20, 10, 2000)
+DEFINE_PROFILE_PARSE_BINARY_GET_MULTI(1000, 60, 10, 2000)
+
+
+// "STAT <name> <value>" lines of lineLen bytes, as of "stats items"
+static std::string statsResponse(int nLines, int lineLen) {
+  std::string response;
+  char header[300];
+  for (int i = 0; i < nLines; i++) {
+    int n = snprintf(header, sizeof header, "STAT items:%d:", i);
+    response.append(header, n);
+    response.append(lineLen - n - 2, 'n');
+    response.append(" 1\r\n");
+  }
+  response.append("END\r\n");
+  return response;
+}
+
+
+// A response arriving a byte per recv, the worst a slow link can do. Each
+// line is looked at for its end on every byte of it.
+static void profile_parse_fragmented(const char* name, const std::string& response,
+                                     const std::vector<std::string>* keys,
+                                     douban::mc::ParserMode mode, int n) {
+  BufferReader reader;
+  RequestArena arena;
+  PacketParser parser(&reader);
+  parser.setRequestArena(&arena);
+  double t0 = getCPUTime();
+  for (int i = 0; i < n; i++) {
+    parse(reader, parser, arena, response, 1, keys, mode);
+  }
+  double t1 = getCPUTime();
+  printf("%s, a byte per recv: %.2f ns per byte\n", name,
+         (t1 - t0) * 1e9 / n / response.size());
+}
+
+
+// what readUnsigned did before parseDigits
+static uint64_t parseBytewise(const char* begin, const char* end) {
+  uint64_t value = 0;
+  for (const char* p = begin; p != end; ++p) {
+    value = value * 10ULL + (*p - '0');
+  }
+  return value;
+}
+
+
+// The flags, bytes and cas of VALUE lines: the digits only, by the byte
+// and by parseDigits, then the whole readUnsigned. Best of 5.
+static void profile_read_unsigned(int rounds) {
+  std::string line;
+  char header[64];
+  for (int i = 0; i < 1000; i++) {
+    snprintf(header, sizeof header, "%d %d %llu\r\n", i % 7, 100 + i,
+             6000000000000000000ULL + 7919ULL * i);
+    line.append(header);
+  }
+  std::vector<std::pair<const char*, const char*> > spans;
+  const char* end = line.data() + line.size();
+  for (const char* p = line.data(); p < end;) {
+    const char* q = douban::mc::io::findNotDigit(p, end);
+    spans.push_back(std::make_pair(p, q));
+    p = q + (*q == '\r' ? 2 : 1);
+  }
+  const double n = static_cast<double>(spans.size()) * rounds;
+  uint64_t sums[] = {0, 0, 0};
+  double ns[] = {1e18, 1e18, 1e18};
+  err_code_t err;
+  BufferReader reader;
+
+  for (int pass = 0; pass < 5; pass++) {
+    double t0 = getCPUTime();
+    for (int r = 0; r < rounds; r++) {
+      for (size_t i = 0; i < spans.size(); i++) {
+        sums[0] += parseBytewise(spans[i].first, spans[i].second);
+      }
+    }
+    double t1 = getCPUTime();
+    ns[0] = MIN(ns[0], (t1 - t0) * 1e9 / n);
+
+    t0 = getCPUTime();
+    for (int r = 0; r < rounds; r++) {
+      for (size_t i = 0; i < spans.size(); i++) {
+        uint64_t val = 0;
+        douban::mc::io::parseDigits(spans[i].first, spans[i].second, val);
+        sums[1] += val;
+      }
+    }
+    t1 = getCPUTime();
+    ns[1] = MIN(ns[1], (t1 - t0) * 1e9 / n);
+
+    t0 = getCPUTime();
+    for (int r = 0; r < rounds; r++) {
+      reader.write(const_cast<char*>(line.data()), line.size());
+      uint64_t val;
+      while (reader.readLeft() > 0) {
+        reader.readUnsigned(err, val);
+        sums[2] += val;
+        reader.skipBytes(err, reader.peek(err, 0) == '\r' ? 2 : 1);
+      }
+      reader.reset();
+    }
+    t1 = getCPUTime();
+    ns[2] = MIN(ns[2], (t1 - t0) * 1e9 / n);
+  }
+  if (sums[1] != sums[0] || sums[2] != sums[0]) {
+    printf("numbers of VALUE lines: sums differ\n");
+  }
+  printf("numbers of VALUE lines: bytewise %.1f ns, swar %.1f ns, readUnsigned %.1f ns\n",
+         ns[0], ns[1], ns[2]);
+}
+
+
+// "stats" as a server sends it, the counters of stat_field_t among as many
+// others
+static std::string generalStatsResponse() {
+  std::string response = "STAT version 1.6.21\r\nSTAT rusage_user 0.123456\r\n";
+  char line[100];
+  for (int i = 0; i < STAT_FIELD_COUNT; i++) {
+    int n = snprintf(line, sizeof line, "STAT %s %d\r\nSTAT other_%d %d\r\n",
+                     douban::mc::keywords::kSTAT_FIELDS[i], 1000000 + i, i, i);
+    response.append(line, n);
+  }
+  response.append("END\r\n");
+  return response;
+}
+
+
+// The counters of "stats", parsed to server_stats_t by the parser, or
+// taken from the line results by the caller, as a monitor does.
+static void profile_parse_stats(bool typed, int n) {
+  std::string response = generalStatsResponse();
+  BufferReader reader;
+  RequestArena arena;
+  PacketParser parser(&reader);
+  parser.setRequestArena(&arena);
+  uint64_t values[STAT_FIELD_COUNT];
+  err_code_t err;
+  double t0 = getCPUTime();
+  for (int i = 0; i < n; i++) {
+    parser.setMode(douban::mc::MODE_END_STATE);
+    if (typed) {
+      parser.setTypedStats();
+    }
+    reader.write(const_cast<char*>(response.data()), response.size());
+    parser.process_packets(err);
+    assert(err == RET_OK);
+    if (typed) {
+      memcpy(values, parser.getServerStats().values, sizeof values);
+    } else {
+      douban::mc::types::LineResultList* lines = parser.getLineResults();
+      for (size_t j = 0; j < lines->size(); j++) {
+        size_t len = 0;
+        char* line = (*lines)[j].inner(len, arena);
+        char* sp = static_cast<char*>(memchr(line, ' ', len));
+        for (int f = 0; f < STAT_FIELD_COUNT; f++) {
+          const char* name = douban::mc::keywords::kSTAT_FIELDS[f];
+          if (strncmp(name, line, sp - line) == 0 && name[sp - line] == '\0') {
+            values[f] = strtoull(sp + 1, NULL, 10);
+            break;
+          }
+        }
+      }
+    }
+    assert(values[STAT_RECLAIMED] == 1000000 + STAT_RECLAIMED);
+    parser.reset();
+    reader.reset();
+    arena.reset();
+  }
+  double t1 = getCPUTime();
+  printf("stats of %d lines, %-10s %.2f us\n", 2 * STAT_FIELD_COUNT + 2,
+         typed ? "typed:" : "as lines:", (t1 - t0) * 1e6 / n);
+}
+
+
+static bool isDelimiter(char c) {
+  return c == ' ' || c == '\r';
+}
+
+
+// Splits a response at every ' ' and '\r', as the parser does with the
+// keys and numbers of VALUE lines. Each scan starts where the last ended.
+#define DEFINE_PROFILE_SCAN(NAME, FIND, N) \
+void profile_scan_##NAME(const std::string& response, int keyLen) { \
+  const char* end = response.data() + response.size(); \
+  size_t nTokens = 0; \
+  double t0 = getCPUTime(); \
+  for (int i = 0; i < (N); i++) { \
+    for (const char* p = response.data(); p < end; ++nTokens) { \
+      p = (FIND) + 1; \
+    } \
+  } \
+  double t1 = getCPUTime(); \
+  printf("split headers with %d bytes keys, %-8s %.2f ns per token\n", \
+         keyLen, #NAME, (t1 - t0) * 1e9 / nTokens); \
+}
+
+DEFINE_PROFILE_SCAN(std_find, std::find_if(p, end, isDelimiter), 2000)
+DEFINE_PROFILE_SCAN(simd, douban::mc::io::findEither(p, end, ' ', '\r'), 2000)
+
+
+int main() {
+  profile_parse_get_multi_1000_20_100();
+  profile_parse_get_multi_1000_20_1000();
+  profile_parse_get_multi_100_20_100();
+  profile_parse_get_multi_1000_20_10();
+  profile_parse_get_multi_1000_60_10();
+  profile_parse_get_multi_1000_200_10();
+  profile_parse_meta_get_multi_1000_20_100();
+  profile_parse_meta_get_multi_1000_20_10();
+  profile_parse_meta_get_multi_1000_60_10();
+  profile_parse_binary_get_multi_1000_20_100();
+  profile_parse_binary_get_multi_1000_20_10();
+  profile_parse_binary_get_multi_1000_60_10();
+  profile_read_unsigned(20);
+  profile_parse_stats(false, 20000);
+  profile_parse_stats(true, 20000);
+
+  std::vector<std::string> keys(100, std::string(20, 'k'));
+  profile_parse_fragmented("get_multi of 100 keys of 200 bytes", getMultiResponse(100, 200, 10),
+                           NULL, douban::mc::MODE_END_STATE, 200);
+  profile_parse_fragmented("meta get_multi of 100 keys", metaGetMultiResponse(100, 10),
+                           &keys, douban::mc::MODE_END_STATE, 200);
+  profile_parse_fragmented("stats of 100 lines of 1000 bytes", statsResponse(100, 1000),
+                           NULL, douban::mc::MODE_END_STATE, 20);
+  profile_parse_fragmented("stats of 10 lines of 16000 bytes", statsResponse(10, 16000),
+                           NULL, douban::mc::MODE_END_STATE, 10);
+
+  int keyLens[] = {20, 60, 200};
+  for (size_t i = 0; i < sizeof keyLens / sizeof keyLens[0]; i++) {
+    std::string headers = getMultiResponse(1000, keyLens[i], 0);
+    profile_scan_std_find(headers, keyLens[i]);
+    profile_scan_simd(headers, keyLens[i]);
+  }
+  return 0;
+}
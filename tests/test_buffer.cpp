@@ -1,12 +1,26 @@
 #include "Common.h"
 #include "Export.h"
 #include "BufferReader.h"
+#include "BufferWriter.h"
+#include "BlockPool.h"
+#include "Scan.h"
+#include <cerrno>
 #include <cstring>
+#include <string>
+#include <vector>
 #include "gtest/gtest.h"
 
 using douban::mc::io::BufferReader;
+using douban::mc::io::BufferWriter;
+using douban::mc::io::BlockPool;
 using douban::mc::io::DataBlock;
 using douban::mc::io::TokenData;
+using douban::mc::io::TokenSlices;
+using douban::mc::RequestArena;
+
+using douban::mc::io::findChar;
+using douban::mc::io::findEither;
+using douban::mc::io::findNotDigit;
 
 #define ASSERT_N_STREQ(S1, S2, N) do {ASSERT_TRUE(0 == std::strncmp((S1), (S2), (N)));} while (0)
 
@@ -171,14 +185,14 @@ TEST(test_buffer, read_until) {
   ASSERT_EQ(td.size(), 1);
   ASSERT_EQ(td.front().size, 3);
   ASSERT_EQ(td.front().offset, 0);
-  dbPtr = &(*td.front().iterator);
+  dbPtr = &(*td.front().block);
   ASSERT_N_STREQ((*dbPtr)[td.front().offset], "foo", 3);
   freeTokenData(td);
 
   ASSERT_EQ(td2.size(), 1);
   ASSERT_EQ(td2.front().size, 1);
   ASSERT_EQ(td2.front().offset, 4);
-  dbPtr = &(*td2.front().iterator);
+  dbPtr = &(*td2.front().block);
   ASSERT_N_STREQ((*dbPtr)[td2.front().offset], "b", 1);
   freeTokenData(td2);
 
@@ -232,7 +246,7 @@ TEST(test_buffer, read_until_across_block) {
   ASSERT_EQ(tdPtr->size(), 1);
   ASSERT_EQ(tdPtr->front().size, 2);
   ASSERT_EQ(tdPtr->front().offset, 0);
-  dbPtr = &*(tdPtr->front().iterator);
+  dbPtr = &*(tdPtr->front().block);
   dbPtr->release(tdPtr->front().size);
   ASSERT_N_STREQ((*dbPtr)[tdPtr->front().offset], "xi", 2);
 
@@ -241,14 +255,14 @@ TEST(test_buffer, read_until_across_block) {
   ASSERT_EQ(tdPtr->size(), 2);
   ASSERT_EQ(tdPtr->front().size, 2);
   ASSERT_EQ(tdPtr->front().offset, 3);
-  dbPtr = &*(tdPtr->front().iterator);
+  dbPtr = &*(tdPtr->front().block);
   dbPtr->release(tdPtr->front().size);
   ASSERT_N_STREQ((*dbPtr)[tdPtr->front().offset], "gu", 2);
   // tdPtr->pop_front();
   tdPtr->erase(tdPtr->begin());
   ASSERT_EQ(tdPtr->front().size, 1);
   ASSERT_EQ(tdPtr->front().offset, 0);
-  dbPtr = &*(tdPtr->front().iterator);
+  dbPtr = &*(tdPtr->front().block);
   dbPtr->release(tdPtr->front().size);
   ASSERT_N_STREQ((*dbPtr)[tdPtr->front().offset], "a", 1);
 
@@ -257,7 +271,7 @@ TEST(test_buffer, read_until_across_block) {
   ASSERT_EQ(tdPtr->size(), 1);
   ASSERT_EQ(tdPtr->front().size, 3);
   ASSERT_EQ(tdPtr->front().offset, 2);
-  dbPtr = &*(tdPtr->front().iterator);
+  dbPtr = &*(tdPtr->front().block);
   dbPtr->release(tdPtr->front().size);
   ASSERT_N_STREQ((*dbPtr)[tdPtr->front().offset], "chi", 3);
 
@@ -266,14 +280,14 @@ TEST(test_buffer, read_until_across_block) {
   ASSERT_EQ(tdPtr->size(), 2);
   ASSERT_EQ(tdPtr->front().size, 4);
   ASSERT_EQ(tdPtr->front().offset, 1);
-  dbPtr = &*(tdPtr->front().iterator);
+  dbPtr = &*(tdPtr->front().block);
   dbPtr->release(tdPtr->front().size);
   ASSERT_N_STREQ((*dbPtr)[tdPtr->front().offset], "guan", 4);
   // tdPtr->pop_front();
   tdPtr->erase(tdPtr->begin());
   ASSERT_EQ(tdPtr->front().size, 1);
   ASSERT_EQ(tdPtr->front().offset, 0);
-  dbPtr = &*(tdPtr->front().iterator);
+  dbPtr = &*(tdPtr->front().block);
   dbPtr->release(tdPtr->front().size);
   ASSERT_N_STREQ((*dbPtr)[tdPtr->front().offset], "g", 1);
 
@@ -282,7 +296,7 @@ TEST(test_buffer, read_until_across_block) {
   ASSERT_EQ(tdPtr->size(), 1);
   ASSERT_EQ(tdPtr->front().size, 2);
   ASSERT_EQ(tdPtr->front().offset, 2);
-  dbPtr = &*(tdPtr->front().iterator);
+  dbPtr = &*(tdPtr->front().block);
   dbPtr->release(tdPtr->front().size);
   ASSERT_N_STREQ((*dbPtr)[tdPtr->front().offset], "le", 2);
 
@@ -291,21 +305,21 @@ TEST(test_buffer, read_until_across_block) {
   ASSERT_EQ(tdPtr->size(), 3);
   ASSERT_EQ(tdPtr->front().size, 5);
   ASSERT_EQ(tdPtr->front().offset, 0);
-  dbPtr = &*(tdPtr->front().iterator);
+  dbPtr = &*(tdPtr->front().block);
   dbPtr->release(tdPtr->front().size);
   ASSERT_N_STREQ((*dbPtr)[tdPtr->front().offset], "aaaaa", 5);
   // tdPtr->pop_front();
   tdPtr->erase(tdPtr->begin());
   ASSERT_EQ(tdPtr->front().size, 5);
   ASSERT_EQ(tdPtr->front().offset, 0);
-  dbPtr = &*(tdPtr->front().iterator);
+  dbPtr = &*(tdPtr->front().block);
   dbPtr->release(tdPtr->front().size);
   ASSERT_N_STREQ((*dbPtr)[tdPtr->front().offset], "aaaaa", 5);
   // tdPtr->pop_front();
   tdPtr->erase(tdPtr->begin());
   ASSERT_EQ(tdPtr->front().size, 3);
   ASSERT_EQ(tdPtr->front().offset, 0);
-  dbPtr = &*(tdPtr->front().iterator);
+  dbPtr = &*(tdPtr->front().block);
   dbPtr->release(tdPtr->front().size);
   ASSERT_N_STREQ((*dbPtr)[tdPtr->front().offset], "aaa", 3);
 
@@ -315,6 +329,58 @@ TEST(test_buffer, read_until_across_block) {
   delete[] tokenDataPtr;
 }
 
+TEST(test_buffer, read_until_fragmented) {
+  err_code_t err;
+  // "STAT k v\r\n" a byte at a time, over blocks of 8
+  DataBlock::setMinCapacity(8);
+  char line[] = "STAT key_of_a_stat value\r\nEND\r\n";
+  size_t lineLen = strlen("STAT key_of_a_stat value\r");
+  BufferReader reader;
+  TokenData td;
+  size_t i = 0;
+  for (; i < lineLen; i++) {
+    reader.write(line + i, 1);
+    // the other delimiters do not take what was scanned for '\n'
+    ASSERT_EQ(reader.peek(err, 0), 'S');
+    if (i >= 4) {
+      size_t len = 0;
+      ASSERT_TRUE(reader.contiguousUntil(' ', len) != NULL);
+      ASSERT_EQ(len, 4);
+    }
+    reader.readUntil(err, '\n', td);
+    ASSERT_EQ(err, RET_INCOMPLETE_BUFFER_ERR);
+    ASSERT_TRUE(td.empty());
+  }
+  reader.write(line + i++, 1);
+  ASSERT_EQ(reader.readUntil(err, '\n', td), lineLen);
+  ASSERT_EQ(err, RET_OK);
+  char* joined = douban::mc::io::parseTokenData(td, lineLen);
+  ASSERT_N_STREQ(joined, line, lineLen);
+  delete[] joined;
+  freeTokenData(td);
+  td.clear();
+  TEST_SKIP_BYTES_NO_THROW(1);
+
+  // from the next read cursor on
+  for (; i < strlen(line) - 1; i++) {
+    reader.write(line + i, 1);
+    reader.skipUntil(err, '\n');
+    ASSERT_EQ(err, RET_INCOMPLETE_BUFFER_ERR);
+  }
+  reader.write(line + i, 1);
+  ASSERT_EQ(reader.skipUntil(err, '\n'), 4);
+  ASSERT_EQ(err, RET_OK);
+  TEST_SKIP_BYTES_NO_THROW(1);
+
+  // nothing of the last batch is taken for scanned
+  reader.reset();
+  reader.write(CSTR("a\n"), 2);
+  ASSERT_EQ(reader.skipUntil(err, '\n'), 1);
+  ASSERT_EQ(err, RET_OK);
+  TEST_SKIP_BYTES_NO_THROW(1);
+}
+
+
 TEST(test_buffer, read_unsigned_empty) {
   err_code_t err;
   char str[] = "6";
@@ -410,6 +476,95 @@ TEST(test_buffer, read_unsigned_across_block) {
 }
 
 
+TEST(test_buffer, read_unsigned_digits) {
+  err_code_t err;
+  char digits[] = "98765432109876543210";
+  uint64_t expected = 0, val;
+  // every length, whole in a block and split over blocks of 3
+  for (size_t len = 1; len < 20; len++) {
+    expected = expected * 10 + (digits[len - 1] - '0');
+    for (size_t capacity = 3; capacity <= MIN_DATABLOCK_CAPACITY; capacity += MIN_DATABLOCK_CAPACITY - 3) {
+      DataBlock::setMinCapacity(capacity);
+      BufferReader reader;
+      reader.write(digits, len);
+      reader.write(CSTR(" "), 1);
+      TEST_READ_UNSIGNED_NO_THROW(val);
+      ASSERT_EQ(val, expected);
+      ASSERT_EQ(reader.readLeft(), 1);
+    }
+  }
+
+  // 2 ** 64 - 1 fits, one more does not
+  const char* numbers[] = {"18446744073709551615\r\n", "18446744073709551616\r\n",
+                           "99999999999999999999\r\n", "0000000000000000000000042\r\n"};
+  err_code_t errs[] = {RET_OK, RET_PROGRAMMING_ERR, RET_PROGRAMMING_ERR, RET_OK};
+  uint64_t vals[] = {18446744073709551615ULL, 0, 0, 42};
+  for (size_t i = 0; i < 4; i++) {
+    for (size_t capacity = 3; capacity <= MIN_DATABLOCK_CAPACITY; capacity += MIN_DATABLOCK_CAPACITY - 3) {
+      DataBlock::setMinCapacity(capacity);
+      BufferReader reader;
+      reader.write(CSTR(numbers[i]), strlen(numbers[i]));
+      reader.readUnsigned(err, val);
+      ASSERT_EQ(err, errs[i]);
+      if (err == RET_OK) {
+        ASSERT_EQ(val, vals[i]);
+      }
+      ASSERT_EQ(reader.readLeft(), 2);
+    }
+  }
+  DataBlock::setMinCapacity(MIN_DATABLOCK_CAPACITY);
+}
+
+
+// what readUnsigned did before parseDigits
+static uint64_t parseBytewise(const char* begin, const char* end) {
+  uint64_t value = 0;
+  for (const char* p = begin; p != end; ++p) {
+    value = value * 10ULL + (*p - '0');
+  }
+  return value;
+}
+
+
+TEST(test_buffer, read_unsigned_value_lines) {
+  // flags, bytes and cas of VALUE lines, as the bytewise loop reads them
+  std::string line;
+  char header[64];
+  for (int i = 0; i < 1000; i++) {
+    snprintf(header, sizeof header, "%d %d %llu\r\n", i % 7, 100 + i,
+             6000000000000000000ULL + 7919ULL * i);
+    line.append(header);
+  }
+  std::vector<std::pair<const char*, const char*> > spans;
+  const char* end = line.data() + line.size();
+  for (const char* p = line.data(); p < end;) {
+    const char* q = findNotDigit(p, end);
+    spans.push_back(std::make_pair(p, q));
+    p = q + (*q == '\r' ? 2 : 1);
+  }
+  uint64_t sums[] = {0, 0, 0};
+  for (size_t i = 0; i < spans.size(); i++) {
+    sums[0] += parseBytewise(spans[i].first, spans[i].second);
+    uint64_t val = 0;
+    ASSERT_TRUE(douban::mc::io::parseDigits(spans[i].first, spans[i].second, val));
+    sums[1] += val;
+  }
+
+  err_code_t err;
+  BufferReader reader;
+  reader.write(const_cast<char*>(line.data()), line.size());
+  uint64_t val;
+  while (reader.readLeft() > 0) {
+    TEST_READ_UNSIGNED_NO_THROW(val);
+    sums[2] += val;
+    TEST_SKIP_BYTES_NO_THROW(reader.peek(err, 0) == '\r' ? 2 : 1);
+  }
+
+  ASSERT_EQ(sums[1], sums[0]);
+  ASSERT_EQ(sums[2], sums[0]);
+}
+
+
 TEST(test_buffer, read_bytes_empty) {
   err_code_t err;
   DataBlock::setMinCapacity(5);
@@ -436,7 +591,7 @@ TEST(test_buffer, read_bytes) {
   ASSERT_EQ(td.size(), 2);
   ASSERT_EQ(td.front().size, 5);
   ASSERT_EQ(td.front().offset, 0);
-  dbPtr = &*(td.front().iterator);
+  dbPtr = &*(td.front().block);
   dbPtr->release(td.front().size);
   ASSERT_N_STREQ((*dbPtr)[td.front().offset], "12345", 5);
   // td.pop_front();
@@ -444,7 +599,7 @@ TEST(test_buffer, read_bytes) {
 
   ASSERT_EQ(td.front().size, 1);
   ASSERT_EQ(td.front().offset, 0);
-  dbPtr = &*(td.front().iterator);
+  dbPtr = &*(td.front().block);
   dbPtr->release(td.front().size);
   ASSERT_N_STREQ((*dbPtr)[td.front().offset], "6", 1);
 
@@ -455,7 +610,7 @@ TEST(test_buffer, read_bytes) {
   ASSERT_EQ(td.size(), 1);
   ASSERT_EQ(td.front().size, 4);
   ASSERT_EQ(td.front().offset, 1);
-  dbPtr = &*(td.front().iterator);
+  dbPtr = &*(td.front().block);
   dbPtr->release(td.front().size);
   ASSERT_N_STREQ((*dbPtr)[td.front().offset], "8964", 4);
 
@@ -465,7 +620,7 @@ TEST(test_buffer, read_bytes) {
   ASSERT_EQ(td.size(), 1);
   ASSERT_EQ(td.front().size, 2);
   ASSERT_EQ(td.front().offset, 0);
-  dbPtr = &*(td.front().iterator);
+  dbPtr = &*(td.front().block);
   dbPtr->release(td.front().size);
   ASSERT_N_STREQ((*dbPtr)[td.front().offset], "\r\n", 2);
 
@@ -482,14 +637,14 @@ TEST(test_buffer, read_bytes) {
   ASSERT_EQ(td.size(), 2);
   ASSERT_EQ(td.front().size, 3);
   ASSERT_EQ(td.front().offset, 2);
-  dbPtr = &*(td.front().iterator);
+  dbPtr = &*(td.front().block);
   dbPtr->release(td.front().size);
   ASSERT_N_STREQ((*dbPtr)[td.front().offset], "syy", 3);
   // td.pop_front();
   td.erase(td.begin());
   ASSERT_EQ(td.front().size, 2);
   ASSERT_EQ(td.front().offset, 0);
-  dbPtr = &*(td.front().iterator);
+  dbPtr = &*(td.front().block);
   dbPtr->release(td.front().size);
   ASSERT_N_STREQ((*dbPtr)[td.front().offset], "in", 2);
 }
@@ -516,7 +671,7 @@ TEST(test_buffer, fuzzy) {
   ASSERT_EQ(td.size(), 1);
   ASSERT_EQ(td.front().offset, 0);
   ASSERT_EQ(td.front().size, 5);
-  dbPtr = &*(td.front().iterator);
+  dbPtr = &*(td.front().block);
   dbPtr->release(td.front().size);
   ASSERT_N_STREQ((*dbPtr)[td.front().offset], "VALUE", 5);
   TEST_SKIP_BYTES_NO_THROW(1);
@@ -527,7 +682,7 @@ TEST(test_buffer, fuzzy) {
   ASSERT_EQ(td.size(), 1);
   ASSERT_EQ(td.front().offset, 1);
   ASSERT_EQ(td.front().size, 3);
-  dbPtr = &*(td.front().iterator);
+  dbPtr = &*(td.front().block);
   dbPtr->release(td.front().size);
   ASSERT_N_STREQ((*dbPtr)[td.front().offset], "foo", 3);
   TEST_SKIP_BYTES_NO_THROW(1);
@@ -546,11 +701,11 @@ TEST(test_buffer, fuzzy) {
 
   reader.readBytes(err, nBytes + 4, td);
   ASSERT_EQ(err, RET_OK);
-  dbPtr = &*(td.front().iterator);
+  dbPtr = &*(td.front().block);
   dbPtr->release(td.front().size);
   // td.pop_front();
   td.erase(td.begin());
-  dbPtr = &*(td.front().iterator);
+  dbPtr = &*(td.front().block);
   dbPtr->release(td.front().size);
 
   ASSERT_EQ(reader.peek(err, 0), 'E');
@@ -579,3 +734,293 @@ TEST(test_buffer, scalability) {
   reader.reset();
   ASSERT_EQ(reader.capacity(), 3);
 }
+
+
+TEST(test_buffer, write_blocks) {
+  err_code_t err;
+  DataBlock::setMinCapacity(4);
+  BufferReader reader;
+  ASSERT_EQ(reader.recvSize(), 4);
+
+  reader.write(CSTR("012"), 3);
+  struct iovec iov[2];
+  size_t iovcnt = 2;
+  ASSERT_EQ(reader.prepareWriteBlocks(8, iov, iovcnt), 8);
+  ASSERT_EQ(iovcnt, 2);
+  ASSERT_EQ(iov[0].iov_len, 1);
+  ASSERT_EQ(iov[1].iov_len, 7);
+  std::memcpy(iov[0].iov_base, "3", 1);
+  std::memcpy(iov[1].iov_base, "45678", 5);
+  reader.commitWriteBlocks(6);
+  ASSERT_EQ(reader.size(), 9);
+  ASSERT_EQ(reader.nDataBlock(), 2);
+  ASSERT_EQ(reader.peek(err, 3), '3');
+  ASSERT_EQ(reader.peek(err, 8), '8');
+  ASSERT_EQ(err, RET_OK);
+
+  // batches of 100 bytes make the recv size grow, up to the scale limit
+  TEST_SKIP_BYTES_NO_THROW(9);
+  reader.reset();
+  ASSERT_EQ(reader.recvSize(), 16);
+  for (int i = 0; i < 20; i++) {
+    for (int j = 0; j < 10; j++) {
+      reader.write(CSTR("0123456789"), 10);
+    }
+    TEST_SKIP_BYTES_NO_THROW(100);
+    reader.reset();
+  }
+  ASSERT_EQ(reader.recvSize(), 128);
+  ASSERT_EQ(reader.getNextPreferedDataBlockSize(), 128);
+  reader.setNextPreferedDataBlockSize(1000);
+  ASSERT_EQ(reader.getNextPreferedDataBlockSize(), 1000);
+  ASSERT_EQ(reader.getNextPreferedDataBlockSize(), 128);
+  DataBlock::setMinCapacity(MIN_DATABLOCK_CAPACITY);
+}
+
+
+TEST(test_buffer, writer_copy_coalesce) {
+  BufferWriter writer;
+  const char* value = "bar";
+  for (int i = 0; i < 3; i++) {
+    writer.copyBuffer(CSTR("set foo "), 8);
+    writer.copyNumber(0);
+    writer.copyBuffer(CSTR(" "), 1);
+    writer.copyNumber(-42);
+    writer.copyBuffer(CSTR("\r\n"), 2);
+    writer.takeBuffer(value, 3);
+    writer.copyBuffer(CSTR("\r\n"), 2);
+  }
+  // header, value, CRLF + next header, value, ..., CRLF
+  ASSERT_EQ(writer.msgIovlen(), 7);
+
+  size_t n = 0;
+  const struct iovec* iov = writer.getReadPtr(n);
+  ASSERT_EQ(iov[0].iov_len, 15);
+  ASSERT_N_STREQ(static_cast<char*>(iov[0].iov_base), "set foo 0 -42\r\n", 15);
+  ASSERT_EQ(iov[1].iov_base, value);
+  ASSERT_EQ(iov[2].iov_len, 17);
+  ASSERT_N_STREQ(static_cast<char*>(iov[2].iov_base), "\r\nset foo 0 -42\r\n", 17);
+  ASSERT_EQ(iov[6].iov_len, 2);
+
+  writer.reset();
+  ASSERT_EQ(writer.msgIovlen(), 0);
+  writer.copyBuffer(CSTR("get foo\r\n"), 9);
+  iov = writer.getReadPtr(n);
+  ASSERT_EQ(n, 1);
+  ASSERT_N_STREQ(static_cast<char*>(iov[0].iov_base), "get foo\r\n", 9);
+}
+
+
+
+
+TEST(test_buffer, writer_number_reuse) {
+  BufferWriter writer;
+  char filler[3000];
+  memset(filler, 'x', sizeof filler);
+  const char* value = "bar";
+  const void* chunks[2];
+
+  for (int i = 0; i < 2; i++) {
+    writer.takeBuffer(CSTR("touch foo "), 10);
+    writer.takeNumber(0);
+    writer.takeBuffer(CSTR(" "), 1);
+    writer.takeNumber(-42);
+    writer.copyBuffer(filler, sizeof filler);
+    writer.takeBuffer(value, 3);
+    // does not fit in the first chunk any more
+    writer.copyBuffer(filler, sizeof filler);
+
+    size_t n = 0;
+    const struct iovec* iov = writer.getReadPtr(n);
+    ASSERT_EQ(n, 6);
+    ASSERT_N_STREQ(static_cast<char*>(iov[1].iov_base), "0", 1);
+    ASSERT_EQ(iov[3].iov_len, 3 + sizeof filler);
+    ASSERT_N_STREQ(static_cast<char*>(iov[3].iov_base), "-42", 3);
+    ASSERT_NE(iov[3].iov_base, iov[5].iov_base);
+    if (i == 0) {
+      chunks[0] = iov[3].iov_base;
+      chunks[1] = iov[5].iov_base;
+    } else {
+      // both chunks are reused after reset()
+      ASSERT_EQ(iov[3].iov_base, chunks[0]);
+      ASSERT_EQ(iov[5].iov_base, chunks[1]);
+    }
+    writer.reset();
+  }
+}
+TEST(test_buffer, ring_reuse) {
+  DataBlock::setMinCapacity(8);
+  BufferReader reader;
+  char data[40];
+  memset(data, 'x', sizeof data);
+
+  for (int i = 0; i < 5; i++) {
+    reader.write(data, 8);
+  }
+  ASSERT_EQ(reader.nDataBlock(), 5);
+  TokenData td;
+  err_code_t err;
+  reader.readBytes(err, 40, td);
+  ASSERT_EQ(err, RET_OK);
+  DataBlock* first = td[0].block;
+  DataBlock* second = td[1].block;
+  freeTokenData(td);
+  reader.reset();
+
+  // the blocks come back in ring order instead of being reallocated
+  for (int i = 0; i < 3; i++) {
+    reader.write(data, 8);
+    reader.write(data, 8);
+    ASSERT_EQ(reader.nDataBlock(), 2);
+    td.clear();
+    reader.readBytes(err, 16, td);
+    ASSERT_EQ(err, RET_OK);
+    ASSERT_EQ(td.size(), 2);
+    ASSERT_EQ(td[0].block, first);
+    ASSERT_EQ(td[1].block, second);
+    freeTokenData(td);
+    reader.reset();
+    ASSERT_EQ(reader.nDataBlock(), 1);
+    ASSERT_EQ(reader.size(), 0);
+    ASSERT_EQ(reader.retainedCapacity(), 40);
+  }
+  DataBlock::setMinCapacity(MIN_DATABLOCK_CAPACITY);
+}
+
+
+TEST(test_buffer, block_pool) {
+  block_pool_stats_t before, after;
+  BlockPool::getStats(&before);
+  char* ptr = BlockPool::allocate(3000);
+  ASSERT_TRUE(ptr != NULL);
+  ASSERT_EQ(reinterpret_cast<uintptr_t>(ptr) % MC_CACHE_LINE_SIZE, 0);
+  BlockPool::deallocate(ptr, 3000);
+
+  // same 8 KB class, from this thread's cache
+  char* ptr2 = BlockPool::allocate(8192);
+  ASSERT_EQ(ptr2, ptr);
+  BlockPool::getStats(&after);
+  ASSERT_EQ(after.allocs - before.allocs, 2);
+  ASSERT_GE(after.hits - before.hits, 1);
+  BlockPool::deallocate(ptr2, 8192);
+
+  // too large to be cached
+  ptr = BlockPool::allocate(4 << 20);
+  ASSERT_TRUE(ptr != NULL);
+  BlockPool::deallocate(ptr, 4 << 20);
+  BlockPool::getStats(&before);
+  ASSERT_EQ(before.retained_bytes, after.retained_bytes + 8192);
+}
+
+
+TEST(test_buffer, block_pool_mapped) {
+  // the tests after this one run on mapped blocks too
+  block_pool_stats_t stats;
+  ASSERT_EQ(BlockPool::reserveMapped(1), 0);
+  ASSERT_EQ(BlockPool::reserveMapped(1), -EEXIST);
+  BlockPool::getStats(&stats);
+  ASSERT_EQ(stats.mapped_bytes, MC_HUGE_PAGE_SIZE);
+  ASSERT_EQ(stats.mapped_used_bytes, 0);
+
+  char* ptr = BlockPool::allocate(100 << 10);
+  ASSERT_TRUE(ptr != NULL);
+  memset(ptr, 'm', 100 << 10);
+  BlockPool::getStats(&stats);
+  ASSERT_EQ(stats.mapped_used_bytes, 128 << 10);
+  BlockPool::deallocate(ptr, 100 << 10);
+  BlockPool::getStats(&stats);
+  ASSERT_EQ(stats.mapped_used_bytes, 0);
+
+  // reused, not carved again
+  ASSERT_EQ(BlockPool::allocate(128 << 10), ptr);
+  char* large = BlockPool::allocate(1 << 20);
+  ASSERT_EQ(large, ptr + (128 << 10));
+  // what is left of the mapping is too small, so from the heap
+  char* heap = BlockPool::allocate(1 << 20);
+  ASSERT_TRUE(heap != NULL);
+  BlockPool::getStats(&stats);
+  ASSERT_EQ(stats.mapped_used_bytes, (128 << 10) + (1 << 20));
+  BlockPool::deallocate(heap, 1 << 20);
+  BlockPool::deallocate(large, 1 << 20);
+  BlockPool::deallocate(ptr, 128 << 10);
+  BlockPool::getStats(&stats);
+  ASSERT_EQ(stats.mapped_used_bytes, 0);
+}
+
+
+TEST(test_buffer, request_arena) {
+  DataBlock::setMinCapacity(8);
+  BufferReader reader;
+  reader.write(CSTR("VALUE "), 6);
+  reader.write(CSTR("0123456789abcdef"), 16);
+  DataBlock::setMinCapacity(MIN_DATABLOCK_CAPACITY);
+
+  err_code_t err;
+  TokenData td;
+  reader.skipBytes(err, 6);
+  reader.readBytes(err, 16, td);
+  ASSERT_EQ(err, RET_OK);
+  ASSERT_GT(td.size(), 1);
+
+  RequestArena arena;
+  size_t nSlices = td.size();
+  TokenSlices ts;
+  ts.assign(td, arena);
+  ASSERT_TRUE(td.empty());
+  ASSERT_EQ(ts.size(), nSlices);
+  // the slices are spilled, then joined
+  size_t spilled = arena.allocatedBytes();
+  const char* first = reinterpret_cast<const char*>(ts.begin());
+  ASSERT_GE(spilled, nSlices * sizeof(douban::mc::io::DataBlockSlice));
+  char* joined = douban::mc::io::parseTokenData(ts, 16, arena);
+  ASSERT_N_STREQ(joined, "0123456789abcdef", 16);
+  ASSERT_EQ(arena.allocatedBytes(), spilled + 16);
+  douban::mc::io::freeTokenData(ts);
+
+  char* large = arena.allocate(MC_REQUEST_ARENA_CHUNK_SIZE);
+  ASSERT_TRUE(large != NULL);
+  ASSERT_EQ(arena.retainedBytes(), 2 * MC_REQUEST_ARENA_CHUNK_SIZE);
+
+  // the large one is gone, the chunk stays for the next request
+  arena.reset();
+  ASSERT_EQ(arena.allocatedBytes(), 0);
+  ASSERT_EQ(arena.retainedBytes(), MC_REQUEST_ARENA_CHUNK_SIZE);
+  ASSERT_EQ(arena.allocate(spilled + 16), first);
+}
+
+
+TEST(test_buffer, scan) {
+  // every length and offset around the 16 and 32 byte vectors
+  char buf[100];
+  for (size_t len = 0; len <= 80; len++) {
+    for (size_t pos = 0; pos <= len; pos++) {
+      memset(buf, '7', sizeof buf);
+      const char* end = buf + len;
+      const char* expected = buf + pos;
+      if (pos < len) {
+        buf[pos] = '\r';
+      }
+      // the bytes past end must not be looked at
+      buf[len] = ' ';
+      ASSERT_EQ(findChar(buf, end, '\r'), expected);
+      ASSERT_EQ(findEither(buf, end, ' ', '\r'), expected);
+      ASSERT_EQ(findNotDigit(buf, end), expected);
+      if (pos < len) {
+        buf[pos] = ' ';
+        ASSERT_EQ(findEither(buf, end, ' ', '\r'), expected);
+        // the first of two
+        if (pos + 1 < len) {
+          buf[pos + 1] = '\r';
+          ASSERT_EQ(findEither(buf, end, ' ', '\r'), expected);
+        }
+        // around '0' and '9'
+        buf[pos] = '/';
+        ASSERT_EQ(findNotDigit(buf, end), expected);
+        buf[pos] = ':';
+        ASSERT_EQ(findNotDigit(buf, end), expected);
+        buf[pos] = '\xb0';
+        ASSERT_EQ(findNotDigit(buf, end), expected);
+      }
+    }
+  }
+}
@@ -1,8 +1,16 @@
 #include "Client.h"
+#include "IoUring.h"
 #include "Result.h"
 #include "test_common.h"
 
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <unistd.h>
 #include <cstring>
+#include <thread>
+#include <vector>
+#include <algorithm>
 #include "gtest/gtest.h"
 
 using douban::mc::Client;
@@ -264,6 +272,76 @@ TEST(test_client, test_stats) {
 }
 
 
+TEST(test_client, test_stats_typed) {
+  // the counters of each server as stats() has them, and over all three
+  Client* client = newClient(3);
+  if (client == NULL) {
+    hint();
+  } else {
+    for (int binary = 0; binary < 2; binary++) {
+      client->config(CFG_USE_BINARY_PROTOCOL, binary);
+      server_stats_t* results = NULL;
+      cluster_stats_t cluster;
+      size_t nHosts = 0;
+      ASSERT_EQ(client->statsTyped(&results, &nHosts, &cluster), RET_OK);
+      ASSERT_EQ(nHosts, 3);
+      ASSERT_EQ(cluster.n_servers, 3);
+      ASSERT_EQ(cluster.n_present[STAT_PID], 3);
+      uint64_t sumItems = 0;
+      for (size_t i = 0; i < nHosts; i++) {
+        ASSERT_TRUE(strlen(results[i].host) > 0);
+        ASSERT_TRUE(results[i].present & (1ULL << STAT_PID));
+        ASSERT_TRUE(results[i].present & (1ULL << STAT_CURR_ITEMS));
+        ASSERT_GE(results[i].values[STAT_PID], cluster.min[STAT_PID]);
+        ASSERT_LE(results[i].values[STAT_PID], cluster.max[STAT_PID]);
+        sumItems += results[i].values[STAT_CURR_ITEMS];
+      }
+      ASSERT_EQ(cluster.sum[STAT_CURR_ITEMS], sumItems);
+      std::vector<uint64_t> pids;
+      for (size_t i = 0; i < nHosts; i++) {
+        pids.push_back(results[i].values[STAT_PID]);
+      }
+
+      broadcast_result_t* b_results = NULL;
+      ASSERT_EQ(client->stats(&b_results, &nHosts), RET_OK);
+      for (size_t i = 0; i < nHosts; i++) {
+        ASSERT_N_STREQ(b_results[i].lines[0], "pid ", 4);
+        ASSERT_EQ(strtoull(b_results[i].lines[0] + 4, NULL, 10), pids[i]);
+      }
+      client->destroyBroadcastResult();
+    }
+    client->config(CFG_USE_BINARY_PROTOCOL, 0);
+  }
+  delete client;
+}
+
+
+TEST(test_client, test_stats_typed_unreachable) {
+  // the server at a closed port is left out, however many times it is asked
+  const char* hosts[] = {"127.0.0.1", "127.0.0.1"};
+  const uint32_t ports[] = {21211, 1};
+  Client* client = new Client();
+  client->init(hosts, ports, 2);
+  for (int i = 0; i < 2; i++) {
+    server_stats_t* results = NULL;
+    cluster_stats_t cluster;
+    size_t nHosts = 0;
+    client->statsTyped(&results, &nHosts, &cluster);
+    ASSERT_EQ(nHosts, 2);
+    if (results[0].present == 0) {
+      hint();
+      break;
+    }
+    ASSERT_EQ(results[1].present, 0);
+    ASSERT_EQ(results[1].values[STAT_PID], 0);
+    ASSERT_EQ(cluster.n_servers, 1);
+    ASSERT_EQ(cluster.n_present[STAT_PID], 1);
+    ASSERT_EQ(cluster.sum[STAT_PID], results[0].values[STAT_PID]);
+  }
+  delete client;
+}
+
+
 TEST(test_client, test_touch) {
   Client* client = newClient(1);
   if (client == NULL) {
@@ -425,3 +503,996 @@ TEST(client, update_server) {
     ASSERT_EQ(rv, -3);
   }
 }
+
+
+// Harvests tickets until n of them are done, in the order they completed.
+static err_code_t completeAll(Client* client, size_t n, std::vector<ticket_t>* done) {
+  err_code_t rv = RET_OK;
+  while (done->size() < n) {
+    ticket_t* tickets = NULL;
+    size_t nTickets = 0;
+    err_code_t err = client->complete(-1, &tickets, &nTickets);
+    if (err != RET_OK) {
+      rv = err;
+    }
+    if (nTickets == 0) {
+      break;
+    }
+    done->insert(done->end(), tickets, tickets + nTickets);
+  }
+  return rv;
+}
+
+
+TEST(test_client, async_tickets) {
+  Client* client = newClient(3);
+  if (client == NULL) {
+    hint();
+  } else {
+    const char* keys[] = {
+      "async_foo", "async_tuiche", "async_buzai"
+    };
+    size_t key_lens[] = {9, 12, 11};
+    flags_t flags[] = {0, 0, 0};
+    const char* vals[] = {
+      "value of foo", "value of tuiche", "value of buzai"
+    };
+    size_t val_lens[] = {12, 15, 14};
+    retrieval_result_t **r_results = NULL;
+    message_result_t **m_results = NULL;
+    size_t nResults = 0;
+    std::vector<ticket_t> done;
+    ticket_t tDel, tSet, tGet, tGets, tMiss;
+
+    ASSERT_EQ(client->deleteAsync(keys, key_lens, false, 3, &tDel), RET_OK);
+    ASSERT_EQ(client->setAsync(keys, key_lens, flags, 0, NULL, false, vals, val_lens, 2, &tSet),
+              RET_OK);
+    ASSERT_EQ(client->getAsync(keys, key_lens, 3, &tGet), RET_OK);
+    ASSERT_EQ(client->getsAsync(keys + 1, key_lens + 1, 1, &tGets), RET_OK);
+    ASSERT_EQ(client->getAsync(keys + 2, key_lens + 2, 1, &tMiss), RET_OK);
+
+    // no synchronous command while tickets are in flight
+    ASSERT_EQ(client->get(keys, key_lens, 3, &r_results, &nResults), RET_PROGRAMMING_ERR);
+    ASSERT_EQ(nResults, 0);
+
+    ASSERT_EQ(completeAll(client, 5, &done), RET_OK);
+    ASSERT_EQ(done.size(), 5);
+    std::sort(done.begin(), done.end());
+    ASSERT_EQ(done[0], tDel);
+    ASSERT_EQ(done[4], tMiss);
+
+    ASSERT_EQ(client->ticketMessageResult(tDel, &m_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 3);
+
+    ASSERT_EQ(client->ticketMessageResult(tSet, &m_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 2);
+    for (size_t i = 0; i < nResults; i++) {
+      ASSERT_EQ(m_results[i]->type_, MSG_STORED);
+    }
+
+    ASSERT_EQ(client->ticketRetrievalResult(tGet, &r_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 2);
+    for (size_t i = 0; i < nResults; i++) {
+      size_t j = r_results[i]->key_len == key_lens[0] ? 0 : 1;
+      ASSERT_N_STREQ(r_results[i]->key, keys[j], key_lens[j]);
+      ASSERT_EQ(r_results[i]->bytes, val_lens[j]);
+      ASSERT_N_STREQ(r_results[i]->data_block, vals[j], val_lens[j]);
+    }
+
+    ASSERT_EQ(client->ticketRetrievalResult(tGets, &r_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 1);
+    ASSERT_N_STREQ(r_results[0]->key, keys[1], key_lens[1]);
+    ASSERT_TRUE(r_results[0]->cas_unique > 0);
+
+    ASSERT_EQ(client->ticketRetrievalResult(tMiss, &r_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 0);
+
+    // more batches go behind the tickets not destroyed yet
+    ticket_t tAgain;
+    done.clear();
+    ASSERT_EQ(client->getAsync(keys, key_lens, 1, &tAgain), RET_OK);
+    ASSERT_EQ(completeAll(client, 1, &done), RET_OK);
+    ASSERT_EQ(done[0], tAgain);
+    ASSERT_EQ(client->ticketRetrievalResult(tAgain, &r_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 1);
+    ASSERT_N_STREQ(r_results[0]->data_block, vals[0], val_lens[0]);
+    ASSERT_EQ(client->ticketRetrievalResult(tGets, &r_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 1);
+
+    // no synchronous command before destroyTickets()
+    ASSERT_EQ(client->get(keys, key_lens, 3, &r_results, &nResults), RET_PROGRAMMING_ERR);
+    client->destroyTickets();
+    ASSERT_EQ(client->ticketRetrievalResult(tGets, &r_results, &nResults), RET_PROGRAMMING_ERR);
+
+    client->_delete(keys, key_lens, false, 3, &m_results, &nResults);
+    ASSERT_EQ(nResults, 3);
+    client->destroyMessageResult();
+    delete client;
+  }
+}
+
+
+TEST(test_client, meta_protocol) {
+  Client* client = newClient(3);
+  if (client == NULL) {
+    hint();
+  } else {
+    client->config(CFG_USE_META_PROTOCOL, 1);
+    const char* keys[] = {
+      "meta_foo", "meta_tuiche", "meta_buzai", "meta_missing"
+    };
+    size_t key_lens[] = {8, 11, 10, 12};
+    flags_t flags[] = {0, 1, 65535, 0};
+    const char* vals[] = {
+      "value of foo", "value of tuiche", "", "99"
+    };
+    size_t val_lens[] = {12, 15, 0, 2};
+    retrieval_result_t **r_results = NULL;
+    message_result_t **m_results = NULL;
+    unsigned_result_t *u_results = NULL;
+    size_t nResults = 0;
+
+    client->_delete(keys, key_lens, false, 4, &m_results, &nResults);
+    ASSERT_EQ(nResults, 4);
+    client->destroyMessageResult();
+
+    // quiet, the results of the keys not answered are made up
+    ASSERT_EQ(client->set(keys, key_lens, flags, 0, NULL, false, vals, val_lens, 3,
+                          &m_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 3);
+    for (size_t i = 0; i < nResults; i++) {
+      ASSERT_EQ(m_results[i]->type_, MSG_STORED);
+    }
+    client->destroyMessageResult();
+    ASSERT_EQ(client->add(keys + 1, key_lens + 1, flags, 0, NULL, false, vals, val_lens, 1,
+                          &m_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 1);
+    ASSERT_EQ(m_results[0]->type_, MSG_NOT_STORED);
+    client->destroyMessageResult();
+
+    // keys are matched by opaque, and point to the ones asked for
+    ASSERT_EQ(client->get(keys, key_lens, 4, &r_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 3);
+    for (size_t i = 0; i < nResults; i++) {
+      size_t j = 0;
+      while (r_results[i]->key != keys[j]) {
+        ASSERT_LT(++j, 3);
+      }
+      ASSERT_EQ(r_results[i]->key_len, key_lens[j]);
+      ASSERT_EQ(r_results[i]->flags, flags[j]);
+      ASSERT_EQ(r_results[i]->bytes, val_lens[j]);
+      ASSERT_N_STREQ(r_results[i]->data_block, vals[j], val_lens[j]);
+    }
+    client->destroyRetrievalResult();
+
+    ASSERT_EQ(client->gets(keys, key_lens, 1, &r_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 1);
+    cas_unique_t cas = r_results[0]->cas_unique + 1;
+    ASSERT_GT(cas, 1);
+    client->destroyRetrievalResult();
+    ASSERT_EQ(client->cas(keys, key_lens, flags, 0, &cas, false, vals, val_lens, 1,
+                          &m_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 1);
+    ASSERT_EQ(m_results[0]->type_, MSG_EXISTS);
+    client->destroyMessageResult();
+    --cas;
+    ASSERT_EQ(client->cas(keys, key_lens, flags, 0, &cas, false, vals, val_lens, 1,
+                          &m_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 1);
+    ASSERT_EQ(m_results[0]->type_, MSG_STORED);
+    client->destroyMessageResult();
+
+    ASSERT_EQ(client->touch(keys + 2, key_lens + 2, 0, false, 2, &m_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 2);
+    for (size_t i = 0; i < nResults; i++) {
+      ASSERT_EQ(m_results[i]->type_, m_results[i]->key == keys[2] ? MSG_TOUCHED : MSG_NOT_FOUND);
+    }
+    client->destroyMessageResult();
+
+    ASSERT_EQ(client->incr(keys[3], key_lens[3], 1, false, &u_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 1);
+    ASSERT_TRUE(u_results == NULL);
+    client->destroyUnsignedResult();
+    client->set(keys + 3, key_lens + 3, flags, 0, NULL, false, vals + 3, val_lens + 3, 1,
+                &m_results, &nResults);
+    client->destroyMessageResult();
+    ASSERT_EQ(client->incr(keys[3], key_lens[3], 1, false, &u_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 1);
+    ASSERT_EQ(u_results->value, 100);
+    client->destroyUnsignedResult();
+    ASSERT_EQ(client->decr(keys[3], key_lens[3], 3, false, &u_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 1);
+    ASSERT_EQ(u_results->value, 97);
+    client->destroyUnsignedResult();
+
+    // batches of meta commands queued behind each other
+    ticket_t tDel, tGet;
+    std::vector<ticket_t> done;
+    ASSERT_EQ(client->deleteAsync(keys, key_lens, false, 2, &tDel), RET_OK);
+    ASSERT_EQ(client->getAsync(keys, key_lens, 4, &tGet), RET_OK);
+    ASSERT_EQ(completeAll(client, 2, &done), RET_OK);
+    ASSERT_EQ(client->ticketMessageResult(tDel, &m_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 2);
+    for (size_t i = 0; i < nResults; i++) {
+      ASSERT_EQ(m_results[i]->type_, MSG_DELETED);
+    }
+    ASSERT_EQ(client->ticketRetrievalResult(tGet, &r_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 2);
+    client->destroyTickets();
+
+    // noreply commands are sent the classic way
+    ASSERT_EQ(client->_delete(keys, key_lens, true, 4, &m_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 0);
+    client->destroyMessageResult();
+    ASSERT_EQ(client->get(keys, key_lens, 4, &r_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 0);
+    client->destroyRetrievalResult();
+  }
+  delete client;
+}
+
+
+TEST(test_client, binary_protocol) {
+  Client* client = newClient(3);
+  if (client == NULL) {
+    hint();
+  } else {
+    client->config(CFG_USE_BINARY_PROTOCOL, 1);
+    const char* keys[] = {
+      "binary_foo", "binary_tuiche", "binary_buzai", "binary_missing"
+    };
+    size_t key_lens[] = {10, 13, 12, 14};
+    flags_t flags[] = {0, 1, 65535, 0};
+    const char* vals[] = {
+      "value of foo", "value of\r\ntuiche", "", "99"
+    };
+    size_t val_lens[] = {12, 16, 0, 2};
+    retrieval_result_t **r_results = NULL;
+    message_result_t **m_results = NULL;
+    unsigned_result_t *u_results = NULL;
+    size_t nResults = 0;
+
+    client->_delete(keys, key_lens, false, 4, &m_results, &nResults);
+    ASSERT_EQ(nResults, 4);
+    client->destroyMessageResult();
+
+    // quiet, the results of the keys not answered are made up
+    ASSERT_EQ(client->set(keys, key_lens, flags, 0, NULL, false, vals, val_lens, 3,
+                          &m_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 3);
+    for (size_t i = 0; i < nResults; i++) {
+      ASSERT_EQ(m_results[i]->type_, MSG_STORED);
+    }
+    client->destroyMessageResult();
+    ASSERT_EQ(client->add(keys + 1, key_lens + 1, flags, 0, NULL, false, vals, val_lens, 1,
+                          &m_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 1);
+    ASSERT_EQ(m_results[0]->type_, MSG_NOT_STORED);
+    client->destroyMessageResult();
+    ASSERT_EQ(client->append(keys + 3, key_lens + 3, flags, 0, NULL, false, vals, val_lens, 1,
+                             &m_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 1);
+    ASSERT_EQ(m_results[0]->type_, MSG_NOT_STORED);
+    client->destroyMessageResult();
+
+    // keys are matched by opaque, and point to the ones asked for
+    ASSERT_EQ(client->get(keys, key_lens, 4, &r_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 3);
+    for (size_t i = 0; i < nResults; i++) {
+      size_t j = 0;
+      while (r_results[i]->key != keys[j]) {
+        ASSERT_LT(++j, 3);
+      }
+      ASSERT_EQ(r_results[i]->key_len, key_lens[j]);
+      ASSERT_EQ(r_results[i]->flags, flags[j]);
+      ASSERT_EQ(r_results[i]->bytes, val_lens[j]);
+      ASSERT_N_STREQ(r_results[i]->data_block, vals[j], val_lens[j]);
+    }
+    client->destroyRetrievalResult();
+
+    ASSERT_EQ(client->gets(keys, key_lens, 1, &r_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 1);
+    cas_unique_t cas = r_results[0]->cas_unique + 1;
+    ASSERT_GT(cas, 1);
+    client->destroyRetrievalResult();
+    ASSERT_EQ(client->cas(keys, key_lens, flags, 0, &cas, false, vals, val_lens, 1,
+                          &m_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 1);
+    ASSERT_EQ(m_results[0]->type_, MSG_EXISTS);
+    client->destroyMessageResult();
+    --cas;
+    ASSERT_EQ(client->cas(keys, key_lens, flags, 0, &cas, false, vals, val_lens, 1,
+                          &m_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 1);
+    ASSERT_EQ(m_results[0]->type_, MSG_STORED);
+    client->destroyMessageResult();
+
+    ASSERT_EQ(client->touch(keys + 2, key_lens + 2, 0, false, 2, &m_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 2);
+    for (size_t i = 0; i < nResults; i++) {
+      ASSERT_EQ(m_results[i]->type_, m_results[i]->key == keys[2] ? MSG_TOUCHED : MSG_NOT_FOUND);
+    }
+    client->destroyMessageResult();
+
+    ASSERT_EQ(client->incr(keys[3], key_lens[3], 1, false, &u_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 1);
+    ASSERT_TRUE(u_results == NULL);
+    client->destroyUnsignedResult();
+    client->set(keys + 3, key_lens + 3, flags, 0, NULL, false, vals + 3, val_lens + 3, 1,
+                &m_results, &nResults);
+    client->destroyMessageResult();
+    ASSERT_EQ(client->incr(keys[3], key_lens[3], 1, false, &u_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 1);
+    ASSERT_EQ(u_results->value, 100);
+    client->destroyUnsignedResult();
+    ASSERT_EQ(client->decr(keys[3], key_lens[3], 3, false, &u_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 1);
+    ASSERT_EQ(u_results->value, 97);
+    client->destroyUnsignedResult();
+
+    broadcast_result_t* b_results = NULL;
+    size_t nHosts = 0;
+    ASSERT_EQ(client->version(&b_results, &nHosts), RET_OK);
+    ASSERT_EQ(nHosts, 3);
+    for (size_t i = 0; i < nHosts; i++) {
+      ASSERT_EQ(b_results[i].len, 1);
+      ASSERT_TRUE('0' <= b_results[i].lines[0][0] && b_results[i].lines[0][0] <= '9');
+    }
+    client->destroyBroadcastResult();
+    ASSERT_EQ(client->stats(&b_results, &nHosts), RET_OK);
+    ASSERT_EQ(nHosts, 3);
+    for (size_t i = 0; i < nHosts; i++) {
+      ASSERT_GT(b_results[i].len, 1);
+      // "<name> <value>", as the text protocol has them
+      ASSERT_TRUE(memchr(b_results[i].lines[0], ' ', b_results[i].line_lens[0]) != NULL);
+    }
+    client->destroyBroadcastResult();
+
+    // batches queued behind each other
+    ticket_t tDel, tGet;
+    std::vector<ticket_t> done;
+    ASSERT_EQ(client->deleteAsync(keys, key_lens, false, 2, &tDel), RET_OK);
+    ASSERT_EQ(client->getAsync(keys, key_lens, 4, &tGet), RET_OK);
+    ASSERT_EQ(completeAll(client, 2, &done), RET_OK);
+    ASSERT_EQ(client->ticketMessageResult(tDel, &m_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 2);
+    for (size_t i = 0; i < nResults; i++) {
+      ASSERT_EQ(m_results[i]->type_, MSG_DELETED);
+    }
+    ASSERT_EQ(client->ticketRetrievalResult(tGet, &r_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 2);
+    client->destroyTickets();
+
+    // noreply commands are binary too, the misses of the first two are
+    // answered all the same and passed over by the get
+    ASSERT_EQ(client->_delete(keys, key_lens, true, 4, &m_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 0);
+    client->destroyMessageResult();
+    ASSERT_EQ(client->get(keys, key_lens, 4, &r_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 0);
+    client->destroyRetrievalResult();
+
+    // the connections are reopened in text
+    client->config(CFG_USE_BINARY_PROTOCOL, 0);
+    ASSERT_EQ(client->set(keys, key_lens, flags, 0, NULL, false, vals, val_lens, 1,
+                          &m_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 1);
+    ASSERT_EQ(m_results[0]->type_, MSG_STORED);
+    client->destroyMessageResult();
+  }
+  delete client;
+}
+
+
+TEST(test_client, zerocopy_large_value) {
+  Client* client = newClient(1);
+  if (client == NULL) {
+    hint();
+  } else {
+    client->config(CFG_ZEROCOPY_THRESHOLD, 16 * 1024);
+    const char* keys[] = {"zerocopy_large", "zerocopy_small"};
+    size_t key_lens[] = {14, 14};
+    flags_t flags[] = {0, 0};
+    size_t val_lens[] = {512 * 1024, 16};
+    char* large = new char[val_lens[0]];
+    memset(large, 'z', val_lens[0]);
+    const char* vals[] = {large, "small value here"};
+    message_result_t **m_results = NULL;
+    retrieval_result_t **r_results = NULL;
+    size_t nResults = 0;
+
+    ASSERT_EQ(client->set(keys, key_lens, flags, 0, NULL, false, vals, val_lens, 2,
+                          &m_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 2);
+    client->destroyMessageResult();
+    // the buffer is ours again once set() returned
+    memset(large, 'x', val_lens[0]);
+
+    ASSERT_EQ(client->get(keys, key_lens, 1, &r_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 1);
+    ASSERT_EQ(r_results[0]->bytes, val_lens[0]);
+    ASSERT_EQ(r_results[0]->data_block[0], 'z');
+    ASSERT_EQ(r_results[0]->data_block[val_lens[0] - 1], 'z');
+    client->destroyRetrievalResult();
+    delete[] large;
+  }
+  delete client;
+}
+
+
+TEST(test_client, fragmented_get) {
+  Client* client = newClient(1);
+  if (client == NULL) {
+    hint();
+  } else {
+    const char* keys[] = {"fragmented_large", "fragmented_small"};
+    size_t key_lens[] = {16, 16};
+    flags_t flags[] = {3, 4};
+    size_t val_lens[] = {1024 * 1024 + 7, 5};
+    std::string large(val_lens[0], 'f');
+    for (size_t i = 0; i < large.size(); i += 4096) {
+      large[i] = static_cast<char>('a' + i % 26);
+    }
+    const char* vals[] = {large.data(), "small"};
+    message_result_t **m_results = NULL;
+    fragmented_retrieval_result_t **f_results = NULL;
+    size_t nResults = 0;
+
+    ASSERT_EQ(client->set(keys, key_lens, flags, 0, NULL, false, vals, val_lens, 2,
+                          &m_results, &nResults), RET_OK);
+    client->destroyMessageResult();
+
+    ASSERT_EQ(client->getFragmented(keys, key_lens, 2, &f_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 2);
+    for (size_t i = 0; i < nResults; i++) {
+      fragmented_retrieval_result_t* r = f_results[i];
+      size_t j = r->key_len == key_lens[0] && memcmp(r->key, keys[0], r->key_len) == 0 ? 0 : 1;
+      ASSERT_EQ(r->bytes, val_lens[j]);
+      ASSERT_EQ(r->flags, flags[j]);
+      std::string joined;
+      for (uint32_t k = 0; k < r->n_fragments; k++) {
+        joined.append(r->fragments[k].ptr, r->fragments[k].len);
+      }
+      ASSERT_TRUE(joined == std::string(vals[j], val_lens[j]));
+      if (j == 0) {
+        // received over many reads
+        ASSERT_GT(r->n_fragments, 1);
+      }
+    }
+    client->destroyRetrievalResult();
+  }
+  delete client;
+}
+
+
+TEST(test_client, indexed_get) {
+  // over three servers, in each protocol
+  Client* client = newClient(3);
+  if (client == NULL) {
+    hint();
+  } else {
+    const char* keys[] = {"indexed_0", "indexed_miss", "indexed_2", "bad key", "indexed_4",
+                          "indexed_0"};
+    size_t key_lens[] = {9, 12, 9, 7, 9, 9};
+    flags_t flags[] = {0, 0, 2, 0, 4};
+    const char* vals[] = {"v0", "", "v2", "", "v4"};
+    size_t val_lens[] = {2, 0, 2, 0, 2};
+    message_result_t **m_results = NULL;
+    retrieval_result_t **r_results = NULL;
+    size_t nResults = 0;
+
+    const char* delKeys[] = {keys[1]};
+    client->_delete(delKeys, key_lens + 1, false, 1, &m_results, &nResults);
+    client->destroyMessageResult();
+    const char* setKeys[] = {keys[0], keys[2], keys[4]};
+    size_t setKeyLens[] = {9, 9, 9};
+    flags_t setFlags[] = {0, 2, 4};
+    const char* setVals[] = {vals[0], vals[2], vals[4]};
+    size_t setValLens[] = {2, 2, 2};
+    ASSERT_EQ(client->set(setKeys, setKeyLens, setFlags, 0, NULL, false, setVals, setValLens, 3,
+                          &m_results, &nResults), RET_OK);
+    client->destroyMessageResult();
+
+    for (int protocol = 0; protocol < 3; protocol++) {
+      client->config(CFG_USE_META_PROTOCOL, protocol == 1);
+      client->config(CFG_USE_BINARY_PROTOCOL, protocol == 2);
+      ASSERT_EQ(client->getIndexed(keys, key_lens, 6, &r_results, &nResults), RET_OK);
+      ASSERT_EQ(nResults, 4);
+      for (size_t i = 0; i < 6; i++) {
+        if (i == 1 || i == 3) {
+          ASSERT_TRUE(r_results[i] == NULL);
+          continue;
+        }
+        // the caller's own key, but for a text VALUE line split over
+        // blocks, whose key is taken as echoed
+        retrieval_result_t* r = r_results[i];
+        ASSERT_TRUE(r != NULL);
+        if (protocol > 0) {
+          ASSERT_EQ(r->key, keys[i]);
+        }
+        ASSERT_EQ(r->key_len, key_lens[i]);
+        ASSERT_N_STREQ(r->key, keys[i], key_lens[i]);
+        ASSERT_EQ(r->flags, flags[i % 5]);
+        ASSERT_N_STREQ(r->data_block, vals[i % 5], val_lens[i % 5]);
+      }
+      client->destroyRetrievalResult();
+    }
+    client->config(CFG_USE_META_PROTOCOL, 0);
+    client->config(CFG_USE_BINARY_PROTOCOL, 0);
+  }
+  delete client;
+}
+
+
+struct StreamSink {
+  Client* client;
+  std::string key;
+  std::string value;
+  uint32_t bytes;
+  flags_t flags;
+  int calls;
+  bool inOrder;
+  size_t peakBufferBytes;
+};
+
+
+static void collectChunk(void* ctx, const retrieval_chunk_t* chunk) {
+  StreamSink* sink = static_cast<StreamSink*>(ctx);
+  if (chunk->offset == 0) {
+    sink->value.clear();
+  }
+  sink->inOrder = sink->inOrder && chunk->offset == sink->value.size();
+  sink->key.assign(chunk->key, chunk->key_len);
+  sink->value.append(chunk->data, chunk->len);
+  sink->bytes = chunk->bytes;
+  sink->flags = chunk->flags;
+  sink->calls++;
+  memory_stats_t stats;
+  sink->client->getMemoryStats(&stats);
+  sink->peakBufferBytes = MAX(sink->peakBufferBytes, stats.buffer_bytes);
+}
+
+
+TEST(test_client, stream_large_value) {
+  Client* client = newClient(1);
+  if (client == NULL) {
+    hint();
+  } else {
+    const char* keys[] = {"stream_large", "stream_empty", "stream_missing"};
+    size_t key_lens[] = {12, 12, 14};
+    flags_t flags[] = {7, 8};
+    size_t val_lens[] = {4 * 1024 * 1024 + 3, 0};
+    std::string large(val_lens[0], 's');
+    for (size_t i = 0; i < large.size(); i += 4096) {
+      large[i] = static_cast<char>('a' + i % 26);
+    }
+    const char* vals[] = {large.data(), ""};
+    message_result_t **m_results = NULL;
+    size_t nResults = 0;
+
+    ASSERT_EQ(client->set(keys, key_lens, flags, 0, NULL, false, vals, val_lens, 2,
+                          &m_results, &nResults), RET_OK);
+    client->destroyMessageResult();
+    ASSERT_EQ(client->_delete(keys + 2, key_lens + 2, false, 1, &m_results, &nResults),
+              RET_OK);
+    client->destroyMessageResult();
+
+    StreamSink sink = {client, "", "", 0, 0, 0, true, 0};
+    ASSERT_EQ(client->getStream(keys, key_lens, 1, collectChunk, &sink), RET_OK);
+    ASSERT_TRUE(sink.inOrder);
+    ASSERT_GT(sink.calls, 1);
+    ASSERT_EQ(sink.key, std::string(keys[0], key_lens[0]));
+    ASSERT_EQ(sink.bytes, val_lens[0]);
+    ASSERT_EQ(sink.flags, flags[0]);
+    ASSERT_TRUE(sink.value == large);
+    // the receive buffers are reused instead of holding the whole value
+    ASSERT_LT(sink.peakBufferBytes, val_lens[0] / 4);
+
+    // an empty value gets one call, a miss gets none
+    StreamSink empty = {client, "", "", 1, 0, 0, true, 0};
+    ASSERT_EQ(client->getsStream(keys + 1, key_lens + 1, 2, collectChunk, &empty), RET_OK);
+    ASSERT_EQ(empty.calls, 1);
+    ASSERT_EQ(empty.key, std::string(keys[1], key_lens[1]));
+    ASSERT_EQ(empty.bytes, 0);
+    ASSERT_EQ(empty.flags, flags[1]);
+    ASSERT_TRUE(empty.value.empty());
+
+    // results are not kept, and plain retrieval still works afterwards
+    retrieval_result_t **r_results = NULL;
+    ASSERT_EQ(client->get(keys + 1, key_lens + 1, 1, &r_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 1);
+    ASSERT_EQ(r_results[0]->bytes, 0);
+    client->destroyRetrievalResult();
+  }
+  delete client;
+}
+
+
+TEST(test_client, memory_stats) {
+  Client* client = newClient(4);
+  if (client == NULL) {
+    hint();
+  } else {
+    memory_stats_t stats;
+
+    const char* keys[] = {"memory_stats"};
+    size_t key_lens[] = {12};
+    flags_t flags[] = {0};
+    const char* vals[] = {"value"};
+    size_t val_lens[] = {5};
+    message_result_t **m_results = NULL;
+    retrieval_result_t **r_results = NULL;
+    size_t nResults = 0;
+    ASSERT_EQ(client->set(keys, key_lens, flags, 0, NULL, false, vals, val_lens, 1,
+                          &m_results, &nResults), RET_OK);
+    client->destroyMessageResult();
+    ASSERT_EQ(client->get(keys, key_lens, 1, &r_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 1);
+    client->destroyRetrievalResult();
+
+    client->getMemoryStats(&stats);
+    ASSERT_GT(stats.result_bytes, 0);
+    ASSERT_LT(stats.result_bytes, 4096);
+  }
+  delete client;
+}
+
+
+TEST(test_client, send_stats) {
+  Client* client = newClient(1);
+  if (client == NULL) {
+    hint();
+  } else {
+    const size_t n = 5000;
+    std::vector<std::string> keys(n);
+    std::vector<const char*> key_ptrs(n), vals(n);
+    std::vector<size_t> key_lens(n), val_lens(n);
+    std::vector<flags_t> flags(n, 0);
+    for (size_t i = 0; i < n; i++) {
+      keys[i] = "send_stats_" + std::to_string(i);
+      key_ptrs[i] = keys[i].c_str();
+      key_lens[i] = keys[i].size();
+      vals[i] = "value";
+      val_lens[i] = 5;
+    }
+    send_stats_t before, after;
+    client->getSendStats(&before);
+    message_result_t **m_results = NULL;
+    size_t nResults = 0;
+    // 2 iovecs per item, more than MC_UIO_MAXIOV in one batch
+    ASSERT_EQ(client->set(&key_ptrs[0], &key_lens[0], &flags[0], 0, NULL, false,
+                          &vals[0], &val_lens[0], n, &m_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, n);
+    client->destroyMessageResult();
+    client->getSendStats(&after);
+    ASSERT_GE(after.sendmsg_calls - before.sendmsg_calls, 2 * n / MC_UIO_MAXIOV);
+    ASSERT_LE(after.partial_sends - before.partial_sends,
+              after.sendmsg_calls - before.sendmsg_calls);
+  }
+  delete client;
+}
+
+
+TEST(test_client, fork_after_first_use) {
+  // a client used before a prefork, like a preloaded app: each child waits
+  // on its own epoll instance, not on one shared with its siblings
+  Client* client = newClient(1);
+  if (client == NULL) {
+    hint();
+    return;
+  }
+  // each child connects its own socket, with the same fd number
+  client->quit();
+  const int nChildren = 4;
+  pid_t pids[nChildren];
+  for (int i = 0; i < nChildren; i++) {
+    pids[i] = fork();
+    ASSERT_GE(pids[i], 0);
+    if (pids[i] == 0) {
+      const char* keys[] = {"fork_after_first_use"};
+      size_t key_lens[] = {20};
+      retrieval_result_t **r_results = NULL;
+      size_t nResults = 0;
+      int failed = 0;
+      for (int j = 0; j < 200; j++) {
+        failed += client->get(keys, key_lens, 1, &r_results, &nResults) != RET_OK;
+        client->destroyRetrievalResult();
+      }
+      _exit(failed == 0 ? 0 : 1);
+    }
+  }
+  for (int i = 0; i < nChildren; i++) {
+    int status = 0;
+    ASSERT_EQ(waitpid(pids[i], &status, 0), pids[i]);
+    ASSERT_TRUE(WIFEXITED(status));
+    EXPECT_EQ(WEXITSTATUS(status), 0);
+  }
+  delete client;
+}
+
+
+// The client falls back to poll where the ring cannot be set up, which
+// these tests would not tell from io_uring.
+static bool ioUringAvailable() {
+#ifdef MC_USE_IO_URING
+  douban::mc::io::IoUring ring;
+  return ring.init(8) == 0;
+#else
+  return false;
+#endif
+}
+
+
+// a socket listening on a free port of 127.0.0.1, -1 on failure
+static int listenLocal(uint32_t* port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  socklen_t len = sizeof addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (fd < 0 || bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof addr) != 0 ||
+      listen(fd, 8) != 0 ||
+      getsockname(fd, reinterpret_cast<struct sockaddr*>(&addr), &len) != 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  *port = ntohs(addr.sin_port);
+  return fd;
+}
+
+
+// Answers the first request of each of n connections with a miss, then
+// closes it, as a server does with a connection idle for too long.
+static void serveMissAndClose(int fd, int n) {
+  for (int i = 0; i < n; i++) {
+    int conn = accept(fd, NULL, NULL);
+    if (conn < 0) {
+      return;
+    }
+    std::string request;
+    char buf[256];
+    ssize_t got;
+    while (request.find("\r\n") == std::string::npos &&
+           (got = recv(conn, buf, sizeof buf, 0)) > 0) {
+      request.append(buf, got);
+    }
+    send(conn, "END\r\n", 5, MSG_NOSIGNAL);
+    close(conn);
+  }
+}
+
+
+TEST(test_client, io_uring_large_values) {
+  if (!ioUringAvailable()) {
+    GTEST_SKIP();
+  }
+  // values of many recvs and sendmsgs each, over three servers
+  Client* client = newClient(3);
+  if (client == NULL) {
+    hint();
+  } else {
+    client->config(CFG_USE_IO_URING, 1);
+    const char* keys[] = {"uring_small", "uring_100k", "uring_900k", "uring_empty", "uring_miss"};
+    size_t key_lens[] = {11, 10, 10, 11, 10};
+    flags_t flags[] = {1, 2, 3, 4};
+    size_t val_lens[] = {5, 100 * 1024, 900 * 1024, 0};
+    std::vector<std::string> vals(4);
+    const char* val_ptrs[4];
+    for (size_t i = 0; i < 4; i++) {
+      vals[i].resize(val_lens[i]);
+      for (size_t j = 0; j < val_lens[i]; j++) {
+        vals[i][j] = static_cast<char>('a' + (i + j) % 26);
+      }
+      val_ptrs[i] = vals[i].data();
+    }
+    message_result_t **m_results = NULL;
+    retrieval_result_t **r_results = NULL;
+    size_t nResults = 0;
+
+    const char* delKeys[] = {keys[4]};
+    client->_delete(delKeys, key_lens + 4, false, 1, &m_results, &nResults);
+    client->destroyMessageResult();
+    ASSERT_EQ(client->set(keys, key_lens, flags, 0, NULL, false, val_ptrs, val_lens, 4,
+                          &m_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 4);
+    for (size_t i = 0; i < nResults; i++) {
+      ASSERT_EQ(m_results[i]->type_, MSG_STORED);
+    }
+    client->destroyMessageResult();
+
+    for (size_t i = 0; i < 4; i++) {
+      ASSERT_EQ(client->get(keys + i, key_lens + i, 1, &r_results, &nResults), RET_OK);
+      ASSERT_EQ(nResults, 1);
+      ASSERT_EQ(r_results[0]->bytes, val_lens[i]);
+      ASSERT_EQ(r_results[0]->flags, flags[i]);
+      ASSERT_N_STREQ(r_results[0]->data_block, vals[i].data(), val_lens[i]);
+      client->destroyRetrievalResult();
+    }
+
+    ASSERT_EQ(client->get(keys, key_lens, 5, &r_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 4);
+    for (size_t i = 0; i < nResults; i++) {
+      retrieval_result_t* r = r_results[i];
+      size_t j = 0;
+      while (j < 4 && !(r->key_len == key_lens[j] && memcmp(r->key, keys[j], key_lens[j]) == 0)) {
+        j++;
+      }
+      ASSERT_LT(j, 4);
+      ASSERT_EQ(r->bytes, val_lens[j]);
+      ASSERT_N_STREQ(r->data_block, vals[j].data(), val_lens[j]);
+    }
+    client->destroyRetrievalResult();
+  }
+  delete client;
+}
+
+
+TEST(test_client, io_uring_timeout) {
+  if (!ioUringAvailable()) {
+    GTEST_SKIP();
+  }
+  // a server that takes the connection but never answers
+  uint32_t port = 0;
+  int fd = listenLocal(&port);
+  ASSERT_GE(fd, 0);
+  const char* hosts[] = {"127.0.0.1"};
+  Client* client = new Client();
+  client->config(CFG_USE_IO_URING, 1);
+  client->config(CFG_POLL_TIMEOUT, 100);
+  client->init(hosts, &port, 1);
+  const char* keys[] = {"uring_timeout"};
+  size_t key_lens[] = {13};
+  retrieval_result_t **r_results = NULL;
+  size_t nResults = 0;
+  for (int i = 0; i < 2; i++) {
+    ASSERT_EQ(client->get(keys, key_lens, 1, &r_results, &nResults), RET_POLL_TIMEOUT_ERR);
+    ASSERT_EQ(nResults, 0);
+    client->destroyRetrievalResult();
+  }
+  delete client;
+  close(fd);
+}
+
+
+TEST(test_client, io_uring_idle_close) {
+  if (!ioUringAvailable()) {
+    GTEST_SKIP();
+  }
+  // the connection the server closed in between is found closed before
+  // the next request is sent on it, and that is sent on a new one
+  uint32_t port = 0;
+  int fd = listenLocal(&port);
+  ASSERT_GE(fd, 0);
+  std::thread server(serveMissAndClose, fd, 2);
+  const char* hosts[] = {"127.0.0.1"};
+  Client* client = new Client();
+  client->config(CFG_USE_IO_URING, 1);
+  client->init(hosts, &port, 1);
+  const char* keys[] = {"uring_idle"};
+  size_t key_lens[] = {10};
+  retrieval_result_t **r_results = NULL;
+  size_t nResults = 0;
+  for (int i = 0; i < 2; i++) {
+    ASSERT_EQ(client->get(keys, key_lens, 1, &r_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, 0);
+    client->destroyRetrievalResult();
+    // the close arrives before the next request
+    usleep(100 * 1000);
+  }
+  server.join();
+  delete client;
+  close(fd);
+}
+
+
+// Answers each of the n requests of one connection with a miss, delayMs
+// after it came in.
+static void serveMisses(int fd, int n, int delayMs) {
+  int conn = accept(fd, NULL, NULL);
+  if (conn < 0) {
+    return;
+  }
+  std::string request;
+  char buf[256];
+  ssize_t got;
+  for (int i = 0; i < n; i++) {
+    size_t pos;
+    while ((pos = request.find("\r\n")) == std::string::npos &&
+           (got = recv(conn, buf, sizeof buf, 0)) > 0) {
+      request.append(buf, got);
+    }
+    if (pos == std::string::npos) {
+      break;
+    }
+    request.erase(0, pos + 2);
+    usleep(delayMs * 1000);
+    send(conn, "END\r\n", 5, MSG_NOSIGNAL);
+  }
+  close(conn);
+}
+
+
+TEST(test_client, async_submit_sends) {
+  // the request is on its way before complete() is called
+  uint32_t port = 0;
+  int fd = listenLocal(&port);
+  ASSERT_GE(fd, 0);
+  std::thread server(serveMisses, fd, 1, 0);
+  const char* hosts[] = {"127.0.0.1"};
+  Client* client = new Client();
+  client->init(hosts, &port, 1);
+  const char* keys[] = {"async_submit"};
+  size_t key_lens[] = {12};
+  ticket_t ticket;
+  ticket_t* tickets = NULL;
+  size_t nTickets = 0;
+  ASSERT_EQ(client->getAsync(keys, key_lens, 1, &ticket), RET_OK);
+  usleep(100 * 1000);
+  ASSERT_EQ(client->complete(0, &tickets, &nTickets), RET_OK);
+  ASSERT_EQ(nTickets, 1);
+  ASSERT_EQ(tickets[0], ticket);
+  client->destroyTickets();
+  server.join();
+  delete client;
+  close(fd);
+}
+
+
+TEST(test_client, async_out_of_order) {
+  // a batch on a fast server completes before one submitted earlier on a
+  // slow server
+  uint32_t ports[2];
+  int fds[2];
+  for (int i = 0; i < 2; i++) {
+    fds[i] = listenLocal(ports + i);
+    ASSERT_GE(fds[i], 0);
+  }
+  std::thread slow(serveMisses, fds[0], 1, 200);
+  std::thread fast(serveMisses, fds[1], 1, 0);
+  const char* hosts[] = {"127.0.0.1", "127.0.0.1"};
+  const char* aliases[] = {"slow", "fast"};
+  Client* client = new Client();
+  client->config(CFG_POLL_TIMEOUT, 1000);
+  client->init(hosts, ports, 2, aliases);
+
+  // a key on each server
+  std::string keys[2];
+  for (int i = 0; keys[0].empty() || keys[1].empty(); i++) {
+    std::string key = "async_order_" + std::to_string(i);
+    const char* name = client->getServerAddressByKey(key.c_str(), key.size());
+    keys[strcmp(name, "slow") == 0 ? 0 : 1] = key;
+  }
+  ticket_t tSlow, tFast;
+  ticket_t* tickets = NULL;
+  size_t nTickets = 0;
+  for (int i = 0; i < 2; i++) {
+    const char* key = keys[i].c_str();
+    size_t key_len = keys[i].size();
+    ASSERT_EQ(client->getAsync(&key, &key_len, 1, i == 0 ? &tSlow : &tFast), RET_OK);
+  }
+
+  ASSERT_EQ(client->complete(-1, &tickets, &nTickets), RET_OK);
+  ASSERT_EQ(nTickets, 1);
+  ASSERT_EQ(tickets[0], tFast);
+  // not done yet within the timeout
+  ASSERT_EQ(client->complete(10, &tickets, &nTickets), RET_OK);
+  ASSERT_EQ(nTickets, 0);
+  ASSERT_EQ(client->complete(-1, &tickets, &nTickets), RET_OK);
+  ASSERT_EQ(nTickets, 1);
+  ASSERT_EQ(tickets[0], tSlow);
+
+  retrieval_result_t **r_results = NULL;
+  size_t nResults = 0;
+  ASSERT_EQ(client->ticketRetrievalResult(tFast, &r_results, &nResults), RET_OK);
+  ASSERT_EQ(nResults, 0);
+  client->destroyTickets();
+  slow.join();
+  fast.join();
+  delete client;
+  for (int i = 0; i < 2; i++) {
+    close(fds[i]);
+  }
+}
@@ -6,7 +6,7 @@ import unittest
 from libmc import (
     Client, encode_value, decode_value,
     MC_RETURN_OK, MC_RETURN_INVALID_KEY_ERR,
-    MC_RETURN_MC_SERVER_ERR
+    MC_RETURN_MC_SERVER_ERR, STAT_FIELD_NAMES
 )
 
 from builtins import int
@@ -225,6 +225,16 @@ class SingleServerCase(unittest.TestCase):
                     isinstance(dct['rusage_user'], float))
             assert isinstance(dct['curr_connections'], int)
 
+    def test_stats_typed(self):
+        stats = self.mc.stats_typed()
+        assert stats['n_servers'] == len(stats['servers']) > 0
+        for addr, dct in stats['servers'].items():
+            assert set(dct) <= set(STAT_FIELD_NAMES)
+            assert dct['pid'] > 0
+            assert stats['min']['uptime'] <= dct['uptime'] <= stats['max']['uptime']
+        assert stats['sum']['curr_items'] == sum(
+            dct['curr_items'] for dct in stats['servers'].values())
+
     def test_get_set_large_raw(self):
         key = 'large_raw_key'
         key_dup = '%s_dup' % key
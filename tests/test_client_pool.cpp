@@ -94,3 +94,66 @@ TEST(test_client_pool, threaded_set_get) {
   delete[] threads;
   delete pool;
 }
+
+TEST(test_client_pool, trim_on_release) {
+  uint32_t ports[n_servers];
+  const char* hosts[n_servers];
+  for (unsigned int i = 0; i < n_servers; i++) {
+    ports[i] = start_port + i;
+    hosts[i] = host;
+  }
+
+  const int cap = 64 * 1024;
+  ClientPool* pool = new ClientPool();
+  pool->config(CFG_HASH_FUNCTION, OPT_HASH_FNV1A_32);
+  pool->config(CFG_MAX_CLIENTS, 1);
+  pool->config(CFG_MAX_RETAINED_BUFFER_BYTES, cap);
+  pool->config(CFG_MAX_RETAINED_RESULT_BYTES, cap);
+  pool->init(hosts, ports, n_servers);
+  ASSERT_TRUE(check_availability(pool));
+
+  // enough values to grow the recv size and the result lists
+  const size_t n = 1000;
+  std::vector<std::string> keys(n);
+  std::vector<const char*> key_ptrs(n), values(n);
+  std::vector<size_t> key_lens(n), value_lens(n);
+  std::vector<flags_t> flags(n, 0);
+  std::string value(2000, 't');
+  for (size_t i = 0; i < n; i++) {
+    keys[i] = "trim_on_release_" + std::to_string(i);
+    key_ptrs[i] = keys[i].c_str();
+    key_lens[i] = keys[i].size();
+    values[i] = value.data();
+    value_lens[i] = value.size();
+  }
+  retrieval_result_t **r_results = NULL;
+  message_result_t **m_results = NULL;
+  size_t nResults = 0;
+  memory_stats_t stats;
+
+  auto c = pool->acquire();
+  ASSERT_EQ(c->set(key_ptrs.data(), key_lens.data(), flags.data(), 0, NULL, 0,
+                   values.data(), value_lens.data(), n, &m_results, &nResults), RET_OK);
+  c->destroyMessageResult();
+  for (int round = 0; round < 8; round++) {
+    ASSERT_EQ(c->get(key_ptrs.data(), key_lens.data(), n, &r_results, &nResults), RET_OK);
+    ASSERT_EQ(nResults, n);
+    c->destroyRetrievalResult();
+  }
+  c->getMemoryStats(&stats);
+  ASSERT_GT(stats.result_bytes + stats.arena_bytes, cap);
+  ASSERT_GT(stats.buffer_bytes, cap);
+  pool->release(c);
+
+  // the only client, trimmed when it was released
+  c = pool->acquire();
+  c->getMemoryStats(&stats);
+  ASSERT_LE(stats.buffer_bytes, cap);
+  ASSERT_LE(stats.result_bytes + stats.arena_bytes, cap);
+  ASSERT_EQ(c->get(key_ptrs.data(), key_lens.data(), n, &r_results, &nResults), RET_OK);
+  ASSERT_EQ(nResults, n);
+  ASSERT_EQ(r_results[0]->bytes, value.size());
+  c->destroyRetrievalResult();
+  pool->release(c);
+  delete pool;
+}
@@ -3,6 +3,8 @@
 #include "BufferReader.h"
 #include "Parser.h"
 #include <cstring>
+#include <string>
+#include <type_traits>
 #include "gtest/gtest.h"
 
 using douban::mc::types::RetrievalResult;
@@ -11,15 +13,18 @@ using douban::mc::io::BufferReader;
 using douban::mc::io::DataBlock;
 using douban::mc::io::TokenData;
 using douban::mc::PacketParser;
+using douban::mc::RequestArena;
 
 
 
 TEST(test_parser, empty_result) {
   err_code_t err;
   BufferReader reader;
+  RequestArena arena;
   PacketParser parser;
   parser.setMode(douban::mc::MODE_END_STATE);
   parser.setBufferReader(&reader);
+  parser.setRequestArena(&arena);
   int i = 0;
   char input_buffer[][5] = {
     "E", "ND\r\n"
@@ -43,9 +48,11 @@ TEST(test_parser, multi_results) {
   err_code_t err;
   DataBlock::setMinCapacity(10);
   BufferReader reader;
+  RequestArena arena;
   PacketParser parser;
   parser.setMode(douban::mc::MODE_END_STATE);
   parser.setBufferReader(&reader);
+  parser.setRequestArena(&arena);
   size_t i = 0;
 
   char input_buffer[][100] = {
@@ -77,7 +84,7 @@ TEST(test_parser, multi_results) {
 
   for (i = 0; i < 3; i++) {
     res = &((*parser.getRetrievalResults())[i]);
-    innerRes = res->inner();
+    innerRes = res->inner(arena);
 
     size_t len_key = 3;
     ASSERT_N_STREQ(innerRes->key, keys[i], len_key);
@@ -90,3 +97,411 @@ TEST(test_parser, multi_results) {
 }
 
 // TODO test MODE_COUNTING
+
+
+TEST(test_parser, move_only_results) {
+  // vector growth moves them, leaving DataBlock references alone
+  ASSERT_FALSE(std::is_copy_constructible<RetrievalResult>::value);
+  ASSERT_TRUE(std::is_nothrow_move_constructible<RetrievalResult>::value);
+  ASSERT_FALSE(std::is_copy_constructible<douban::mc::types::LineResult>::value);
+  ASSERT_TRUE(std::is_nothrow_move_constructible<douban::mc::types::LineResult>::value);
+
+  BufferReader reader;
+  RequestArena arena;
+  reader.write(CSTR("VALUE foo 0 3\r\nbar\r\n"), 20);
+  PacketParser parser(&reader);
+  parser.setRequestArena(&arena);
+  parser.setMode(douban::mc::MODE_END_STATE);
+  err_code_t err;
+  parser.process_packets(err);
+  ASSERT_EQ(err, RET_INCOMPLETE_BUFFER_ERR);
+  douban::mc::types::RetrievalResultList* results = parser.getRetrievalResults();
+  ASSERT_EQ(results->size(), 1);
+  DataBlock* block = (*results)[0].data_block.begin()->block;
+  size_t refs = block->nBytesRef();
+  results->reserve(results->capacity() * 4 + 1);
+  ASSERT_EQ(block->nBytesRef(), refs);
+  ASSERT_EQ(strncmp((*results)[0].inner(arena)->data_block, "bar", 3), 0);
+}
+
+
+TEST(test_parser, value_lines) {
+  // whole lines are parsed in place, the one split at the end of the
+  // block step by step
+  DataBlock::setMinCapacity(64);
+  BufferReader reader;
+  RequestArena arena;
+  PacketParser parser(&reader);
+  parser.setRequestArena(&arena);
+  parser.setMode(douban::mc::MODE_END_STATE);
+  const char* response =
+    "VALUE foo 1 3 42\r\nbar\r\n"
+    "VALUE empty 65535 0\r\n\r\n"
+    "VALUE split 7 4 18446744073709551615\r\nabcd\r\nEND\r\n";
+  size_t len = strlen(response);
+  err_code_t err;
+  reader.write(CSTR(response), 64);
+  parser.process_packets(err);
+  ASSERT_EQ(err, RET_INCOMPLETE_BUFFER_ERR);
+  reader.write(CSTR(response + 64), len - 64);
+  parser.process_packets(err);
+  ASSERT_EQ(err, RET_OK);
+  DataBlock::setMinCapacity(MIN_DATABLOCK_CAPACITY);
+
+  douban::mc::types::RetrievalResultList* results = parser.getRetrievalResults();
+  ASSERT_EQ(results->size(), 3);
+  const char* keys[] = {"foo", "empty", "split"};
+  const char* vals[] = {"bar", "", "abcd"};
+  flags_t flags[] = {1, 65535, 7};
+  cas_unique_t cas[] = {42, 0, 18446744073709551615ULL};
+  for (size_t i = 0; i < 3; i++) {
+    retrieval_result_t* r = (*results)[i].inner(arena);
+    ASSERT_EQ(r->key_len, strlen(keys[i]));
+    ASSERT_N_STREQ(r->key, keys[i], r->key_len);
+    ASSERT_EQ(r->bytes, strlen(vals[i]));
+    ASSERT_N_STREQ(r->data_block, vals[i], r->bytes);
+    ASSERT_EQ(r->flags, flags[i]);
+    ASSERT_EQ(r->cas_unique, cas[i]);
+  }
+  parser.reset();
+  ASSERT_EQ(reader.nBytesRef(), 0);
+}
+
+
+TEST(test_parser, request_key_matching) {
+  // a get of four keys answered with one out of order, then a delete
+  BufferReader reader;
+  RequestArena arena;
+  PacketParser parser(&reader);
+  parser.setRequestArena(&arena);
+  std::string keys[] = {"foo", "miss", "bar", "baz", "qux"};
+  for (size_t i = 0; i < 4; i++) {
+    parser.addRequestKey(keys[i].data(), keys[i].size());
+  }
+  parser.setMode(douban::mc::MODE_END_STATE);
+  parser.pushBatch(1);
+  parser.addRequestKey(keys[4].data(), keys[4].size());
+  parser.setMode(douban::mc::MODE_COUNTING);
+  parser.pushBatch(2);
+  const char* response =
+    "VALUE foo 0 1\r\na\r\n"
+    "VALUE baz 0 1\r\nc\r\n"
+    "VALUE bar 0 1\r\nb\r\n"
+    "END\r\n"
+    "DELETED\r\n";
+  err_code_t err;
+  reader.write(CSTR(response), strlen(response));
+  parser.process_packets(err);
+  ASSERT_EQ(err, RET_OK);
+
+  // the matched ones point at the request keys, bar is taken as echoed
+  douban::mc::types::RetrievalResultList* results = parser.getRetrievalResults();
+  ASSERT_EQ(results->size(), 3);
+  ASSERT_EQ((*results)[0].requestKey, keys[0].data());
+  ASSERT_EQ((*results)[1].requestKey, keys[3].data());
+  ASSERT_TRUE((*results)[2].requestKey == NULL);
+  retrieval_result_t* r = (*results)[2].inner(arena);
+  ASSERT_EQ(r->key_len, 3);
+  ASSERT_N_STREQ(r->key, "bar", 3);
+  ASSERT_N_STREQ(r->data_block, "b", 1);
+  ASSERT_EQ(parser.getMessageResults()->size(), 1);
+  ASSERT_EQ(parser.getMessageResults()->front().type_, MSG_DELETED);
+  ASSERT_EQ(parser.getMessageResults()->front().key, keys[4].data());
+  parser.reset();
+  ASSERT_EQ(reader.nBytesRef(), 0);
+}
+
+
+TEST(test_parser, meta_responses) {
+  // lines are matched to request keys by their opaque, fed a byte at a
+  // time so that every one of them is split
+  DataBlock::setMinCapacity(4);
+  BufferReader reader;
+  RequestArena arena;
+  PacketParser parser(&reader);
+  parser.setRequestArena(&arena);
+  const char* keys[] = {"foo", "miss", "bar", "baz"};
+  for (size_t i = 0; i < 4; i++) {
+    parser.addRequestKey(keys[i], strlen(keys[i]));
+  }
+  parser.setMode(douban::mc::MODE_END_STATE);
+  const char* response =
+    "VA 3 f1 c42 O0\r\nabc\r\n"
+    "VA 0 f0 O2 W\r\n\r\n"
+    "VA 4 O3 f65535\r\nxy\r\n\r\n"
+    "MN\r\n";
+  err_code_t err = RET_INCOMPLETE_BUFFER_ERR;
+  for (size_t i = 0; response[i] != '\0'; i++) {
+    ASSERT_EQ(err, RET_INCOMPLETE_BUFFER_ERR);
+    reader.write(CSTR(response + i), 1);
+    parser.process_packets(err);
+  }
+  ASSERT_EQ(err, RET_OK);
+  DataBlock::setMinCapacity(MIN_DATABLOCK_CAPACITY);
+
+  douban::mc::types::RetrievalResultList* results = parser.getRetrievalResults();
+  ASSERT_EQ(results->size(), 3);
+  size_t hits[] = {0, 2, 3};
+  const char* vals[] = {"abc", "", "xy\r\n"};
+  flags_t flags[] = {1, 0, 65535};
+  cas_unique_t cas[] = {42, 0, 0};
+  for (size_t i = 0; i < 3; i++) {
+    retrieval_result_t* r = (*results)[i].inner(arena);
+    ASSERT_EQ(r->key, keys[hits[i]]);
+    ASSERT_EQ(r->key_len, strlen(keys[hits[i]]));
+    ASSERT_EQ(r->bytes, strlen(vals[i]));
+    ASSERT_N_STREQ(r->data_block, vals[i], r->bytes);
+    ASSERT_EQ(r->flags, flags[i]);
+    ASSERT_EQ(r->cas_unique, cas[i]);
+  }
+  parser.reset();
+
+  // quiet storage: only the failures are answered
+  for (size_t i = 0; i < 4; i++) {
+    parser.addRequestKey(keys[i], strlen(keys[i]));
+  }
+  parser.setMode(douban::mc::MODE_END_STATE, MSG_STORED);
+  const char* failures = "NS O1\r\nEX O2\r\nMN\r\n";
+  reader.write(CSTR(failures), strlen(failures));
+  parser.process_packets(err);
+  ASSERT_EQ(err, RET_OK);
+  douban::mc::types::MessageResultList* messages = parser.getMessageResults();
+  ASSERT_EQ(messages->size(), 4);
+  message_result_type types[] = {MSG_STORED, MSG_NOT_STORED, MSG_EXISTS, MSG_STORED};
+  for (size_t i = 0; i < 4; i++) {
+    ASSERT_EQ((*messages)[i].type_, types[i]);
+    ASSERT_EQ((*messages)[i].key, keys[i]);
+  }
+  parser.reset();
+
+  // an opaque of no request
+  parser.addRequestKey(keys[0], strlen(keys[0]));
+  parser.setMode(douban::mc::MODE_END_STATE, MSG_DELETED);
+  reader.write(CSTR("NF O1\r\nMN\r\n"), 11);
+  parser.process_packets(err);
+  ASSERT_EQ(err, RET_PROGRAMMING_ERR);
+  parser.reset();
+  reader.reset();
+
+  // lines too short for a code, whole and split
+  const char* shorts[] = {"M\n", "MN\n", "M\r\n"};
+  for (size_t i = 0; i < 3; i++) {
+    for (size_t split = 0; split < 2; split++) {
+      DataBlock::setMinCapacity(split ? 1 : MIN_DATABLOCK_CAPACITY);
+      parser.addRequestKey(keys[0], strlen(keys[0]));
+      parser.setMode(douban::mc::MODE_END_STATE, MSG_DELETED);
+      err = RET_INCOMPLETE_BUFFER_ERR;
+      for (size_t j = 0; shorts[i][j] != '\0' && err == RET_INCOMPLETE_BUFFER_ERR; j++) {
+        reader.write(CSTR(shorts[i] + j), 1);
+        parser.process_packets(err);
+      }
+      ASSERT_EQ(err, RET_PROGRAMMING_ERR);
+      parser.reset();
+      reader.reset();
+    }
+  }
+  DataBlock::setMinCapacity(MIN_DATABLOCK_CAPACITY);
+  ASSERT_EQ(reader.nBytesRef(), 0);
+}
+
+
+// a response of the binary protocol, as a server would send it
+static std::string binaryResponse(uint8_t opcode, uint16_t status, uint32_t opaque,
+                                  const std::string& extras = "",
+                                  const std::string& key = "",
+                                  const std::string& value = "", uint64_t cas = 0) {
+  namespace binary = douban::mc::binary;
+  std::string out(sizeof(binary::header_t), '\0');
+  binary::header_t* h = reinterpret_cast<binary::header_t*>(&out[0]);
+  h->magic = binary::MAGIC_RESPONSE;
+  h->opcode = opcode;
+  h->keyLen = binary::swap16(static_cast<uint16_t>(key.size()));
+  h->extrasLen = static_cast<uint8_t>(extras.size());
+  h->status = binary::swap16(status);
+  h->bodyLen = binary::swap32(static_cast<uint32_t>(extras.size() + key.size() + value.size()));
+  h->opaque = binary::swap32(opaque);
+  h->cas = binary::swap64(cas);
+  return out + extras + key + value;
+}
+
+
+TEST(test_parser, binary_responses) {
+  namespace binary = douban::mc::binary;
+  // fed a byte at a time, so that headers are copied out of split blocks
+  DataBlock::setMinCapacity(4);
+  BufferReader reader;
+  RequestArena arena;
+  PacketParser parser(&reader);
+  parser.setRequestArena(&arena);
+  const char* keys[] = {"foo", "miss", "bar", "baz"};
+  for (size_t i = 0; i < 4; i++) {
+    parser.addRequestKey(keys[i], strlen(keys[i]));
+  }
+  parser.setMode(douban::mc::MODE_BINARY);
+  std::string flags1("\0\0\0\x01", 4), flags2("\0\0\xff\xff", 4);
+  std::string response = binaryResponse(binary::OP_GETQ, 0, 0, flags1, "", "abc", 42) +
+    binaryResponse(binary::OP_GETQ, 0, 2, flags1, "", "") +
+    binaryResponse(binary::OP_GETKQ, 0, 3, flags2, "baz", "xy\r\n") +
+    binaryResponse(binary::OP_NOOP, 0, 0);
+  err_code_t err = RET_INCOMPLETE_BUFFER_ERR;
+  for (size_t i = 0; i < response.size(); i++) {
+    ASSERT_EQ(err, RET_INCOMPLETE_BUFFER_ERR);
+    reader.write(&response[i], 1);
+    parser.process_packets(err);
+  }
+  ASSERT_EQ(err, RET_OK);
+  DataBlock::setMinCapacity(MIN_DATABLOCK_CAPACITY);
+
+  douban::mc::types::RetrievalResultList* results = parser.getRetrievalResults();
+  ASSERT_EQ(results->size(), 3);
+  size_t hits[] = {0, 2, 3};
+  const char* vals[] = {"abc", "", "xy\r\n"};
+  flags_t flags[] = {1, 1, 65535};
+  cas_unique_t cas[] = {42, 0, 0};
+  for (size_t i = 0; i < 3; i++) {
+    retrieval_result_t* r = (*results)[i].inner(arena);
+    ASSERT_EQ(r->key, keys[hits[i]]);
+    ASSERT_EQ(r->key_len, strlen(keys[hits[i]]));
+    ASSERT_EQ(r->bytes, strlen(vals[i]));
+    ASSERT_N_STREQ(r->data_block, vals[i], r->bytes);
+    ASSERT_EQ(r->flags, flags[i]);
+    ASSERT_EQ(r->cas_unique, cas[i]);
+  }
+  parser.reset();
+
+  // quiet storage: only the failures are answered
+  for (size_t i = 0; i < 4; i++) {
+    parser.addRequestKey(keys[i], strlen(keys[i]));
+  }
+  parser.setMode(douban::mc::MODE_BINARY, MSG_STORED);
+  response = binaryResponse(binary::OP_ADDQ, binary::STATUS_KEY_EXISTS, 1, "", "", "Data exists") +
+    binaryResponse(binary::OP_SETQ, binary::STATUS_KEY_EXISTS, 2) +
+    binaryResponse(binary::OP_NOOP, 0, 0);
+  reader.write(&response[0], response.size());
+  parser.process_packets(err);
+  ASSERT_EQ(err, RET_OK);
+  douban::mc::types::MessageResultList* messages = parser.getMessageResults();
+  ASSERT_EQ(messages->size(), 4);
+  message_result_type types[] = {MSG_STORED, MSG_NOT_STORED, MSG_EXISTS, MSG_STORED};
+  for (size_t i = 0; i < 4; i++) {
+    ASSERT_EQ((*messages)[i].type_, types[i]);
+    ASSERT_EQ((*messages)[i].key, keys[i]);
+  }
+  parser.reset();
+
+  // a failed noreply request of before, incr, then a miss
+  parser.addRequestKey(keys[0], strlen(keys[0]));
+  parser.addRequestKey(keys[1], strlen(keys[1]));
+  parser.setMode(douban::mc::MODE_BINARY);
+  response = binaryResponse(binary::OP_SETQ, binary::STATUS_KEY_EXISTS, binary::kNoreplyOpaque,
+                            "", "", "Data exists") +
+    binaryResponse(binary::OP_INCREMENT, 0, 0, "", "", std::string("\0\0\0\0\0\0\x01\x02", 8)) +
+    binaryResponse(binary::OP_INCREMENT, binary::STATUS_KEY_NOT_FOUND, 1, "", "", "Not found") +
+    binaryResponse(binary::OP_NOOP, 0, 0);
+  reader.write(&response[0], response.size());
+  parser.process_packets(err);
+  ASSERT_EQ(err, RET_OK);
+  ASSERT_EQ(parser.getUnsignedResults()->size(), 1);
+  ASSERT_EQ(parser.getUnsignedResults()->front().value, 258);
+  ASSERT_EQ(parser.getMessageResults()->size(), 1);
+  ASSERT_EQ(parser.getMessageResults()->front().type_, MSG_NOT_FOUND);
+  ASSERT_EQ(parser.getMessageResults()->front().key, keys[1]);
+  parser.reset();
+
+  // stats, as "<name> <value>" lines
+  parser.setMode(douban::mc::MODE_BINARY);
+  response = binaryResponse(binary::OP_STAT, 0, 0, "", "pid", "42") +
+    binaryResponse(binary::OP_STAT, 0, 0, "", "version", "1.6.21") +
+    binaryResponse(binary::OP_STAT, 0, 0);
+  reader.write(&response[0], response.size());
+  parser.process_packets(err);
+  ASSERT_EQ(err, RET_OK);
+  douban::mc::types::LineResultList* lines = parser.getLineResults();
+  ASSERT_EQ(lines->size(), 2);
+  size_t n = 0;
+  char* line = (*lines)[1].inner(n, arena);
+  ASSERT_EQ(n, 14);
+  ASSERT_N_STREQ(line, "version 1.6.21", n);
+  parser.reset();
+
+  // an opaque of no request
+  parser.addRequestKey(keys[0], strlen(keys[0]));
+  parser.setMode(douban::mc::MODE_BINARY, MSG_DELETED);
+  response = binaryResponse(binary::OP_DELETEQ, binary::STATUS_KEY_NOT_FOUND, 1) +
+    binaryResponse(binary::OP_NOOP, 0, 0);
+  reader.write(&response[0], response.size());
+  parser.process_packets(err);
+  ASSERT_EQ(err, RET_PROGRAMMING_ERR);
+  parser.reset();
+  reader.reset();
+  ASSERT_EQ(reader.nBytesRef(), 0);
+}
+
+
+TEST(test_parser, typed_stats) {
+  // counters are parsed to numbers whether their line is in place or split,
+  // out of order and among the others
+  const char* response =
+    "STAT pid 42\r\n"
+    "STAT version 1.6.21\r\n"
+    "STAT rusage_user 0.5\r\n"
+    "STAT bytes_read 1024\r\n"
+    "STAT evictions 18446744073709551615\r\n"
+    "STAT curr_items many\r\n"
+    "STAT bytes 77\r\n"
+    "STAT get_hits 3\r\n"
+    "END\r\n";
+  const size_t capacities[] = {4, MIN_DATABLOCK_CAPACITY};
+  for (size_t capacity : capacities) {
+    DataBlock::setMinCapacity(capacity);
+    BufferReader reader;
+    RequestArena arena;
+    PacketParser parser(&reader);
+    parser.setRequestArena(&arena);
+    parser.setMode(douban::mc::MODE_END_STATE);
+    parser.setTypedStats();
+    err_code_t err = RET_INCOMPLETE_BUFFER_ERR;
+    size_t step = capacity == 4 ? 1 : strlen(response);
+    for (size_t i = 0; response[i] != '\0'; i += step) {
+      ASSERT_EQ(err, RET_INCOMPLETE_BUFFER_ERR);
+      reader.write(CSTR(response + i), step);
+      parser.process_packets(err);
+    }
+    ASSERT_EQ(err, RET_OK);
+    DataBlock::setMinCapacity(MIN_DATABLOCK_CAPACITY);
+
+    const server_stats_t& stats = parser.getServerStats();
+    ASSERT_EQ(parser.getLineResults()->size(), 0);
+    ASSERT_EQ(stats.present, (1ULL << STAT_PID) | (1ULL << STAT_BYTES_READ) |
+              (1ULL << STAT_EVICTIONS) | (1ULL << STAT_BYTES) | (1ULL << STAT_GET_HITS));
+    ASSERT_EQ(stats.values[STAT_PID], 42);
+    ASSERT_EQ(stats.values[STAT_BYTES_READ], 1024);
+    ASSERT_EQ(stats.values[STAT_EVICTIONS], UINT64_MAX);
+    ASSERT_EQ(stats.values[STAT_BYTES], 77);
+    ASSERT_EQ(stats.values[STAT_GET_HITS], 3);
+    ASSERT_EQ(stats.values[STAT_CURR_ITEMS], 0);
+    parser.reset();
+  }
+
+  namespace binary = douban::mc::binary;
+  BufferReader reader;
+  RequestArena arena;
+  PacketParser parser(&reader);
+  parser.setRequestArena(&arena);
+  parser.setMode(douban::mc::MODE_BINARY);
+  parser.setTypedStats();
+  std::string binaryStats = binaryResponse(binary::OP_STAT, 0, 0, "", "curr_items", "12") +
+    binaryResponse(binary::OP_STAT, 0, 0, "", "version", "1.6.21") +
+    binaryResponse(binary::OP_STAT, 0, 0, "", "threads", std::string(200, '4')) +
+    binaryResponse(binary::OP_STAT, 0, 0);
+  reader.write(&binaryStats[0], binaryStats.size());
+  err_code_t err;
+  parser.process_packets(err);
+  ASSERT_EQ(err, RET_OK);
+  ASSERT_EQ(parser.getLineResults()->size(), 0);
+  ASSERT_EQ(parser.getServerStats().present, 1ULL << STAT_CURR_ITEMS);
+  ASSERT_EQ(parser.getServerStats().values[STAT_CURR_ITEMS], 12);
+  // nothing is left for a connection that is not asked the next time
+  parser.reset();
+  ASSERT_EQ(parser.getServerStats().present, 0);
+}